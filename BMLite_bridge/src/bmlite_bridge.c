@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_bridge.c
+ * @brief   Forwards BM-Lite attached to UART or SPI to a TCP port
+ *
+ * Host connects with TCP_INTERFACE (rpi_tcp.c). HCP link frames are passed
+ * unchanged, one frame per send(). The bridge keeps ACK turnaround local:
+ * it waits for ACK of every frame it passes to BM-Lite, retrying if needed,
+ * and ACKs every frame received from BM-Lite before forwarding it. One host
+ * is served at a time.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "bmlite_if.h"
+#include "hcp_tiny.h"
+#include "platform.h"
+#include "bmlite_hal.h"
+#include "platform_rpi.h"
+#include "fpc_crc.h"
+
+/** ACK wait after frame sent to BM-Lite (msec), as in HCP */
+#define BRIDGE_ACK_TIMEOUT 500
+/** Attempts to pass a frame to BM-Lite */
+#define BRIDGE_TX_ATTEMPTS 3
+/** Longest BM-Lite read between checks for new host frame (msec) */
+#define BRIDGE_POLL_SLICE 10
+/** Time to receive rest of a frame once its header arrived (msec) */
+#define BRIDGE_FRAME_TIMEOUT 1000
+/** Time between checks for quit while idle (msec) */
+#define BRIDGE_IDLE_SLICE 1000
+/** Default listen address. No authentication, so loopback only */
+#define BRIDGE_DEFAULT_ADDRESS "127.0.0.1:" TCP_DEFAULT_PORT
+
+/* HCP link frame: channel, size, transport header and payload, CRC */
+#define FRAME_HEADER_SIZE 4
+#define FRAME_OVERHEAD 8
+#define FRAME_LNK_SIZE 2
+#define FRAME_SEQ_NR 6
+#define FRAME_SEQ_LEN 8
+
+#define DATA_BUFFER_SIZE 102400
+static uint8_t hcp_txrx_buffer[MTU];
+static uint8_t hcp_data_buffer[DATA_BUFFER_SIZE];
+
+static HCP_comm_t hcp_chain = {
+    .read = platform_bmlite_receive,
+    .write = platform_bmlite_send,
+    .pkt_buffer = hcp_data_buffer,
+    .txrx_buffer = hcp_txrx_buffer,
+    .pkt_size = 0,
+    .pkt_size_max = sizeof(hcp_data_buffer),
+    .phy_rx_timeout = 2000,
+};
+
+typedef struct {
+    uint32_t clients;
+    /** Frames host to BM-Lite */
+    uint32_t frames_in;
+    /** Frames BM-Lite to host */
+    uint32_t frames_out;
+    /** Frames resent to BM-Lite after missing or bad ACK */
+    uint32_t retries;
+    /** Frames BM-Lite didn't ACK after all attempts */
+    uint32_t tx_errors;
+    /** Frames from BM-Lite dropped due to CRC or size error */
+    uint32_t rx_errors;
+    /** Responses dropped because host sent new command */
+    uint32_t abandoned;
+} bridge_stats_t;
+
+static const uint32_t ack = FPC_BEP_ACK;
+static uint8_t frame[MTU];
+/* Host connection. COM session code works on sockets */
+static rpi_com_session_t client = { .fd = -1 };
+static bridge_stats_t stats;
+static volatile sig_atomic_t quit;
+
+static void help(void)
+{
+    fprintf(stderr, "BM-Lite TCP bridge\n");
+    fprintf(stderr, "Syntax: bmlite_bridge [-s | -e] [-w] [-F] [-p port] [-b baudrate] [-t timeout]\n");
+    fprintf(stderr, "       [-l [address]:port]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t-s\tuse SPI interface\n");
+    fprintf(stderr, "\t-e\tuse emulated BM-Lite\n");
+    fprintf(stderr, "\t-w\twarm attach: probe BM-Lite and reset only if it doesn't answer\n");
+    fprintf(stderr, "\t-F\tuse RTS/CTS hardware flow control\n");
+    fprintf(stderr, "\t-p\tcom port\n");
+    fprintf(stderr, "\t-b\tbaudrate\n");
+    fprintf(stderr, "\t-t\ttimeout\n");
+    fprintf(stderr, "\t-l\tlisten address, default %s. Anyone reaching the port\n",
+            BRIDGE_DEFAULT_ADDRESS);
+    fprintf(stderr, "\t\tdrives BM-Lite, listen wider (e.g. 0.0.0.0:%s) on trusted networks only\n",
+            TCP_DEFAULT_PORT);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool last_frame(void)
+{
+    return get_le16(frame + FRAME_SEQ_NR) == get_le16(frame + FRAME_SEQ_LEN);
+}
+
+/* Wait until host sends something. Returns false on quit */
+static bool client_wait(int timeout)
+{
+    struct pollfd pfd = { .fd = client.fd, .events = POLLIN };
+
+    while (!quit) {
+        if (rpi_com_rx_pending(&client) || poll(&pfd, 1, timeout) > 0) {
+            return true;
+        }
+        if (timeout == 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static fpc_bep_result_t client_read_frame(uint16_t *size)
+{
+    fpc_bep_result_t res;
+    uint16_t lnk_size;
+
+    res = rpi_com_receive(FRAME_HEADER_SIZE, frame, BRIDGE_FRAME_TIMEOUT, &client);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    lnk_size = get_le16(frame + FRAME_LNK_SIZE);
+    if (lnk_size + FRAME_OVERHEAD > MTU) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    *size = lnk_size + FRAME_OVERHEAD;
+    return rpi_com_receive(lnk_size + FRAME_OVERHEAD - FRAME_HEADER_SIZE,
+            frame + FRAME_HEADER_SIZE, BRIDGE_FRAME_TIMEOUT, &client);
+}
+
+static fpc_bep_result_t device_write_frame(uint16_t size)
+{
+    uint32_t answer;
+
+    for (int i = 0; i < BRIDGE_TX_ATTEMPTS; i++) {
+        if (i > 0) {
+            stats.retries++;
+        }
+        if (hcp_chain.write(size, frame, 0, hcp_chain.phy_session) != FPC_BEP_RESULT_OK) {
+            continue;
+        }
+        if (hcp_chain.read(sizeof(answer), (uint8_t *)&answer, BRIDGE_ACK_TIMEOUT,
+                hcp_chain.phy_session) == FPC_BEP_RESULT_OK && answer == ack) {
+            stats.frames_in++;
+            return FPC_BEP_RESULT_OK;
+        }
+    }
+    stats.tx_errors++;
+    return FPC_BEP_RESULT_IO_ERROR;
+}
+
+/*
+ * Receive and ACK one frame from BM-Lite. Gives up with TIMEOUT if host
+ * sends a new frame meanwhile
+ */
+static fpc_bep_result_t device_read_frame(uint16_t *size)
+{
+    fpc_bep_result_t res;
+    uint16_t lnk_size;
+
+    do {
+        if (client_wait(0)) {
+            stats.abandoned++;
+            return FPC_BEP_RESULT_TIMEOUT;
+        }
+        if (quit) {
+            return FPC_BEP_RESULT_CANCELLED;
+        }
+        res = hcp_chain.read(FRAME_HEADER_SIZE, frame, BRIDGE_POLL_SLICE,
+                hcp_chain.phy_session);
+    } while (res == FPC_BEP_RESULT_TIMEOUT);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    lnk_size = get_le16(frame + FRAME_LNK_SIZE);
+    if (lnk_size + FRAME_OVERHEAD > MTU) {
+        stats.rx_errors++;
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    res = hcp_chain.read(lnk_size + FRAME_OVERHEAD - FRAME_HEADER_SIZE,
+            frame + FRAME_HEADER_SIZE, 100, hcp_chain.phy_session);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    if (fpc_crc(0, frame + FRAME_HEADER_SIZE, lnk_size) !=
+            get_le32(frame + FRAME_HEADER_SIZE + lnk_size)) {
+        // Not ACKed, as host would do
+        stats.rx_errors++;
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    hcp_chain.write(sizeof(ack), (const uint8_t *)&ack, 0, hcp_chain.phy_session);
+    stats.frames_out++;
+    *size = lnk_size + FRAME_OVERHEAD;
+    return FPC_BEP_RESULT_OK;
+}
+
+/* Pass response frames to host. Returns false if host is gone */
+static bool relay_response(void)
+{
+    uint16_t size;
+
+    do {
+        if (device_read_frame(&size) != FPC_BEP_RESULT_OK) {
+            // Host times out or has already moved on. Rest of the response
+            // must not be taken for the answer to the next command
+            bmlite_drain_link(&hcp_chain, bmlite_frame_time(&hcp_chain));
+            return true;
+        }
+        if (rpi_com_send(size, frame, 0, &client) != FPC_BEP_RESULT_OK) {
+            return false;
+        }
+    } while (!last_frame());
+    return true;
+}
+
+static void serve(void)
+{
+    uint16_t size;
+
+    while (client_wait(BRIDGE_IDLE_SLICE)) {
+        if (client_read_frame(&size) != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        if (device_write_frame(size) != FPC_BEP_RESULT_OK) {
+            fprintf(stderr, "BM-Lite doesn't ACK frame\n");
+            continue;
+        }
+        if (last_frame() && !relay_response()) {
+            break;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    fpc_bep_result_t res;
+    rpi_initparams_t rpi_params;
+    const char *address = BRIDGE_DEFAULT_ADDRESS;
+    struct sigaction sa;
+    int listen_fd;
+
+    rpi_params.iface = COM_INTERFACE;
+    rpi_params.hcp_comm = &hcp_chain;
+    rpi_params.baudrate = 921600;
+    rpi_params.timeout = 5;
+    rpi_params.port = NULL;
+    rpi_params.warm_attach = false;
+    rpi_params.flow_control = false;
+
+    opterr = 0;
+
+    while ((c = getopt (argc, argv, "sewFb:p:t:l:")) != -1) {
+        switch (c) {
+            case 's':
+                rpi_params.iface = SPI_INTERFACE;
+                if(rpi_params.baudrate == 921600)
+                    rpi_params.baudrate = 1000000;
+                break;
+            case 'e':
+                rpi_params.iface = EMU_INTERFACE;
+                break;
+            case 'w':
+                rpi_params.warm_attach = true;
+                break;
+            case 'F':
+                rpi_params.flow_control = true;
+                break;
+            case 'b':
+                rpi_params.baudrate = atoi(optarg);
+                break;
+            case 'p':
+                rpi_params.port = optarg;
+                break;
+            case 't':
+                rpi_params.timeout = atoi(optarg);
+                break;
+            case 'l':
+                address = optarg;
+                break;
+            case '?':
+                if (isprint (optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr,
+                            "Unknown option character `\\x%x'.\n",
+                            optopt);
+                return 1;
+            default:
+                help();
+                exit(1);
+            }
+        }
+
+    if (rpi_params.iface == COM_INTERFACE && rpi_params.port == NULL) {
+        printf("port must be specified\n");
+        help();
+        exit(1);
+    }
+
+    if (rpi_params.warm_attach) {
+        platform_attach_timing_t timing = { 0 };
+
+        res = platform_attach(&rpi_params, &hcp_chain, &timing);
+        fprintf(stderr, "Attach: init %u ms, probe %u ms, %s %u ms\n", timing.init_ms,
+                timing.probe_ms, timing.reset ? "HW reset" : "no reset", timing.reset_ms);
+    } else {
+        res = platform_init(&rpi_params);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        fprintf(stderr, "Startup failed: %d\n", res);
+        help();
+        exit(1);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    /* No SA_RESTART: poll() must return on signal */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    hcp_chain.link_speed = rpi_params.baudrate;
+
+    listen_fd = rpi_tcp_listen(address);
+    if (listen_fd < 0) {
+        exit(1);
+    }
+    printf("Listening on %s\n", address);
+    fflush(stdout);
+
+    while (!quit) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, BRIDGE_IDLE_SLICE) <= 0) {
+            continue;
+        }
+        client.fd = accept(listen_fd, NULL, NULL);
+        if (client.fd < 0) {
+            continue;
+        }
+        fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) | O_NONBLOCK);
+        fcntl(client.fd, F_SETFD, FD_CLOEXEC);
+        client.rx_head = 0;
+        client.rx_tail = 0;
+        stats.clients++;
+        serve();
+        close(client.fd);
+        client.fd = -1;
+    }
+    close(listen_fd);
+
+    printf("Clients: %u, frames to BM-Lite: %u, from BM-Lite: %u, retries: %u, "
+            "TX errors: %u, RX errors: %u, abandoned responses: %u\n",
+            stats.clients, stats.frames_in, stats.frames_out, stats.retries,
+            stats.tx_errors, stats.rx_errors, stats.abandoned);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef WORK_STEAL_H
+#define WORK_STEAL_H
+
+/**
+ * @file    work_steal.h
+ * @brief   Work-stealing pool running a function over a range of indexes
+ *
+ * Indexes are split evenly between workers. A worker takes indexes from the
+ * front of its own range. A worker whose range is empty steals the back half
+ * of the largest remaining range. Each range is one 64-bit word updated with
+ * compare-and-swap, so taking and stealing work need no locks.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Function called for every index
+ *
+ * @param[in] index  - index in [0, count)
+ * @param[in] worker - worker number in [0, workers)
+ * @param[in] ctx    - context given to work_steal_run()
+ */
+typedef void (*work_steal_fn_t)(uint32_t index, uint32_t worker, void *ctx);
+
+typedef struct {
+    /** Indexes processed by worker */
+    uint32_t done;
+    /** Ranges stolen by worker */
+    uint32_t steals;
+} work_steal_stats_t;
+
+/**
+ * @brief Call function for indexes [0, count) on several threads
+ *
+ * Returns when all indexes are processed.
+ *
+ * @param[in] count   - number of indexes
+ * @param[in] workers - number of threads. Calling thread is worker 0
+ * @param[in] fn      - function
+ * @param[in] ctx     - context passed to function
+ * @param[out] stats  - array of per worker counters. Can be NULL
+ *
+ * @return false if pool can not be allocated, nothing is done then, or some
+ *         threads can not be created, their work is done by the others
+ */
+bool work_steal_run(uint32_t count, uint32_t workers, work_steal_fn_t fn, void *ctx,
+        work_steal_stats_t *stats);
+
+#endif /* WORK_STEAL_H */
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_convert.c
+ * @brief   Offline converter and analyzer of raw image dumps
+ *
+ * Raw 8-bit images saved from bep_image_get() are converted to PGM or PNG
+ * and checked with the SDK quality kernels. Files are mapped to memory and
+ * processed by a work-stealing pool on all cores.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bmlite_image_quality.h"
+#include "image_export.h"
+#include "work_steal.h"
+
+/** Default number of histogram bins in metadata */
+#define DEFAULT_BINS 16
+/** Largest image file (bytes), image sides are 16-bit */
+#define MAX_IMAGE_SIZE ((uint64_t)UINT16_MAX * UINT16_MAX)
+
+typedef enum {
+    STATUS_OK = 0,
+    STATUS_OPEN,
+    STATUS_GEOMETRY,
+    STATUS_WRITE,
+} status_t;
+
+static const char *const status_names[] = { "ok", "can't read", "size does not fit geometry",
+    "can't write" };
+
+static const char *const quality_names[] = { "ok", "low_coverage", "low_contrast",
+    "low_variance", "low_sharpness", "bad_geometry" };
+
+typedef struct {
+    uint8_t status;
+    uint8_t reason;
+    uint8_t min;
+    uint8_t max;
+    uint16_t width;
+    uint16_t height;
+    uint64_t size;
+    /** Mean pixel value, 1/100 of gray level */
+    uint32_t mean;
+    bmlite_image_quality_t quality;
+} result_t;
+
+typedef struct {
+    char **paths;
+    uint32_t count;
+    result_t *results;
+    /** count * bins histogram bins */
+    uint32_t *hist;
+    uint32_t bins;
+    /** Fixed geometry, 0 - square image is assumed */
+    image_geometry_t geometry;
+    const char *out_dir;
+    image_format_t format;
+} job_t;
+
+static void help(void)
+{
+    fprintf(stderr, "Converter and analyzer of raw BM-Lite images\n");
+    fprintf(stderr, "Syntax: bmlite_convert [-o out_dir] [-f pgm|png] [-g WxH[,dpi]] [-j threads]\n");
+    fprintf(stderr, "       [-m metadata_file] [-B bins] [-s] input ...\n");
+    fprintf(stderr, "Inputs are raw image files or directories of *.raw files\n");
+    fprintf(stderr, "-o: convert images to out_dir, otherwise analyze only\n");
+    fprintf(stderr, "-m: per-image statistics as JSON lines\n");
+    fprintf(stderr, "-s: run with 1, 2, 4 ... threads and print images per second\n");
+}
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool geometry_of(const job_t *job, uint32_t size, image_geometry_t *g)
+{
+    uint32_t side = 0;
+
+    if (job->geometry.width) {
+        *g = job->geometry;
+        return (uint32_t)g->width * g->height == size;
+    }
+    while ((uint64_t)(side + 1) * (side + 1) <= size) {
+        side++;
+    }
+    g->width = side;
+    g->height = side;
+    g->dpi = job->geometry.dpi;
+    return side && side * side == size;
+}
+
+static bool output_path(const job_t *job, const char *input, char *path, size_t size)
+{
+    const char *name = strrchr(input, '/');
+    const char *ext;
+    int len;
+
+    name = name ? name + 1 : input;
+    ext = strrchr(name, '.');
+    len = ext ? (int)(ext - name) : (int)strlen(name);
+    return snprintf(path, size, "%s/%.*s.%s", job->out_dir, len, name,
+            job->format == IMAGE_FORMAT_PNG ? "png" : "pgm") < (int)size;
+}
+
+static void process(uint32_t index, uint32_t worker, void *ctx)
+{
+    job_t *job = ctx;
+    result_t *r = &job->results[index];
+    uint32_t *bins = job->hist + (size_t)index * job->bins;
+    bmlite_quality_params_t params = BMLITE_QUALITY_PARAMS_DEFAULT;
+    image_geometry_t g;
+    uint32_t hist[256];
+    uint64_t sum = 0;
+    struct stat st;
+    uint8_t *image;
+    int fd;
+
+    (void)worker;
+    memset(r, 0, sizeof(*r));
+    r->status = STATUS_OPEN;
+    fd = open(job->paths[index], O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    r->size = st.st_size;
+    r->status = STATUS_GEOMETRY;
+    if (r->size > MAX_IMAGE_SIZE || !geometry_of(job, (uint32_t)r->size, &g)) {
+        close(fd);
+        return;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        r->status = STATUS_OPEN;
+        return;
+    }
+    madvise(image, st.st_size, MADV_WILLNEED);
+    r->status = STATUS_OK;
+    r->width = g.width;
+    r->height = g.height;
+
+    params.width = g.width;
+    r->reason = bmlite_image_check(image, r->size, &params, &r->quality);
+
+    bmlite_image_histogram(image, r->size, hist);
+    r->min = 255;
+    for (uint32_t v = 0; v < 256; v++) {
+        if (hist[v]) {
+            r->min = v < r->min ? v : r->min;
+            r->max = v;
+        }
+        sum += (uint64_t)hist[v] * v;
+        bins[v * job->bins / 256] += hist[v];
+    }
+    r->mean = sum * 100 / r->size;
+
+    if (job->out_dir) {
+        char path[IMAGE_EXPORT_PATH_MAX];
+
+        if (!output_path(job, job->paths[index], path, sizeof(path)) ||
+                image_save(path, job->format, &g, image) != FPC_BEP_RESULT_OK) {
+            r->status = STATUS_WRITE;
+        }
+    }
+    munmap(image, st.st_size);
+}
+
+/* Add file or *.raw files of directory to list */
+static bool add_input(job_t *job, uint32_t *capacity, const char *path)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *e;
+
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "Can't read %s\n", path);
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (job->count == *capacity) {
+            char **paths = realloc(job->paths, (*capacity = *capacity * 2 + 64) * sizeof(char *));
+            if (paths == NULL) {
+                return false;
+            }
+            job->paths = paths;
+        }
+        job->paths[job->count] = strdup(path);
+        return job->paths[job->count++] != NULL;
+    }
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Can't read %s\n", path);
+        return false;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        size_t len = strlen(e->d_name);
+        char file[IMAGE_EXPORT_PATH_MAX];
+
+        if (len < 4 || strcmp(e->d_name + len - 4, ".raw") != 0) {
+            continue;
+        }
+        if (snprintf(file, sizeof(file), "%s/%s", path, e->d_name) >= (int)sizeof(file)) {
+            fprintf(stderr, "Path too long: %s/%s\n", path, e->d_name);
+            continue;
+        }
+        if (!add_input(job, capacity, file)) {
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static uint64_t run(job_t *job, uint32_t threads, work_steal_stats_t *stats)
+{
+    uint64_t start;
+
+    memset(job->hist, 0, (size_t)job->count * job->bins * sizeof(uint32_t));
+    start = time_us();
+    if (!work_steal_run(job->count, threads, process, job, stats)) {
+        fprintf(stderr, "Can't start %u threads\n", threads);
+    }
+    return time_us() - start;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void write_metadata(FILE *f, const job_t *job)
+{
+    for (uint32_t i = 0; i < job->count; i++) {
+        const result_t *r = &job->results[i];
+        const uint32_t *bins = job->hist + (size_t)i * job->bins;
+
+        fprintf(f, "{\"file\":");
+        json_string(f, job->paths[i]);
+        fprintf(f, ",\"size\":%llu", (unsigned long long)r->size);
+        if (r->status != STATUS_OK) {
+            fprintf(f, ",\"error\":\"%s\"}\n", status_names[r->status]);
+            continue;
+        }
+        fprintf(f, ",\"width\":%u,\"height\":%u,\"min\":%u,\"max\":%u,\"mean\":%u.%02u,"
+                "\"coverage\":%u,\"contrast\":%u,\"variance\":%u,\"sharpness\":%u.%02u,"
+                "\"quality\":\"%s\",\"hist\":[", r->width, r->height, r->min, r->max,
+                r->mean / 100, r->mean % 100, r->quality.coverage, r->quality.contrast,
+                r->quality.variance, r->quality.sharpness / 100, r->quality.sharpness % 100,
+                quality_names[r->reason]);
+        for (uint32_t b = 0; b < job->bins; b++) {
+            fprintf(f, b ? ",%u" : "%u", bins[b]);
+        }
+        fprintf(f, "]}\n");
+    }
+}
+
+static void print_summary(const job_t *job, uint32_t threads, uint64_t us,
+        const work_steal_stats_t *stats)
+{
+    uint32_t failed[4] = { 0 };
+    uint32_t reasons[6] = { 0 };
+    uint64_t coverage = 0, contrast = 0, variance = 0, sharpness = 0, mean = 0, bytes = 0;
+    uint32_t ok = 0;
+
+    for (uint32_t i = 0; i < job->count; i++) {
+        const result_t *r = &job->results[i];
+
+        bytes += r->size;
+        if (r->status != STATUS_OK) {
+            failed[r->status]++;
+            continue;
+        }
+        ok++;
+        reasons[r->reason]++;
+        coverage += r->quality.coverage;
+        contrast += r->quality.contrast;
+        variance += r->quality.variance;
+        sharpness += r->quality.sharpness;
+        mean += r->mean;
+    }
+
+    printf("Images: %u, analyzed %u, kernel %s\n", job->count, ok, bmlite_image_kernel_name());
+    for (uint32_t s = STATUS_OK + 1; s < 4; s++) {
+        if (failed[s]) {
+            printf("  %-28s %u\n", status_names[s], failed[s]);
+        }
+    }
+    printf("Quality:\n");
+    for (uint32_t q = 0; q < 6; q++) {
+        if (reasons[q]) {
+            printf("  %-28s %u\n", quality_names[q], reasons[q]);
+        }
+    }
+    if (ok) {
+        printf("Mean: brightness %.2f, coverage %.1f%%, contrast %.1f, variance %.1f, "
+                "sharpness %.2f\n", mean / 100.0 / ok, (double)coverage / ok,
+                (double)contrast / ok, (double)variance / ok, sharpness / 100.0 / ok);
+    }
+    printf("Time: %.1f ms, %u threads, %.0f images/s, %.1f MB/s\n", us / 1000.0, threads,
+            job->count * 1e6 / (us ? us : 1), bytes / (double)(us ? us : 1));
+    printf("  %-8s %8s %8s\n", "thread", "images", "steals");
+    for (uint32_t t = 0; t < threads; t++) {
+        printf("  %-8u %8u %8u\n", t, stats[t].done, stats[t].steals);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    job_t job = {
+        .bins = DEFAULT_BINS,
+        .geometry = { .dpi = IMAGE_EXPORT_DEFAULT_DPI },
+        .format = IMAGE_FORMAT_PGM,
+    };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cpus > 0 ? cpus : 1;
+    uint32_t capacity = 0;
+    const char *meta_path = NULL;
+    bool scaling = false;
+    work_steal_stats_t *stats;
+    uint64_t us;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:f:g:j:m:B:sh")) != -1) {
+        switch (c) {
+            case 'o':
+                job.out_dir = optarg;
+                break;
+            case 'f':
+                if (strcmp(optarg, "png") == 0) {
+                    job.format = IMAGE_FORMAT_PNG;
+                } else if (strcmp(optarg, "pgm") != 0) {
+                    help();
+                    return 1;
+                }
+                break;
+            case 'g': {
+                unsigned w = 0, h = 0, dpi = IMAGE_EXPORT_DEFAULT_DPI;
+                if (sscanf(optarg, "%ux%u,%u", &w, &h, &dpi) < 2 || !w || !h ||
+                        w > UINT16_MAX || h > UINT16_MAX) {
+                    help();
+                    return 1;
+                }
+                job.geometry = (image_geometry_t){ .width = w, .height = h, .dpi = dpi };
+                break;
+            }
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'm':
+                meta_path = optarg;
+                break;
+            case 'B':
+                job.bins = atoi(optarg);
+                break;
+            case 's':
+                scaling = true;
+                break;
+            default:
+                help();
+                return 1;
+        }
+    }
+    if (optind >= argc || threads == 0 || job.bins == 0 || job.bins > 256 || 256 % job.bins) {
+        help();
+        return 1;
+    }
+#ifndef BMLITE_USE_ZLIB
+    if (job.format == IMAGE_FORMAT_PNG) {
+        fprintf(stderr, "PNG needs zlib, build with make USE_ZLIB=1\n");
+        return 1;
+    }
+#endif
+    if (job.out_dir && mkdir(job.out_dir, 0755) < 0) {
+        struct stat st;
+        if (stat(job.out_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Can't create %s\n", job.out_dir);
+            return 1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (!add_input(&job, &capacity, argv[i])) {
+            return 1;
+        }
+    }
+    if (job.count == 0) {
+        fprintf(stderr, "No images\n");
+        return 1;
+    }
+    // Same order of metadata whatever order directories are listed in
+    qsort(job.paths, job.count, sizeof(char *), cmp_path);
+
+    job.results = malloc(job.count * sizeof(result_t));
+    job.hist = malloc((size_t)job.count * job.bins * sizeof(uint32_t));
+    stats = calloc(threads, sizeof(*stats));
+    if (job.results == NULL || job.hist == NULL || stats == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if (scaling) {
+        uint64_t single = 0;
+
+        // Warm page cache, so the first run is not penalized
+        run(&job, threads, stats);
+        printf("%8s %10s %10s %8s\n", "threads", "ms", "images/s", "speedup");
+        for (uint32_t t = 1; ; t = t * 2 < threads ? t * 2 : threads) {
+            us = run(&job, t, stats);
+            if (t == 1) {
+                single = us;
+            }
+            printf("%8u %10.1f %10.0f %8.2f\n", t, us / 1000.0, job.count * 1e6 / (us ? us : 1),
+                    (double)single / (us ? us : 1));
+            if (t == threads) {
+                break;
+            }
+        }
+    }
+
+    us = run(&job, threads, stats);
+    print_summary(&job, threads, us, stats);
+
+    if (meta_path) {
+        FILE *f = strcmp(meta_path, "-") == 0 ? stdout : fopen(meta_path, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Can't create %s\n", meta_path);
+            return 1;
+        }
+        write_metadata(f, &job);
+        if (f != stdout) {
+            fclose(f);
+        }
+    }
+
+    for (uint32_t i = 0; i < job.count; i++) {
+        free(job.paths[i]);
+    }
+    free(job.paths);
+    free(job.results);
+    free(job.hist);
+    free(stats);
+    return 0;
+}
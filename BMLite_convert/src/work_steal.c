@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    work_steal.c
+ * @brief   Work-stealing pool running a function over a range of indexes
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "work_steal.h"
+
+#define CACHE_LINE 64
+
+/* Range [begin, end) packed as begin << 32 | end */
+#define RANGE(begin, end) ((uint64_t)(begin) << 32 | (end))
+#define RANGE_BEGIN(r) ((uint32_t)((r) >> 32))
+#define RANGE_END(r) ((uint32_t)(r))
+
+typedef struct pool pool_t;
+
+typedef struct {
+    uint64_t range;
+    pool_t *pool;
+    uint32_t id;
+    pthread_t thread;
+    work_steal_stats_t stats;
+} __attribute__((aligned(CACHE_LINE))) worker_t;
+
+struct pool {
+    worker_t *workers;
+    uint32_t count;
+    work_steal_fn_t fn;
+    void *ctx;
+};
+
+static bool take_own(worker_t *w, uint32_t *index)
+{
+    uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+    while (RANGE_BEGIN(r) < RANGE_END(r)) {
+        if (__atomic_compare_exchange_n(&w->range, &r, RANGE(RANGE_BEGIN(r) + 1, RANGE_END(r)),
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *index = RANGE_BEGIN(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Move back half of the largest other range to own range */
+static bool steal(worker_t *w)
+{
+    pool_t *p = w->pool;
+
+    for (;;) {
+        worker_t *victim = NULL;
+        uint64_t r = 0;
+        uint32_t left = 0;
+
+        for (uint32_t i = 0; i < p->count; i++) {
+            worker_t *v = &p->workers[i];
+            uint64_t vr = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+            uint32_t n = RANGE_BEGIN(vr) < RANGE_END(vr) ? RANGE_END(vr) - RANGE_BEGIN(vr) : 0;
+
+            if (v != w && n > left) {
+                victim = v;
+                r = vr;
+                left = n;
+            }
+        }
+        if (victim == NULL) {
+            // Work still in progress belongs to workers which are running
+            return false;
+        }
+
+        uint32_t split = RANGE_END(r) - (left + 1) / 2;
+        if (__atomic_compare_exchange_n(&victim->range, &r, RANGE(RANGE_BEGIN(r), split),
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // Nobody steals from an empty range, so plain store is enough
+            __atomic_store_n(&w->range, RANGE(split, RANGE_END(r)), __ATOMIC_RELEASE);
+            w->stats.steals++;
+            return true;
+        }
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *w = arg;
+    uint32_t index;
+
+    do {
+        while (take_own(w, &index)) {
+            w->pool->fn(index, w->id, w->pool->ctx);
+            w->stats.done++;
+        }
+    } while (steal(w));
+    return NULL;
+}
+
+bool work_steal_run(uint32_t count, uint32_t workers, work_steal_fn_t fn, void *ctx,
+        work_steal_stats_t *stats)
+{
+    pool_t pool = { .count = workers, .fn = fn, .ctx = ctx };
+    uint32_t started;
+    bool ok = true;
+
+    if (workers == 0) {
+        return false;
+    }
+    if (posix_memalign((void **)&pool.workers, CACHE_LINE, workers * sizeof(worker_t)) != 0) {
+        return false;
+    }
+    memset(pool.workers, 0, workers * sizeof(worker_t));
+
+    for (uint32_t i = 0; i < workers; i++) {
+        worker_t *w = &pool.workers[i];
+        w->pool = &pool;
+        w->id = i;
+        w->range = RANGE((uint64_t)count * i / workers, (uint64_t)count * (i + 1) / workers);
+    }
+
+    for (started = 1; started < workers; started++) {
+        if (pthread_create(&pool.workers[started].thread, NULL, worker_run,
+                &pool.workers[started]) != 0) {
+            // Calling thread steals the work of workers not started
+            ok = false;
+            break;
+        }
+    }
+    worker_run(&pool.workers[0]);
+    for (uint32_t i = 1; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    if (stats) {
+        for (uint32_t i = 0; i < workers; i++) {
+            stats[i] = pool.workers[i].stats;
+        }
+    }
+    free(pool.workers);
+    return ok;
+}
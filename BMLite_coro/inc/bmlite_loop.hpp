@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITE_LOOP_HPP
+#define BMLITE_LOOP_HPP
+
+/**
+ * @file    bmlite_loop.hpp
+ * @brief   Single-threaded epoll event loop for BM-Lite coroutines
+ *
+ * Coroutines suspend on file descriptor readiness (tty, emulator timerfd,
+ * GPIO IRQ value file, sockets of the application) or on timers and are
+ * resumed from run() on the thread calling it. Nothing here is thread-safe:
+ * all tasks of a loop, and all sensors driven by them, belong to one thread.
+ */
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <utility>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "bmlite_task.hpp"
+
+namespace bmlite {
+
+class event_loop {
+public:
+    using clock = std::chrono::steady_clock;
+
+    event_loop() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~event_loop()
+    {
+        if (epfd_ >= 0) {
+            close(epfd_);
+        }
+    }
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    /** false if epoll instance could not be created */
+    bool valid() const noexcept { return epfd_ >= 0; }
+
+    /**
+     * Awaitable waiting for fd events with optional timeout.
+     * co_await yields true if fd is ready, false on timeout or error.
+     */
+    class wait_awaiter {
+    public:
+        wait_awaiter(event_loop &loop, int fd, uint32_t events, clock::time_point deadline,
+                bool has_deadline) noexcept
+            : loop_(loop), fd_(fd), events_(events), deadline_(deadline),
+              has_deadline_(has_deadline) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            h_ = h;
+            return loop_.add(this);
+        }
+
+        bool await_resume() const noexcept { return ready_; }
+
+    private:
+        friend class event_loop;
+
+        event_loop &loop_;
+        int fd_;
+        uint32_t events_;
+        clock::time_point deadline_;
+        bool has_deadline_;
+        bool ready_ = false;
+        bool watching_fd_ = false;
+        std::multimap<clock::time_point, wait_awaiter *>::iterator timer_;
+        std::coroutine_handle<> h_;
+    };
+
+    /**
+     * Wait for events on fd.
+     *
+     * @param fd          File descriptor.
+     * @param events      EPOLLIN, EPOLLPRI...
+     * @param timeout_ms  Timeout in ms. Use 0 for infinity.
+     */
+    wait_awaiter wait(int fd, uint32_t events, uint32_t timeout_ms = 0) noexcept
+    {
+        return wait_awaiter(*this, fd, events,
+                clock::now() + std::chrono::milliseconds(timeout_ms), timeout_ms != 0);
+    }
+
+    wait_awaiter readable(int fd, uint32_t timeout_ms = 0) noexcept
+    {
+        return wait(fd, EPOLLIN, timeout_ms);
+    }
+
+    wait_awaiter sleep_for(clock::duration d) noexcept
+    {
+        return wait_awaiter(*this, -1, 0, clock::now() + d, true);
+    }
+
+    wait_awaiter sleep_until(clock::time_point t) noexcept
+    {
+        return wait_awaiter(*this, -1, 0, t, true);
+    }
+
+    /** Resume h from the loop on next iteration */
+    void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+    /** Start task owned by the loop. run() returns when all of them finish */
+    void spawn(task<> t)
+    {
+        tasks_++;
+        run_detached(this, std::move(t));
+    }
+
+    /** Number of spawned tasks not finished yet */
+    unsigned tasks() const noexcept { return tasks_; }
+
+    /** Make run() return after current iteration */
+    void stop() noexcept { stop_ = true; }
+
+    /**
+     * Run until all spawned tasks finish or stop() is called.
+     *
+     * @return false on epoll error.
+     */
+    bool run()
+    {
+        epoll_event evs[16];
+
+        stop_ = false;
+        while (!stop_) {
+            while (!ready_.empty() && !stop_) {
+                std::coroutine_handle<> h = ready_.front();
+                ready_.pop_front();
+                h.resume();
+            }
+            if (stop_ || tasks_ == 0) {
+                break;
+            }
+
+            int timeout = -1;
+            if (!ready_.empty()) {
+                timeout = 0;
+            } else if (!timers_.empty()) {
+                auto left = timers_.begin()->first - clock::now();
+                // Round up, waking early would only spin
+                auto ms = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+                timeout = ms > 0 ? (int)ms : 0;
+            }
+
+            int n = epoll_wait(epfd_, evs, sizeof(evs) / sizeof(evs[0]), timeout);
+            if (n < 0 && errno != EINTR) {
+                return false;
+            }
+            for (int i = 0; i < n; i++) {
+                finish(static_cast<wait_awaiter *>(evs[i].data.ptr), true);
+            }
+
+            auto now = clock::now();
+            while (!timers_.empty() && timers_.begin()->first <= now) {
+                finish(timers_.begin()->second, false);
+            }
+        }
+        return true;
+    }
+
+private:
+    struct detached {
+        struct promise_type {
+            detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    static detached run_detached(event_loop *loop, task<> t)
+    {
+        co_await t;
+        loop->tasks_--;
+    }
+
+    /* Returns false if the awaiter must not suspend */
+    bool add(wait_awaiter *w)
+    {
+        if (w->fd_ >= 0) {
+            epoll_event ev = {};
+            ev.events = w->events_;
+            ev.data.ptr = w;
+            if (epoll_ctl(epfd_, EPOLL_CTL_ADD, w->fd_, &ev) < 0) {
+                return false;
+            }
+            w->watching_fd_ = true;
+        }
+        if (w->has_deadline_) {
+            w->timer_ = timers_.emplace(w->deadline_, w);
+        }
+        return true;
+    }
+
+    void finish(wait_awaiter *w, bool ready)
+    {
+        if (w->watching_fd_) {
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, w->fd_, nullptr);
+            w->watching_fd_ = false;
+        }
+        if (w->has_deadline_) {
+            timers_.erase(w->timer_);
+            w->has_deadline_ = false;
+        }
+        // Sleep has no fd, its expiry is the successful outcome
+        w->ready_ = ready || w->fd_ < 0;
+        ready_.push_back(w->h_);
+    }
+
+    int epfd_;
+    bool stop_ = false;
+    unsigned tasks_ = 0;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::multimap<clock::time_point, wait_awaiter *> timers_;
+};
+
+} // namespace bmlite
+
+#endif /* BMLITE_LOOP_HPP */
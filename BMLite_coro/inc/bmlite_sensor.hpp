@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITE_SENSOR_HPP
+#define BMLITE_SENSOR_HPP
+
+/**
+ * @file    bmlite_sensor.hpp
+ * @brief   C++20 coroutine front-end for BM-Lite operations
+ *
+ * sensor wraps an HCP_comm_t chain. Operations are coroutines which send
+ * the command and suspend until the link signals that BM-Lite started to
+ * answer, so one event_loop thread can drive several sensors next to the
+ * rest of the application:
+ *
+ *     bmlite::identify_result r = co_await sensor.identify(5000);
+ *     bmlite::command t = co_await sensor.template_get();
+ *     std::span<const uint8_t> data = t.data();
+ *
+ * A command keeps the sensor until it is destroyed, so spans returned by
+ * it point into the chain packet buffer without copying and stay valid for
+ * the lifetime of the command. Other coroutines using the same sensor
+ * wait for it in FIFO order, so a coroutine must not start another
+ * operation on a sensor while it still holds a command of it.
+ *
+ * Only the wait for BM-Lite processing is asynchronous. Frame transfers,
+ * including ACKs, are done by bmlite_send() and bmlite_receive() in place
+ * and block the loop for the link transfer time.
+ */
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "bmlite_if.h"
+#include "bmlite_continuous.h"
+#include "hcp_tiny.h"
+#include "bmlite_watchdog.h"
+#ifdef BMLITE_USE_METRICS
+#include "bmlite_metrics.h"
+#endif
+}
+
+#include "bmlite_loop.hpp"
+#include "bmlite_task.hpp"
+
+namespace bmlite {
+
+/** How a physical layer signals data from BM-Lite to the event loop */
+struct link {
+    /** Descriptor becoming ready when BM-Lite answers. -1 - receive blocking */
+    int fd = -1;
+    /** epoll events to wait for: EPOLLIN for tty and IRQ eventfd (rpi_spi_get_irq_fd),
+        EPOLLPRI for GPIO value file */
+    uint32_t events = EPOLLIN;
+    /** Optional check for data already waiting on host side, e.g. rpi_com_rx_pending,
+        rpi_spi_irq_pending */
+    bool (*pending)(void *session) = nullptr;
+};
+
+struct identify_result {
+    /** Communication error or BM-Lite result */
+    fpc_bep_result_t result = FPC_BEP_RESULT_OK;
+    bool match = false;
+    uint16_t template_id = 0;
+};
+
+class sensor;
+
+/**
+ * Command being built, executed or read. Owns the sensor while it exists.
+ */
+class command {
+public:
+    command(command &&other) noexcept
+        : s_(std::exchange(other.s_, nullptr)), result_(other.result_) {}
+    command &operator=(command &&) = delete;
+    command(const command &) = delete;
+    ~command();
+
+    /** Start new command on the owned sensor. Arguments of previous one are dropped */
+    fpc_bep_result_t reset(uint16_t cmd, uint16_t arg = ARG_NONE);
+
+    fpc_bep_result_t add_arg(uint16_t type, std::span<const uint8_t> data = {});
+
+    template <typename T>
+    fpc_bep_result_t add_arg(uint16_t type, const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return add_arg(type, std::span<const uint8_t>(
+                reinterpret_cast<const uint8_t *>(&value), sizeof(value)));
+    }
+
+    /** Send command and wait for answer with chain phy_rx_timeout */
+    task<fpc_bep_result_t> run();
+
+    /**
+     * Send command and wait for answer.
+     *
+     * @param timeout_ms  Timeout in ms. Use 0 for infinity.
+     */
+    task<fpc_bep_result_t> run(uint32_t timeout_ms);
+
+    /** Communication error of last run, or BM-Lite result if communication succeeded */
+    fpc_bep_result_t result() const noexcept;
+
+    explicit operator bool() const noexcept { return result() == FPC_BEP_RESULT_OK; }
+
+    /** View of answer argument in packet buffer. Empty if missing */
+    std::span<const uint8_t> arg(uint16_t key);
+
+    std::span<const uint8_t> data() { return arg(ARG_DATA); }
+
+    template <typename T>
+    std::optional<T> value(uint16_t key)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        std::span<const uint8_t> a = arg(key);
+        if (a.size() < sizeof(T)) {
+            return std::nullopt;
+        }
+        T v;
+        std::memcpy(&v, a.data(), sizeof(T));
+        return v;
+    }
+
+private:
+    friend class sensor;
+
+    explicit command(sensor *s) noexcept : s_(s) {}
+
+    sensor *s_;
+    fpc_bep_result_t result_ = FPC_BEP_RESULT_OK;
+};
+
+class sensor {
+public:
+    /** Answer timeout of wait-ready probe after match, see bep_wait_ready() */
+    static constexpr uint32_t ready_timeout_ms = 50;
+    /** Host waits this much longer than BM-Lite itself, so a late answer is not
+        left on the link for the next command */
+    static constexpr uint32_t rx_margin_ms = BMLITE_CONTINUOUS_RX_MARGIN;
+    static constexpr int max_capture_attempts = 3;
+
+    sensor(event_loop &loop, HCP_comm_t &chain, link l) noexcept
+        : loop_(loop), chain_(chain), link_(l) {}
+    sensor(const sensor &) = delete;
+    sensor &operator=(const sensor &) = delete;
+
+    event_loop &loop() noexcept { return loop_; }
+    HCP_comm_t &chain() noexcept { return chain_; }
+
+    /** Wait for the sensor and start new command on it */
+    task<command> begin(uint16_t cmd, uint16_t arg = ARG_NONE)
+    {
+        co_await acquire_awaiter{*this};
+        command c(this);
+        c.reset(cmd, arg);
+        co_return c;
+    }
+
+    /**
+     * Capture image, see bep_capture().
+     *
+     * @param timeout_ms  Timeout of waiting for finger in ms. Host waits
+     *                    rx_margin_ms longer for the answer.
+     */
+    task<fpc_bep_result_t> capture(uint16_t timeout_ms)
+    {
+        command c = co_await begin(CMD_CAPTURE);
+        co_return co_await capture(c, timeout_ms);
+    }
+
+    /** Capture and identify finger against templates in storage */
+    task<identify_result> identify(uint16_t timeout_ms)
+    {
+        identify_result r;
+        command c = co_await begin(CMD_CAPTURE);
+
+        bmlite_emit_identify_start(&chain_);
+        r.result = co_await capture(c, timeout_ms);
+        if (r.result == FPC_BEP_RESULT_OK) {
+            r.result = co_await run(c, CMD_IMAGE, ARG_EXTRACT);
+        }
+        if (r.result == FPC_BEP_RESULT_OK) {
+            r.result = co_await run(c, CMD_IDENTIFY, ARG_NONE);
+        }
+        if (r.result == FPC_BEP_RESULT_OK) {
+            std::optional<uint8_t> match = c.value<uint8_t>(ARG_MATCH);
+            std::optional<uint16_t> id = c.value<uint16_t>(ARG_ID);
+            r.match = match.value_or(0) != 0;
+            if (!match) {
+                r.result = FPC_BEP_RESULT_INVALID_ARGUMENT;
+            } else if (r.match && id) {
+                r.template_id = *id;
+                bmlite_emit_template_change(&chain_, BMLITE_TEMPLATE_MATCHED, *id, nullptr, 0);
+                // Wait for possible updating template on BM-Lite
+                c.reset(CMD_INFO, ARG_GET);
+                c.add_arg(ARG_VERSION);
+                co_await c.run(ready_timeout_ms + rx_margin_ms);
+            }
+        }
+        bmlite_emit_identify_finish(&chain_);
+        co_return r;
+    }
+
+    /** Upload captured image. Pixels are in data() of returned command */
+    task<command> image_get()
+    {
+        command c = co_await begin(CMD_IMAGE, ARG_UPLOAD);
+        co_await c.run();
+        co_return c;
+    }
+
+    /** Upload template from RAM. Template is in data() of returned command */
+    task<command> template_get()
+    {
+        command c = co_await begin(CMD_TEMPLATE, ARG_UPLOAD);
+        co_await c.run();
+        co_return c;
+    }
+
+    /** Download template to RAM */
+    task<fpc_bep_result_t> template_put(std::span<const uint8_t> data)
+    {
+        command c = co_await begin(CMD_TEMPLATE, ARG_DOWNLOAD);
+        if (c.add_arg(ARG_DATA, data) != FPC_BEP_RESULT_OK) {
+            co_return FPC_BEP_RESULT_NO_MEMORY;
+        }
+        co_await c.run();
+        co_return c.result();
+    }
+
+    /** Save template in RAM to storage */
+    task<fpc_bep_result_t> template_save(uint16_t template_id)
+    {
+        command c = co_await begin(CMD_TEMPLATE, ARG_SAVE);
+        c.add_arg(ARG_ID, template_id);
+        co_await c.run();
+        co_return c.result();
+    }
+
+    task<fpc_bep_result_t> template_remove_all()
+    {
+        command c = co_await begin(CMD_STORAGE_TEMPLATE, ARG_DELETE);
+        c.add_arg(ARG_ALL);
+        co_await c.run();
+        co_return c.result();
+    }
+
+private:
+    friend class command;
+
+    struct acquire_awaiter {
+        sensor &s;
+
+        bool await_ready() const noexcept
+        {
+            if (!s.busy_) {
+                s.busy_ = true;
+                return true;
+            }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) { s.waiters_.push_back(h); }
+        void await_resume() const noexcept {}
+    };
+
+    /* Hand the sensor over to next waiter or mark it free */
+    void release()
+    {
+        if (waiters_.empty()) {
+            busy_ = false;
+        } else {
+            loop_.post(waiters_.front());
+            waiters_.pop_front();
+        }
+    }
+
+    task<fpc_bep_result_t> run(command &c, uint16_t cmd, uint16_t arg)
+    {
+        c.reset(cmd, arg);
+        co_await c.run();
+        co_return c.result();
+    }
+
+    task<fpc_bep_result_t> capture(command &c, uint16_t timeout_ms)
+    {
+        bmlite_emit_start_capture(&chain_);
+        for (int i = 0; i < max_capture_attempts; i++) {
+            c.reset(CMD_CAPTURE, ARG_NONE);
+            c.add_arg(ARG_TIMEOUT, timeout_ms);
+            co_await c.run(timeout_ms ? timeout_ms + rx_margin_ms : 0);
+            if (c.result() == FPC_BEP_RESULT_OK) {
+                break;
+            }
+        }
+        bmlite_emit_finish_capture(&chain_);
+        co_return c.result();
+    }
+
+    /* Same as bmlite_tranceive(), but answer is awaited on the loop */
+    task<fpc_bep_result_t> transceive(uint32_t timeout_ms)
+    {
+        fpc_bep_result_t result;
+#ifdef BMLITE_USE_METRICS
+        // Command id is the first field of the packet
+        uint16_t cmd;
+        std::memcpy(&cmd, chain_.pkt_buffer, sizeof(cmd));
+        event_loop::clock::time_point start = event_loop::clock::now();
+
+        bmlite_metric_add(in_flight, 1);
+#endif
+
+        if (chain_.exchange_timeout) {
+            chain_.exchange_deadline = hal_timebase_get_us() +
+                    (uint64_t)chain_.exchange_timeout * 1000;
+            // Answer wait on the loop is part of the exchange too
+            if (timeout_ms == 0 || timeout_ms > chain_.exchange_timeout) {
+                timeout_ms = chain_.exchange_timeout;
+            }
+        }
+        result = bmlite_send(&chain_);
+        if (result == FPC_BEP_RESULT_OK && link_.fd >= 0 &&
+                !(link_.pending && link_.pending(chain_.phy_session)) &&
+                !co_await loop_.wait(link_.fd, link_.events, timeout_ms)) {
+            result = FPC_BEP_RESULT_TIMEOUT;
+            bmlite_emit_error(&chain_, BMLITE_ERROR_SEND_CMD, result);
+        }
+        if (result == FPC_BEP_RESULT_OK) {
+            // Keeps waiting for the rest of answer frames with the same timeout
+            uint32_t prev_timeout = chain_.phy_rx_timeout;
+            chain_.phy_rx_timeout = timeout_ms;
+            result = bmlite_receive(&chain_);
+            chain_.phy_rx_timeout = prev_timeout;
+        }
+        if (result == FPC_BEP_RESULT_TIMEOUT) {
+            // Answer coming after the timeout must not be taken for answer of next command
+            bmlite_drain_link(&chain_, bmlite_frame_time(&chain_));
+        }
+        if (result == FPC_BEP_RESULT_OK && bmlite_get_arg(&chain_, ARG_RESULT) == FPC_BEP_RESULT_OK) {
+            chain_.bep_result = (fpc_bep_result_t)*(int8_t *)chain_.arg.data;
+        } else {
+            chain_.bep_result = FPC_BEP_RESULT_OK;
+        }
+        chain_.exchange_deadline = 0;
+
+#ifdef BMLITE_USE_METRICS
+        bmlite_metrics_command(cmd, result ? result : chain_.bep_result,
+                (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                        event_loop::clock::now() - start).count());
+        bmlite_metric_add(in_flight, -1);
+#endif
+        bmlite_watchdog_command(&chain_, result);
+        co_return result;
+    }
+
+    event_loop &loop_;
+    HCP_comm_t &chain_;
+    link link_;
+    bool busy_ = false;
+    std::deque<std::coroutine_handle<>> waiters_;
+};
+
+inline command::~command()
+{
+    if (s_) {
+        s_->release();
+    }
+}
+
+inline fpc_bep_result_t command::reset(uint16_t cmd, uint16_t arg)
+{
+    result_ = bmlite_init_cmd(&s_->chain_, cmd, arg);
+    return result_;
+}
+
+inline fpc_bep_result_t command::add_arg(uint16_t type, std::span<const uint8_t> data)
+{
+    if (data.size() > UINT16_MAX) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    fpc_bep_result_t r = bmlite_add_arg(&s_->chain_, type, const_cast<uint8_t *>(data.data()),
+            (uint16_t)data.size());
+    if (r != FPC_BEP_RESULT_OK) {
+        result_ = r;
+    }
+    return r;
+}
+
+inline task<fpc_bep_result_t> command::run()
+{
+    return run(s_->chain_.phy_rx_timeout);
+}
+
+inline task<fpc_bep_result_t> command::run(uint32_t timeout_ms)
+{
+    // Command failed to build, nothing is sent
+    if (result_ != FPC_BEP_RESULT_OK) {
+        co_return result_;
+    }
+    result_ = co_await s_->transceive(timeout_ms);
+    co_return result_;
+}
+
+inline fpc_bep_result_t command::result() const noexcept
+{
+    return result_ != FPC_BEP_RESULT_OK ? result_ : s_->chain_.bep_result;
+}
+
+inline std::span<const uint8_t> command::arg(uint16_t key)
+{
+    if (bmlite_get_arg(&s_->chain_, key) != FPC_BEP_RESULT_OK) {
+        return {};
+    }
+    return std::span<const uint8_t>(s_->chain_.arg.data, s_->chain_.arg.size);
+}
+
+} // namespace bmlite
+
+#endif /* BMLITE_SENSOR_HPP */
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITE_TASK_HPP
+#define BMLITE_TASK_HPP
+
+/**
+ * @file    bmlite_task.hpp
+ * @brief   Lazy coroutine task for the BM-Lite C++20 front-end
+ *
+ * task<T> starts when it is awaited and resumes the awaiting coroutine
+ * directly when it finishes (symmetric transfer), so chains of nested
+ * operations do not grow the stack. Errors are returned as values, like
+ * in the C SDK. Exceptions are not used and terminate the program.
+ */
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace bmlite {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        std::coroutine_handle<> c = h.promise().continuation;
+        return c ? c : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+};
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result() { return std::move(*value); }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+    void result() noexcept {}
+};
+
+} // namespace detail
+
+template <typename T>
+class [[nodiscard]] task {
+public:
+    using promise_type = detail::promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit task(handle_type h) noexcept : h_(h) {}
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            if (h_) {
+                h_.destroy();
+            }
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        h_.promise().continuation = awaiting;
+        return h_;
+    }
+
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    handle_type h_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+} // namespace bmlite
+
+#endif /* BMLITE_TASK_HPP */
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    main.cpp
+ * @brief   Several BM-Lite driven by coroutines on one thread
+ *
+ * Every sensor runs identify rounds in its own coroutine. A ticker task
+ * stands in for the rest of the application and reports how late the loop
+ * served it, i.e. how long sensor work blocked the thread.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+#include "platform.h"
+#include "platform_rpi.h"
+}
+
+#include "bmlite_loop.hpp"
+#include "bmlite_sensor.hpp"
+
+#define DATA_BUFFER_SIZE 102400
+#define DEFAULT_EMULATED 2
+#define SPI_SPEED_HZ 1000000
+#define TICK_PERIOD_MS 10
+
+using clock_type = bmlite::event_loop::clock;
+
+struct device {
+    std::string name;
+    rpi_emu_t *emu = nullptr;
+    rpi_com_session_t *com = nullptr;
+    uint8_t txrx_buffer[MTU];
+    uint8_t data_buffer[DATA_BUFFER_SIZE];
+    HCP_comm_t chain = {};
+    std::unique_ptr<bmlite::sensor> sensor;
+
+    uint32_t rounds = 0;
+    uint32_t matches = 0;
+    uint32_t errors = 0;
+    uint64_t busy_us = 0;
+    uint64_t max_us = 0;
+
+    ~device()
+    {
+        rpi_emu_close(emu);
+        rpi_com_close(com);
+    }
+};
+
+struct ticker_stats {
+    /** Sensor tasks still running */
+    unsigned sensors = 0;
+    uint32_t ticks = 0;
+    uint64_t max_late_us = 0;
+};
+
+static uint64_t us_since(clock_type::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - t).count();
+}
+
+static void help(void)
+{
+    fprintf(stderr, "BM-Lite coroutine demo\n");
+    fprintf(stderr, "Syntax: bmlite_coro [-e count] [-p port]... [-s] [-b baudrate] [-n rounds] [-t timeout]\n");
+    fprintf(stderr, "-e: number of emulated BM-Lite, default %d if no port is given\n",
+            DEFAULT_EMULATED);
+    fprintf(stderr, "-p: BM-Lite on COM port, can be repeated\n");
+    fprintf(stderr, "-s: BM-Lite on SPI, answers are awaited on IRQ pin edges\n");
+}
+
+/* Emulated sensor i has finger i + 1 enrolled as template i + 1 */
+static bmlite::task<> prepare(device &d, uint16_t id)
+{
+    std::vector<uint8_t> tmpl(EMU_TEMPLATE_SIZE);
+    fpc_bep_result_t res;
+
+    rpi_emu_make_template(id, tmpl.data(), tmpl.size());
+    res = co_await d.sensor->template_remove_all();
+    if (res == FPC_BEP_RESULT_OK) {
+        res = co_await d.sensor->template_put(tmpl);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        // Read back in place. The command holds the sensor until end of scope
+        bmlite::command t = co_await d.sensor->template_get();
+        if (!t || !std::ranges::equal(t.data(), tmpl)) {
+            res = t ? FPC_BEP_RESULT_INVALID_FORMAT : t.result();
+        }
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = co_await d.sensor->template_save(id);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        printf("%s: template setup failed %d\n", d.name.c_str(), res);
+        d.errors++;
+    }
+    rpi_emu_session_set_finger(d.emu, id);
+}
+
+static bmlite::task<> identify_rounds(device &d, uint32_t rounds, uint16_t timeout)
+{
+    for (uint32_t i = 0; i < rounds; i++) {
+        clock_type::time_point start = clock_type::now();
+        bmlite::identify_result r = co_await d.sensor->identify(timeout);
+        uint64_t us = us_since(start);
+
+        d.rounds++;
+        d.busy_us += us;
+        d.max_us = std::max(d.max_us, us);
+        if (r.result != FPC_BEP_RESULT_OK) {
+            d.errors++;
+            printf("%s: identify error %d\n", d.name.c_str(), r.result);
+        } else if (r.match) {
+            d.matches++;
+            printf("%s: match id %u, %.1f ms\n", d.name.c_str(), r.template_id, us / 1000.0);
+        } else {
+            printf("%s: no match, %.1f ms\n", d.name.c_str(), us / 1000.0);
+        }
+    }
+}
+
+static bmlite::task<> sensor_main(device &d, uint16_t id, uint32_t rounds, uint16_t timeout,
+        ticker_stats &stats)
+{
+    if (d.emu) {
+        co_await prepare(d, id);
+    }
+    co_await identify_rounds(d, rounds, timeout);
+    stats.sensors--;
+}
+
+/* Rest of the application: periodic work which must not starve */
+static bmlite::task<> ticker(bmlite::event_loop &loop, ticker_stats &stats)
+{
+    clock_type::time_point next = clock_type::now();
+
+    while (stats.sensors) {
+        next += std::chrono::milliseconds(TICK_PERIOD_MS);
+        co_await loop.sleep_until(next);
+        stats.ticks++;
+        stats.max_late_us = std::max(stats.max_late_us, us_since(next));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::unique_ptr<device>> devices;
+    std::vector<std::string> ports;
+    int emulated = -1;
+    bool spi = false;
+    uint32_t baudrate = 921600;
+    uint32_t rounds = 5;
+    uint16_t timeout = 5000;
+    ticker_stats stats;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:p:sb:n:t:h")) != -1) {
+        switch (opt) {
+            case 'e':
+                emulated = atoi(optarg);
+                break;
+            case 'p':
+                ports.push_back(optarg);
+                break;
+            case 's':
+                spi = true;
+                break;
+            case 'b':
+                baudrate = atoi(optarg);
+                break;
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 't':
+                timeout = atoi(optarg);
+                break;
+            default:
+                help();
+                exit(1);
+        }
+    }
+    if (emulated < 0) {
+        emulated = ports.empty() && !spi ? DEFAULT_EMULATED : 0;
+    }
+
+    bmlite::event_loop loop;
+    if (!loop.valid()) {
+        perror("epoll");
+        exit(1);
+    }
+
+    for (int i = 0; i < emulated; i++) {
+        std::unique_ptr<device> d(new device);
+        d->name = "emu" + std::to_string(i);
+        d->emu = rpi_emu_open(baudrate, EMU_DEFAULT_CAPACITY);
+        if (d->emu == NULL || rpi_emu_get_fd(d->emu) < 0) {
+            fprintf(stderr, "Emulator initialization failed\n");
+            exit(1);
+        }
+        d->chain.read = rpi_emu_receive;
+        d->chain.write = rpi_emu_send;
+        d->chain.phy_session = d->emu;
+        d->chain.link_speed = baudrate;
+        d->sensor.reset(new bmlite::sensor(loop, d->chain, { rpi_emu_get_fd(d->emu), EPOLLIN, nullptr }));
+        devices.push_back(std::move(d));
+    }
+    for (std::string &port : ports) {
+        std::unique_ptr<device> d(new device);
+        d->name = port;
+        d->com = rpi_com_open(&port[0], baudrate, false);
+        if (d->com == NULL) {
+            fprintf(stderr, "Com initialization failed\n");
+            exit(1);
+        }
+        d->chain.read = rpi_com_receive;
+        d->chain.write = rpi_com_send;
+        d->chain.phy_session = d->com;
+        d->chain.link_speed = baudrate;
+        d->sensor.reset(new bmlite::sensor(loop, d->chain,
+                { rpi_com_get_fd(d->com), EPOLLIN, rpi_com_rx_pending }));
+        devices.push_back(std::move(d));
+    }
+    if (spi) {
+        std::unique_ptr<device> d(new device);
+        d->name = "spi";
+        if (!rpi_spi_init(SPI_SPEED_HZ, true)) {
+            fprintf(stderr, "SPI initialization failed\n");
+            exit(1);
+        }
+        d->chain.read = platform_bmlite_receive;
+        d->chain.write = platform_bmlite_send;
+        d->chain.link_speed = SPI_SPEED_HZ;
+        // Without edge interrupt the IRQ pin is polled in blocking receive
+        d->sensor.reset(new bmlite::sensor(loop, d->chain,
+                { rpi_spi_get_irq_fd(), EPOLLIN, rpi_spi_irq_pending }));
+        devices.push_back(std::move(d));
+    }
+    if (devices.empty()) {
+        help();
+        exit(1);
+    }
+    for (std::unique_ptr<device> &d : devices) {
+        d->chain.pkt_buffer = d->data_buffer;
+        d->chain.txrx_buffer = d->txrx_buffer;
+        d->chain.pkt_size_max = sizeof(d->data_buffer);
+        d->chain.phy_rx_timeout = timeout;
+    }
+
+    clock_type::time_point start = clock_type::now();
+    for (size_t i = 0; i < devices.size(); i++) {
+        stats.sensors++;
+        loop.spawn(sensor_main(*devices[i], i + 1, rounds, timeout, stats));
+    }
+    loop.spawn(ticker(loop, stats));
+    if (!loop.run()) {
+        perror("epoll_wait");
+        exit(1);
+    }
+    uint64_t wall_us = us_since(start);
+
+    uint64_t sum_us = 0;
+    uint32_t errors = 0;
+    printf("\n%-14s %7s %7s %7s %9s %9s\n", "sensor", "rounds", "match", "errors", "mean ms", "max ms");
+    for (std::unique_ptr<device> &d : devices) {
+        printf("%-14s %7u %7u %7u %9.1f %9.1f\n", d->name.c_str(), d->rounds, d->matches,
+                d->errors, d->rounds ? d->busy_us / 1000.0 / d->rounds : 0, d->max_us / 1000.0);
+        sum_us += d->busy_us;
+        errors += d->errors;
+    }
+    printf("wall %.1f ms, sum of operations %.1f ms, one thread\n", wall_us / 1000.0, sum_us / 1000.0);
+    printf("ticker %u ticks of %d ms, max late %.1f ms\n", stats.ticks, TICK_PERIOD_MS,
+            stats.max_late_us / 1000.0);
+
+    return errors ? 1 : 0;
+}
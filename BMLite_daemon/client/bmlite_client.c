@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_client.c
+ * @brief   Command line client of BM-Lite daemon
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bmlited_client.h"
+
+/** Maximum number of concurrent bench clients */
+#define BENCH_MAX_CLIENTS 32
+
+static const char *socket_path = BMLITED_SOCKET_PATH;
+
+static void help(void)
+{
+    fprintf(stderr, "BM-Lite daemon client\n");
+    fprintf(stderr, "Syntax: bmlite_client [-S socket] command [args]\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  ping | version | identify [timeout_ms] | enroll | save id | remove id\n");
+    fprintf(stderr, "  remove_all | list | monitor | bench [count] [clients]\n");
+}
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_message(bmlited_conn_t *conn, const bmlited_hdr_t *hdr, const uint8_t *data)
+{
+    uint32_t value;
+    bmlited_identify_rsp_t identify;
+    bmlited_template_evt_t template;
+
+    (void)conn;
+    switch (hdr->type) {
+        case BMLITED_RSP_PROGRESS:
+            memcpy(&value, data, sizeof(value));
+            if (value == BMLITED_PROGRESS_PUT_FINGER)
+                printf("Put finger on the sensor\n");
+            else
+                printf("Remove finger from the sensor\n");
+            break;
+        case BMLITED_EVT_IDENTIFY:
+            memcpy(&identify, data, sizeof(identify));
+            if (identify.match)
+                printf("Identify: match with template id: %d\n", identify.template_id);
+            else
+                printf("Identify: no match\n");
+            break;
+        case BMLITED_EVT_TEMPLATE:
+            memcpy(&template, data, sizeof(template));
+            printf("Template event %u, id %d\n", template.event, template.template_id);
+            break;
+        default:
+            printf("Unexpected message %d\n", hdr->type);
+            break;
+    }
+    fflush(stdout);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, double p)
+{
+    uint32_t i = (uint32_t)(p * (n - 1) + 0.5);
+
+    return sorted[i < n ? i : n - 1];
+}
+
+typedef struct {
+    pthread_t thread;
+    uint16_t type;
+    uint32_t count;
+    uint32_t *samples;
+    uint32_t done;
+} bench_client_t;
+
+static void *bench_thread(void *arg)
+{
+    bench_client_t *client = arg;
+    bmlited_conn_t *conn = malloc(sizeof(*conn));
+
+    if (conn == NULL || !bmlited_connect(conn, socket_path)) {
+        free(conn);
+        return NULL;
+    }
+    for (client->done = 0; client->done < client->count; client->done++) {
+        uint64_t start = time_us();
+        if (bmlited_request(conn, client->type, NULL, 0, NULL, NULL, NULL) !=
+                FPC_BEP_RESULT_OK)
+            break;
+        client->samples[client->done] = (uint32_t)(time_us() - start);
+    }
+    bmlited_close(conn);
+    free(conn);
+    return NULL;
+}
+
+/* Run count requests from each of clients connections at once */
+static int bench(const char *name, uint16_t type, uint32_t count, uint32_t clients)
+{
+    bench_client_t client[BENCH_MAX_CLIENTS];
+    uint32_t *samples = malloc(sizeof(uint32_t) * count * clients);
+    uint32_t n = 0;
+    uint64_t start;
+    uint64_t elapsed;
+
+    if (samples == NULL)
+        return 1;
+    start = time_us();
+    for (uint32_t i = 0; i < clients; i++) {
+        client[i].type = type;
+        client[i].count = count;
+        client[i].samples = samples + i * count;
+        client[i].done = 0;
+        pthread_create(&client[i].thread, NULL, bench_thread, &client[i]);
+    }
+    for (uint32_t i = 0; i < clients; i++) {
+        pthread_join(client[i].thread, NULL);
+        memmove(samples + n, client[i].samples, client[i].done * sizeof(uint32_t));
+        n += client[i].done;
+    }
+    elapsed = time_us() - start;
+
+    if (n == 0) {
+        printf("%s: no responses\n", name);
+        free(samples);
+        return 1;
+    }
+    qsort(samples, n, sizeof(uint32_t), cmp_u32);
+    printf("%-8s %u clients x %u: p50 %u us, p99 %u us, max %u us, %.0f req/s\n",
+            name, clients, count, percentile(samples, n, 0.5), percentile(samples, n, 0.99),
+            samples[n - 1], n * 1e6 / elapsed);
+    free(samples);
+    return n == count * clients ? 0 : 1;
+}
+
+static int print_result(fpc_bep_result_t res, fpc_bep_result_t bep_result)
+{
+    if (res != FPC_BEP_RESULT_OK || bep_result != FPC_BEP_RESULT_OK) {
+        printf("Error: result %d, BM-Lite result %d\n", res, bep_result);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static bmlited_conn_t conn;
+    static uint8_t rsp[BMLITED_MAX_RESPONSE];
+    uint32_t rsp_size = sizeof(rsp);
+    fpc_bep_result_t res;
+    fpc_bep_result_t bep_result = FPC_BEP_RESULT_OK;
+    const char *cmd;
+    int c;
+
+    while ((c = getopt(argc, argv, "S:h")) != -1) {
+        switch (c) {
+            case 'S':
+                socket_path = optarg;
+                break;
+            default:
+                help();
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        help();
+        return 1;
+    }
+    cmd = argv[optind];
+
+    if (strcmp(cmd, "bench") == 0) {
+        uint32_t count = optind + 1 < argc ? atoi(argv[optind + 1]) : 1000;
+        uint32_t clients = optind + 2 < argc ? atoi(argv[optind + 2]) : 1;
+        if (count == 0 || clients == 0 || clients > BENCH_MAX_CLIENTS) {
+            help();
+            return 1;
+        }
+        /* Ping is answered by daemon, version goes to BM-Lite */
+        return bench("ping", BMLITED_REQ_PING, count, clients) |
+               bench("version", BMLITED_REQ_VERSION, count, clients);
+    }
+
+    if (!bmlited_connect(&conn, socket_path)) {
+        fprintf(stderr, "Can't connect to %s\n", socket_path);
+        return 1;
+    }
+    conn.on_message = on_message;
+
+    if (strcmp(cmd, "ping") == 0) {
+        res = bmlited_request(&conn, BMLITED_REQ_PING, NULL, 0, NULL, NULL, &bep_result);
+    } else if (strcmp(cmd, "version") == 0) {
+        res = bmlited_request(&conn, BMLITED_REQ_VERSION, NULL, 0, rsp, &rsp_size, &bep_result);
+        if (res == FPC_BEP_RESULT_OK && rsp_size > 0) {
+            rsp[rsp_size - 1] = 0;
+            printf("%s\n", rsp);
+        }
+    } else if (strcmp(cmd, "identify") == 0) {
+        bmlited_identify_req_t req = {
+            .timeout = optind + 1 < argc ? atoi(argv[optind + 1]) : 0,
+        };
+        bmlited_identify_rsp_t result;
+        rsp_size = sizeof(result);
+        res = bmlited_request(&conn, BMLITED_REQ_IDENTIFY, &req, sizeof(req), &result,
+                &rsp_size, &bep_result);
+        if (res == FPC_BEP_RESULT_OK && bep_result == FPC_BEP_RESULT_OK) {
+            if (result.match)
+                printf("Match with template id: %d\n", result.template_id);
+            else
+                printf("No match\n");
+        }
+    } else if (strcmp(cmd, "enroll") == 0) {
+        res = bmlited_request(&conn, BMLITED_REQ_ENROLL, NULL, 0, NULL, NULL, &bep_result);
+    } else if ((strcmp(cmd, "save") == 0 || strcmp(cmd, "remove") == 0) && optind + 1 < argc) {
+        uint16_t id = atoi(argv[optind + 1]);
+        res = bmlited_request(&conn, cmd[0] == 's' ? BMLITED_REQ_TEMPLATE_SAVE :
+                BMLITED_REQ_TEMPLATE_REMOVE, &id, sizeof(id), NULL, NULL, &bep_result);
+    } else if (strcmp(cmd, "remove_all") == 0) {
+        res = bmlited_request(&conn, BMLITED_REQ_TEMPLATE_REMOVE_ALL, NULL, 0, NULL, NULL,
+                &bep_result);
+    } else if (strcmp(cmd, "list") == 0) {
+        res = bmlited_request(&conn, BMLITED_REQ_TEMPLATE_IDS, NULL, 0, rsp, &rsp_size,
+                &bep_result);
+        if (res == FPC_BEP_RESULT_OK && bep_result == FPC_BEP_RESULT_OK) {
+            printf("Template list:\n");
+            for (uint32_t i = 0; i + 1 < rsp_size; i += 2) {
+                printf("%d ", rsp[i] | rsp[i + 1] << 8);
+            }
+            printf("\n");
+        }
+    } else if (strcmp(cmd, "monitor") == 0) {
+        uint32_t mask = BMLITED_EVENT_IDENTIFY | BMLITED_EVENT_TEMPLATE;
+        bmlited_hdr_t hdr;
+        const uint8_t *data;
+        res = bmlited_request(&conn, BMLITED_REQ_SUBSCRIBE, &mask, sizeof(mask), NULL, NULL,
+                &bep_result);
+        while (res == FPC_BEP_RESULT_OK && (data = bmlited_receive(&conn, &hdr)) != NULL) {
+            on_message(&conn, &hdr, data);
+        }
+    } else {
+        help();
+        bmlited_close(&conn);
+        return 1;
+    }
+
+    bmlited_close(&conn);
+    return print_result(res, bep_result);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlited_client.c
+ * @brief   Client library of BM-Lite daemon
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "bmlited_client.h"
+
+bool bmlited_connect(bmlited_conn_t *conn, const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(conn, 0, sizeof(*conn));
+    if (path == NULL)
+        path = BMLITED_SOCKET_PATH;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn->fd < 0)
+        return false;
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void bmlited_close(bmlited_conn_t *conn)
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    uint8_t *p = data;
+
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+const uint8_t *bmlited_receive(bmlited_conn_t *conn, bmlited_hdr_t *hdr)
+{
+    if (!read_all(conn->fd, hdr, sizeof(*hdr)) || hdr->length > sizeof(conn->rx) ||
+            !read_all(conn->fd, conn->rx, hdr->length))
+        return NULL;
+    return conn->rx;
+}
+
+fpc_bep_result_t bmlited_request(bmlited_conn_t *conn, uint16_t type, const void *data,
+        uint32_t size, void *rsp, uint32_t *rsp_size, fpc_bep_result_t *bep_result)
+{
+    bmlited_hdr_t hdr = {
+        .type = type,
+        .seq = ++conn->seq,
+        .length = size,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)data, .iov_len = size },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+    uint32_t seq = hdr.seq;
+
+    if (sendmsg(conn->fd, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof(hdr) + size))
+        return FPC_BEP_RESULT_IO_ERROR;
+
+    while (1) {
+        const uint8_t *payload = bmlited_receive(conn, &hdr);
+        if (payload == NULL)
+            return FPC_BEP_RESULT_IO_ERROR;
+
+        if (hdr.type != BMLITED_RSP_RESULT || hdr.seq != seq) {
+            if (conn->on_message)
+                conn->on_message(conn, &hdr, payload);
+            continue;
+        }
+
+        bmlited_result_t result;
+        uint32_t data_size;
+        if (hdr.length < sizeof(result))
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        memcpy(&result, payload, sizeof(result));
+        data_size = hdr.length - sizeof(result);
+        if (rsp_size) {
+            if (data_size > *rsp_size)
+                data_size = *rsp_size;
+            if (rsp)
+                memcpy(rsp, payload + sizeof(result), data_size);
+            *rsp_size = data_size;
+        }
+        if (bep_result)
+            *bep_result = result.bep_result;
+        return result.result;
+    }
+}
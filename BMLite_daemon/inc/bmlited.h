@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITED_H
+#define BMLITED_H
+
+/**
+ * @file    bmlited.h
+ * @brief   BM-Lite daemon internals
+ *
+ * One I/O thread serves the socket: accepts clients, parses requests,
+ * answers requests which don't need BM-Lite and queues the rest. The I/O
+ * thread never blocks on a client socket, its answers are queued and sent
+ * when the socket is writable.
+ * One worker thread owns HCP chain and runs queued requests one by one,
+ * taking one request from each client in turn.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "hcp_tiny.h"
+#include "bmlite_power.h"
+#include "bmlite_watchdog.h"
+#include "bmlited_proto.h"
+
+/** Maximum number of connected clients */
+#define BMLITED_MAX_CLIENTS 32
+/** Requests queued per client. Client gets NO_RESOURCE when queue is full */
+#define BMLITED_CLIENT_QUEUE 8
+/** Longest capture wait (msec). Finger waits can't hold BM-Lite forever */
+#define BMLITED_MAX_CAPTURE_TIMEOUT 30000
+/** Send timeout of worker (msec). Client not reading responses is disconnected */
+#define BMLITED_SEND_TIMEOUT 1000
+/** Replies of I/O thread waiting for socket to take them. Client is not read
+    while the queue is full */
+#define BMLITED_REPLY_QUEUE 16
+/** Retry period of watchdog recovery while BM-Lite does not answer (msec) */
+#define BMLITED_WATCHDOG_RETRY 1000
+
+typedef struct {
+    bmlited_hdr_t hdr;
+    uint8_t data[BMLITED_MAX_REQUEST];
+} bmlited_request_t;
+
+/** Reply sent by I/O thread without asking BM-Lite */
+typedef struct __attribute__((packed)) {
+    bmlited_hdr_t hdr;
+    bmlited_result_t rsp;
+} bmlited_reply_t;
+
+typedef struct {
+    /** Socket. -1 - slot is free */
+    int fd;
+    /** Incremented when slot is reused. Stale responses are dropped */
+    uint32_t generation;
+    /** Subscribed BMLITED_EVENT_xxx */
+    uint32_t events;
+    bmlited_request_t queue[BMLITED_CLIENT_QUEUE];
+    uint32_t head;
+    uint32_t count;
+    /** Serializes writes of I/O and worker threads */
+    pthread_mutex_t write_lock;
+    /** Replies of I/O thread, sent without blocking when socket is writable */
+    bmlited_reply_t replies[BMLITED_REPLY_QUEUE];
+    uint32_t reply_head;
+    uint32_t reply_count;
+    /** Bytes of first reply already sent */
+    uint32_t reply_sent;
+    /** Protects reply queue. Taken after write_lock */
+    pthread_mutex_t reply_lock;
+    uint8_t rx[sizeof(bmlited_hdr_t) + BMLITED_MAX_REQUEST];
+    uint32_t rx_len;
+} bmlited_session_t;
+
+typedef struct {
+    uint32_t clients;
+    uint32_t requests;
+    /** Requests run by worker */
+    uint32_t device_requests;
+    /** Requests rejected because client queue was full */
+    uint32_t rejected;
+    uint32_t events;
+    /** Time worker spent on BM-Lite requests (msec) */
+    uint64_t device_ms;
+} bmlited_stats_t;
+
+typedef enum {
+    BMLITED_NEXT_REQUEST = 0,
+    /** No request within timeout */
+    BMLITED_NEXT_TIMEOUT,
+    /** Server is stopping */
+    BMLITED_NEXT_STOP,
+} bmlited_next_t;
+
+typedef struct {
+    const char *path;
+    int listen_fd;
+    HCP_comm_t *chain;
+    bmlited_session_t sessions[BMLITED_MAX_CLIENTS];
+    /** Protects queues, subscriptions and slot state */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /** Round-robin position of worker */
+    uint32_t next;
+    bool stop;
+    pthread_t worker;
+    bmlited_stats_t stats;
+    /** BM-Lite is stepped down to low power modes between requests */
+    bool power_enabled;
+    bmlite_power_t power;
+    /** Wedged BM-Lite is recovered between requests */
+    bool watchdog_enabled;
+    bmlite_watchdog_t watchdog;
+} bmlited_server_t;
+
+/**
+ * @brief Create listening socket
+ *
+ * Stale socket file left by killed daemon is removed.
+ *
+ * @param[in] server - server
+ * @param[in] path   - socket path
+ * @param[in] chain  - HCP com chain of initialized BM-Lite
+ *
+ * @return true on success
+ */
+bool bmlited_server_open(bmlited_server_t *server, const char *path, HCP_comm_t *chain);
+
+/**
+ * @brief Serve clients until quit flag is set
+ *
+ * @param[in] server - server
+ * @param[in] quit   - set by signal handler
+ */
+void bmlited_server_run(bmlited_server_t *server, volatile sig_atomic_t *quit);
+
+/**
+ * @brief Disconnect clients, close and remove socket
+ *
+ * @param[in] server - server
+ */
+void bmlited_server_close(bmlited_server_t *server);
+
+/**
+ * @brief Send message to client
+ *
+ * Message is dropped if client slot was reused since request was taken.
+ *
+ * @param[in] server     - server
+ * @param[in] slot       - client slot
+ * @param[in] generation - client slot generation
+ * @param[in] type       - ::bmlited_msg_type_t
+ * @param[in] seq        - request sequence number
+ * @param[in] head       - first part of payload. Can be NULL
+ * @param[in] head_size  - size of first part
+ * @param[in] data       - second part of payload. Can be NULL
+ * @param[in] size       - size of second part
+ *
+ * @return true if message was sent
+ */
+bool bmlited_server_send(bmlited_server_t *server, uint32_t slot, uint32_t generation,
+        uint16_t type, uint32_t seq, const void *head, uint32_t head_size,
+        const void *data, uint32_t size);
+
+/**
+ * @brief Send event to subscribed clients
+ *
+ * @param[in] server - server
+ * @param[in] event  - BMLITED_EVENT_xxx bit
+ * @param[in] type   - ::bmlited_msg_type_t
+ * @param[in] data   - payload
+ * @param[in] size   - payload size
+ */
+void bmlited_server_broadcast(bmlited_server_t *server, uint32_t event, uint16_t type,
+        const void *data, uint32_t size);
+
+/**
+ * @brief Take next queued request
+ *
+ * Blocks until any client has queued request. Clients are served in turn.
+ *
+ * @param[in]  server     - server
+ * @param[out] request    - request
+ * @param[out] slot       - client slot
+ * @param[out] generation - client slot generation
+ * @param[in]  timeout    - timeout (msec). 0 - wait forever
+ *
+ * @return ::bmlited_next_t
+ */
+bmlited_next_t bmlited_server_next(bmlited_server_t *server, bmlited_request_t *request,
+        uint32_t *slot, uint32_t *generation, uint32_t timeout);
+
+/**
+ * @brief Start worker thread running queued requests on BM-Lite
+ *
+ * BM-Lite is put to low power modes by policy while no requests come.
+ * Tripped watchdog recovers BM-Lite after the request, and again every
+ * BMLITED_WATCHDOG_RETRY while BM-Lite does not answer.
+ *
+ * @param[in] server   - server
+ * @param[in] policy   - power policy. NULL - BM-Lite is kept active
+ * @param[in] watchdog - watchdog limits. NULL - no watchdog
+ *
+ * @return true on success
+ */
+bool bmlited_worker_start(bmlited_server_t *server, const bmlite_power_policy_t *policy,
+        const bmlite_watchdog_config_t *watchdog);
+
+/**
+ * @brief Stop worker thread
+ *
+ * Request in progress is finished first.
+ *
+ * @param[in] server - server
+ */
+void bmlited_worker_stop(bmlited_server_t *server);
+
+#endif /* BMLITED_H */
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITED_CLIENT_H
+#define BMLITED_CLIENT_H
+
+/**
+ * @file    bmlited_client.h
+ * @brief   Client library of BM-Lite daemon
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fpc_bep_types.h"
+#include "bmlited_proto.h"
+
+typedef struct bmlited_conn_s bmlited_conn_t;
+
+/**
+ * @brief Called for messages which are not response of current request
+ *
+ * @param[in] conn - connection
+ * @param[in] hdr  - message header. type is BMLITED_RSP_PROGRESS or BMLITED_EVT_xxx
+ * @param[in] data - message payload
+ */
+typedef void (*bmlited_message_cb_t)(bmlited_conn_t *conn, const bmlited_hdr_t *hdr,
+        const uint8_t *data);
+
+struct bmlited_conn_s {
+    int fd;
+    uint32_t seq;
+    /** Progress and event handler. Can be NULL */
+    bmlited_message_cb_t on_message;
+    void *ctx;
+    uint8_t rx[BMLITED_MAX_RESPONSE + sizeof(bmlited_result_t)];
+};
+
+/**
+ * @brief Connect to daemon
+ *
+ * @param[out] conn - connection
+ * @param[in]  path - socket path. NULL - BMLITED_SOCKET_PATH
+ *
+ * @return true on success
+ */
+bool bmlited_connect(bmlited_conn_t *conn, const char *path);
+
+/**
+ * @brief Close connection
+ *
+ * @param[in] conn - connection
+ */
+void bmlited_close(bmlited_conn_t *conn);
+
+/**
+ * @brief Send request and wait for result
+ *
+ * Progress and events received while waiting are passed to on_message.
+ *
+ * @param[in]     conn       - connection
+ * @param[in]     type       - ::bmlited_msg_type_t request
+ * @param[in]     data       - request payload. Can be NULL
+ * @param[in]     size       - request payload size
+ * @param[out]    rsp        - buffer for response data. Can be NULL
+ * @param[in,out] rsp_size   - in: buffer size, out: response data size. Can be NULL
+ * @param[out]    bep_result - BM-Lite result. Can be NULL
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_IO_ERROR if connection is lost
+ */
+fpc_bep_result_t bmlited_request(bmlited_conn_t *conn, uint16_t type, const void *data,
+        uint32_t size, void *rsp, uint32_t *rsp_size, fpc_bep_result_t *bep_result);
+
+/**
+ * @brief Wait for next message from daemon
+ *
+ * @param[in]  conn - connection
+ * @param[out] hdr  - message header
+ *
+ * @return message payload or NULL if connection is lost
+ */
+const uint8_t *bmlited_receive(bmlited_conn_t *conn, bmlited_hdr_t *hdr);
+
+#endif /* BMLITED_CLIENT_H */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITED_PROTO_H
+#define BMLITED_PROTO_H
+
+/**
+ * @file    bmlited_proto.h
+ * @brief   BM-Lite daemon request/response protocol
+ *
+ * Every message is a header followed by payload. Clients and daemon run
+ * on the same host, so all fields are in host byte order.
+ *
+ * Client sends requests. Daemon answers every request with one
+ * BMLITED_RSP_RESULT. Requests which wait for a finger also stream
+ * BMLITED_RSP_PROGRESS messages before the result. Responses carry
+ * sequence number of the request.
+ *
+ * Subscribed clients get BMLITED_EVT_xxx messages with sequence number 0.
+ */
+
+#include <stdint.h>
+
+/** Default daemon socket */
+#define BMLITED_SOCKET_PATH "/tmp/bmlited.sock"
+/** Maximum request payload */
+#define BMLITED_MAX_REQUEST 64
+/** Maximum response payload */
+#define BMLITED_MAX_RESPONSE 4096
+
+typedef struct __attribute__((packed)) {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t seq;
+    /** Payload size */
+    uint32_t length;
+} bmlited_hdr_t;
+
+typedef enum {
+    /** Answered by daemon without BM-Lite. Measures daemon overhead */
+    BMLITED_REQ_PING = 1,
+    /** Response: version string */
+    BMLITED_REQ_VERSION,
+    /** Payload: bmlited_identify_req_t. Response: bmlited_identify_rsp_t */
+    BMLITED_REQ_IDENTIFY,
+    /** Enroll finger. Template is left in BM-Lite RAM */
+    BMLITED_REQ_ENROLL,
+    /** Payload: uint16_t template ID */
+    BMLITED_REQ_TEMPLATE_SAVE,
+    /** Payload: uint16_t template ID */
+    BMLITED_REQ_TEMPLATE_REMOVE,
+    BMLITED_REQ_TEMPLATE_REMOVE_ALL,
+    /** Response: uint16_t template IDs */
+    BMLITED_REQ_TEMPLATE_IDS,
+    BMLITED_REQ_SW_RESET,
+    /** Payload: uint32_t mask of BMLITED_EVENT_xxx. 0 - unsubscribe */
+    BMLITED_REQ_SUBSCRIBE,
+
+    /** Payload: bmlited_result_t followed by response data */
+    BMLITED_RSP_RESULT = 0x100,
+    /** Payload: uint32_t bmlited_progress_t */
+    BMLITED_RSP_PROGRESS,
+
+    /** Payload: bmlited_identify_rsp_t */
+    BMLITED_EVT_IDENTIFY = 0x200,
+    /** Payload: bmlited_template_evt_t */
+    BMLITED_EVT_TEMPLATE,
+} bmlited_msg_type_t;
+
+typedef enum {
+    BMLITED_PROGRESS_PUT_FINGER = 1,
+    BMLITED_PROGRESS_REMOVE_FINGER,
+} bmlited_progress_t;
+
+/** Subscription mask bits */
+#define BMLITED_EVENT_IDENTIFY (1 << 0)
+#define BMLITED_EVENT_TEMPLATE (1 << 1)
+
+typedef struct __attribute__((packed)) {
+    /** Transfer result. ::fpc_bep_result_t */
+    int32_t result;
+    /** BM-Lite result. ::fpc_bep_result_t */
+    int32_t bep_result;
+} bmlited_result_t;
+
+typedef struct __attribute__((packed)) {
+    /** Capture timeout (msec). 0 - daemon maximum */
+    uint32_t timeout;
+} bmlited_identify_req_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t match;
+    uint16_t template_id;
+} bmlited_identify_rsp_t;
+
+typedef struct __attribute__((packed)) {
+    /** ::bmlite_template_event_t */
+    uint32_t event;
+    uint16_t template_id;
+} bmlited_template_evt_t;
+
+#endif /* BMLITED_PROTO_H */
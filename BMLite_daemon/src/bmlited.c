@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlited.c
+ * @brief   BM-Lite daemon. Shares one BM-Lite between local clients
+ *
+ * BM-Lite is initialized once at start. Clients connect to Unix socket
+ * and send requests described in bmlited_proto.h.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "bmlite_if.h"
+#include "hcp_tiny.h"
+#include "platform.h"
+#include "bmlite_hal.h"
+#include "platform_rpi.h"
+#include "bmlited.h"
+
+#define DATA_BUFFER_SIZE 102400
+static uint8_t hcp_txrx_buffer[MTU];
+static uint8_t hcp_data_buffer[DATA_BUFFER_SIZE];
+
+static HCP_comm_t hcp_chain = {
+    .read = platform_bmlite_receive,
+    .write = platform_bmlite_send,
+    .pkt_buffer = hcp_data_buffer,
+    .txrx_buffer = hcp_txrx_buffer,
+    .pkt_size = 0,
+    .pkt_size_max = sizeof(hcp_data_buffer),
+    .phy_rx_timeout = 2000,
+};
+
+static bmlited_server_t server;
+static volatile sig_atomic_t quit;
+
+static void help(void)
+{
+    fprintf(stderr, "BM-Lite daemon\n");
+    fprintf(stderr, "Syntax: bmlited [-s | -e] [-w] [-F] [-p port] [-b baudrate] [-t timeout]\n");
+    fprintf(stderr, "       [-S socket] [-P idle_ms,sleep_ms,deep_sleep_ms]\n");
+    fprintf(stderr, "       [-M metrics_file[,interval_ms]] [-W faults[,window_ms[,fails]]]\n");
+    fprintf(stderr, "-P: enter power modes after idle time. 0 - mode not used\n");
+    fprintf(stderr, "-W: recover BM-Lite after link faults within window or failed requests in a row\n");
+    fprintf(stderr, "-M: write link and command counters in Prometheus text format\n");
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
+
+int main (int argc, char **argv)
+{
+    int c;
+    fpc_bep_result_t res;
+    rpi_initparams_t rpi_params;
+    const char *socket_path = BMLITED_SOCKET_PATH;
+    struct sigaction sa;
+    bmlite_power_policy_t policy;
+    bool power_policy = false;
+    bmlite_watchdog_config_t watchdog = BMLITE_WATCHDOG_CONFIG_DEFAULT;
+    bool use_watchdog = false;
+    char *metrics_path = NULL;
+    uint32_t metrics_interval = 1000;
+
+    rpi_params.iface = COM_INTERFACE;
+    rpi_params.hcp_comm = &hcp_chain;
+    rpi_params.baudrate = 921600;
+    rpi_params.timeout = 5;
+    rpi_params.port = NULL;
+    rpi_params.warm_attach = false;
+    rpi_params.flow_control = false;
+
+    opterr = 0;
+
+    while ((c = getopt (argc, argv, "sewFb:p:t:S:P:M:W:")) != -1) {
+        switch (c) {
+            case 's':
+                rpi_params.iface = SPI_INTERFACE;
+                if(rpi_params.baudrate == 921600)
+                    rpi_params.baudrate = 1000000;
+                break;
+            case 'e':
+                rpi_params.iface = EMU_INTERFACE;
+                break;
+            case 'w':
+                rpi_params.warm_attach = true;
+                break;
+            case 'F':
+                rpi_params.flow_control = true;
+                break;
+            case 'b':
+                rpi_params.baudrate = atoi(optarg);
+                break;
+            case 'p':
+                rpi_params.port = optarg;
+                break;
+            case 't':
+                rpi_params.timeout = atoi(optarg);
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'P':
+                memset(&policy, 0, sizeof(policy));
+                if (sscanf(optarg, "%u,%u,%u", &policy.enter_ms[BMLITE_POWER_IDLE],
+                        &policy.enter_ms[BMLITE_POWER_SLEEP],
+                        &policy.enter_ms[BMLITE_POWER_DEEP_SLEEP]) < 1) {
+                    help();
+                    exit(1);
+                }
+                power_policy = true;
+                break;
+            case 'W':
+                if (sscanf(optarg, "%u,%u,%u", &watchdog.fault_limit, &watchdog.window_ms,
+                        &watchdog.fail_limit) < 1) {
+                    help();
+                    exit(1);
+                }
+                use_watchdog = true;
+                break;
+            case 'M': {
+                char *interval = strrchr(optarg, ',');
+                if (interval) {
+                    *interval++ = 0;
+                    metrics_interval = atoi(interval);
+                }
+                metrics_path = optarg;
+                break;
+            }
+            case '?':
+                if (isprint (optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr,
+                            "Unknown option character `\\x%x'.\n",
+                            optopt);
+                return 1;
+            default:
+                help();
+                exit(1);
+            }
+        }
+
+    if (rpi_params.iface == COM_INTERFACE && rpi_params.port == NULL) {
+        printf("port must be specified\n");
+        help();
+        exit(1);
+    }
+
+    if (metrics_path) {
+        if (!rpi_metrics_exporter_start(metrics_path, metrics_interval)) {
+            fprintf(stderr, "Can't start metrics exporter\n");
+            exit(1);
+        }
+        atexit(rpi_metrics_exporter_stop);
+    }
+
+    /* BM-Lite init and reset are paid once for all clients */
+    if (rpi_params.warm_attach) {
+        platform_attach_timing_t timing = { 0 };
+
+        res = platform_attach(&rpi_params, &hcp_chain, &timing);
+        fprintf(stderr, "Attach: init %u ms, probe %u ms, %s %u ms\n", timing.init_ms,
+                timing.probe_ms, timing.reset ? "HW reset" : "no reset", timing.reset_ms);
+    } else {
+        res = platform_init(&rpi_params);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        fprintf(stderr, "Startup failed: %d\n", res);
+        help();
+        exit(1);
+    }
+    hcp_chain.link_speed = rpi_params.baudrate;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    /* No SA_RESTART: poll() must return on signal */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!bmlited_server_open(&server, socket_path, &hcp_chain)) {
+        exit(1);
+    }
+    if (!bmlited_worker_start(&server, power_policy ? &policy : NULL,
+            use_watchdog ? &watchdog : NULL)) {
+        fprintf(stderr, "Can't start worker\n");
+        bmlited_server_close(&server);
+        exit(1);
+    }
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    bmlited_server_run(&server, &quit);
+
+    bmlited_server_close(&server);
+    bmlited_worker_stop(&server);
+
+    printf("Clients: %u, requests: %u, on BM-Lite: %u (%llu ms), rejected: %u, events: %u\n",
+            server.stats.clients, server.stats.requests, server.stats.device_requests,
+            (unsigned long long)server.stats.device_ms, server.stats.rejected,
+            server.stats.events);
+    if (power_policy) {
+        static const char *const names[BMLITE_POWER_MODES] = {
+            "active", "idle", "sleep", "deep sleep"
+        };
+        for (int mode = BMLITE_POWER_IDLE; mode < BMLITE_POWER_MODES; mode++) {
+            bmlite_power_stats_t *stats = &server.power.stats[mode];
+            printf("%-10s: entered %u, woken %u, wake avg %llu us, max %u us, residency %llu ms\n",
+                    names[mode], stats->entries, stats->wakeups,
+                    stats->wakeups ? (unsigned long long)(stats->wake_us_total / stats->wakeups) : 0ULL,
+                    stats->wake_us_max, (unsigned long long)stats->residency_ms);
+        }
+    }
+    if (use_watchdog) {
+        bmlite_watchdog_stats_t *stats = &server.watchdog.stats;
+        printf("Watchdog: trips %u, failed %u, MTTR %u ms, max %u ms\n", stats->trips,
+                stats->failed, bmlite_watchdog_mttr_us(&server.watchdog) / 1000,
+                stats->down_us_max / 1000);
+        for (int step = 0; step < BMLITE_WATCHDOG_STEPS; step++) {
+            printf("%-12s: recovered %u\n", bmlite_watchdog_step_name(step),
+                    stats->recovered[step]);
+        }
+    }
+    return 0;
+}
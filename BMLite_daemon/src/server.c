@@ -0,0 +1,451 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    server.c
+ * @brief   BM-Lite daemon socket server
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "bmlited.h"
+
+#define LISTEN_BACKLOG 8
+
+bool bmlited_server_open(bmlited_server_t *server, const char *path, HCP_comm_t *chain)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    memset(server, 0, sizeof(*server));
+    server->path = path;
+    server->chain = chain;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+    for (uint32_t i = 0; i < BMLITED_MAX_CLIENTS; i++) {
+        server->sessions[i].fd = -1;
+        pthread_mutex_init(&server->sessions[i].write_lock, NULL);
+        pthread_mutex_init(&server->sessions[i].reply_lock, NULL);
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd < 0) {
+        perror("socket");
+        return false;
+    }
+
+    /* Remove socket of killed daemon, but never a live one or a regular file */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "Daemon already running on %s\n", path);
+            close(server->listen_fd);
+            return false;
+        }
+        close(server->listen_fd);
+        unlink(path);
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+
+    if (server->listen_fd < 0 ||
+            bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(server->listen_fd, LISTEN_BACKLOG) < 0) {
+        fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+        if (server->listen_fd >= 0)
+            close(server->listen_fd);
+        return false;
+    }
+    return true;
+}
+
+static void session_close(bmlited_server_t *server, bmlited_session_t *session)
+{
+    pthread_mutex_lock(&server->lock);
+    pthread_mutex_lock(&session->write_lock);
+    close(session->fd);
+    session->fd = -1;
+    session->generation++;
+    session->events = 0;
+    session->count = 0;
+    session->rx_len = 0;
+    pthread_mutex_lock(&session->reply_lock);
+    session->reply_head = 0;
+    session->reply_count = 0;
+    session->reply_sent = 0;
+    pthread_mutex_unlock(&session->reply_lock);
+    pthread_mutex_unlock(&session->write_lock);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void session_accept(bmlited_server_t *server)
+{
+    struct timeval tv = {
+        .tv_sec = BMLITED_SEND_TIMEOUT / 1000,
+        .tv_usec = (BMLITED_SEND_TIMEOUT % 1000) * 1000,
+    };
+    int fd = accept(server->listen_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+
+    for (uint32_t i = 0; i < BMLITED_MAX_CLIENTS; i++) {
+        bmlited_session_t *session = &server->sessions[i];
+        if (session->fd < 0) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            pthread_mutex_lock(&server->lock);
+            session->fd = fd;
+            server->stats.clients++;
+            pthread_mutex_unlock(&server->lock);
+            return;
+        }
+    }
+    fprintf(stderr, "Too many clients\n");
+    close(fd);
+}
+
+/* Send queued replies. Called with write_lock held, so nothing else is
+   written to the socket. Blocking send only finishes partly sent reply.
+   Returns false if client has to be disconnected */
+static bool replies_send(bmlited_session_t *session, bool block)
+{
+    pthread_mutex_lock(&session->reply_lock);
+    while (session->reply_count > 0 && (!block || session->reply_sent > 0)) {
+        bmlited_reply_t *reply = &session->replies[session->reply_head];
+        uint32_t sent = session->reply_sent;
+
+        // I/O thread only appends to the queue, first reply stays put
+        pthread_mutex_unlock(&session->reply_lock);
+        ssize_t n = send(session->fd, (uint8_t *)reply + sent, sizeof(*reply) - sent,
+                MSG_NOSIGNAL | (block ? 0 : MSG_DONTWAIT));
+        pthread_mutex_lock(&session->reply_lock);
+        if (n < 0) {
+            pthread_mutex_unlock(&session->reply_lock);
+            return !block && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        session->reply_sent += n;
+        if (session->reply_sent == sizeof(*reply)) {
+            session->reply_head = (session->reply_head + 1) % BMLITED_REPLY_QUEUE;
+            session->reply_count--;
+            session->reply_sent = 0;
+        }
+    }
+    pthread_mutex_unlock(&session->reply_lock);
+    return true;
+}
+
+bool bmlited_server_send(bmlited_server_t *server, uint32_t slot, uint32_t generation,
+        uint16_t type, uint32_t seq, const void *head, uint32_t head_size,
+        const void *data, uint32_t size)
+{
+    bmlited_session_t *session = &server->sessions[slot];
+    bmlited_hdr_t hdr = {
+        .type = type,
+        .seq = seq,
+        .length = head_size + size,
+    };
+    struct iovec iov[3] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)head, .iov_len = head_size },
+        { .iov_base = (void *)data, .iov_len = size },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 3,
+    };
+    size_t total = sizeof(hdr) + head_size + size;
+    bool sent = false;
+
+    pthread_mutex_lock(&session->write_lock);
+    if (session->fd >= 0 && session->generation == generation) {
+        /* Unix stream socket writes whole message unless client stops reading */
+        sent = replies_send(session, true) &&
+                sendmsg(session->fd, &msg, MSG_NOSIGNAL) == (ssize_t)total;
+        if (!sent) {
+            /* Let I/O thread see hangup and free the slot */
+            shutdown(session->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&session->write_lock);
+    return sent;
+}
+
+void bmlited_server_broadcast(bmlited_server_t *server, uint32_t event, uint16_t type,
+        const void *data, uint32_t size)
+{
+    uint32_t generation[BMLITED_MAX_CLIENTS];
+    bool subscribed[BMLITED_MAX_CLIENTS];
+
+    pthread_mutex_lock(&server->lock);
+    for (uint32_t i = 0; i < BMLITED_MAX_CLIENTS; i++) {
+        subscribed[i] = server->sessions[i].fd >= 0 && (server->sessions[i].events & event);
+        generation[i] = server->sessions[i].generation;
+    }
+    server->stats.events++;
+    pthread_mutex_unlock(&server->lock);
+
+    for (uint32_t i = 0; i < BMLITED_MAX_CLIENTS; i++) {
+        if (subscribed[i])
+            bmlited_server_send(server, i, generation[i], type, 0, NULL, 0, data, size);
+    }
+}
+
+bmlited_next_t bmlited_server_next(bmlited_server_t *server, bmlited_request_t *request,
+        uint32_t *slot, uint32_t *generation, uint32_t timeout)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    while (!server->stop) {
+        for (uint32_t n = 0; n < BMLITED_MAX_CLIENTS; n++) {
+            uint32_t i = (server->next + n) % BMLITED_MAX_CLIENTS;
+            bmlited_session_t *session = &server->sessions[i];
+            if (session->fd >= 0 && session->count > 0) {
+                *request = session->queue[session->head];
+                session->head = (session->head + 1) % BMLITED_CLIENT_QUEUE;
+                session->count--;
+                *slot = i;
+                *generation = session->generation;
+                server->next = i + 1;
+                pthread_mutex_unlock(&server->lock);
+                return BMLITED_NEXT_REQUEST;
+            }
+        }
+        if (timeout == 0) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        } else if (pthread_cond_timedwait(&server->cond, &server->lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&server->lock);
+            return BMLITED_NEXT_TIMEOUT;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    return BMLITED_NEXT_STOP;
+}
+
+/* Queue reply, I/O thread sends it when socket is writable. Requests are
+   not parsed while the queue is full, so there is always room */
+static void reply(bmlited_server_t *server, uint32_t slot, const bmlited_hdr_t *hdr,
+        fpc_bep_result_t result)
+{
+    bmlited_session_t *session = &server->sessions[slot];
+    bmlited_reply_t *r;
+
+    pthread_mutex_lock(&session->reply_lock);
+    r = &session->replies[(session->reply_head + session->reply_count) % BMLITED_REPLY_QUEUE];
+    memset(r, 0, sizeof(*r));
+    r->hdr.type = BMLITED_RSP_RESULT;
+    r->hdr.seq = hdr->seq;
+    r->hdr.length = sizeof(r->rsp);
+    r->rsp.result = result;
+    r->rsp.bep_result = FPC_BEP_RESULT_OK;
+    session->reply_count++;
+    pthread_mutex_unlock(&session->reply_lock);
+}
+
+/* Send queued replies without blocking. Worker sending a response holds the
+   socket, replies then wait for next poll.
+   Returns false if client has to be disconnected */
+static bool session_write(bmlited_server_t *server, uint32_t slot)
+{
+    bmlited_session_t *session = &server->sessions[slot];
+    bool ok;
+
+    if (pthread_mutex_trylock(&session->write_lock) != 0)
+        return true;
+    ok = replies_send(session, false);
+    pthread_mutex_unlock(&session->write_lock);
+    return ok;
+}
+
+static uint32_t replies_queued(bmlited_session_t *session)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&session->reply_lock);
+    count = session->reply_count;
+    pthread_mutex_unlock(&session->reply_lock);
+    return count;
+}
+
+static void dispatch(bmlited_server_t *server, uint32_t slot, const bmlited_hdr_t *hdr,
+        const uint8_t *data)
+{
+    bmlited_session_t *session = &server->sessions[slot];
+    fpc_bep_result_t result = FPC_BEP_RESULT_OK;
+
+    pthread_mutex_lock(&server->lock);
+    server->stats.requests++;
+    switch (hdr->type) {
+        case BMLITED_REQ_PING:
+            break;
+        case BMLITED_REQ_SUBSCRIBE:
+            if (hdr->length == sizeof(uint32_t)) {
+                memcpy(&session->events, data, sizeof(uint32_t));
+            } else {
+                result = FPC_BEP_RESULT_INVALID_ARGUMENT;
+            }
+            break;
+        case BMLITED_REQ_VERSION:
+        case BMLITED_REQ_IDENTIFY:
+        case BMLITED_REQ_ENROLL:
+        case BMLITED_REQ_TEMPLATE_SAVE:
+        case BMLITED_REQ_TEMPLATE_REMOVE:
+        case BMLITED_REQ_TEMPLATE_REMOVE_ALL:
+        case BMLITED_REQ_TEMPLATE_IDS:
+        case BMLITED_REQ_SW_RESET:
+            if (session->count == BMLITED_CLIENT_QUEUE) {
+                server->stats.rejected++;
+                result = FPC_BEP_RESULT_NO_RESOURCE;
+                break;
+            }
+            bmlited_request_t *request =
+                &session->queue[(session->head + session->count) % BMLITED_CLIENT_QUEUE];
+            request->hdr = *hdr;
+            memcpy(request->data, data, hdr->length);
+            session->count++;
+            pthread_cond_signal(&server->cond);
+            pthread_mutex_unlock(&server->lock);
+            /* Worker answers */
+            return;
+        default:
+            result = FPC_BEP_RESULT_NOT_SUPPORTED;
+            break;
+    }
+    pthread_mutex_unlock(&server->lock);
+    reply(server, slot, hdr, result);
+}
+
+/* Dispatch complete requests read from client. Client not reading replies
+   is not read either until replies are sent.
+   Returns false if client has to be disconnected */
+static bool session_parse(bmlited_server_t *server, uint32_t slot)
+{
+    bmlited_session_t *session = &server->sessions[slot];
+
+    while (session->rx_len >= sizeof(bmlited_hdr_t) &&
+            replies_queued(session) < BMLITED_REPLY_QUEUE) {
+        bmlited_hdr_t hdr;
+        memcpy(&hdr, session->rx, sizeof(hdr));
+        if (hdr.length > BMLITED_MAX_REQUEST) {
+            fprintf(stderr, "Client %u: request too long\n", slot);
+            return false;
+        }
+        uint32_t size = sizeof(hdr) + hdr.length;
+        if (session->rx_len < size)
+            break;
+        dispatch(server, slot, &hdr, session->rx + sizeof(hdr));
+        session->rx_len -= size;
+        memmove(session->rx, session->rx + size, session->rx_len);
+    }
+    return true;
+}
+
+/* Read what client sent and dispatch complete requests.
+   Returns false if client has to be disconnected */
+static bool session_read(bmlited_server_t *server, uint32_t slot)
+{
+    bmlited_session_t *session = &server->sessions[slot];
+    ssize_t n = recv(session->fd, session->rx + session->rx_len,
+            sizeof(session->rx) - session->rx_len, 0);
+
+    if (n <= 0)
+        return false;
+    session->rx_len += n;
+    return session_parse(server, slot);
+}
+
+void bmlited_server_run(bmlited_server_t *server, volatile sig_atomic_t *quit)
+{
+    struct pollfd fds[BMLITED_MAX_CLIENTS + 1];
+    uint32_t slots[BMLITED_MAX_CLIENTS + 1];
+
+    while (!*quit) {
+        nfds_t nfds = 0;
+
+        fds[nfds].fd = server->listen_fd;
+        fds[nfds++].events = POLLIN;
+        for (uint32_t i = 0; i < BMLITED_MAX_CLIENTS; i++) {
+            if (server->sessions[i].fd >= 0) {
+                uint32_t queued = replies_queued(&server->sessions[i]);
+
+                slots[nfds] = i;
+                fds[nfds].fd = server->sessions[i].fd;
+                /* Full queue stops reading, client blocks on its own send */
+                fds[nfds++].events = (queued < BMLITED_REPLY_QUEUE ? POLLIN : 0) |
+                        (queued ? POLLOUT : 0);
+            }
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (nfds_t i = 1; i < nfds; i++) {
+            bool ok = true;
+
+            if (fds[i].revents & ~POLLOUT)
+                ok = session_read(server, slots[i]);
+            /* Replies to what was just read usually fit in the socket at once.
+               Sent replies make room for requests left unparsed */
+            if (ok && fds[i].revents)
+                ok = session_write(server, slots[i]) && session_parse(server, slots[i]);
+            if (!ok)
+                session_close(server, &server->sessions[slots[i]]);
+        }
+        if (fds[0].revents & POLLIN) {
+            session_accept(server);
+        }
+    }
+}
+
+void bmlited_server_close(bmlited_server_t *server)
+{
+    for (uint32_t i = 0; i < BMLITED_MAX_CLIENTS; i++) {
+        if (server->sessions[i].fd >= 0)
+            session_close(server, &server->sessions[i]);
+    }
+    close(server->listen_fd);
+    unlink(server->path);
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    worker.c
+ * @brief   BM-Lite daemon worker running requests on BM-Lite
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bmlited.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+
+/* Request in progress. Used by callbacks to stream progress to its client */
+static bmlited_server_t *current_server;
+static uint32_t current_slot;
+static uint32_t current_generation;
+static uint32_t current_seq;
+static bool current_active;
+
+static void send_progress(bmlited_progress_t progress)
+{
+    uint32_t value = progress;
+
+    if (current_active) {
+        bmlited_server_send(current_server, current_slot, current_generation,
+                BMLITED_RSP_PROGRESS, current_seq, &value, sizeof(value), NULL, 0);
+    }
+}
+
+void bmlite_on_error(bmlite_error_t error, int32_t value)
+{
+    fprintf(stderr, "Error: %d, return code %d\n", error, (int16_t)value);
+}
+
+void bmlite_on_start_capture()
+{
+    send_progress(BMLITED_PROGRESS_PUT_FINGER);
+}
+
+void bmlite_on_finish_capture()
+{
+    send_progress(BMLITED_PROGRESS_REMOVE_FINGER);
+}
+
+void bmlite_on_template_change(HCP_comm_t *chain, bmlite_template_event_t event,
+        uint16_t template_id, const uint8_t *data, uint32_t size)
+{
+    bmlited_template_evt_t evt = {
+        .event = event,
+        .template_id = template_id,
+    };
+
+    (void)chain;
+    (void)data;
+    (void)size;
+    if (current_server) {
+        bmlited_server_broadcast(current_server, BMLITED_EVENT_TEMPLATE, BMLITED_EVT_TEMPLATE,
+                &evt, sizeof(evt));
+    }
+}
+
+static uint32_t capture_timeout(uint32_t timeout)
+{
+    if (timeout == 0 || timeout > BMLITED_MAX_CAPTURE_TIMEOUT)
+        return BMLITED_MAX_CAPTURE_TIMEOUT;
+    return timeout;
+}
+
+/* Run request on BM-Lite. Response data is placed to rsp, its size to rsp_size */
+static fpc_bep_result_t run_request(bmlited_server_t *server, const bmlited_request_t *request,
+        uint8_t *rsp, uint32_t *rsp_size)
+{
+    HCP_comm_t *chain = server->chain;
+    const bmlited_hdr_t *hdr = &request->hdr;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint16_t template_id = 0;
+
+    *rsp_size = 0;
+    if (hdr->type == BMLITED_REQ_TEMPLATE_SAVE || hdr->type == BMLITED_REQ_TEMPLATE_REMOVE) {
+        if (hdr->length != sizeof(template_id))
+            return FPC_BEP_RESULT_INVALID_ARGUMENT;
+        memcpy(&template_id, request->data, sizeof(template_id));
+    }
+
+    switch (hdr->type) {
+        case BMLITED_REQ_VERSION:
+            memset(rsp, 0, 128);
+            res = bep_version(chain, (char *)rsp, 127);
+            *rsp_size = strlen((char *)rsp) + 1;
+            break;
+        case BMLITED_REQ_IDENTIFY: {
+            bmlited_identify_req_t req = { .timeout = 0 };
+            bmlited_identify_rsp_t result = { 0 };
+            uint16_t id = 0;
+            bool match = false;
+
+            if (hdr->length == sizeof(req))
+                memcpy(&req, request->data, sizeof(req));
+            res = bep_identify_finger(chain, capture_timeout(req.timeout), &id, &match);
+            if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+                result.match = match;
+                result.template_id = id;
+                memcpy(rsp, &result, sizeof(result));
+                *rsp_size = sizeof(result);
+                bmlited_server_broadcast(server, BMLITED_EVENT_IDENTIFY, BMLITED_EVT_IDENTIFY,
+                        &result, sizeof(result));
+            }
+            break;
+        }
+        case BMLITED_REQ_ENROLL:
+            res = bep_enroll_finger(chain);
+            break;
+        case BMLITED_REQ_TEMPLATE_SAVE:
+            res = bep_template_save(chain, template_id);
+            break;
+        case BMLITED_REQ_TEMPLATE_REMOVE:
+            res = bep_template_remove(chain, template_id);
+            break;
+        case BMLITED_REQ_TEMPLATE_REMOVE_ALL:
+            res = bep_template_remove_all(chain);
+            break;
+        case BMLITED_REQ_TEMPLATE_IDS:
+            res = bep_template_get_ids(chain);
+            if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+                *rsp_size = chain->arg.size < BMLITED_MAX_RESPONSE ?
+                        chain->arg.size : BMLITED_MAX_RESPONSE;
+                memcpy(rsp, chain->arg.data, *rsp_size);
+            }
+            break;
+        case BMLITED_REQ_SW_RESET:
+            res = bep_sw_reset(chain);
+            break;
+        default:
+            res = FPC_BEP_RESULT_NOT_SUPPORTED;
+            break;
+    }
+    return res;
+}
+
+/* Recover wedged BM-Lite. Queued requests wait for it */
+static void check_watchdog(bmlited_server_t *server)
+{
+    bmlite_watchdog_t *wd = &server->watchdog;
+    bmlite_watchdog_step_t step;
+
+    if (!wd->tripped) {
+        return;
+    }
+    if (bmlite_watchdog_recover(wd, &step) == FPC_BEP_RESULT_OK) {
+        fprintf(stderr, "BM-Lite recovered by %s in %u ms\n", bmlite_watchdog_step_name(step),
+                wd->stats.down_us_last / 1000);
+    } else {
+        fprintf(stderr, "BM-Lite does not answer after HW reset, retrying\n");
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    bmlited_server_t *server = arg;
+    static uint8_t rsp[BMLITED_MAX_RESPONSE];
+    bmlited_request_t request;
+    uint32_t slot;
+    uint32_t generation;
+
+    while (1) {
+        bmlited_result_t result;
+        uint32_t rsp_size;
+        uint32_t timeout = server->power_enabled ? bmlite_power_next_ms(&server->power) : 0;
+        bool wedged = server->watchdog_enabled && server->watchdog.tripped;
+
+        if (wedged && (timeout == 0 || timeout > BMLITED_WATCHDOG_RETRY)) {
+            timeout = BMLITED_WATCHDOG_RETRY;
+        }
+        bmlited_next_t next = bmlited_server_next(server, &request, &slot, &generation, timeout);
+
+        if (next == BMLITED_NEXT_STOP) {
+            break;
+        }
+        if (next == BMLITED_NEXT_TIMEOUT && wedged) {
+            check_watchdog(server);
+            continue;
+        }
+        if (next == BMLITED_NEXT_TIMEOUT) {
+            if (bmlite_power_idle(&server->power) != FPC_BEP_RESULT_OK) {
+                fprintf(stderr, "Can't enter power mode, power policy disabled\n");
+                server->power_enabled = false;
+            }
+            continue;
+        }
+
+        hal_tick_t start = hal_timebase_get_tick();
+        if (server->power_enabled) {
+            bmlite_power_wake(&server->power);
+        }
+
+        current_slot = slot;
+        current_generation = generation;
+        current_seq = request.hdr.seq;
+        current_active = true;
+        server->chain->bep_result = FPC_BEP_RESULT_OK;
+
+        result.result = run_request(server, &request, rsp, &rsp_size);
+        result.bep_result = server->chain->bep_result;
+        current_active = false;
+        if (server->power_enabled) {
+            bmlite_power_done(&server->power);
+        }
+
+        pthread_mutex_lock(&server->lock);
+        server->stats.device_requests++;
+        server->stats.device_ms += hal_timebase_get_tick() - start;
+        pthread_mutex_unlock(&server->lock);
+
+        bmlited_server_send(server, slot, generation, BMLITED_RSP_RESULT, request.hdr.seq,
+                &result, sizeof(result), rsp, rsp_size);
+        if (server->watchdog_enabled) {
+            check_watchdog(server);
+        }
+    }
+    return NULL;
+}
+
+bool bmlited_worker_start(bmlited_server_t *server, const bmlite_power_policy_t *policy,
+        const bmlite_watchdog_config_t *watchdog)
+{
+    current_server = server;
+    server->power_enabled = policy != NULL;
+    if (policy) {
+        bmlite_power_init(&server->power, server->chain, policy);
+    }
+    server->watchdog_enabled = watchdog != NULL;
+    if (watchdog) {
+        bmlite_watchdog_init(&server->watchdog, server->chain, watchdog);
+    }
+    return pthread_create(&server->worker, NULL, worker_thread, server) == 0;
+}
+
+void bmlited_worker_stop(bmlited_server_t *server)
+{
+    pthread_mutex_lock(&server->lock);
+    server->stop = true;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+    pthread_join(server->worker, NULL);
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Size and speed of debug, release and PGO builds of bmlite_demo.
+# Run with "make report [make options]": benchmarks run on emulated BM-Lite
+# without link delay, so the build host must be able to run the binary.
+
+set -e
+
+MAKE=${MAKE:-make}
+SIZE=${SIZE:-size}
+PING_COUNT=${PING_COUNT:-2000}
+QUALITY_COUNT=${QUALITY_COUNT:-500}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+run() {
+    dir=$1
+    "$dir/bmlite_demo" -e -b 0 -o "$TMP/result.json" "bench_ping $PING_COUNT" capture \
+        "bench_quality $QUALITY_COUNT" "image_get $TMP/image" > "$TMP/stdout" 2>&1
+}
+
+# Value of field $2 of step starting with command $1
+step_field() {
+    sed -n "s/.*\"cmd\":\"$1[^\"]*\".*\"$2\":\([0-9]*\).*/\1/p" "$TMP/result.json"
+}
+
+for build in debug release pgo; do
+    case $build in
+        debug)   target= ; dir=out ;;
+        release) target=BUILD=release; dir=out/release ;;
+        pgo)     target=pgo; dir=out/pgo ;;
+    esac
+    if ! $MAKE $target USE_EMULATOR=1 > "$TMP/build.log" 2>&1; then
+        cat "$TMP/build.log" >&2
+        exit 1
+    fi
+    run $dir
+    set -- $($SIZE $dir/bmlite_demo | tail -1)
+    printf '%s %s %s %s %s %s %s %s\n' $build $1 $2 $3 \
+        "$(sed -n 's/.*p50 \([0-9]*\),.*/\1/p' "$TMP/stdout")" \
+        "$(step_field bench_ping cpu_us)" "$(step_field image_get cpu_us)" \
+        "$(sed -n 's/.*scalar \([0-9.]*\) us.*/\1/p' "$TMP/stdout")"
+done > "$TMP/report"
+
+# Wall time includes time emulated BM-Lite is busy, CPU time is host only
+printf '%-8s %8s %6s %6s %10s %10s %10s %10s\n' build text data bss "ping p50" \
+    "ping cpu" "image cpu" quality
+printf '%-8s %8s %6s %6s %10s %10s %10s %10s\n' "" bytes bytes bytes "us wall" us us "us/img"
+while read build text data bss p50 ping image quality; do
+    printf '%-8s %8s %6s %6s %10s %10s %10s %10s\n' $build $text $data $bss $p50 $ping \
+        $image $quality
+done < "$TMP/report"
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BATCH_ENROLL_H
+#define BATCH_ENROLL_H
+
+/**
+ * @file    batch_enroll.h
+ * @brief   Offline enrollment from recorded images
+ *
+ * Images of a dataset are grouped by label, one group per user, and the
+ * label is used as template ID. Images of every user are pushed to BM-Lite
+ * and added to enroll until BM-Lite has enough samples. Extra images
+ * of the user are skipped. Images are read by a prefetch thread, see
+ * image_dataset.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+
+/** Number of images read ahead */
+#define BATCH_ENROLL_PREFETCH_DEPTH 8
+
+typedef struct {
+    /** Save templates to BM-Lite storage. Existing templates are replaced */
+    bool save;
+    /** Directory to write templates to as "<id>.bin". NULL - no export */
+    const char *export_dir;
+    /** Stop at first user whose enroll failed to start or to take an image
+        on link error, or whose template failed to finish, export or save.
+        false - count the user as failed and go on with the next one */
+    bool stop_on_error;
+} batch_enroll_params_t;
+
+typedef struct {
+    uint32_t users;
+    uint32_t enrolled;
+    /** Users without enough good images, with enroll failed or whose template
+        was not stored. Their enroll session is cancelled */
+    uint32_t failed;
+    /** Images added to enroll */
+    uint32_t images;
+    /** Images rejected by BM-Lite or failed to read */
+    uint32_t rejected;
+    /** Total time (msec) */
+    uint32_t elapsed_ms;
+} batch_enroll_stats_t;
+
+/**
+ * @brief Enroll all users of dataset
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] dataset - directory, tar archive or list file
+ * @param[in] params  - where to put created templates
+ * @param[out] stats  - enroll statistics
+ *
+ * @return ::fpc_bep_result_t, error of the failed user if params->stop_on_error is set
+ */
+fpc_bep_result_t batch_enroll(HCP_comm_t *chain, const char *dataset,
+        const batch_enroll_params_t *params, batch_enroll_stats_t *stats);
+
+#endif /* BATCH_ENROLL_H */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BATCH_IDENTIFY_H
+#define BATCH_IDENTIFY_H
+
+/**
+ * @file    batch_identify.h
+ * @brief   Offline identification of recorded images
+ *
+ * Every image is pushed to BM-Lite, extracted and identified against
+ * templates in BM-Lite storage. Images are read and decoded by a prefetch
+ * thread while the previous image is processed. Dataset label is ID of
+ * the template the image belongs to, see image_dataset.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+#include "image_dataset.h"
+
+/** Number of images read ahead */
+#define BATCH_PREFETCH_DEPTH 4
+
+typedef struct {
+    uint32_t images;
+    /** Images which belong to an enrolled template */
+    uint32_t genuine;
+    uint32_t impostor;
+    /** Genuine images without match */
+    uint32_t false_rejects;
+    /** Genuine images matched to other template */
+    uint32_t misidentified;
+    /** Impostor images with match */
+    uint32_t false_accepts;
+    /** Images failed to read or process */
+    uint32_t errors;
+    /** Total time (msec) */
+    uint32_t elapsed_ms;
+} batch_identify_stats_t;
+
+/**
+ * @brief Identify all images of dataset
+ *
+ * Prints per-stage latency and result tallies.
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] dataset - directory, tar archive or list file
+ * @param[in] verbose - print result of every image
+ * @param[out] stats  - result tallies
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t batch_identify(HCP_comm_t *chain, const char *dataset, bool verbose,
+        batch_identify_stats_t *stats);
+
+#endif /* BATCH_IDENTIFY_H */
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BATCH_SCRIPT_H
+#define BATCH_SCRIPT_H
+
+/**
+ * @file    batch_script.h
+ * @brief   Non-interactive command sequences for provisioning and test runs
+ *
+ * Every step is one command with arguments:
+ *   version                 - read BM-Lite version
+ *   enroll                  - enroll finger to RAM
+ *   identify [n] [timeout]  - capture and identify n times
+ *   save <id>               - save template in RAM to storage
+ *   remove <id>             - remove template from storage
+ *   remove_all              - remove all templates from storage
+ *   list                    - list template IDs in storage
+ *   template_get <file>     - save template in RAM to file
+ *   template_put <file>     - push template from file to RAM
+ *   capture [timeout]       - capture image
+ *   image_get <name>        - pull captured image to <name>.pgm
+ *   backup <file> [z]       - backup all templates to archive, z - compressed
+ *   restore <file>          - restore all templates from archive
+ *   reset                   - SW reset
+ *   bench_ping [n]          - n round trips, see bench_ping()
+ *   bench_quality [n]       - image quality kernels on captured image
+ *   bench_transfer [n]      - n uploads and downloads of captured image and
+ *                             of template in RAM, see bench_transfer()
+ *   bench_touch [n] [period] [hold]
+ *                           - n touches every period ms held for hold ms,
+ *                             see bench_touch(). Emulator only
+ *   bench_loss [n] [floor]  - recovery after n lost frames with adaptive
+ *                             timeouts not below floor ms, see bench_loss().
+ *                             Emulator only
+ *   bench_wedge [n]         - recovery of wedged BM-Lite by watchdog, see
+ *                             bench_wedge(). Emulator only
+ *   bench_ready [n]         - identify to next command with fixed delay and
+ *                             with bep_wait_ready(). Emulator only
+ *
+ * Result of every step is printed as one JSON object per line with wall
+ * and CPU time of the step, followed by a summary line. Recovery of wedged
+ * BM-Lite by chain watchdog adds a line after the step. Steps never read
+ * stdin. Benchmark reports are printed to stderr when results go to
+ * stdout, otherwise to stdout.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "hcp_tiny.h"
+
+/** Maximum length of script line */
+#define BATCH_SCRIPT_LINE_MAX 256
+
+typedef struct {
+    uint32_t steps;
+    uint32_t failed;
+    /** Total time (msec) */
+    uint32_t elapsed_ms;
+} batch_script_stats_t;
+
+/**
+ * @brief Run sequence of steps
+ *
+ * @param[in]  chain      - HCP com chain
+ * @param[in]  steps      - steps, one command with arguments each
+ * @param[in]  count      - number of steps
+ * @param[in]  keep_going - continue after failed step
+ * @param[in]  out        - stream for results
+ * @param[out] stats      - step tallies
+ *
+ * @return ::fpc_bep_result_t of first failed step
+ */
+fpc_bep_result_t batch_script_run(HCP_comm_t *chain, char *const *steps, int count,
+        bool keep_going, FILE *out, batch_script_stats_t *stats);
+
+/**
+ * @brief Run steps from script file
+ *
+ * One step per line. Empty lines and lines starting with '#' are skipped.
+ *
+ * @param[in]  chain      - HCP com chain
+ * @param[in]  path       - script file
+ * @param[in]  keep_going - continue after failed step
+ * @param[in]  out        - stream for results
+ * @param[out] stats      - step tallies
+ *
+ * @return ::fpc_bep_result_t of first failed step
+ */
+fpc_bep_result_t batch_script_run_file(HCP_comm_t *chain, const char *path, bool keep_going,
+        FILE *out, batch_script_stats_t *stats);
+
+#endif /* BATCH_SCRIPT_H */
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/**
+ * @file    bench.h
+ * @brief   Latency measurement helpers for BM-Lite example
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hcp_tiny.h"
+
+/**
+ * @brief Get monotonic time in micro seconds
+ *
+ * @return time in us.
+ */
+uint64_t bench_time_us(void);
+
+/**
+ * @brief Print latency percentiles
+ *
+ * @param[in] name    - name of measured operation
+ * @param[in] samples - latency samples (us). Sorted in place
+ * @param[in] count   - number of samples
+ * @param[in] out     - stream for the report
+ */
+void bench_report(const char *name, uint32_t *samples, uint32_t count, FILE *out);
+
+/**
+ * @brief Measure command round trip latency
+ *
+ * Sends count CMD_INFO requests and prints p50/p99/p99.9/max round trip time.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] count  - number of requests
+ * @param[in] out    - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_ping(HCP_comm_t *chain, uint32_t count, FILE *out);
+
+/**
+ * @brief Measure image and template transfer time and throughput
+ *
+ * Uploads and downloads captured image, and the template in RAM if there
+ * is one, count times each. Prints p50/max time and kB/s of every
+ * transfer, to compare links (UART speeds, SPI, TCP bridge).
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] count  - number of transfers of each kind
+ * @param[in] out    - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_transfer(HCP_comm_t *chain, uint32_t count, FILE *out);
+
+/**
+ * @brief Measure wake-up latency of power modes
+ *
+ * For every power mode BM-Lite is put to the mode, woken up and a finger
+ * is identified. Prints wake-up to first answer latency and wake-up to
+ * identify result time. On the emulator wake-up latency is its own constant
+ * per mode.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] cycles - number of wake-ups per mode
+ * @param[in] out    - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_power(HCP_comm_t *chain, uint32_t cycles, FILE *out);
+
+/**
+ * @brief Measure gallery paging identify latency
+ *
+ * Runs identifies against galleries from half to eight times of capacity
+ * with skewed user distribution. Needs emulated BM-Lite.
+ *
+ * @param[in] chain      - HCP com chain
+ * @param[in] capacity   - number of BM-Lite storage slots to use
+ * @param[in] identifies - number of identifies per gallery size
+ * @param[in] out        - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_gallery(HCP_comm_t *chain, uint32_t capacity, uint32_t identifies,
+        FILE *out);
+
+/**
+ * @brief Measure image quality kernels on captured image
+ *
+ * Compares timing and results of scalar and SIMD kernels.
+ *
+ * @param[in] chain      - HCP com chain
+ * @param[in] iterations - number of runs of each kernel
+ * @param[in] out        - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_image_quality(HCP_comm_t *chain, uint32_t iterations, FILE *out);
+
+/**
+ * @brief Measure touch-to-decision latency of continuous identification
+ *
+ * Emulated finger touches the sensor periodically. Touches are identified
+ * with bep_identify_finger() and sensor_wait_finger_not_present() and then
+ * with bmlite_continuous_run(). Prints latency from true touch start to
+ * decision and CPU load of both. Needs emulated BM-Lite.
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[in] touches   - number of touches per run
+ * @param[in] period_ms - touch period
+ * @param[in] hold_ms   - time finger stays on the sensor
+ * @param[in] out       - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_touch(HCP_comm_t *chain, uint32_t touches, uint32_t period_ms,
+        uint32_t hold_ms, FILE *out);
+
+/**
+ * @brief Measure recovery time after frame loss
+ *
+ * Emulated link loses one frame of a version request, the request is issued
+ * again until it succeeds. Runs with fixed link timeouts, with adaptive ones
+ * and with adaptive ones and link retries. Then checks that enroll start
+ * with lost ACK is not run twice by link retries. Needs emulated BM-Lite.
+ *
+ * @param[in] chain    - HCP com chain
+ * @param[in] count    - number of lost frames per run
+ * @param[in] floor_ms - floor of adaptive timeouts, 0 - SDK default
+ * @param[in] out      - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_loss(HCP_comm_t *chain, uint32_t count, uint32_t floor_ms, FILE *out);
+
+/**
+ * @brief Measure recovery of wedged BM-Lite by watchdog
+ *
+ * Emulated BM-Lite is wedged in every way curable by every recovery step.
+ * Version request is issued again until it succeeds, tripped watchdog is
+ * recovered between requests. Prints time from first fault to answer and
+ * link fault counts. Needs emulated BM-Lite.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] count - number of wedges per kind and recovery step
+ * @param[in] out   - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_wedge(HCP_comm_t *chain, uint32_t count, FILE *out);
+
+/**
+ * @brief Measure identify to next command latency
+ *
+ * Emulated finger matches stored template, BM-Lite updates the template
+ * after answering. Next command is sent after the fixed 50 ms delay and
+ * after bep_wait_ready(). Prints latency from identify answer to answer of
+ * the next command. Needs emulated BM-Lite.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] count - number of identifies per run
+ * @param[in] out   - stream for the report
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bench_ready(HCP_comm_t *chain, uint32_t count, FILE *out);
+
+/**
+ * @brief Start synthetic CPU load
+ *
+ * Starts busy looping threads with default scheduling policy. Threads
+ * inherit CPU affinity of the caller, so call it before
+ * rpi_rt_profile_apply() pins the caller to its CPU.
+ *
+ * @param[in] threads - number of threads
+ */
+void bench_cpu_hog_start(int threads);
+
+#endif /* BENCH_H */
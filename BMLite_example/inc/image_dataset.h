@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IMAGE_DATASET_H
+#define IMAGE_DATASET_H
+
+/**
+ * @file    image_dataset.h
+ * @brief   Sets of recorded images and their read-ahead
+ *
+ * Dataset is a directory, a tar archive or a list file:
+ * - directory: all regular files, in name order. File name "<label>_..."
+ *   sets image label, any other name gives label -1
+ * - tar archive (ustar): regular members, in name order, labeled by file
+ *   name as in a directory. Images are read from the archive in place
+ * - list file: lines "<path> <label>", path may contain spaces
+ *
+ * Images are raw 8-bit pixels or binary PGM (P5), of at most
+ * IMAGE_DATASET_PIXELS_MAX pixels.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "fpc_bep_types.h"
+#include "work_queue.h"
+
+/** Maximum length of image path */
+#define IMAGE_DATASET_PATH_MAX 256
+/** Largest image BM-Lite takes, its data argument has 16-bit length */
+#define IMAGE_DATASET_PIXELS_MAX 0xffff
+
+typedef struct {
+    /** Image file, or member name if dataset is an archive */
+    char path[IMAGE_DATASET_PATH_MAX];
+    int32_t label;
+    /** Position and size of archive member */
+    long offset;
+    long length;
+} image_dataset_entry_t;
+
+typedef struct {
+    image_dataset_entry_t *entries;
+    uint32_t count;
+    /** Archive file, empty if images are separate files */
+    char archive[IMAGE_DATASET_PATH_MAX];
+} image_dataset_t;
+
+typedef struct {
+    const image_dataset_entry_t *entry;
+    /** Result of reading the image */
+    fpc_bep_result_t result;
+    uint8_t *image;
+    uint32_t size;
+} image_dataset_item_t;
+
+typedef struct {
+    const image_dataset_t *dataset;
+    work_queue_t queue;
+    pthread_t thread;
+    /** Error which ended reading before the last image. Valid after
+        image_prefetch_stop() */
+    fpc_bep_result_t result;
+} image_prefetch_t;
+
+/**
+ * @brief Get list of dataset images
+ *
+ * @param[out] dataset - dataset
+ * @param[in] path     - directory, tar archive or list file
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t image_dataset_open(image_dataset_t *dataset, const char *path);
+
+/**
+ * @brief Free dataset resources
+ *
+ * @param[in] dataset - dataset
+ */
+void image_dataset_close(image_dataset_t *dataset);
+
+/**
+ * @brief Read image file
+ *
+ * @param[in] path   - file name
+ * @param[out] image - image pixels. Must be freed with free()
+ * @param[out] size  - number of pixels
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t image_load(const char *path, uint8_t **image, uint32_t *size);
+
+/**
+ * @brief Read image of dataset entry
+ *
+ * @param[in] dataset - dataset
+ * @param[in] entry   - dataset entry
+ * @param[out] image  - image pixels. Must be freed with free()
+ * @param[out] size   - number of pixels
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t image_dataset_load(const image_dataset_t *dataset,
+        const image_dataset_entry_t *entry, uint8_t **image, uint32_t *size);
+
+/**
+ * @brief Start reading dataset images in a helper thread
+ *
+ * @param[in] prefetch - prefetch context
+ * @param[in] dataset  - dataset
+ * @param[in] depth    - number of images read ahead
+ *
+ * @return true on success
+ */
+bool image_prefetch_start(image_prefetch_t *prefetch, const image_dataset_t *dataset,
+        uint32_t depth);
+
+/**
+ * @brief Take next image in dataset order
+ *
+ * @param[in] prefetch - prefetch context
+ *
+ * @return image, must be freed with image_prefetch_release(). NULL at end
+ *         or if reading failed, see image_prefetch_t::result
+ */
+image_dataset_item_t *image_prefetch_next(image_prefetch_t *prefetch);
+
+/**
+ * @brief Free image taken by image_prefetch_next()
+ *
+ * @param[in] item - image
+ */
+void image_prefetch_release(image_dataset_item_t *item);
+
+/**
+ * @brief Stop reading and free images which were not taken
+ *
+ * @param[in] prefetch - prefetch context
+ */
+void image_prefetch_stop(image_prefetch_t *prefetch);
+
+#endif /* IMAGE_DATASET_H */
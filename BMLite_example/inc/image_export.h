@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IMAGE_EXPORT_H
+#define IMAGE_EXPORT_H
+
+/**
+ * @file    image_export.h
+ * @brief   Saving of captured images to binary PGM and PNG files
+ *
+ * PNG needs zlib (make USE_ZLIB=1). Files can be written synchronously or
+ * handed to a writer thread, so capture loops are not blocked on storage.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "hcp_tiny.h"
+#include "work_queue.h"
+
+/** Default sensor resolution if BM-Lite does not report it */
+#define IMAGE_EXPORT_DEFAULT_DPI 508
+/** Maximum length of file name */
+#define IMAGE_EXPORT_PATH_MAX 256
+
+typedef enum {
+    /** Binary 8-bit PGM (P5) */
+    IMAGE_FORMAT_PGM = 0,
+    /** 8-bit grayscale PNG */
+    IMAGE_FORMAT_PNG,
+} image_format_t;
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint16_t dpi;
+} image_geometry_t;
+
+typedef struct {
+    work_queue_t queue;
+    pthread_t thread;
+    /** Images written to files */
+    uint32_t written;
+    /** Images dropped because queue was full */
+    uint32_t dropped;
+    /** Images failed to write */
+    uint32_t errors;
+} image_writer_t;
+
+/**
+ * @brief Get image geometry
+ *
+ * Geometry is requested from BM-Lite. If BM-Lite does not report it,
+ * square image of given size and default resolution is assumed.
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[in] size      - image size in bytes
+ * @param[out] geometry - image geometry
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t image_get_geometry(HCP_comm_t *chain, uint32_t size,
+        image_geometry_t *geometry);
+
+/**
+ * @brief Save 8-bit image to file
+ *
+ * @param[in] path     - file name
+ * @param[in] format   - file format
+ * @param[in] geometry - image geometry
+ * @param[in] image    - image pixels
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t image_save(const char *path, image_format_t format,
+        const image_geometry_t *geometry, const uint8_t *image);
+
+/**
+ * @brief Start image writer thread
+ *
+ * @param[in] writer - writer
+ * @param[in] depth  - maximum number of queued images
+ *
+ * @return true on success
+ */
+bool image_writer_start(image_writer_t *writer, uint32_t depth);
+
+/**
+ * @brief Queue image for saving. Never blocks
+ *
+ * Writer takes ownership of the image buffer, which must be allocated with
+ * malloc(). Image is dropped if the queue is full.
+ *
+ * @param[in] writer   - writer
+ * @param[in] path     - file name
+ * @param[in] format   - file format
+ * @param[in] geometry - image geometry
+ * @param[in] image    - image pixels
+ *
+ * @return true if image is queued
+ */
+bool image_writer_submit(image_writer_t *writer, const char *path, image_format_t format,
+        const image_geometry_t *geometry, uint8_t *image);
+
+/**
+ * @brief Write all queued images and stop writer thread
+ *
+ * @param[in] writer - writer
+ */
+void image_writer_stop(image_writer_t *writer);
+
+#endif /* IMAGE_EXPORT_H */
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEMPLATE_ARCHIVE_H
+#define TEMPLATE_ARCHIVE_H
+
+/**
+ * @file    template_archive.h
+ * @brief   Backup and restore of all BM-Lite templates to a single archive
+ *
+ * Archive layout (little endian):
+ *   header  - magic "BMLT", version, flags, template count, index offset
+ *   records - record header (id, flags, raw size, stored size, CRC-32 of raw data)
+ *             followed by stored template data
+ *   index   - one entry per template with the record header fields and
+ *             record offset
+ *
+ * File I/O and compression run on a helper thread, overlapped with
+ * the link transfer of the next template.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+
+/** Maximum template size. Limited by bep_template_put() */
+#define TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE 65535
+
+typedef struct {
+    /** Number of transferred templates */
+    uint32_t templates;
+    /** Size of template data */
+    uint64_t raw_bytes;
+    /** Size of template data stored in archive */
+    uint64_t stored_bytes;
+    /** Total time (msec) */
+    uint32_t elapsed_ms;
+} template_archive_stats_t;
+
+typedef struct {
+    uint16_t id;
+    /** Record flags. TEMPLATE_ARCHIVE_FLAG_xxx */
+    uint16_t flags;
+    uint32_t raw_size;
+    uint32_t stored_size;
+    /** CRC-32 of raw template data */
+    uint32_t crc;
+    /** Offset of record header in archive */
+    uint32_t offset;
+} template_archive_entry_t;
+
+typedef struct {
+    uint16_t id;
+    uint32_t size;
+    uint8_t *data;
+} template_archive_item_t;
+
+/** Archive or record is compressed with zlib */
+#define TEMPLATE_ARCHIVE_FLAG_COMPRESSED 0x0001
+
+/**
+ * @brief Backup all templates from BM-Lite storage to archive
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[in] path      - archive file name
+ * @param[in] compress  - compress templates. Requires build with USE_ZLIB=1
+ * @param[out] stats    - transfer statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_archive_backup(HCP_comm_t *chain, const char *path, bool compress,
+        template_archive_stats_t *stats);
+
+/**
+ * @brief Restore all templates from archive to BM-Lite storage
+ *
+ * Templates are saved with their original IDs. Existing templates
+ * with the same IDs are replaced.
+ * Compressed archive needs build with USE_ZLIB=1, otherwise
+ * FPC_BEP_RESULT_NOT_SUPPORTED is returned.
+ *
+ * @param[in] chain     - HCP com chain
+ * @param[in] path      - archive file name
+ * @param[out] stats    - transfer statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_archive_restore(HCP_comm_t *chain, const char *path,
+        template_archive_stats_t *stats);
+
+/**
+ * @brief Load all templates from archive to memory
+ *
+ * Compressed archive needs build with USE_ZLIB=1, otherwise
+ * FPC_BEP_RESULT_NOT_SUPPORTED is returned.
+ *
+ * @param[in] path      - archive file name
+ * @param[out] items    - array of templates. Must be freed by template_archive_free()
+ * @param[out] count    - number of templates
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_archive_load(const char *path, template_archive_item_t **items,
+        uint32_t *count);
+
+/**
+ * @brief Free templates loaded by template_archive_load()
+ *
+ * @param[in] items     - array of templates
+ * @param[in] count     - number of templates
+ */
+void template_archive_free(template_archive_item_t *items, uint32_t count);
+
+#endif /* TEMPLATE_ARCHIVE_H */
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEMPLATE_GALLERY_H
+#define TEMPLATE_GALLERY_H
+
+/**
+ * @file    template_gallery.h
+ * @brief   Host-managed template paging for galleries larger than BM-Lite storage
+ *
+ * The gallery keeps all templates on host. When the gallery is larger than
+ * BM-Lite storage, slots 0..capacity-2 hold a resident set and the last slot
+ * is the paging slot. Otherwise all templates are resident.
+ *
+ * Identify runs on stored templates first. On no match, templates not in
+ * storage are saved to the paging slot in order of their score, image
+ * features are extracted again (template put replaces them in BM-Lite RAM)
+ * and identify runs again, until the first match or until the gallery is
+ * exhausted. Score is hit count decayed by TEMPLATE_GALLERY_HALF_LIFE
+ * identifies, so both frequency and recency of matches are taken into account.
+ *
+ * Every paged template costs a storage removal and a save. Storage flash has
+ * limited number of erase cycles, so the resident set should hold the
+ * templates that match most: template_gallery_rebalance() moves the best
+ * scored templates there and should run from time to time (e.g. nightly).
+ * Writes are counted in template_gallery_stats_t::flash_writes.
+ *
+ * Captured image must stay valid while templates are paged. Gallery owns
+ * BM-Lite storage and RAM template: storage is cleared on init.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+#include "template_archive.h"
+
+/** Score decay period in identify calls */
+#define TEMPLATE_GALLERY_HALF_LIFE 64
+/** Score added on match */
+#define TEMPLATE_GALLERY_HIT_SCORE 1024
+
+typedef struct {
+    /** Gallery template ID reported on match */
+    uint16_t id;
+    uint32_t size;
+    const uint8_t *data;
+    /** Decayed hit score at the time of last_use */
+    uint32_t score;
+    uint32_t last_use;
+    /** BM-Lite storage slot or -1 if not resident */
+    int32_t slot;
+} template_gallery_entry_t;
+
+/** Entry index with its score, sorted to get paging order */
+typedef struct {
+    uint32_t score;
+    uint32_t index;
+} template_gallery_key_t;
+
+typedef struct {
+    HCP_comm_t *chain;
+    template_gallery_entry_t *entries;
+    uint32_t count;
+    /** Number of BM-Lite storage slots */
+    uint32_t capacity;
+    /** Slots holding resident templates. Slot resident is the paging slot */
+    uint32_t resident;
+    /** Entry index for every slot, -1 if slot is empty */
+    int32_t *slot_entry;
+    /** Identify counter */
+    uint32_t clock;
+    /** Paging order buffer */
+    template_gallery_key_t *order;
+} template_gallery_t;
+
+typedef struct {
+    /** Identify commands sent */
+    uint32_t identifies;
+    /** Templates saved to the paging slot */
+    uint32_t paged;
+    /** Storage writes, template saves and removals */
+    uint32_t flash_writes;
+    /** Total time (msec) */
+    uint32_t elapsed_ms;
+} template_gallery_stats_t;
+
+/**
+ * @brief Create gallery and fill BM-Lite storage
+ *
+ * The first capacity templates become resident. Template data is
+ * referenced, not copied, and must outlive the gallery.
+ *
+ * @param[in] gallery  - gallery
+ * @param[in] chain    - HCP com chain
+ * @param[in] items    - gallery templates, most used first
+ * @param[in] count    - number of templates
+ * @param[in] capacity - number of BM-Lite storage slots to use
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_gallery_init(template_gallery_t *gallery, HCP_comm_t *chain,
+        const template_archive_item_t *items, uint32_t count, uint32_t capacity);
+
+/**
+ * @brief Free gallery resources
+ *
+ * @param[in] gallery - gallery
+ */
+void template_gallery_destroy(template_gallery_t *gallery);
+
+/**
+ * @brief Identify extracted image against the whole gallery
+ *
+ * Image must be captured and extracted before the call. After paging, BM-Lite
+ * RAM holds features extracted again from the same image.
+ *
+ * @param[in] gallery      - gallery
+ * @param[out] match       - match found
+ * @param[out] template_id - gallery ID of matched template
+ * @param[out] stats       - identify statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_gallery_identify(template_gallery_t *gallery, bool *match,
+        uint16_t *template_id, template_gallery_stats_t *stats);
+
+/**
+ * @brief Move best scored templates to BM-Lite storage
+ *
+ * Resident templates scoring lower than the best non-resident ones are
+ * replaced, at most max_moves of them. Each move removes and saves a template.
+ *
+ * @param[in] gallery   - gallery
+ * @param[in] max_moves - most templates moved to storage
+ * @param[out] stats    - statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_gallery_rebalance(template_gallery_t *gallery, uint32_t max_moves,
+        template_gallery_stats_t *stats);
+
+#endif /* TEMPLATE_GALLERY_H */
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEMPLATE_MIRROR_H
+#define TEMPLATE_MIRROR_H
+
+/**
+ * @file    template_mirror.h
+ * @brief   Host-side record of templates stored on BM-Lite
+ *
+ * The mirror keeps content hash (CRC-32) and size of every template in
+ * BM-Lite storage. It is kept current through bmlite_on_template_change(),
+ * so BM-Lite SDK must be built with BMLITE_USE_CALLBACK to track changes
+ * made outside of the mirror. With BMLITE_USE_EVENT_QUEUE the changes come
+ * from the queue consumer thread; build and sync wait until the queue has
+ * applied earlier changes before reading the mirror and again before they
+ * return, so the consumer must be running.
+ *
+ * Templates saved from an unknown RAM template (enroll) are marked stale.
+ * A match does not change the state of the matched template.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "hcp_tiny.h"
+#include "template_archive.h"
+
+/** Number of possible template IDs */
+#define TEMPLATE_MIRROR_ID_COUNT 65536
+
+typedef enum {
+    TEMPLATE_MIRROR_ABSENT = 0,
+    /** Template is on BM-Lite, hash is known */
+    TEMPLATE_MIRROR_PRESENT,
+    /** Template is on BM-Lite, content is unknown */
+    TEMPLATE_MIRROR_STALE,
+    /** ID is reserved by template_mirror_alloc_id(), template is not saved yet */
+    TEMPLATE_MIRROR_PENDING,
+} template_mirror_state_t;
+
+typedef struct {
+    /** CRC-32 of template data */
+    uint32_t hash;
+    uint32_t size;
+    /** Mirror generation of last change */
+    uint32_t generation;
+    /** Mirror generation when template was last synced */
+    uint32_t synced_generation;
+    uint8_t state;
+} template_mirror_entry_t;
+
+typedef struct template_mirror {
+    HCP_comm_t *chain;
+    /** Mirror reflects BM-Lite storage */
+    bool valid;
+    template_mirror_entry_t *entries;
+    /** Bitmap of used IDs */
+    uint64_t *used;
+    /** First bitmap word which may have free ID */
+    uint32_t free_hint;
+    /** Incremented on every change */
+    uint32_t generation;
+    /** Template currently in BM-Lite RAM */
+    bool ram_known;
+    uint32_t ram_hash;
+    uint32_t ram_size;
+    /** Guards the mirror against template change callbacks from event queue thread */
+    pthread_mutex_t lock;
+    struct template_mirror *next;
+} template_mirror_t;
+
+typedef struct {
+    /** Templates pushed to BM-Lite */
+    uint32_t uploaded;
+    /** Templates removed from BM-Lite */
+    uint32_t removed;
+    /** Templates already up to date */
+    uint32_t unchanged;
+    /** Total time (msec) */
+    uint32_t elapsed_ms;
+} template_mirror_sync_stats_t;
+
+/**
+ * @brief Create mirror for HCP com chain
+ *
+ * Mirror starts empty and registers for template change callbacks.
+ *
+ * @param[in] mirror - mirror
+ * @param[in] chain  - HCP com chain
+ *
+ * @return true on success
+ */
+bool template_mirror_init(template_mirror_t *mirror, HCP_comm_t *chain);
+
+/**
+ * @brief Free mirror resources
+ *
+ * @param[in] mirror - mirror
+ */
+void template_mirror_destroy(template_mirror_t *mirror);
+
+/**
+ * @brief Build mirror from BM-Lite storage
+ *
+ * Gets list of IDs and uploads every template to calculate its hash.
+ *
+ * @param[in] mirror - mirror
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_mirror_build(template_mirror_t *mirror);
+
+/**
+ * @brief Make BM-Lite storage equal to the set of templates
+ *
+ * Only templates which are missing, different or stale are pushed to BM-Lite.
+ *
+ * @param[in] mirror       - mirror
+ * @param[in] items        - desired templates
+ * @param[in] count        - number of desired templates
+ * @param[in] remove_extra - remove templates which are not in items
+ * @param[out] stats       - sync statistics. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t template_mirror_sync(template_mirror_t *mirror,
+        const template_archive_item_t *items, uint32_t count, bool remove_extra,
+        template_mirror_sync_stats_t *stats);
+
+/**
+ * @brief Reserve free template ID
+ *
+ * The ID is marked pending and is not returned again until a template is
+ * saved with it, it is released or all templates are removed.
+ *
+ * @param[in] mirror - mirror
+ *
+ * @return free ID or -1 if all IDs are used
+ */
+int32_t template_mirror_alloc_id(template_mirror_t *mirror);
+
+/**
+ * @brief Release ID reserved by template_mirror_alloc_id() and not used
+ *
+ * @param[in] mirror      - mirror
+ * @param[in] template_id - reserved template ID
+ */
+void template_mirror_release_id(template_mirror_t *mirror, uint16_t template_id);
+
+/**
+ * @brief Get mirror entry for template ID
+ *
+ * @param[in] mirror      - mirror
+ * @param[in] template_id - template ID
+ *
+ * @return entry
+ */
+const template_mirror_entry_t *template_mirror_get(const template_mirror_t *mirror,
+        uint16_t template_id);
+
+#endif /* TEMPLATE_MIRROR_H */
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UART_SPEED_H
+#define UART_SPEED_H
+
+/**
+ * @file    uart_speed.h
+ * @brief   UART speed negotiation with BM-Lite
+ */
+
+#include <stdint.h>
+
+#include "hcp_tiny.h"
+
+/**
+ * @brief Switch BM-Lite and host UART to new speed
+ *
+ * Sets BM-Lite speed, reconfigures host tty and verifies the link.
+ * Both sides are rolled back to the old speed on failure.
+ *
+ * @param[in] chain    - HCP com chain on COM interface
+ * @param[in] baudrate - new baudrate
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t uart_speed_switch(HCP_comm_t *chain, uint32_t baudrate);
+
+#endif /* UART_SPEED_H */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+/**
+ * @file    work_queue.h
+ * @brief   Bounded blocking queue for handing work between threads
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct {
+    void **items;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} work_queue_t;
+
+/**
+ * @brief Initialize queue
+ *
+ * @param[in] queue    - queue
+ * @param[in] capacity - maximum number of queued items
+ *
+ * @return true on success
+ */
+bool work_queue_init(work_queue_t *queue, uint32_t capacity);
+
+/**
+ * @brief Free queue resources
+ *
+ * @param[in] queue    - queue
+ */
+void work_queue_destroy(work_queue_t *queue);
+
+/**
+ * @brief Add item to queue. Blocks while queue is full
+ *
+ * @param[in] queue    - queue
+ * @param[in] item     - item
+ *
+ * @return false if queue is closed
+ */
+bool work_queue_push(work_queue_t *queue, void *item);
+
+/**
+ * @brief Add item to queue if there is free space
+ *
+ * @param[in] queue    - queue
+ * @param[in] item     - item
+ *
+ * @return false if queue is full or closed
+ */
+bool work_queue_try_push(work_queue_t *queue, void *item);
+
+/**
+ * @brief Take item from queue. Blocks while queue is empty
+ *
+ * @param[in] queue    - queue
+ *
+ * @return item or NULL if queue is closed and empty
+ */
+void *work_queue_pop(work_queue_t *queue);
+
+/**
+ * @brief Close queue. Wakes up all waiting threads
+ *
+ * Items already in queue can still be taken out.
+ *
+ * @param[in] queue    - queue
+ */
+void work_queue_close(work_queue_t *queue);
+
+#endif /* WORK_QUEUE_H */
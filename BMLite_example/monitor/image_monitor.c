@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    image_monitor.c
+ * @brief   Quality monitor reading images published by bmlite_demo -I
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+
+#include "platform_rpi.h"
+#include "bmlite_image_quality.h"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void help(void)
+{
+    fprintf(stderr, "BM-Lite image ring monitor\n");
+    fprintf(stderr, "Syntax: bmlite_image_monitor [-n shm_name] [-c count] [-d delay_ms] [-q]\n");
+    fprintf(stderr, "-d: time spent on each image, to see a slow consumer losing images\n");
+    fprintf(stderr, "-q: print summary only\n");
+}
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = RPI_IMAGE_RING_NAME;
+    rpi_image_reader_t reader;
+    rpi_image_view_t view;
+    uint32_t count = 0;
+    uint32_t delay_ms = 0;
+    bool quiet = false;
+    uint64_t latency_sum = 0;
+    uint64_t latency_max = 0;
+    uint32_t rejected = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:c:d:qh")) != -1) {
+        switch (c) {
+            case 'n':
+                name = optarg;
+                break;
+            case 'c':
+                count = atoi(optarg);
+                break;
+            case 'd':
+                delay_ms = atoi(optarg);
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                help();
+                return 1;
+        }
+    }
+
+    if (!rpi_image_reader_open(&reader, name)) {
+        fprintf(stderr, "Can't open image ring %s\n", name);
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!stop && (count == 0 || reader.received < count)) {
+        bmlite_quality_params_t params = BMLITE_QUALITY_PARAMS_DEFAULT;
+        bmlite_image_quality_t quality;
+        bmlite_quality_reason_t reason;
+        fpc_bep_result_t res;
+        uint64_t latency;
+
+        res = rpi_image_reader_acquire(&reader, &view, 500);
+        if (res == FPC_BEP_RESULT_TIMEOUT) {
+            continue;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            fprintf(stderr, "Image ring closed\n");
+            break;
+        }
+        latency = time_us() - view.timestamp_us;
+
+        // Image is checked in place, in shared memory
+        params.width = view.width;
+        reason = bmlite_image_check(view.data, view.size, &params, &quality);
+        if (delay_ms) {
+            usleep(delay_ms * 1000);
+        }
+        if (!rpi_image_reader_release(&reader, &view)) {
+            continue;
+        }
+
+        latency_sum += latency;
+        if (latency > latency_max) {
+            latency_max = latency;
+        }
+        if (reason != BMLITE_QUALITY_OK) {
+            rejected++;
+        }
+        if (!quiet) {
+            printf("#%u %ux%u %u dpi: coverage %u%%, contrast %u, sharpness %u.%02u%s, "
+                    "latency %llu us\n", view.seq, view.width, view.height, view.dpi,
+                    quality.coverage, quality.contrast, quality.sharpness / 100,
+                    quality.sharpness % 100, reason == BMLITE_QUALITY_OK ? "" : " (rejected)",
+                    (unsigned long long)latency);
+            fflush(stdout);
+        }
+    }
+
+    printf("Images: %llu, dropped %llu, rejected %u, latency avg %llu us, max %llu us\n",
+            (unsigned long long)reader.received, (unsigned long long)reader.dropped, rejected,
+            (unsigned long long)(reader.received ? latency_sum / reader.received : 0),
+            (unsigned long long)latency_max);
+    rpi_image_reader_close(&reader);
+    return 0;
+}
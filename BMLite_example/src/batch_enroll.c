@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    batch_enroll.c
+ * @brief   Offline enrollment from recorded images
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_enroll.h"
+#include "image_dataset.h"
+#include "template_archive.h"
+#include "bench.h"
+#include "bmlite_if.h"
+
+static int compare_user(const void *a, const void *b)
+{
+    const image_dataset_entry_t *x = a;
+    const image_dataset_entry_t *y = b;
+
+    if (x->label != y->label) {
+        return x->label < y->label ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static fpc_bep_result_t check_result(HCP_comm_t *chain, fpc_bep_result_t res)
+{
+    return res != FPC_BEP_RESULT_OK ? res : chain->bep_result;
+}
+
+static fpc_bep_result_t export_template(HCP_comm_t *chain, const char *dir, uint16_t id,
+        uint8_t *buf)
+{
+    char path[IMAGE_DATASET_PATH_MAX];
+    fpc_bep_result_t res;
+    FILE *f;
+
+    res = check_result(chain, bep_template_get(chain, buf, TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE));
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    snprintf(path, sizeof(path), "%s/%u.bin", dir, id);
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (fwrite(buf, 1, chain->arg.size, f) != chain->arg.size) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (fclose(f) != 0) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    return res;
+}
+
+static fpc_bep_result_t store_template(HCP_comm_t *chain, const batch_enroll_params_t *params,
+        uint16_t id, uint8_t *buf)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+
+    if (params->export_dir) {
+        res = export_template(chain, params->export_dir, id, buf);
+    }
+    if (res == FPC_BEP_RESULT_OK && params->save) {
+        res = check_result(chain, bep_template_save(chain, id));
+        if (res == FPC_BEP_RESULT_ID_NOT_UNIQUE) {
+            res = check_result(chain, bep_template_remove(chain, id));
+            if (res == FPC_BEP_RESULT_OK) {
+                res = check_result(chain, bep_template_save(chain, id));
+            }
+        }
+    }
+    return res;
+}
+
+/* Count user as failed and cancel enroll session it may have left open.
+   Returns error stopping the batch, FPC_BEP_RESULT_OK to go on */
+static fpc_bep_result_t fail_user(HCP_comm_t *chain, const batch_enroll_params_t *params,
+        int32_t user, fpc_bep_result_t res, batch_enroll_stats_t *stats)
+{
+    if (res != FPC_BEP_RESULT_OK) {
+        printf("User %d: error %d\n", user, res);
+    }
+    bmlite_send_cmd(chain, CMD_CANCEL, ARG_NONE);
+    chain->bep_result = FPC_BEP_RESULT_OK;
+    stats->failed++;
+    return params->stop_on_error ? res : FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t batch_enroll(HCP_comm_t *chain, const char *dataset,
+        const batch_enroll_params_t *params, batch_enroll_stats_t *stats)
+{
+    image_dataset_t ds;
+    image_prefetch_t prefetch;
+    image_dataset_item_t *item;
+    uint8_t *buf = NULL;
+    uint64_t start;
+    fpc_bep_result_t res;
+    uint32_t remaining = 0;
+    int32_t user = -1;
+    bool started = false;
+    bool skip = false;
+
+    memset(stats, 0, sizeof(*stats));
+    res = image_dataset_open(&ds, dataset);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    // Images of every user go one after another
+    qsort(ds.entries, ds.count, sizeof(*ds.entries), compare_user);
+
+    buf = malloc(TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE);
+    if (buf == NULL) {
+        image_dataset_close(&ds);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    if (!image_prefetch_start(&prefetch, &ds, BATCH_ENROLL_PREFETCH_DEPTH)) {
+        free(buf);
+        image_dataset_close(&ds);
+        return FPC_BEP_RESULT_NO_RESOURCE;
+    }
+
+    start = bench_time_us();
+    while (res == FPC_BEP_RESULT_OK) {
+        item = image_prefetch_next(&prefetch);
+
+        if (item == NULL || item->entry->label != user) {
+            // End of previous user
+            if (started && remaining == 0) {
+                res = check_result(chain, bep_enroll_finish(chain));
+                if (res == FPC_BEP_RESULT_OK) {
+                    res = store_template(chain, params, user, buf);
+                }
+                if (res == FPC_BEP_RESULT_OK) {
+                    stats->enrolled++;
+                } else {
+                    res = fail_user(chain, params, user, res, stats);
+                }
+            } else if (started) {
+                printf("User %d: %u more images needed\n", user, remaining);
+                fail_user(chain, params, user, FPC_BEP_RESULT_OK, stats);
+            }
+            started = false;
+            skip = false;
+            if (item == NULL || res != FPC_BEP_RESULT_OK) {
+                image_prefetch_release(item);
+                break;
+            }
+            user = item->entry->label;
+        }
+
+        if (user < 0 || user > UINT16_MAX || skip) {
+            // Unlabeled images can't be enrolled, rest of failed user is skipped
+            image_prefetch_release(item);
+            continue;
+        }
+        if (!started) {
+            stats->users++;
+            res = check_result(chain, bep_enroll_start(chain));
+            if (res != FPC_BEP_RESULT_OK) {
+                res = fail_user(chain, params, user, res, stats);
+                skip = true;
+                image_prefetch_release(item);
+                continue;
+            }
+            started = true;
+            remaining = UINT32_MAX;
+        }
+        if (remaining > 0) {
+            if (item->result != FPC_BEP_RESULT_OK) {
+                stats->rejected++;
+            } else {
+                res = bep_enroll_add_image(chain, item->image, item->size, &remaining);
+                if (res != FPC_BEP_RESULT_OK) {
+                    // Link error, the session is in unknown state
+                    res = fail_user(chain, params, user, res, stats);
+                    started = false;
+                    skip = true;
+                } else if (chain->bep_result != FPC_BEP_RESULT_OK) {
+                    // Bad image, try next one
+                    stats->rejected++;
+                } else {
+                    stats->images++;
+                }
+            }
+        }
+        image_prefetch_release(item);
+    }
+    stats->elapsed_ms = (bench_time_us() - start) / 1000;
+    image_prefetch_stop(&prefetch);
+    if (res == FPC_BEP_RESULT_OK && prefetch.result != FPC_BEP_RESULT_OK) {
+        printf("Reading images failed with error %d\n", prefetch.result);
+        res = prefetch.result;
+    }
+
+    printf("%u users: %u enrolled, %u failed. %u images used, %u rejected\n", stats->users,
+            stats->enrolled, stats->failed, stats->images, stats->rejected);
+    printf("%u ms, %.1f enrollments/min\n", stats->elapsed_ms,
+            stats->elapsed_ms ? stats->enrolled * 60000.0 / stats->elapsed_ms : 0.0);
+
+    free(buf);
+    image_dataset_close(&ds);
+    return res;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    batch_identify.c
+ * @brief   Offline identification of recorded images
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_identify.h"
+#include "image_dataset.h"
+#include "bench.h"
+#include "bmlite_if.h"
+
+typedef enum {
+    STAGE_PUT = 0,
+    STAGE_EXTRACT,
+    STAGE_IDENTIFY,
+    STAGE_COUNT
+} stage_t;
+
+static const char *stage_names[STAGE_COUNT] = { "put", "extract", "identify" };
+
+/* Device errors are reported by *rejected, the rest are link errors */
+static fpc_bep_result_t check_result(HCP_comm_t *chain, fpc_bep_result_t res, bool *rejected)
+{
+    if (res == FPC_BEP_RESULT_OK && chain->bep_result != FPC_BEP_RESULT_OK) {
+        *rejected = true;
+        return chain->bep_result;
+    }
+    return res;
+}
+
+static fpc_bep_result_t process_image(HCP_comm_t *chain, image_dataset_item_t *item,
+        uint32_t *latency, bool *match, uint16_t *id, bool *rejected)
+{
+    fpc_bep_result_t res;
+    uint64_t start = bench_time_us();
+
+    res = check_result(chain, bep_image_put(chain, item->image, item->size), rejected);
+    latency[STAGE_PUT] = bench_time_us() - start;
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    start = bench_time_us();
+    res = check_result(chain, bep_image_extract(chain), rejected);
+    latency[STAGE_EXTRACT] = bench_time_us() - start;
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    start = bench_time_us();
+    res = check_result(chain, bep_identify(chain), rejected);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bmlite_get_arg(chain, ARG_MATCH);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        *match = *(bool *)chain->arg.data;
+        if (*match && bmlite_get_arg(chain, ARG_ID) == FPC_BEP_RESULT_OK) {
+            *id = *(uint16_t *)chain->arg.data;
+        }
+    }
+    latency[STAGE_IDENTIFY] = bench_time_us() - start;
+    return res;
+}
+
+fpc_bep_result_t batch_identify(HCP_comm_t *chain, const char *dataset, bool verbose,
+        batch_identify_stats_t *stats)
+{
+    image_dataset_t ds;
+    image_prefetch_t prefetch;
+    image_dataset_item_t *item;
+    uint32_t *latency[STAGE_COUNT] = { NULL };
+    uint32_t done = 0;
+    uint64_t start;
+    fpc_bep_result_t res;
+
+    memset(stats, 0, sizeof(*stats));
+    res = image_dataset_open(&ds, dataset);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        latency[s] = malloc((ds.count ? ds.count : 1) * sizeof(uint32_t));
+        if (latency[s] == NULL) {
+            res = FPC_BEP_RESULT_NO_MEMORY;
+        }
+    }
+    if (res != FPC_BEP_RESULT_OK || !image_prefetch_start(&prefetch, &ds, BATCH_PREFETCH_DEPTH)) {
+        res = res != FPC_BEP_RESULT_OK ? res : FPC_BEP_RESULT_NO_RESOURCE;
+        goto exit;
+    }
+
+    start = bench_time_us();
+    while ((item = image_prefetch_next(&prefetch)) != NULL) {
+        int32_t expected = item->entry->label;
+        uint32_t stage_us[STAGE_COUNT];
+        bool match = false;
+        bool rejected = false;
+        uint16_t id = 0;
+
+        stats->images++;
+        res = item->result;
+        if (res == FPC_BEP_RESULT_OK) {
+            res = process_image(chain, item, stage_us, &match, &id, &rejected);
+        } else {
+            rejected = true;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            stats->errors++;
+            printf("%s: error %d\n", item->entry->path, res);
+            image_prefetch_release(item);
+            // Link errors stop the run, bad images are skipped
+            if (!rejected) {
+                break;
+            }
+            res = FPC_BEP_RESULT_OK;
+            continue;
+        }
+
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            latency[s][done] = stage_us[s];
+        }
+        done++;
+
+        if (expected >= 0) {
+            stats->genuine++;
+            if (!match) {
+                stats->false_rejects++;
+            } else if (id != expected) {
+                stats->misidentified++;
+            }
+        } else {
+            stats->impostor++;
+            stats->false_accepts += match;
+        }
+        if (verbose) {
+            printf("%s: expected %d, %s %d\n", item->entry->path, expected,
+                    match ? "match" : "no match", match ? id : -1);
+        }
+        image_prefetch_release(item);
+    }
+    stats->elapsed_ms = (bench_time_us() - start) / 1000;
+    image_prefetch_stop(&prefetch);
+    if (res == FPC_BEP_RESULT_OK && prefetch.result != FPC_BEP_RESULT_OK) {
+        printf("Reading images failed with error %d\n", prefetch.result);
+        res = prefetch.result;
+    }
+
+    printf("%u images, %u errors in %u ms, %.1f images/s\n", stats->images, stats->errors,
+            stats->elapsed_ms, stats->elapsed_ms ? done * 1000.0 / stats->elapsed_ms : 0.0);
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        bench_report(stage_names[s], latency[s], done, stdout);
+    }
+    printf("Genuine %u: false reject %u (FRR %.2f%%), misidentified %u\n", stats->genuine,
+            stats->false_rejects,
+            stats->genuine ? stats->false_rejects * 100.0 / stats->genuine : 0.0,
+            stats->misidentified);
+    printf("Impostor %u: false accept %u (FAR %.2f%%)\n", stats->impostor, stats->false_accepts,
+            stats->impostor ? stats->false_accepts * 100.0 / stats->impostor : 0.0);
+
+exit:
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        free(latency[s]);
+    }
+    image_dataset_close(&ds);
+    return res;
+}
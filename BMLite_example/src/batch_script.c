@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    batch_script.c
+ * @brief   Non-interactive command sequences for provisioning and test runs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch_script.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+#include "bmlite_watchdog.h"
+#include "bench.h"
+#include "image_export.h"
+#include "template_archive.h"
+
+/** Maximum number of arguments of a step */
+#define STEP_ARGS_MAX 4
+
+/* Print JSON string. Only quote, backslash and control characters are escaped */
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static fpc_bep_result_t step_identify(HCP_comm_t *chain, int argc, char **argv, FILE *out)
+{
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 1;
+    uint32_t timeout = argc > 2 ? atoi(argv[2]) : 0;
+    uint32_t matches = 0;
+    uint32_t done;
+    uint16_t template_id = 0;
+    uint32_t *samples;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+
+    if (count == 0)
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    samples = malloc(count * sizeof(uint32_t));
+    if (samples == NULL)
+        return FPC_BEP_RESULT_NO_MEMORY;
+
+    for (done = 0; done < count; done++) {
+        uint64_t start = bench_time_us();
+        uint16_t id;
+        bool match;
+        res = bep_identify_finger(chain, timeout, &id, &match);
+        if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK)
+            break;
+        samples[done] = (uint32_t)(bench_time_us() - start);
+        if (match) {
+            matches++;
+            template_id = id;
+        }
+    }
+
+    fprintf(out, ",\"count\":%u,\"match\":%u,\"no_match\":%u,\"last_id\":%u", done, matches,
+            done - matches, template_id);
+    if (done > 0) {
+        qsort(samples, done, sizeof(uint32_t), cmp_u32);
+        fprintf(out, ",\"p50_us\":%u,\"max_us\":%u", samples[done / 2], samples[done - 1]);
+    }
+    free(samples);
+    return res;
+}
+
+static fpc_bep_result_t step_template_file(HCP_comm_t *chain, bool get, const char *path,
+        FILE *out)
+{
+    uint8_t *buf = malloc(TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE);
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t size = 0;
+    FILE *f;
+
+    if (buf == NULL)
+        return FPC_BEP_RESULT_NO_MEMORY;
+
+    if (get) {
+        res = bep_template_get(chain, buf, TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE);
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            size = chain->arg.size;
+            f = fopen(path, "wb");
+            if (f == NULL || fwrite(buf, 1, size, f) != size)
+                res = FPC_BEP_RESULT_IO_ERROR;
+            if (f)
+                fclose(f);
+        }
+    } else {
+        f = fopen(path, "rb");
+        if (f) {
+            size = fread(buf, 1, TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE, f);
+            fclose(f);
+        }
+        if (size == 0) {
+            res = FPC_BEP_RESULT_IO_ERROR;
+        } else {
+            res = bep_template_put(chain, buf, size);
+        }
+    }
+    fprintf(out, ",\"bytes\":%u", size);
+    free(buf);
+    return res;
+}
+
+/* CPU time of the process. Time BM-Lite is busy is not included */
+static uint64_t cpu_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static fpc_bep_result_t step_image_get(HCP_comm_t *chain, const char *name, FILE *out)
+{
+    char path[IMAGE_EXPORT_PATH_MAX];
+    image_geometry_t geometry;
+    uint32_t size = 0;
+    uint8_t *buf;
+    fpc_bep_result_t res;
+
+    res = bep_image_get_size(chain, &size);
+    if (res != FPC_BEP_RESULT_OK || chain->bep_result != FPC_BEP_RESULT_OK)
+        return res;
+    buf = malloc(size);
+    if (buf == NULL)
+        return FPC_BEP_RESULT_NO_MEMORY;
+
+    res = bep_image_get(chain, buf, size);
+    if (res == FPC_BEP_RESULT_OK)
+        res = image_get_geometry(chain, size, &geometry);
+    if (res == FPC_BEP_RESULT_OK) {
+        snprintf(path, sizeof(path), "%s.pgm", name);
+        res = image_save(path, IMAGE_FORMAT_PGM, &geometry, buf);
+        fprintf(out, ",\"bytes\":%u,\"width\":%u,\"height\":%u,\"file\":", size,
+                geometry.width, geometry.height);
+        json_string(out, path);
+    }
+    free(buf);
+    return res;
+}
+
+static fpc_bep_result_t step_archive(HCP_comm_t *chain, bool backup, int argc, char **argv,
+        FILE *out)
+{
+    template_archive_stats_t stats = { 0 };
+    fpc_bep_result_t res;
+
+    if (backup) {
+        res = template_archive_backup(chain, argv[1], argc > 2 && argv[2][0] == 'z', &stats);
+    } else {
+        res = template_archive_restore(chain, argv[1], &stats);
+    }
+    fprintf(out, ",\"templates\":%u,\"raw_bytes\":%llu,\"stored_bytes\":%llu", stats.templates,
+            (unsigned long long)stats.raw_bytes, (unsigned long long)stats.stored_bytes);
+    return res;
+}
+
+/* Run one step. Step specific result fields are printed to out, benchmark reports to report */
+static fpc_bep_result_t run_step(HCP_comm_t *chain, int argc, char **argv, FILE *out,
+        FILE *report)
+{
+    const char *cmd = argv[0];
+
+    if (strcmp(cmd, "version") == 0) {
+        char version[100];
+        fpc_bep_result_t res;
+        memset(version, 0, sizeof(version));
+        res = bep_version(chain, version, sizeof(version) - 1);
+        fprintf(out, ",\"version\":");
+        json_string(out, version);
+        return res;
+    }
+    if (strcmp(cmd, "enroll") == 0)
+        return bep_enroll_finger(chain);
+    if (strcmp(cmd, "identify") == 0)
+        return step_identify(chain, argc, argv, out);
+    if (strcmp(cmd, "remove_all") == 0)
+        return bep_template_remove_all(chain);
+    if (strcmp(cmd, "reset") == 0)
+        return bep_sw_reset(chain);
+    if (strcmp(cmd, "list") == 0) {
+        fpc_bep_result_t res = bep_template_get_ids(chain);
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+            fprintf(out, ",\"ids\":[");
+            for (uint32_t i = 0; i < chain->arg.size / 2; i++) {
+                fprintf(out, "%s%u", i ? "," : "", *(uint16_t *)(chain->arg.data + i * 2));
+            }
+            fprintf(out, "]");
+        }
+        return res;
+    }
+    if (strcmp(cmd, "bench_ping") == 0)
+        return bench_ping(chain, argc > 1 ? atoi(argv[1]) : 1000, report);
+    if (strcmp(cmd, "bench_transfer") == 0)
+        return bench_transfer(chain, argc > 1 ? atoi(argv[1]) : 10, report);
+    if (strcmp(cmd, "bench_quality") == 0)
+        return bench_image_quality(chain, argc > 1 ? atoi(argv[1]) : 100, report);
+    if (strcmp(cmd, "bench_loss") == 0)
+        return bench_loss(chain, argc > 1 ? atoi(argv[1]) : 20, argc > 2 ? atoi(argv[2]) : 0,
+                report);
+    if (strcmp(cmd, "bench_wedge") == 0)
+        return bench_wedge(chain, argc > 1 ? atoi(argv[1]) : 3, report);
+    if (strcmp(cmd, "bench_ready") == 0)
+        return bench_ready(chain, argc > 1 ? atoi(argv[1]) : 20, report);
+    if (strcmp(cmd, "bench_touch") == 0)
+        return bench_touch(chain, argc > 1 ? atoi(argv[1]) : 20, argc > 2 ? atoi(argv[2]) : 500,
+                argc > 3 ? atoi(argv[3]) : 150, report);
+    if (strcmp(cmd, "capture") == 0) {
+        uint32_t timeout = argc > 1 ? atoi(argv[1]) : 0;
+        uint32_t prev_timeout = chain->phy_rx_timeout;
+        fpc_bep_result_t res;
+        if (timeout > 0)
+            chain->phy_rx_timeout = timeout;
+        res = bep_capture(chain, timeout);
+        chain->phy_rx_timeout = prev_timeout;
+        return res;
+    }
+
+    /* Commands with mandatory argument */
+    fpc_bep_result_t res = argc < 2 ? FPC_BEP_RESULT_INVALID_ARGUMENT : FPC_BEP_RESULT_OK;
+    if (strcmp(cmd, "save") == 0)
+        return res ? res : bep_template_save(chain, atoi(argv[1]));
+    if (strcmp(cmd, "remove") == 0)
+        return res ? res : bep_template_remove(chain, atoi(argv[1]));
+    if (strcmp(cmd, "template_get") == 0 || strcmp(cmd, "template_put") == 0)
+        return res ? res : step_template_file(chain, cmd[9] == 'g', argv[1], out);
+    if (strcmp(cmd, "image_get") == 0)
+        return res ? res : step_image_get(chain, argv[1], out);
+    if (strcmp(cmd, "backup") == 0 || strcmp(cmd, "restore") == 0)
+        return res ? res : step_archive(chain, cmd[0] == 'b', argc, argv, out);
+
+    return FPC_BEP_RESULT_NOT_SUPPORTED;
+}
+
+/* Recover wedged BM-Lite before next step */
+static void check_watchdog(HCP_comm_t *chain, FILE *out)
+{
+    bmlite_watchdog_t *wd = chain->watchdog;
+    bmlite_watchdog_step_t step;
+    fpc_bep_result_t res;
+
+    if (wd == NULL || !wd->tripped)
+        return;
+    res = bmlite_watchdog_recover(wd, &step);
+    fprintf(out, "{\"watchdog\":true,\"result\":%d", res);
+    if (res == FPC_BEP_RESULT_OK)
+        fprintf(out, ",\"step\":\"%s\",\"down_us\":%u", bmlite_watchdog_step_name(step),
+                wd->stats.down_us_last);
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+fpc_bep_result_t batch_script_run(HCP_comm_t *chain, char *const *steps, int count,
+        bool keep_going, FILE *out, batch_script_stats_t *stats)
+{
+    fpc_bep_result_t first_error = FPC_BEP_RESULT_OK;
+    hal_tick_t start = hal_timebase_get_tick();
+    // Benchmark reports are text, stdout carries JSON lines only if results go there
+    FILE *report = out == stdout ? stderr : stdout;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i < count; i++) {
+        char line[BATCH_SCRIPT_LINE_MAX];
+        char *argv[STEP_ARGS_MAX];
+        char *save = NULL;
+        int argc = 0;
+        fpc_bep_result_t res;
+
+        snprintf(line, sizeof(line), "%s", steps[i]);
+        for (char *t = strtok_r(line, " \t\r\n", &save); t && argc < STEP_ARGS_MAX;
+                t = strtok_r(NULL, " \t\r\n", &save)) {
+            argv[argc++] = t;
+        }
+        if (argc == 0)
+            continue;
+
+        stats->steps++;
+        /* Step fields are collected first, so SDK debug output can't split the line */
+        char *fields = NULL;
+        size_t fields_size = 0;
+        FILE *step_out = open_memstream(&fields, &fields_size);
+        if (step_out == NULL)
+            return FPC_BEP_RESULT_NO_MEMORY;
+
+        chain->bep_result = FPC_BEP_RESULT_OK;
+        uint64_t step_start = bench_time_us();
+        uint64_t step_cpu = cpu_time_us();
+        res = run_step(chain, argc, argv, step_out, report);
+        uint32_t step_us = (uint32_t)(bench_time_us() - step_start);
+        step_cpu = cpu_time_us() - step_cpu;
+        fclose(step_out);
+
+        fprintf(out, "{\"step\":%u,\"cmd\":", stats->steps);
+        json_string(out, steps[i]);
+        fprintf(out, "%s,\"result\":%d,\"bep_result\":%d,\"us\":%u,\"cpu_us\":%u}\n", fields,
+                res, chain->bep_result, step_us, (uint32_t)step_cpu);
+        fflush(out);
+        free(fields);
+        check_watchdog(chain, out);
+
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result != FPC_BEP_RESULT_OK)
+            res = chain->bep_result;
+        if (res != FPC_BEP_RESULT_OK) {
+            stats->failed++;
+            if (first_error == FPC_BEP_RESULT_OK)
+                first_error = res;
+            if (!keep_going)
+                break;
+        }
+    }
+
+    stats->elapsed_ms = (uint32_t)(hal_timebase_get_tick() - start);
+    fprintf(out, "{\"summary\":true,\"steps\":%u,\"failed\":%u,\"ms\":%u}\n", stats->steps,
+            stats->failed, stats->elapsed_ms);
+    fflush(out);
+    return first_error;
+}
+
+fpc_bep_result_t batch_script_run_file(HCP_comm_t *chain, const char *path, bool keep_going,
+        FILE *out, batch_script_stats_t *stats)
+{
+    char line[BATCH_SCRIPT_LINE_MAX];
+    char **steps = NULL;
+    int count = 0;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *s = line + strspn(line, " \t");
+        s[strcspn(s, "\r\n")] = 0;
+        if (*s == 0 || *s == '#')
+            continue;
+        char **grown = realloc(steps, (count + 1) * sizeof(char *));
+        if (grown == NULL || (grown[count] = strdup(s)) == NULL) {
+            steps = grown ? grown : steps;
+            res = FPC_BEP_RESULT_NO_MEMORY;
+            break;
+        }
+        steps = grown;
+        count++;
+    }
+    fclose(f);
+
+    if (res == FPC_BEP_RESULT_OK)
+        res = batch_script_run(chain, steps, count, keep_going, out, stats);
+    for (int i = 0; i < count; i++)
+        free(steps[i]);
+    free(steps);
+    return res;
+}
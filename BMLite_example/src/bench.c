@@ -0,0 +1,890 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bench.c
+ * @brief   Latency measurement helpers for BM-Lite example
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "bench.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+#include "platform_rpi.h"
+#include "template_gallery.h"
+#include "image_export.h"
+#include "bmlite_image_quality.h"
+#include "bmlite_power.h"
+#include "bmlite_continuous.h"
+#include "bmlite_watchdog.h"
+
+/** Finger key of emulated gallery template */
+#define GALLERY_KEY(i) (0x1000 + (i))
+/** Finger key and storage slot of touch benchmark user */
+#define TOUCH_KEY 0x2000
+#define TOUCH_ID 0
+/** Fixed wait after match replaced by bep_wait_ready() (msec) */
+#define READY_DELAY 50
+/** Wedge benchmark gives up on BM-Lite not answering (usec) */
+#define BENCH_WEDGE_GIVE_UP_US 20000000
+
+uint64_t bench_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, double p)
+{
+    uint32_t i = (uint32_t)(p * (n - 1) + 0.5);
+
+    return sorted[i < n ? i : n - 1];
+}
+
+void bench_report(const char *name, uint32_t *samples, uint32_t count, FILE *out)
+{
+    if (count == 0) {
+        return;
+    }
+    qsort(samples, count, sizeof(*samples), cmp_u32);
+    fprintf(out, "%-10s (us): p50 %u, p99 %u, max %u\n", name, percentile(samples, count, 0.5),
+            percentile(samples, count, 0.99), samples[count - 1]);
+}
+
+fpc_bep_result_t bench_ping(HCP_comm_t *chain, uint32_t count, FILE *out)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    char version[100];
+    uint32_t *rtt;
+    uint32_t n;
+
+    if (count == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    rtt = malloc(count * sizeof(*rtt));
+    if (rtt == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    for (n = 0; n < count; n++) {
+        uint64_t start = bench_time_us();
+        res = bep_version(chain, version, sizeof(version) - 1);
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        rtt[n] = (uint32_t)(bench_time_us() - start);
+    }
+
+    if (n > 0) {
+        qsort(rtt, n, sizeof(*rtt), cmp_u32);
+        fprintf(out, "Round trip of %u requests (us): p50 %u, p99 %u, p99.9 %u, max %u\n", n,
+                percentile(rtt, n, 0.5), percentile(rtt, n, 0.99),
+                percentile(rtt, n, 0.999), rtt[n - 1]);
+    }
+
+    free(rtt);
+    return res;
+}
+
+/* Run one transfer count times, print p50 and throughput */
+static fpc_bep_result_t transfer_report(HCP_comm_t *chain, const char *name, bool upload,
+        bool image, uint8_t *data, uint32_t size, uint32_t *samples, uint32_t count, FILE *out)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t n, p50;
+
+    for (n = 0; n < count; n++) {
+        uint64_t start = bench_time_us();
+        if (image) {
+            res = upload ? bep_image_get(chain, data, size) : bep_image_put(chain, data, size);
+        } else {
+            res = upload ? bep_template_get(chain, data, size) :
+                    bep_template_put(chain, data, size);
+        }
+        if (res == FPC_BEP_RESULT_OK && chain->bep_result != FPC_BEP_RESULT_OK) {
+            res = chain->bep_result;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        samples[n] = (uint32_t)(bench_time_us() - start);
+    }
+    if (n > 0) {
+        qsort(samples, n, sizeof(*samples), cmp_u32);
+        p50 = percentile(samples, n, 0.5);
+        fprintf(out, "%-18s %6u %6u %9.2f %9.2f %9.1f\n", name, size, n, p50 / 1000.0,
+                samples[n - 1] / 1000.0, p50 ? size * 1000.0 / p50 : 0.0);
+    }
+    return res;
+}
+
+fpc_bep_result_t bench_transfer(HCP_comm_t *chain, uint32_t count, FILE *out)
+{
+    fpc_bep_result_t res;
+    uint32_t *samples;
+    uint8_t *buf;
+    uint32_t size;
+
+    if (count == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    res = bep_image_get_size(chain, &size);
+    if (res == FPC_BEP_RESULT_OK && (size == 0 || size > UINT16_MAX)) {
+        res = FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        fprintf(out, "Transfer benchmark needs captured image\n");
+        return res;
+    }
+    samples = malloc(count * sizeof(*samples));
+    buf = malloc(UINT16_MAX);
+    if (samples == NULL || buf == NULL) {
+        free(samples);
+        free(buf);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    fprintf(out, "%-18s %6s %6s %9s %9s %9s\n", "transfer", "bytes", "runs", "p50 ms", "max ms",
+            "kB/s");
+    res = transfer_report(chain, "image upload", true, true, buf, size, samples, count, out);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = transfer_report(chain, "image download", false, true, buf, size, samples,
+                count, out);
+    }
+    // Template rows only if there is a template in RAM
+    if (res == FPC_BEP_RESULT_OK &&
+            bep_template_get(chain, buf, UINT16_MAX) == FPC_BEP_RESULT_OK &&
+            chain->bep_result == FPC_BEP_RESULT_OK) {
+        size = chain->arg.size;
+        res = transfer_report(chain, "template upload", true, false, buf, size, samples,
+                count, out);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = transfer_report(chain, "template download", false, false, buf, size, samples,
+                    count, out);
+        }
+    }
+    chain->bep_result = FPC_BEP_RESULT_OK;
+
+    free(buf);
+    free(samples);
+    return res;
+}
+
+fpc_bep_result_t bench_power(HCP_comm_t *chain, uint32_t cycles, FILE *out)
+{
+    static const char *const names[BMLITE_POWER_MODES] = {
+        "active", "idle", "sleep", "deep sleep"
+    };
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t *wake;
+    uint32_t *identify;
+    uint32_t n = 0;
+
+    if (cycles == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    wake = malloc(cycles * sizeof(*wake));
+    identify = malloc(cycles * sizeof(*identify));
+    if (wake == NULL || identify == NULL) {
+        free(wake);
+        free(identify);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    for (int mode = BMLITE_POWER_ACTIVE; mode < BMLITE_POWER_MODES && res == FPC_BEP_RESULT_OK;
+            mode++) {
+        /* Only measured mode is used, entered right after 1 ms of idle */
+        bmlite_power_policy_t policy = { .enter_ms = { 0 } };
+        bmlite_power_t power;
+
+        policy.enter_ms[mode] = 1;
+        bmlite_power_init(&power, chain, &policy);
+        for (n = 0; n < cycles; n++) {
+            uint16_t template_id;
+            bool match;
+
+            hal_timebase_busy_wait(2);
+            res = bmlite_power_idle(&power);
+            if (res != FPC_BEP_RESULT_OK) {
+                break;
+            }
+            uint64_t start = bench_time_us();
+            res = bmlite_power_wake(&power);
+            if (res == FPC_BEP_RESULT_OK) {
+                wake[n] = power.stats[mode].wake_us_last;
+                res = bep_identify_finger(chain, 1000, &template_id, &match);
+            }
+            identify[n] = (uint32_t)(bench_time_us() - start);
+            bmlite_power_done(&power);
+            if (res != FPC_BEP_RESULT_OK) {
+                break;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        fprintf(out, "%s:\n", names[mode]);
+        if (mode != BMLITE_POWER_ACTIVE) {
+            bench_report("  wake", wake, n, out);
+        }
+        bench_report("  identify", identify, n, out);
+    }
+
+    if (res != FPC_BEP_RESULT_OK) {
+        fprintf(out, "Power mode failed with error %d after %u cycles\n", res, n);
+    }
+#ifdef BMLITE_USE_EMULATOR
+    if (rpi_emu_is_active()) {
+        fprintf(out, "Wake-up times are emulator constants, not BM-Lite measurements\n");
+    }
+#endif
+    free(wake);
+    free(identify);
+    return res;
+}
+
+fpc_bep_result_t bench_image_quality(HCP_comm_t *chain, uint32_t iterations, FILE *out)
+{
+    const bmlite_quality_params_t params = BMLITE_QUALITY_PARAMS_DEFAULT;
+    bmlite_image_sums_t scalar, simd;
+    bmlite_image_quality_t quality;
+    image_geometry_t geometry;
+    fpc_bep_result_t res;
+    uint64_t start, scalar_us, simd_us;
+    uint8_t *image;
+    uint32_t size;
+
+    if (iterations == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    res = bep_image_get_size(chain, &size);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    if (size == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    res = image_get_geometry(chain, size, &geometry);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    image = malloc(size);
+    if (image == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    res = bep_image_get(chain, image, size);
+    if (res != FPC_BEP_RESULT_OK) {
+        free(image);
+        return res;
+    }
+
+    start = bench_time_us();
+    for (uint32_t i = 0; i < iterations; i++) {
+        bmlite_image_sums_scalar(image, geometry.width, geometry.height, params.background, &scalar);
+    }
+    scalar_us = bench_time_us() - start;
+    start = bench_time_us();
+    for (uint32_t i = 0; i < iterations; i++) {
+        bmlite_image_sums(image, geometry.width, geometry.height, params.background, &simd);
+    }
+    simd_us = bench_time_us() - start;
+
+    fprintf(out, "Image %ux%u: scalar %.1f us, %s %.1f us per image, results %s\n",
+            geometry.width, geometry.height, (double)scalar_us / iterations,
+            bmlite_image_kernel_name(), (double)simd_us / iterations,
+            memcmp(&scalar, &simd, sizeof(scalar)) == 0 ? "equal" : "DIFFERENT");
+
+    if (bmlite_image_check(image, size, &params, &quality) == BMLITE_QUALITY_BAD_GEOMETRY) {
+        free(image);
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    fprintf(out, "Coverage %u%%, contrast %u, variance %u, sharpness %u.%02u\n", quality.coverage,
+            quality.contrast, quality.variance, quality.sharpness / 100, quality.sharpness % 100);
+
+    free(image);
+    return FPC_BEP_RESULT_OK;
+}
+
+#ifdef BMLITE_USE_EMULATOR
+
+/* 80% of identifies are made by 10% of users */
+static uint32_t pick_user(uint32_t count)
+{
+    uint32_t frequent = count / 10 ? count / 10 : 1;
+
+    return rand() % 10 < 8 ? rand() % frequent : rand() % count;
+}
+
+static fpc_bep_result_t bench_gallery_size(HCP_comm_t *chain, uint32_t capacity,
+        uint32_t size, uint32_t identifies, FILE *out)
+{
+    template_archive_item_t *items;
+    template_gallery_t gallery;
+    template_gallery_stats_t stats = { 0 };
+    rpi_emu_stats_t emu_before, emu_after;
+    fpc_bep_result_t res;
+    uint32_t *latency;
+    uint32_t n = 0;
+
+    items = calloc(size, sizeof(*items));
+    latency = malloc(identifies * sizeof(*latency));
+    if (items == NULL || latency == NULL) {
+        free(items);
+        free(latency);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        items[i].id = i;
+        items[i].size = EMU_TEMPLATE_SIZE;
+        items[i].data = malloc(EMU_TEMPLATE_SIZE);
+        if (items[i].data == NULL) {
+            template_archive_free(items, i);
+            free(latency);
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+        rpi_emu_make_template(GALLERY_KEY(i), items[i].data, EMU_TEMPLATE_SIZE);
+    }
+
+    res = template_gallery_init(&gallery, chain, items, size, capacity);
+    rpi_emu_get_stats(&emu_before);
+
+    for (n = 0; n < identifies && res == FPC_BEP_RESULT_OK; n++) {
+        uint32_t user = pick_user(size);
+        uint16_t id = 0;
+        bool match = false;
+        uint64_t start;
+
+        rpi_emu_set_finger(GALLERY_KEY(user));
+        res = bep_capture(chain, 0);
+        if (res == FPC_BEP_RESULT_OK) {
+            res = bep_image_extract(chain);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        start = bench_time_us();
+        res = template_gallery_identify(&gallery, &match, &id, &stats);
+        if (res == FPC_BEP_RESULT_OK && (!match || id != user)) {
+            fprintf(out, "Wrong identify result for user %u\n", user);
+            res = FPC_BEP_RESULT_GENERAL_ERROR;
+        }
+        latency[n] = (uint32_t)((bench_time_us() - start) / 1000);
+    }
+
+    rpi_emu_get_stats(&emu_after);
+
+    if (n > 0) {
+        qsort(latency, n, sizeof(*latency), cmp_u32);
+        fprintf(out, "%6u %6u %8u %8u %8.2f %8.2f %8.2f\n", size, n, percentile(latency, n, 0.5),
+                percentile(latency, n, 0.99), (double)stats.identifies / n,
+                (double)stats.paged / n,
+                (double)(emu_after.flash_writes - emu_before.flash_writes) / n);
+    }
+
+    template_gallery_destroy(&gallery);
+    template_archive_free(items, size);
+    free(latency);
+    return res;
+}
+
+fpc_bep_result_t bench_gallery(HCP_comm_t *chain, uint32_t capacity, uint32_t identifies,
+        FILE *out)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    /* Gallery sizes relative to capacity, in halves */
+    static const uint32_t scale[] = { 1, 2, 4, 8, 16 };
+
+    if (!rpi_emu_is_active()) {
+        fprintf(out, "Gallery benchmark needs emulated BM-Lite\n");
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+    if (capacity == 0 || identifies == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    fprintf(out, "Capacity %u slots\n", capacity);
+    fprintf(out, "%6s %6s %8s %8s %8s %8s %8s\n", "size", "runs", "p50 ms", "p99 ms",
+            "ident/op", "paged/op", "flash/op");
+    for (uint32_t i = 0; i < sizeof(scale) / sizeof(scale[0]) && res == FPC_BEP_RESULT_OK; i++) {
+        res = bench_gallery_size(chain, capacity, capacity * scale[i] / 2, identifies, out);
+    }
+    return res;
+}
+
+static uint64_t cpu_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+    uint32_t *latency;
+    uint32_t count;
+    uint32_t n;
+    uint32_t wrong;
+} touch_run_t;
+
+/* Latency from true touch start. Valid while decision comes within touch period */
+static uint32_t touch_latency(void)
+{
+    uint64_t now = bench_time_us();
+
+    return (uint32_t)(now - rpi_emu_get_touch_start(NULL, now));
+}
+
+static bool on_touch(const bmlite_touch_event_t *event, void *ctx)
+{
+    touch_run_t *run = ctx;
+
+    run->latency[run->n++] = touch_latency();
+    if (event->result != BMLITE_TOUCH_MATCH || event->template_id != TOUCH_ID) {
+        run->wrong++;
+    }
+    return run->n < run->count;
+}
+
+static void touch_report(const char *name, touch_run_t *run, uint64_t wall_us,
+        uint64_t cpu_us, FILE *out)
+{
+    bench_report(name, run->latency, run->n, out);
+    fprintf(out, "%-10s       %u touches, %u wrong, CPU %.2f%%\n", "", run->n, run->wrong,
+            wall_us ? 100.0 * cpu_us / wall_us : 0.0);
+}
+
+fpc_bep_result_t bench_touch(HCP_comm_t *chain, uint32_t touches, uint32_t period_ms,
+        uint32_t hold_ms, FILE *out)
+{
+    bmlite_continuous_params_t params = BMLITE_CONTINUOUS_PARAMS_DEFAULT;
+    bmlite_continuous_t engine;
+    uint8_t template[EMU_TEMPLATE_SIZE];
+    touch_run_t run = { 0 };
+    fpc_bep_result_t res;
+    uint64_t wall, cpu;
+
+    if (!rpi_emu_is_active()) {
+        fprintf(out, "Touch benchmark needs emulated BM-Lite\n");
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+    if (touches == 0 || period_ms == 0 || hold_ms == 0 || hold_ms >= period_ms) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    run.latency = malloc(touches * sizeof(*run.latency));
+    if (run.latency == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    rpi_emu_make_template(TOUCH_KEY, template, sizeof(template));
+    res = bep_template_remove_all(chain);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bep_template_put(chain, template, sizeof(template));
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bep_template_save(chain, TOUCH_ID);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+    fprintf(out, "Touch every %u ms, held for %u ms\n", period_ms, hold_ms);
+
+    // Identify and wait for lift with generic calls
+    run.count = touches;
+    rpi_emu_set_touch_pattern(NULL, TOUCH_KEY, period_ms, hold_ms);
+    wall = bench_time_us();
+    cpu = cpu_time_us();
+    for (run.n = 0; run.n < touches; ) {
+        uint16_t id = 0;
+        bool match = false;
+
+        res = bep_identify_finger(chain, 2 * period_ms, &id, &match);
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        run.latency[run.n++] = touch_latency();
+        if (!match || id != TOUCH_ID) {
+            run.wrong++;
+        }
+        res = sensor_wait_finger_not_present(chain, 0);
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+    }
+    touch_report("  generic", &run, bench_time_us() - wall, cpu_time_us() - cpu, out);
+    if (res != FPC_BEP_RESULT_OK) {
+        goto exit;
+    }
+
+    run.n = 0;
+    run.wrong = 0;
+    params.capture_timeout = period_ms;
+    bmlite_continuous_init(&engine, chain, &params, on_touch, NULL, &run);
+    rpi_emu_set_touch_pattern(NULL, TOUCH_KEY, period_ms, hold_ms);
+    wall = bench_time_us();
+    cpu = cpu_time_us();
+    res = bmlite_continuous_run(&engine);
+    touch_report("  engine", &run, bench_time_us() - wall, cpu_time_us() - cpu, out);
+    fprintf(out, "%-10s       %u idle re-arms\n", "", engine.stats.idle_rearms);
+
+exit:
+    rpi_emu_set_touch_pattern(NULL, 0, 0, 0);
+    free(run.latency);
+    return res;
+}
+
+/* Version request repeated until it succeeds. Returns time taken (usec) */
+static fpc_bep_result_t ping_until_ok(HCP_comm_t *chain, uint32_t attempts, uint32_t *us)
+{
+    char version[100];
+    uint64_t start = bench_time_us();
+    fpc_bep_result_t res = FPC_BEP_RESULT_IO_ERROR;
+
+    while (attempts-- && res != FPC_BEP_RESULT_OK) {
+        res = bep_version(chain, version, sizeof(version) - 1);
+    }
+    *us = (uint32_t)(bench_time_us() - start);
+    return res;
+}
+
+/* Enroll start with lost ACK and link retries must run once and fail */
+static fpc_bep_result_t loss_ack_check(HCP_comm_t *chain, FILE *out)
+{
+    rpi_emu_stats_t before;
+    rpi_emu_stats_t after;
+    fpc_bep_result_t res;
+    uint32_t runs;
+    uint32_t clean;
+
+    chain->link_retries = 2;
+    rpi_emu_get_stats(&before);
+    rpi_emu_drop_acks(NULL, 1);
+    res = bep_enroll_start(chain);
+    rpi_emu_get_stats(&after);
+    runs = after.commands - before.commands;
+    fprintf(out, "%-10s enroll start %s, run %u times\n", "lost ACK",
+            res == FPC_BEP_RESULT_OK ? "succeeded" : "failed", runs);
+    if (runs != 1) {
+        fprintf(out, "Enroll start run again after lost ACK\n");
+        return FPC_BEP_RESULT_GENERAL_ERROR;
+    }
+    // Link works after the failed command
+    return ping_until_ok(chain, 1, &clean);
+}
+
+fpc_bep_result_t bench_loss(HCP_comm_t *chain, uint32_t count, uint32_t floor_ms, FILE *out)
+{
+    static const struct {
+        const char *name;
+        uint32_t ack_ms;
+        uint32_t body_ms;
+        uint8_t retries;
+    } modes[] = {
+        { "fixed", HCP_ACK_TIMEOUT_INIT, HCP_BODY_TIMEOUT_INIT, 0 },
+        { "adaptive", 0, 0, 0 },
+        { "retry", 0, 0, 2 },
+    };
+    HCP_rto_t ack_rto = chain->ack_rto;
+    HCP_rto_t body_rto = chain->body_rto;
+    uint8_t link_retries = chain->link_retries;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t *recovery;
+    uint32_t clean;
+
+    if (!rpi_emu_is_active()) {
+        fprintf(out, "Loss benchmark needs emulated BM-Lite\n");
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+    if (count == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    recovery = malloc(count * sizeof(*recovery));
+    if (recovery == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    fprintf(out, "Version request with one lost frame, %u times\n", count);
+    for (uint32_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && res == FPC_BEP_RESULT_OK; m++) {
+        uint32_t min = modes[m].ack_ms ? modes[m].ack_ms : floor_ms;
+
+        chain->ack_rto = (HCP_rto_t){ .min = min, .max = modes[m].ack_ms };
+        min = modes[m].body_ms ? modes[m].body_ms : floor_ms;
+        chain->body_rto = (HCP_rto_t){ .min = min, .max = modes[m].body_ms };
+        chain->link_retries = modes[m].retries;
+
+        // Let timeouts learn round trips of healthy link
+        for (uint32_t i = 0; i < 20 && res == FPC_BEP_RESULT_OK; i++) {
+            res = ping_until_ok(chain, 1, &clean);
+        }
+        for (uint32_t n = 0; n < count && res == FPC_BEP_RESULT_OK; n++) {
+            rpi_emu_drop_frames(NULL, 1);
+            // Command failed by lost frame is issued again by application
+            res = ping_until_ok(chain, 3, &recovery[n]);
+            if (res == FPC_BEP_RESULT_OK) {
+                res = ping_until_ok(chain, 1, &clean);
+            }
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        fprintf(out, "%-10s ACK timeout %u ms, body timeout %u ms per MTU, clean request %u us\n",
+                modes[m].name, chain->ack_rto.timeout, chain->body_rto.timeout, clean);
+        bench_report(modes[m].name, recovery, count, out);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = loss_ack_check(chain, out);
+    }
+
+    chain->ack_rto = ack_rto;
+    chain->body_rto = body_rto;
+    chain->link_retries = link_retries;
+    free(recovery);
+    return res;
+}
+
+fpc_bep_result_t bench_wedge(HCP_comm_t *chain, uint32_t count, FILE *out)
+{
+    static const struct {
+        const char *name;
+        rpi_emu_wedge_t wedge;
+    } wedges[] = {
+        { "silent", RPI_EMU_WEDGE_SILENT },
+        { "crc", RPI_EMU_WEDGE_CRC },
+        { "nak", RPI_EMU_WEDGE_NAK },
+    };
+    /* Command curing the wedge, by recovery step expected to bring BM-Lite back */
+    static const uint16_t cures[BMLITE_WATCHDOG_STEPS] = {
+        CMD_CANCEL, CMD_RESET, CMD_SENSOR, 0,
+    };
+    const bmlite_watchdog_config_t config = BMLITE_WATCHDOG_CONFIG_DEFAULT;
+    struct bmlite_watchdog *prev_watchdog = chain->watchdog;
+    bmlite_watchdog_t wd;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t *down;
+    uint32_t clean;
+
+    if (!rpi_emu_is_active()) {
+        fprintf(out, "Wedge benchmark needs emulated BM-Lite\n");
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+    if (count == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    down = malloc(count * sizeof(*down));
+    if (down == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    bmlite_watchdog_init(&wd, chain, &config);
+    fprintf(out, "Version requests to wedged BM-Lite until watchdog recovers it, %u times\n", count);
+    for (uint32_t w = 0; w < sizeof(wedges) / sizeof(wedges[0]) && res == FPC_BEP_RESULT_OK; w++) {
+        for (int cure = 0; cure < BMLITE_WATCHDOG_STEPS && res == FPC_BEP_RESULT_OK; cure++) {
+            bmlite_watchdog_step_t step = BMLITE_WATCHDOG_CANCEL;
+            uint32_t wrong_step = 0;
+            char name[32];
+
+            // Let timeouts learn round trips of healthy link
+            for (uint32_t i = 0; i < 20 && res == FPC_BEP_RESULT_OK; i++) {
+                res = ping_until_ok(chain, 1, &clean);
+            }
+            for (uint32_t n = 0; n < count && res == FPC_BEP_RESULT_OK; n++) {
+                uint64_t start = bench_time_us();
+
+                rpi_emu_wedge(NULL, wedges[w].wedge, cures[cure]);
+                do {
+                    res = ping_until_ok(chain, 1, &clean);
+                    if (res != FPC_BEP_RESULT_OK && wd.tripped &&
+                            bmlite_watchdog_recover(&wd, &step) == FPC_BEP_RESULT_OK) {
+                        wrong_step += step != (bmlite_watchdog_step_t)cure;
+                    }
+                } while (res != FPC_BEP_RESULT_OK &&
+                        bench_time_us() - start < BENCH_WEDGE_GIVE_UP_US);
+                down[n] = wd.stats.down_us_last;
+            }
+            if (res != FPC_BEP_RESULT_OK) {
+                fprintf(out, "%s wedge not recovered by %s\n", wedges[w].name,
+                        bmlite_watchdog_step_name(cure));
+                break;
+            }
+            snprintf(name, sizeof(name), "%s/%s", wedges[w].name, bmlite_watchdog_step_name(cure));
+            bench_report(name, down, count, out);
+            if (wrong_step) {
+                fprintf(out, "%-10s       %u recovered by other step\n", "", wrong_step);
+            }
+        }
+    }
+
+    fprintf(out, "Faults:");
+    for (int f = 0; f < BMLITE_WATCHDOG_FAULTS; f++) {
+        fprintf(out, " %s %u", bmlite_watchdog_fault_name(f), wd.stats.faults[f]);
+    }
+    fprintf(out, "\nTrips %u, failed %u, MTTR %u us\n", wd.stats.trips, wd.stats.failed,
+            bmlite_watchdog_mttr_us(&wd));
+
+    bmlite_watchdog_detach(&wd);
+    chain->watchdog = prev_watchdog;
+    free(down);
+    return res;
+}
+
+fpc_bep_result_t bench_ready(HCP_comm_t *chain, uint32_t count, FILE *out)
+{
+    static const char *const names[] = { "fixed", "ready" };
+    uint8_t template[EMU_TEMPLATE_SIZE];
+    fpc_bep_result_t res;
+    char version[100];
+    uint32_t *latency;
+
+    if (!rpi_emu_is_active()) {
+        fprintf(out, "Ready benchmark needs emulated BM-Lite\n");
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+    if (count == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    latency = malloc(count * sizeof(*latency));
+    if (latency == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    rpi_emu_make_template(TOUCH_KEY, template, sizeof(template));
+    res = bep_template_remove_all(chain);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bep_template_put(chain, template, sizeof(template));
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = bep_template_save(chain, TOUCH_ID);
+    }
+    rpi_emu_set_finger(TOUCH_KEY);
+    fprintf(out, "Matching identify to next command, %u times\n", count);
+
+    // Old fixed delay after match, then wait for readiness
+    for (uint32_t mode = 0; mode < 2 && res == FPC_BEP_RESULT_OK; mode++) {
+        uint32_t n;
+
+        for (n = 0; n < count && res == FPC_BEP_RESULT_OK; n++) {
+            uint64_t start;
+
+            res = bep_capture(chain, 0);
+            if (res == FPC_BEP_RESULT_OK) {
+                res = bep_image_extract(chain);
+            }
+            if (res == FPC_BEP_RESULT_OK) {
+                res = bep_identify(chain);
+            }
+            if (res != FPC_BEP_RESULT_OK) {
+                break;
+            }
+            start = bench_time_us();
+            if (mode == 0) {
+                hal_timebase_busy_wait(READY_DELAY);
+            } else {
+                bep_wait_ready(chain, READY_DELAY);
+            }
+            res = bep_version(chain, version, sizeof(version) - 1);
+            latency[n] = (uint32_t)(bench_time_us() - start);
+        }
+        bench_report(names[mode], latency, n, out);
+    }
+
+    free(latency);
+    return res;
+}
+#else
+
+static fpc_bep_result_t no_emulator(const char *name, FILE *out)
+{
+    fprintf(out, "%s benchmark needs emulated BM-Lite, build with make USE_EMULATOR=1\n", name);
+    return FPC_BEP_RESULT_NOT_SUPPORTED;
+}
+
+fpc_bep_result_t bench_gallery(HCP_comm_t *chain, uint32_t capacity, uint32_t identifies,
+        FILE *out)
+{
+    return no_emulator("Gallery", out);
+}
+
+fpc_bep_result_t bench_touch(HCP_comm_t *chain, uint32_t touches, uint32_t period_ms,
+        uint32_t hold_ms, FILE *out)
+{
+    return no_emulator("Touch", out);
+}
+
+fpc_bep_result_t bench_loss(HCP_comm_t *chain, uint32_t count, uint32_t floor_ms, FILE *out)
+{
+    return no_emulator("Loss", out);
+}
+
+fpc_bep_result_t bench_wedge(HCP_comm_t *chain, uint32_t count, FILE *out)
+{
+    return no_emulator("Wedge", out);
+}
+
+fpc_bep_result_t bench_ready(HCP_comm_t *chain, uint32_t count, FILE *out)
+{
+    return no_emulator("Ready", out);
+}
+
+#endif /* BMLITE_USE_EMULATOR */
+
+static void *cpu_hog(void *arg)
+{
+    volatile uint32_t x = 0;
+
+    (void)arg;
+    while (1) {
+        x++;
+    }
+    return NULL;
+}
+
+void bench_cpu_hog_start(int threads)
+{
+    pthread_attr_t attr;
+    struct sched_param sp;
+    pthread_t tid;
+
+    memset(&sp, 0, sizeof(sp));
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &sp);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tid, &attr, cpu_hog, NULL) != 0) {
+            fprintf(stderr, "Can't start CPU load thread\n");
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
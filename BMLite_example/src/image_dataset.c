@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    image_dataset.c
+ * @brief   Sets of recorded images and their read-ahead
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "image_dataset.h"
+
+static image_dataset_entry_t *add_entry(image_dataset_t *ds, uint32_t *allocated,
+        const char *path, int32_t label)
+{
+    image_dataset_entry_t *e;
+
+    if (ds->count == *allocated) {
+        uint32_t n = *allocated ? *allocated * 2 : 64;
+        e = realloc(ds->entries, n * sizeof(*e));
+        if (e == NULL) {
+            return NULL;
+        }
+        ds->entries = e;
+        *allocated = n;
+    }
+    e = &ds->entries[ds->count++];
+    snprintf(e->path, IMAGE_DATASET_PATH_MAX, "%s", path);
+    e->label = label;
+    e->offset = 0;
+    e->length = 0;
+    return e;
+}
+
+static int32_t name_label(const char *name)
+{
+    const char *p = name;
+
+    while (isdigit((unsigned char)*p)) {
+        p++;
+    }
+    return p != name && *p == '_' ? atoi(name) : -1;
+}
+
+static int compare_path(const void *a, const void *b)
+{
+    return strcmp(((const image_dataset_entry_t *)a)->path,
+            ((const image_dataset_entry_t *)b)->path);
+}
+
+static fpc_bep_result_t open_dir(image_dataset_t *ds, const char *path)
+{
+    char file[IMAGE_DATASET_PATH_MAX];
+    uint32_t allocated = 0;
+    struct dirent *d;
+    struct stat st;
+    DIR *dir = opendir(path);
+
+    if (dir == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.') {
+            continue;
+        }
+        if (snprintf(file, sizeof(file), "%s/%s", path, d->d_name) >= (int)sizeof(file) ||
+                stat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (add_entry(ds, &allocated, file, name_label(d->d_name)) == NULL) {
+            closedir(dir);
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+    }
+    closedir(dir);
+
+    qsort(ds->entries, ds->count, sizeof(*ds->entries), compare_path);
+    return FPC_BEP_RESULT_OK;
+}
+
+/* ustar header: member name, size in octal, type, magic, name prefix */
+#define TAR_BLOCK 512
+#define TAR_NAME 0
+#define TAR_NAME_SIZE 100
+#define TAR_SIZE 124
+#define TAR_SIZE_SIZE 12
+#define TAR_TYPE 156
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+#define TAR_PREFIX_SIZE 155
+
+static bool tar_header(const uint8_t *h)
+{
+    return memcmp(h + TAR_MAGIC, "ustar", 5) == 0;
+}
+
+static bool tar_size(const uint8_t *h, long *size)
+{
+    long v = 0;
+
+    for (int i = 0; i < TAR_SIZE_SIZE && h[TAR_SIZE + i] != 0 && h[TAR_SIZE + i] != ' '; i++) {
+        uint8_t c = h[TAR_SIZE + i];
+        if (c < '0' || c > '7' || v > (LONG_MAX >> 3)) {
+            return false;
+        }
+        v = v * 8 + (c - '0');
+    }
+    *size = v;
+    return true;
+}
+
+static fpc_bep_result_t open_tar(image_dataset_t *ds, const char *path, FILE *f)
+{
+    uint8_t h[TAR_BLOCK];
+    char name[TAR_PREFIX_SIZE + TAR_NAME_SIZE + 2];
+    uint32_t allocated = 0;
+    long offset = 0, end, length;
+
+    if (snprintf(ds->archive, sizeof(ds->archive), "%s", path) >= (int)sizeof(ds->archive)) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (end = ftell(f)) < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    while (offset + TAR_BLOCK <= end) {
+        if (fseek(f, offset, SEEK_SET) != 0 || fread(h, 1, TAR_BLOCK, f) != TAR_BLOCK) {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+        if (h[0] == 0) {
+            // End of archive
+            break;
+        }
+        offset += TAR_BLOCK;
+        if (!tar_header(h) || !tar_size(h, &length) || length > end - offset) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+        if (h[TAR_TYPE] == '0' || h[TAR_TYPE] == 0) {
+            const char *base;
+            image_dataset_entry_t *e;
+
+            // Name and prefix are not terminated when full
+            if (h[TAR_PREFIX]) {
+                snprintf(name, sizeof(name), "%.*s/%.*s", TAR_PREFIX_SIZE,
+                        (const char *)h + TAR_PREFIX, TAR_NAME_SIZE, (const char *)h + TAR_NAME);
+            } else {
+                snprintf(name, sizeof(name), "%.*s", TAR_NAME_SIZE, (const char *)h + TAR_NAME);
+            }
+            if (strlen(name) >= IMAGE_DATASET_PATH_MAX) {
+                return FPC_BEP_RESULT_INVALID_FORMAT;
+            }
+            base = strrchr(name, '/');
+            base = base ? base + 1 : name;
+            if (base[0] && base[0] != '.') {
+                e = add_entry(ds, &allocated, name, name_label(base));
+                if (e == NULL) {
+                    return FPC_BEP_RESULT_NO_MEMORY;
+                }
+                e->offset = offset;
+                e->length = length;
+            }
+        }
+        offset += (length + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+
+    qsort(ds->entries, ds->count, sizeof(*ds->entries), compare_path);
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t open_list(image_dataset_t *ds, FILE *f)
+{
+    char line[IMAGE_DATASET_PATH_MAX + 32];
+    uint32_t allocated = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t n = strcspn(line, "\n");
+        char *path = line, *label, *stop;
+        long value;
+
+        if (line[n] != '\n' && !feof(f)) {
+            // Longer than any path with label
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+        // Label is the last field, path is everything before it
+        while (n > 0 && isspace((unsigned char)line[n - 1])) {
+            n--;
+        }
+        line[n] = 0;
+        label = line + n;
+        while (label > line && !isspace((unsigned char)label[-1])) {
+            label--;
+        }
+        stop = label;
+        while (stop > line && isspace((unsigned char)stop[-1])) {
+            stop--;
+        }
+        *stop = 0;
+        while (isspace((unsigned char)*path)) {
+            path++;
+        }
+        if (path[0] == '#' || path[0] == 0 || label[0] == 0) {
+            continue;
+        }
+        value = strtol(label, &stop, 10);
+        if (*stop != 0) {
+            continue;
+        }
+        if (strlen(path) >= IMAGE_DATASET_PATH_MAX) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+        if (add_entry(ds, &allocated, path, value) == NULL) {
+            return FPC_BEP_RESULT_NO_MEMORY;
+        }
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t image_dataset_open(image_dataset_t *dataset, const char *path)
+{
+    uint8_t h[TAR_BLOCK];
+    struct stat st;
+    fpc_bep_result_t res;
+    FILE *f;
+
+    memset(dataset, 0, sizeof(*dataset));
+    if (stat(path, &st) != 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        res = open_dir(dataset, path);
+    } else if ((f = fopen(path, "rb")) == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    } else {
+        if (fread(h, 1, TAR_BLOCK, f) == TAR_BLOCK && tar_header(h)) {
+            res = open_tar(dataset, path, f);
+        } else {
+            rewind(f);
+            res = open_list(dataset, f);
+        }
+        fclose(f);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        image_dataset_close(dataset);
+    }
+    return res;
+}
+
+void image_dataset_close(image_dataset_t *dataset)
+{
+    free(dataset->entries);
+    dataset->entries = NULL;
+    dataset->count = 0;
+}
+
+/* Skip PGM header whitespace and comments */
+static int pgm_skip(FILE *f)
+{
+    int c;
+
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(f)) != EOF && c != '\n') {
+            }
+        } else if (!isspace(c)) {
+            ungetc(c, f);
+            break;
+        }
+    }
+    return c;
+}
+
+static bool pgm_number(FILE *f, unsigned *value)
+{
+    return pgm_skip(f) != EOF && fscanf(f, "%u", value) == 1;
+}
+
+/* Read image of length bytes from current position of f */
+static fpc_bep_result_t load_stream(FILE *f, long length, uint8_t **image, uint32_t *size)
+{
+    unsigned width, height, maxval;
+    uint8_t magic[2];
+    uint32_t pixels;
+    long start = ftell(f), pos;
+
+    if (start < 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (length >= 2 && fread(magic, 1, 2, f) == 2 && magic[0] == 'P' && magic[1] == '5') {
+        if (!pgm_number(f, &width) || !pgm_number(f, &height) || !pgm_number(f, &maxval) ||
+                maxval > 255 || width == 0 || height == 0 ||
+                __builtin_mul_overflow(width, height, &pixels) ||
+                pixels > IMAGE_DATASET_PIXELS_MAX) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+        // Single whitespace separates header and pixels
+        fgetc(f);
+        // Pixels must be within the file or archive member
+        if ((pos = ftell(f)) < 0 || pixels > length - (pos - start)) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+    } else {
+        if (length <= 0 || length > IMAGE_DATASET_PIXELS_MAX) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+        if (fseek(f, start, SEEK_SET) != 0) {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+        pixels = length;
+    }
+
+    *image = malloc(pixels);
+    if (*image == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    if (fread(*image, 1, pixels, f) != pixels) {
+        free(*image);
+        *image = NULL;
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    *size = pixels;
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t image_load(const char *path, uint8_t **image, uint32_t *size)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_IO_ERROR;
+    long length;
+    FILE *f = fopen(path, "rb");
+
+    *image = NULL;
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        res = load_stream(f, length, image, size);
+    }
+    fclose(f);
+    return res;
+}
+
+fpc_bep_result_t image_dataset_load(const image_dataset_t *dataset,
+        const image_dataset_entry_t *entry, uint8_t **image, uint32_t *size)
+{
+    fpc_bep_result_t res = FPC_BEP_RESULT_IO_ERROR;
+    FILE *f;
+
+    if (dataset->archive[0] == 0) {
+        return image_load(entry->path, image, size);
+    }
+    *image = NULL;
+    f = fopen(dataset->archive, "rb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (fseek(f, entry->offset, SEEK_SET) == 0) {
+        res = load_stream(f, entry->length, image, size);
+    }
+    fclose(f);
+    return res;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    image_prefetch_t *p = arg;
+
+    for (uint32_t i = 0; i < p->dataset->count; i++) {
+        image_dataset_item_t *item = calloc(1, sizeof(*item));
+        if (item == NULL) {
+            // Consumer must not take truncated dataset for whole one
+            p->result = FPC_BEP_RESULT_NO_MEMORY;
+            break;
+        }
+        item->entry = &p->dataset->entries[i];
+        item->result = image_dataset_load(p->dataset, item->entry, &item->image, &item->size);
+        if (!work_queue_push(&p->queue, item)) {
+            // Stopped by consumer
+            image_prefetch_release(item);
+            break;
+        }
+    }
+    work_queue_close(&p->queue);
+    return NULL;
+}
+
+bool image_prefetch_start(image_prefetch_t *prefetch, const image_dataset_t *dataset,
+        uint32_t depth)
+{
+    prefetch->dataset = dataset;
+    prefetch->result = FPC_BEP_RESULT_OK;
+    if (!work_queue_init(&prefetch->queue, depth)) {
+        return false;
+    }
+    if (pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch) != 0) {
+        work_queue_destroy(&prefetch->queue);
+        return false;
+    }
+    return true;
+}
+
+image_dataset_item_t *image_prefetch_next(image_prefetch_t *prefetch)
+{
+    return work_queue_pop(&prefetch->queue);
+}
+
+void image_prefetch_release(image_dataset_item_t *item)
+{
+    if (item) {
+        free(item->image);
+        free(item);
+    }
+}
+
+void image_prefetch_stop(image_prefetch_t *prefetch)
+{
+    image_dataset_item_t *item;
+
+    work_queue_close(&prefetch->queue);
+    while ((item = work_queue_pop(&prefetch->queue)) != NULL) {
+        image_prefetch_release(item);
+    }
+    pthread_join(prefetch->thread, NULL);
+    work_queue_destroy(&prefetch->queue);
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    image_export.c
+ * @brief   Saving of captured images to binary PGM and PNG files
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BMLITE_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "image_export.h"
+#include "bmlite_if.h"
+
+typedef struct {
+    char path[IMAGE_EXPORT_PATH_MAX];
+    image_format_t format;
+    image_geometry_t geometry;
+    uint8_t *image;
+} image_job_t;
+
+fpc_bep_result_t image_get_geometry(HCP_comm_t *chain, uint32_t size,
+        image_geometry_t *geometry)
+{
+    uint32_t side = 0;
+
+    if (bep_image_get_geometry(chain, &geometry->width, &geometry->height,
+            &geometry->dpi) == FPC_BEP_RESULT_OK &&
+            (uint32_t)geometry->width * geometry->height == size) {
+        if (geometry->dpi == 0) {
+            geometry->dpi = IMAGE_EXPORT_DEFAULT_DPI;
+        }
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Geometry request is optional, its failure is not a command failure
+    chain->bep_result = FPC_BEP_RESULT_OK;
+    while ((side + 1) * (side + 1) <= size) {
+        side++;
+    }
+    if (side == 0 || side * side != size) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    geometry->width = side;
+    geometry->height = side;
+    geometry->dpi = IMAGE_EXPORT_DEFAULT_DPI;
+    return FPC_BEP_RESULT_OK;
+}
+
+static bool save_pgm(FILE *f, const image_geometry_t *g, const uint8_t *image)
+{
+    size_t size = (size_t)g->width * g->height;
+
+    fprintf(f, "P5\n# dpi %u\n%u %u\n255\n", g->dpi, g->width, g->height);
+    return fwrite(image, 1, size, f) == size;
+}
+
+#ifdef BMLITE_USE_ZLIB
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool png_chunk(FILE *f, const char *type, const uint8_t *data, uint32_t size)
+{
+    uint8_t buf[8];
+    uint32_t crc;
+
+    put_be32(buf, size);
+    memcpy(buf + 4, type, 4);
+    crc = crc32(0, buf + 4, 4);
+    if (size) {
+        // crc32() restarts on NULL buffer
+        crc = crc32(crc, data, size);
+    }
+    if (fwrite(buf, 1, 8, f) != 8 || fwrite(data, 1, size, f) != size) {
+        return false;
+    }
+    put_be32(buf, crc);
+    return fwrite(buf, 1, 4, f) == 4;
+}
+
+static bool save_png(FILE *f, const image_geometry_t *g, const uint8_t *image)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint32_t row = g->width + 1;
+    uLong raw_size = (uLong)row * g->height;
+    uLongf zsize = compressBound(raw_size);
+    uint8_t ihdr[13] = { 0 };
+    uint8_t phys[9];
+    uint8_t *raw = malloc(raw_size);
+    uint8_t *z = malloc(zsize);
+    bool ok = false;
+
+    if (raw == NULL || z == NULL) {
+        goto exit;
+    }
+
+    // Sub filter: ridges make neighbour pixel a good predictor
+    for (uint32_t y = 0; y < g->height; y++) {
+        const uint8_t *src = image + (size_t)y * g->width;
+        uint8_t *dst = raw + (size_t)y * row;
+        dst[0] = 1;
+        dst[1] = src[0];
+        for (uint32_t x = 1; x < g->width; x++) {
+            dst[x + 1] = src[x] - src[x - 1];
+        }
+    }
+    if (compress2(z, &zsize, raw, raw_size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        goto exit;
+    }
+
+    put_be32(ihdr, g->width);
+    put_be32(ihdr + 4, g->height);
+    ihdr[8] = 8;
+    // Pixels per meter
+    put_be32(phys, (uint32_t)(g->dpi / 0.0254 + 0.5));
+    put_be32(phys + 4, (uint32_t)(g->dpi / 0.0254 + 0.5));
+    phys[8] = 1;
+
+    ok = fwrite(signature, 1, sizeof(signature), f) == sizeof(signature) &&
+            png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) &&
+            png_chunk(f, "pHYs", phys, sizeof(phys)) &&
+            png_chunk(f, "IDAT", z, zsize) &&
+            png_chunk(f, "IEND", NULL, 0);
+exit:
+    free(raw);
+    free(z);
+    return ok;
+}
+#endif
+
+fpc_bep_result_t image_save(const char *path, image_format_t format,
+        const image_geometry_t *geometry, const uint8_t *image)
+{
+    FILE *f;
+    bool ok;
+
+#ifndef BMLITE_USE_ZLIB
+    if (format == IMAGE_FORMAT_PNG) {
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+#endif
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+#ifdef BMLITE_USE_ZLIB
+    if (format == IMAGE_FORMAT_PNG) {
+        ok = save_png(f, geometry, image);
+    } else
+#endif
+    {
+        ok = save_pgm(f, geometry, image);
+    }
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    return ok ? FPC_BEP_RESULT_OK : FPC_BEP_RESULT_IO_ERROR;
+}
+
+static void *writer_thread(void *arg)
+{
+    image_writer_t *w = arg;
+    image_job_t *job;
+
+    while ((job = work_queue_pop(&w->queue)) != NULL) {
+        if (image_save(job->path, job->format, &job->geometry, job->image) == FPC_BEP_RESULT_OK) {
+            __atomic_fetch_add(&w->written, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+        }
+        free(job->image);
+        free(job);
+    }
+    return NULL;
+}
+
+bool image_writer_start(image_writer_t *writer, uint32_t depth)
+{
+    memset(writer, 0, sizeof(*writer));
+    if (!work_queue_init(&writer->queue, depth)) {
+        return false;
+    }
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        work_queue_destroy(&writer->queue);
+        return false;
+    }
+    return true;
+}
+
+bool image_writer_submit(image_writer_t *writer, const char *path, image_format_t format,
+        const image_geometry_t *geometry, uint8_t *image)
+{
+    image_job_t *job = malloc(sizeof(*job));
+
+    if (job != NULL) {
+        snprintf(job->path, sizeof(job->path), "%s", path);
+        job->format = format;
+        job->geometry = *geometry;
+        job->image = image;
+        if (work_queue_try_push(&writer->queue, job)) {
+            return true;
+        }
+        free(job);
+    }
+    free(image);
+    __atomic_fetch_add(&writer->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+void image_writer_stop(image_writer_t *writer)
+{
+    work_queue_close(&writer->queue);
+    pthread_join(writer->thread, NULL);
+    work_queue_destroy(&writer->queue);
+}
@@ -31,12 +31,27 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "bmlite_if.h"
 #include "hcp_tiny.h"
 #include "platform.h"
 #include "bmlite_hal.h"
 #include "platform_rpi.h"
+#include "bench.h"
+#include "template_archive.h"
+#include "template_mirror.h"
+#include "template_gallery.h"
+#include "image_export.h"
+#include "batch_identify.h"
+#include "batch_enroll.h"
+#include "batch_script.h"
+#include "uart_speed.h"
+#include "bmlite_watchdog.h"
+
+/** Number of images waiting to be saved */
+#define IMAGE_WRITER_DEPTH 16
 
 #define DATA_BUFFER_SIZE 102400
 static uint8_t hcp_txrx_buffer[MTU];
@@ -52,34 +67,96 @@ static HCP_comm_t hcp_chain = {
     .phy_rx_timeout = 2000,
 };
 
+static template_mirror_t template_mirror;
+static image_writer_t image_writer;
+/* Uploaded images shared with other processes (-I) */
+static rpi_image_ring_t *image_ring;
+static const char *image_ring_name;
+static image_geometry_t image_ring_geometry;
+/* Prompts and messages. Batch mode keeps stdout for results */
+static FILE *ui_out;
+/* Recovers wedged BM-Lite (-W) */
+static bmlite_watchdog_t watchdog;
+/* Process start, time to first identify is reported from it */
+static hal_tick_t process_start;
+static bool first_identify_done;
+
+#ifdef BMLITE_USE_EVENT_QUEUE
+/** Callbacks are called from this thread, not from HCP transport */
+#define EVENT_QUEUE_SIZE 64
+/* Holds a few images and templates of bmlite_on_image and bmlite_on_template_change */
+#define EVENT_PAYLOAD_SIZE (128 * 1024)
+#define EVENT_DRAIN_PERIOD_US 2000
+
+static bmlite_event_t event_storage[EVENT_QUEUE_SIZE];
+static uint8_t event_payload[EVENT_PAYLOAD_SIZE];
+static bmlite_event_queue_t event_queue;
+static pthread_t event_thread;
+static bool event_thread_stop;
+
+static void *event_thread_run(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&event_thread_stop, __ATOMIC_ACQUIRE)) {
+        if (bmlite_event_queue_drain(&event_queue, 0) == 0) {
+            usleep(EVENT_DRAIN_PERIOD_US);
+        }
+    }
+    bmlite_event_queue_drain(&event_queue, 0);
+    return NULL;
+}
+
+static void event_thread_stop_all(void)
+{
+    bmlite_event_queue_stats_t stats;
+
+    __atomic_store_n(&event_thread_stop, true, __ATOMIC_RELEASE);
+    pthread_join(event_thread, NULL);
+    bmlite_event_queue_get_stats(&event_queue, &stats);
+    if (stats.dropped) {
+        fprintf(stderr, "Events: %u, dropped %u\n", stats.posted, stats.dropped);
+    }
+}
+#endif
+
 static void help(void)
 {
     fprintf(stderr, "BEP Host Communication Application\n");
-    fprintf(stderr, "Syntax: bep_host_com [-s] [-p port] [-b baudrate] [-t timeout]\n");
+    fprintf(stderr, "Syntax: bep_host_com [-s | -e | -T host[:port]] [-w] [-F] [-p port] [-b baudrate] [-t timeout]\n");
+    fprintf(stderr, "       [-R priority] [-c cpu] [-L load_threads]\n");
+    fprintf(stderr, "       [-M metrics_file[,interval_ms]] [-I shm_name[,slots]]\n");
+    fprintf(stderr, "       [-W faults[,window_ms[,fails]]]\n");
+    fprintf(stderr, "       [-x script_file] [-o result_file] [-k] [step ...]\n");
+    fprintf(stderr, "Steps given with -x or as arguments are run without menu, see batch_script.h.\n");
+    fprintf(stderr, "Results are JSON lines, use -o to keep them apart from debug output\n");
+    fprintf(stderr, "-M: write link and command counters in Prometheus text format\n");
+    fprintf(stderr, "-I: publish uploaded images to shared memory ring (" RPI_IMAGE_RING_NAME ")\n");
+    fprintf(stderr, "-T: BM-Lite attached to bmlite_bridge, reset is left to the bridge\n");
+    fprintf(stderr, "-W: recover BM-Lite after link faults within window or failed commands in a row\n");
 }
 
 void bmlite_on_error(bmlite_error_t error, int32_t value) 
 { 
-    printf("Error: %d, return code %d\n", error, (int16_t)value); 
+    fprintf(ui_out, "Error: %d, return code %d\n", error, (int16_t)value); 
 }
 
 void bmlite_on_start_capture() 
 {
-    printf("Put finger on the sensor\n");
+    fprintf(ui_out, "Put finger on the sensor\n");
 }
 void bmlite_on_finish_capture() 
 {
-    printf("Remove finger from the sensor\n");
+    fprintf(ui_out, "Remove finger from the sensor\n");
 }
 
 void bmlite_on_start_enroll() 
 {
-    printf("Start enrolling\n");
+    fprintf(ui_out, "Start enrolling\n");
 }
 
 void bmlite_on_finish_enroll() 
 {
-    printf("Finish enrolling\n");
+    fprintf(ui_out, "Finish enrolling\n");
 }
 
 void bmlite_on_start_enrollcapture() {}
@@ -87,48 +164,121 @@ void bmlite_on_finish_enrollcapture() {}
 
 void bmlite_on_identify_start() 
 {
-    printf("Start Identifying\n");
+    fprintf(ui_out, "Start Identifying\n");
 }
 void bmlite_on_identify_finish() 
 {
-    printf("Finish Identifying\n");
+    fprintf(ui_out, "Finish Identifying\n");
+    if (!first_identify_done) {
+        first_identify_done = true;
+        fprintf(ui_out, "First identify: %d ms after start\n",
+                (int)(hal_timebase_get_tick() - process_start));
+    }
 }
 
-void save_to_pgm(FILE *f, uint8_t *image, int res_x, int res_y)
+void bmlite_on_image(HCP_comm_t *chain, const uint8_t *data, uint32_t size)
 {
-        /* Print 8-bpp PGM ASCII header */
-        fprintf(f, "P2\n%d %d\n255\n", res_x, res_y);
-        for (int y = 0; y < res_y; y++) {
-                for (int x = 0; x < res_x; x++, image++)
-                        fprintf(f,"%d ", *image);
-                fprintf(f,"\n");
+    image_geometry_t g = image_ring_geometry;
+    uint32_t side = 0;
+
+    (void)chain;
+    if (image_ring == NULL) {
+        return;
+    }
+    // Geometry is asked once at start. Other sizes are taken as square
+    if ((uint32_t)g.width * g.height != size) {
+        while ((side + 1) * (side + 1) <= size) {
+            side++;
         }
+        g.width = side;
+        g.height = side;
+    }
+    rpi_image_ring_publish(image_ring, data, size, g.width, g.height, g.dpi);
+}
+
+static void image_ring_stop(void)
+{
+    rpi_image_ring_destroy(image_ring, image_ring_name);
+    image_ring = NULL;
+}
 
-        fprintf(f,"\x04"); /* End Of Transmission */
+/* Queue image for saving in all supported formats */
+static void submit_image(image_writer_t *writer, const char *name,
+        const image_geometry_t *geometry, const uint8_t *image, uint32_t size)
+{
+    char path[IMAGE_EXPORT_PATH_MAX];
+    uint8_t *copy = malloc(size);
+
+    if (copy) {
+        memcpy(copy, image, size);
+        snprintf(path, sizeof(path), "%s.pgm", name);
+        image_writer_submit(writer, path, IMAGE_FORMAT_PGM, geometry, copy);
+    }
+#ifdef BMLITE_USE_ZLIB
+    copy = malloc(size);
+    if (copy) {
+        memcpy(copy, image, size);
+        snprintf(path, sizeof(path), "%s.png", name);
+        image_writer_submit(writer, path, IMAGE_FORMAT_PNG, geometry, copy);
+    }
+#endif
 }
 
+/* BM-Lite behind the bridge can't be reset from here */
+static void bridge_reset(HCP_comm_t *chain)
+{
+    (void)chain;
+}
 
 int main (int argc, char **argv)
 {
-    int index;
     int c;
+    fpc_bep_result_t res;
     rpi_initparams_t rpi_params;
     
+    process_start = hal_timebase_get_tick();
     rpi_params.iface = COM_INTERFACE;
     rpi_params.hcp_comm = &hcp_chain;
     rpi_params.baudrate = 921600;
     rpi_params.timeout = 5;
     rpi_params.port = NULL;
+    rpi_params.warm_attach = false;
+    rpi_params.flow_control = false;
 
+    rpi_rt_params_t rt_params = {
+        .priority = 0,
+        .cpu = -1,
+        .lock_memory = false,
+    };
+    int load_threads = 0;
+    const char *script = NULL;
+    const char *result_path = NULL;
+    bool keep_going = false;
+    char *metrics_path = NULL;
+    uint32_t metrics_interval = 1000;
+    uint32_t image_ring_slots = RPI_IMAGE_RING_SLOTS;
+    bmlite_watchdog_config_t watchdog_config = BMLITE_WATCHDOG_CONFIG_DEFAULT;
+    bool use_watchdog = false;
+
+    ui_out = stdout;
     opterr = 0;
 
-    while ((c = getopt (argc, argv, "sb:p:t:")) != -1) {
+    while ((c = getopt (argc, argv, "sewFb:p:t:T:R:c:L:M:I:W:x:o:k")) != -1) {
         switch (c) {
             case 's':
                 rpi_params.iface = SPI_INTERFACE;
                 if(rpi_params.baudrate == 921600)
                     rpi_params.baudrate = 1000000;
                 break;
+            case 'e':
+                rpi_params.iface = EMU_INTERFACE;
+                break;
+            case 'w':
+                rpi_params.warm_attach = true;
+                break;
+            case 'F':
+                rpi_params.flow_control = true;
+                break;
             case 'b':
                 rpi_params.baudrate = atoi(optarg);
                 break;
@@ -138,6 +288,56 @@ int main (int argc, char **argv)
             case 't':
                 rpi_params.timeout = atoi(optarg);
                 break;
+            case 'T':
+                rpi_params.iface = TCP_INTERFACE;
+                rpi_params.port = optarg;
+                rpi_params.warm_attach = true;
+                break;
+            case 'R':
+                rt_params.priority = atoi(optarg);
+                rt_params.lock_memory = true;
+                break;
+            case 'c':
+                rt_params.cpu = atoi(optarg);
+                break;
+            case 'L':
+                load_threads = atoi(optarg);
+                break;
+            case 'M': {
+                char *interval = strrchr(optarg, ',');
+                if (interval) {
+                    *interval++ = 0;
+                    metrics_interval = atoi(interval);
+                }
+                metrics_path = optarg;
+                break;
+            }
+            case 'I': {
+                char *slots = strrchr(optarg, ',');
+                if (slots) {
+                    *slots++ = 0;
+                    image_ring_slots = atoi(slots);
+                }
+                image_ring_name = optarg;
+                break;
+            }
+            case 'W':
+                if (sscanf(optarg, "%u,%u,%u", &watchdog_config.fault_limit,
+                        &watchdog_config.window_ms, &watchdog_config.fail_limit) < 1) {
+                    help();
+                    exit(1);
+                }
+                use_watchdog = true;
+                break;
+            case 'x':
+                script = optarg;
+                break;
+            case 'o':
+                result_path = optarg;
+                break;
+            case 'k':
+                keep_going = true;
+                break;
             case '?':
                 if (optopt == 'b')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -160,15 +360,115 @@ int main (int argc, char **argv)
         exit(1);
     }
 
-    for (index = optind; index < argc; index++) {
-        printf ("Non-option argument %s\n", argv[index]);
+    bool batch_mode = script != NULL || optind < argc;
+    if (batch_mode) {
+        ui_out = stderr;
     }
 
-    if(platform_init(&rpi_params) != FPC_BEP_RESULT_OK) {
+    if (metrics_path) {
+        if (!rpi_metrics_exporter_start(metrics_path, metrics_interval)) {
+            fprintf(stderr, "Can't start metrics exporter\n");
+            exit(1);
+        }
+        atexit(rpi_metrics_exporter_stop);
+    }
+
+#ifdef BMLITE_USE_EVENT_QUEUE
+    bmlite_event_queue_init(&event_queue, event_storage, EVENT_QUEUE_SIZE);
+    bmlite_event_queue_set_payload(&event_queue, event_payload, EVENT_PAYLOAD_SIZE);
+    if (pthread_create(&event_thread, NULL, event_thread_run, NULL) != 0) {
+        fprintf(stderr, "Can't start event thread\n");
+        exit(1);
+    }
+    hcp_chain.event_queue = &event_queue;
+    atexit(event_thread_stop_all);
+#endif
+
+    platform_attach_timing_t attach_timing = { 0 };
+    hal_tick_t start = hal_timebase_get_tick();
+    if (rpi_params.warm_attach) {
+        res = platform_attach(&rpi_params, &hcp_chain, &attach_timing);
+    } else {
+        res = platform_init(&rpi_params);
+    }
+    int startup_ms = (int)(hal_timebase_get_tick() - start);
+    if (rpi_params.iface != TCP_INTERFACE) {
+        hcp_chain.link_speed = rpi_params.baudrate;
+    }
+    if (rpi_params.warm_attach) {
+        fprintf(ui_out, "Attach: init %u ms, probe %u ms, %s %u ms\n", attach_timing.init_ms,
+                attach_timing.probe_ms, attach_timing.reset ? "HW reset" : "no reset",
+                attach_timing.reset_ms);
+    }
+    if (batch_mode) {
+        fprintf(ui_out, "Startup: %d ms (%s)\n", startup_ms, rpi_params.warm_attach ? "warm" : "cold");
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        fprintf(stderr, "Startup failed: %d\n", res);
         help();
         exit(1);
     }
 
+    if (use_watchdog) {
+        if (rpi_params.iface == TCP_INTERFACE) {
+            watchdog_config.hw_reset = bridge_reset;
+        }
+        bmlite_watchdog_init(&watchdog, &hcp_chain, &watchdog_config);
+    }
+
+    template_mirror_init(&template_mirror, &hcp_chain);
+
+    if (image_ring_name) {
+        // Images are received to the chain buffer, so they are never bigger
+        image_ring = rpi_image_ring_create(image_ring_name, image_ring_slots,
+                sizeof(hcp_data_buffer));
+        if (image_ring == NULL) {
+            fprintf(stderr, "Can't create image ring %s\n", image_ring_name);
+            exit(1);
+        }
+        atexit(image_ring_stop);
+        if (bep_image_get_geometry(&hcp_chain, &image_ring_geometry.width,
+                &image_ring_geometry.height, &image_ring_geometry.dpi) != FPC_BEP_RESULT_OK) {
+            memset(&image_ring_geometry, 0, sizeof(image_ring_geometry));
+            hcp_chain.bep_result = FPC_BEP_RESULT_OK;
+        }
+        if (image_ring_geometry.dpi == 0) {
+            image_ring_geometry.dpi = IMAGE_EXPORT_DEFAULT_DPI;
+        }
+    }
+    if (!image_writer_start(&image_writer, IMAGE_WRITER_DEPTH)) {
+        printf("Can't start image writer\n");
+        exit(1);
+    }
+
+    // Load threads are started first, so they don't inherit real-time CPU affinity
+    bench_cpu_hog_start(load_threads);
+    if ((rt_params.priority > 0 || rt_params.cpu >= 0) &&
+            !rpi_rt_profile_apply(&rt_params, &hcp_chain)) {
+        exit(1);
+    }
+
+    if (batch_mode) {
+        batch_script_stats_t stats;
+        FILE *out = stdout;
+
+        if (result_path && (out = fopen(result_path, "w")) == NULL) {
+            fprintf(stderr, "Can't create %s\n", result_path);
+            exit(1);
+        }
+        if (script) {
+            res = batch_script_run_file(&hcp_chain, script, keep_going, out, &stats);
+        } else {
+            res = batch_script_run(&hcp_chain, argv + optind, argc - optind, keep_going, out,
+                    &stats);
+        }
+        if (out != stdout) {
+            fclose(out);
+        }
+        image_writer_stop(&image_writer);
+        return res == FPC_BEP_RESULT_OK ? 0 : 1;
+    }
+
     while(1) {
         char cmd[100];
         fpc_bep_result_t res = FPC_BEP_RESULT_OK;
@@ -179,23 +479,50 @@ int main (int argc, char **argv)
         printf("BM-Lite Interface\n");
         if (rpi_params.iface == SPI_INTERFACE)
         	printf("SPI port: speed %d Hz\n", rpi_params.baudrate);
+        else if (rpi_params.iface == EMU_INTERFACE)
+            printf("Emulator: link speed %d\n", rpi_params.baudrate);
+        else if (rpi_params.iface == TCP_INTERFACE)
+            printf("TCP bridge: %s\n", rpi_params.port);
         else
-            printf("Com port: %s [speed: %d]\n", rpi_params.port, rpi_params.baudrate);
+            printf("Com port: %s [speed: %d%s]\n", rpi_params.port, rpi_params.baudrate,
+                    rpi_params.flow_control ? ", RTS/CTS" : "");
         printf("Timeout: %ds\n", rpi_params.timeout);
+        if (rt_params.priority > 0) {
+            printf("Real-time: SCHED_FIFO priority %d, CPU %d\n", rt_params.priority, rt_params.cpu);
+        }
+        if (load_threads > 0) {
+            printf("CPU load threads: %d\n", load_threads);
+        }
+        printf("Startup: %d ms (%s)\n", startup_ms, rpi_params.warm_attach ? "warm" : "cold");
         printf("-------------------\n\n");
         printf("Possible options:\n");
         printf("a: Enroll finger\n");
         printf("b: Capture and identify finger\n");
+        printf("B: Capture and identify finger with image quality check\n");
         printf("c: Remove all templates\n");
         printf("d: Save template\n");
         printf("e: Remove template\n");
         printf("l: List of templates\n");
         printf("t: Save template to file\n");
         printf("T: Push template from file\n");
+        printf("x: Backup all templates to archive\n");
+        printf("X: Restore all templates from archive\n");
+        printf("m: Sync templates with archive (only changed templates are sent)\n");
         printf("f: Capture image\n");
         printf("g: Pull captured image\n");
+        printf("k: Capture series of images to files\n");
+        printf("Q: Image quality of captured image\n");
+        printf("I: Identify recorded images (batch)\n");
+        printf("E: Enroll from recorded images (batch)\n");
         printf("h: Get version\n");
+        printf("i: Identify-to-next-command latency\n");
+        printf("p: Command round trip latency\n");
+        printf("z: Power mode wake-up latency\n");
+        if (rpi_params.iface == EMU_INTERFACE)
+            printf("P: Gallery paging identify latency\n");
         printf("r: SW Reset\n");
+        if (rpi_params.iface == COM_INTERFACE)
+            printf("u: Switch UART speed\n");
         printf("q: Exit program\n");
         printf("\nOption>> ");
         fgets(cmd, sizeof(cmd), stdin);
@@ -213,6 +540,64 @@ int main (int argc, char **argv)
                     }
                 }
                 break;
+            case 'B': {
+                const bmlite_quality_params_t quality = BMLITE_QUALITY_PARAMS_DEFAULT;
+                bmlite_quality_reason_t reason;
+                res = bep_identify_finger_checked(&hcp_chain, 0, &quality, &template_id, &match,
+                        &reason);
+                if (reason != BMLITE_QUALITY_OK) {
+                    printf("Poor image (reason %d), touch the sensor again\n", reason);
+                } else if (res == FPC_BEP_RESULT_OK) {
+                    if (match) {
+                        printf("Match with template id: %d\n", template_id);
+                    } else {
+                        printf("No match\n");
+                    }
+                }
+                break;
+            }
+            case 'I': {
+                batch_identify_stats_t stats;
+                char path[IMAGE_DATASET_PATH_MAX];
+
+                printf("Image directory, tar archive or list file: ");
+                fgets(path, sizeof(path), stdin);
+                path[strcspn(path, "\n")] = 0;
+                printf("Print every result (y/n): ");
+                fgets(cmd, sizeof(cmd), stdin);
+                res = batch_identify(&hcp_chain, path, cmd[0] == 'y', &stats);
+                break;
+            }
+            case 'E': {
+                batch_enroll_params_t params = {
+                    .save = true, .export_dir = NULL, .stop_on_error = false };
+                batch_enroll_stats_t stats;
+                char path[IMAGE_DATASET_PATH_MAX];
+                char dir[IMAGE_DATASET_PATH_MAX];
+
+                printf("Image directory, tar archive or list file: ");
+                fgets(path, sizeof(path), stdin);
+                path[strcspn(path, "\n")] = 0;
+                printf("Export directory (empty - no export): ");
+                fgets(dir, sizeof(dir), stdin);
+                dir[strcspn(dir, "\n")] = 0;
+                if (dir[0]) {
+                    params.export_dir = dir;
+                }
+                printf("Save to BM-Lite (y/n): ");
+                fgets(cmd, sizeof(cmd), stdin);
+                params.save = cmd[0] == 'y';
+                printf("Stop at first failed user (y/n): ");
+                fgets(cmd, sizeof(cmd), stdin);
+                params.stop_on_error = cmd[0] == 'y';
+                res = batch_enroll(&hcp_chain, path, &params, &stats);
+                break;
+            }
+            case 'Q':
+                printf("Number of iterations: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                res = bench_image_quality(&hcp_chain, atoi(cmd), stdout);
+                break;
             case 'c':
                 res = bep_template_remove_all(&hcp_chain);
                 break;
@@ -254,29 +639,76 @@ int main (int argc, char **argv)
                 if (res == FPC_BEP_RESULT_OK) {
                     uint8_t *buf = malloc(size);
                     if (buf) {
+                      rpi_com_stats_t stats_start, stats_end;
+                      clock_t cpu_start = clock();
+                      rpi_com_get_stats(&stats_start);
                       res = bep_image_get(&hcp_chain, buf, size);
+                      rpi_com_get_stats(&stats_end);
+                      if (rpi_params.iface == COM_INTERFACE && res == FPC_BEP_RESULT_OK) {
+                          uint32_t syscalls = (stats_end.read_calls - stats_start.read_calls) +
+                                  (stats_end.write_calls - stats_start.write_calls) +
+                                  (stats_end.poll_calls - stats_start.poll_calls);
+                          printf("UART: %.1f syscalls per KB, CPU %.1f ms\n",
+                                  syscalls * 1024.0 / size,
+                                  (clock() - cpu_start) * 1000.0 / CLOCKS_PER_SEC);
+                      }
                       if (res == FPC_BEP_RESULT_OK) {
-                        //   if(size != hcp_chain.arg.size) {
-                              printf("Image size: %d. Received %d bytes\n", size, hcp_chain.arg.size);
-                        //   }
+                        image_geometry_t geometry;
+                        printf("Image size: %d. Received %d bytes\n", size, hcp_chain.arg.size);
                         FILE *f = fopen("image.raw", "wb");
                         if (f) {
                             fwrite(buf, 1, size, f);
                             fclose(f);
                             printf("Image saved as image.raw\n");
                         }
-                        f = fopen("image.pgm", "wb");
-                        if(f) {
-                            save_to_pgm(f, buf, 160, 160);
-                            fclose(f);
-                            printf("Image saved as image.pgm\n");
+                        if (image_get_geometry(&hcp_chain, size, &geometry) == FPC_BEP_RESULT_OK) {
+                            printf("Image %ux%u, %u dpi\n", geometry.width, geometry.height,
+                                    geometry.dpi);
+                            submit_image(&image_writer, "image", &geometry, buf, size);
                         }
-                        free(buf);
                       }
+                      free(buf);
                     }
                 }
                 break;
             }
+            case 'k': {
+                image_geometry_t geometry;
+                uint32_t size = 0;
+                uint8_t *buf = NULL;
+                int count, n;
+
+                printf("Number of images: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                count = atoi(cmd);
+                hal_tick_t start = hal_timebase_get_tick();
+                for (n = 0; n < count && res == FPC_BEP_RESULT_OK; n++) {
+                    res = bep_capture(&hcp_chain, 0);
+                    if (hcp_chain.bep_result != FPC_BEP_RESULT_OK) {
+                        break;
+                    }
+                    if (res == FPC_BEP_RESULT_OK && buf == NULL) {
+                        res = bep_image_get_size(&hcp_chain, &size);
+                        if (res == FPC_BEP_RESULT_OK) {
+                            res = image_get_geometry(&hcp_chain, size, &geometry);
+                        }
+                        buf = res == FPC_BEP_RESULT_OK ? malloc(size) : NULL;
+                    }
+                    if (res == FPC_BEP_RESULT_OK && buf != NULL) {
+                        char name[32];
+                        res = bep_image_get(&hcp_chain, buf, size);
+                        snprintf(name, sizeof(name), "capture_%03d", n);
+                        submit_image(&image_writer, name, &geometry, buf, size);
+                    }
+                }
+                free(buf);
+                printf("Captured %d images in %d ms. Written %u, dropped %u, failed %u\n", n,
+                        (int)(hal_timebase_get_tick() - start),
+                        __atomic_load_n(&image_writer.written, __ATOMIC_RELAXED),
+                        __atomic_load_n(&image_writer.dropped, __ATOMIC_RELAXED),
+                        __atomic_load_n(&image_writer.errors, __ATOMIC_RELAXED));
+                break;
+            }
             case 'T': {
                 uint32_t size;
                 printf("Read template from file: ");
@@ -321,6 +753,49 @@ int main (int argc, char **argv)
                     free(buf);
                 break;
             }
+            case 'x':
+            case 'X': {
+                template_archive_stats_t stats = { 0 };
+                char path[100];
+
+                printf("Archive file: ");
+                fgets(path, sizeof(path), stdin);
+                path[strcspn(path, "\n")] = 0;
+                if (cmd[0] == 'x') {
+                    printf("Compress (y/n): ");
+                    fgets(cmd, sizeof(cmd), stdin);
+                    res = template_archive_backup(&hcp_chain, path, cmd[0] == 'y', &stats);
+                } else {
+                    res = template_archive_restore(&hcp_chain, path, &stats);
+                }
+                printf("%u templates, %llu bytes (%llu stored) in %u ms\n", stats.templates,
+                        (unsigned long long)stats.raw_bytes,
+                        (unsigned long long)stats.stored_bytes, stats.elapsed_ms);
+                break;
+            }
+            case 'm': {
+                template_mirror_sync_stats_t stats = { 0 };
+                template_archive_item_t *items;
+                uint32_t count;
+
+                printf("Archive file: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                cmd[strcspn(cmd, "\n")] = 0;
+                res = template_archive_load(cmd, &items, &count);
+                if (res != FPC_BEP_RESULT_OK) {
+                    break;
+                }
+                if (!template_mirror.valid) {
+                    res = template_mirror_build(&template_mirror);
+                }
+                if (res == FPC_BEP_RESULT_OK) {
+                    res = template_mirror_sync(&template_mirror, items, count, true, &stats);
+                }
+                printf("Uploaded %u, removed %u, unchanged %u in %u ms\n", stats.uploaded,
+                        stats.removed, stats.unchanged, stats.elapsed_ms);
+                template_archive_free(items, count);
+                break;
+            }
             case 'h': {
                 char version[100];
 
@@ -331,14 +806,80 @@ int main (int argc, char **argv)
                 }
                 break;
             }
+            case 'i': {
+                char version[100];
+                hal_tick_t start;
+
+                res = bep_capture(&hcp_chain, 0);
+                if (res == FPC_BEP_RESULT_OK) {
+                    res = bep_image_extract(&hcp_chain);
+                }
+                if (res == FPC_BEP_RESULT_OK) {
+                    start = hal_timebase_get_tick();
+                    res = bep_identify(&hcp_chain);
+                    if (res == FPC_BEP_RESULT_OK) {
+                        bep_wait_ready(&hcp_chain, 50);
+                        res = bep_version(&hcp_chain, version, 99);
+                    }
+                    if (res == FPC_BEP_RESULT_OK) {
+                        printf("Identify to next command: %d ms\n",
+                                (int)(hal_timebase_get_tick() - start));
+                    }
+                }
+                break;
+            }
+            case 'p':
+                printf("Number of requests: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                res = bench_ping(&hcp_chain, atoi(cmd), stdout);
+                break;
+            case 'z':
+                printf("Wake-ups per power mode: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                res = bench_power(&hcp_chain, atoi(cmd), stdout);
+                break;
+            case 'P':
+                if (rpi_params.iface != EMU_INTERFACE) {
+                    printf("\nUnknown command\n");
+                    break;
+                }
+                printf("Storage slots: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                template_id = atoi(cmd);
+                printf("Identifies per gallery size: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                res = bench_gallery(&hcp_chain, template_id, atoi(cmd), stdout);
+                break;
+            case 'u':
+                if (rpi_params.iface != COM_INTERFACE) {
+                    printf("\nUnknown command\n");
+                    break;
+                }
+                printf("New speed: ");
+                fgets(cmd, sizeof(cmd), stdin);
+                res = uart_speed_switch(&hcp_chain, atoi(cmd));
+                if (res == FPC_BEP_RESULT_OK) {
+                    rpi_params.baudrate = atoi(cmd);
+                }
+                break;
             case 'r':
                 bep_sw_reset(&hcp_chain);
                 break;
             case 'q':
+                image_writer_stop(&image_writer);
                 return 0;
             default:
                 printf("\nUnknown command\n");
         }
+        if (use_watchdog && watchdog.tripped) {
+            bmlite_watchdog_step_t step;
+            if (bmlite_watchdog_recover(&watchdog, &step) == FPC_BEP_RESULT_OK) {
+                printf("\nBM-Lite recovered by %s in %u ms\n", bmlite_watchdog_step_name(step),
+                        watchdog.stats.down_us_last / 1000);
+            } else {
+                printf("\nBM-Lite does not answer after HW reset\n");
+            }
+        }
         if (hcp_chain.bep_result == FPC_BEP_RESULT_OK) {
             printf("\nCommand succeded\n");
         } else {
@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    template_archive.c
+ * @brief   Backup and restore of all BM-Lite templates to a single archive
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef BMLITE_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "template_archive.h"
+#include "work_queue.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+#include "fpc_crc.h"
+
+#define ARCHIVE_MAGIC "BMLT"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 24
+#define ARCHIVE_RECORD_HEADER_SIZE 16
+#define ARCHIVE_INDEX_ENTRY_SIZE 20
+
+/** Number of template buffers in flight between link and file threads */
+#define ARCHIVE_PIPELINE_DEPTH 3
+
+typedef struct {
+    uint16_t id;
+    uint32_t size;
+    fpc_bep_result_t result;
+    uint8_t data[TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE];
+} template_buf_t;
+
+typedef struct {
+    FILE *f;
+    bool compress;
+    work_queue_t full;
+    work_queue_t free;
+    template_buf_t *pool;
+    template_archive_entry_t *index;
+    uint32_t count;
+    uint32_t offset;
+    uint8_t *zbuf;
+    uint32_t zbuf_size;
+    bool failed;
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+} archive_ctx_t;
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static fpc_bep_result_t check_result(HCP_comm_t *chain, fpc_bep_result_t res)
+{
+    return res != FPC_BEP_RESULT_OK ? res : chain->bep_result;
+}
+
+static void encode_entry(uint8_t *p, const template_archive_entry_t *e)
+{
+    put_le16(p, e->id);
+    put_le16(p + 2, e->flags);
+    put_le32(p + 4, e->raw_size);
+    put_le32(p + 8, e->stored_size);
+    put_le32(p + 12, e->crc);
+}
+
+static void decode_entry(const uint8_t *p, template_archive_entry_t *e)
+{
+    e->id = get_le16(p);
+    e->flags = get_le16(p + 2);
+    e->raw_size = get_le32(p + 4);
+    e->stored_size = get_le32(p + 8);
+    e->crc = get_le32(p + 12);
+}
+
+static bool write_header(FILE *f, uint16_t flags, uint32_t count, uint32_t index_offset)
+{
+    uint8_t hdr[ARCHIVE_HEADER_SIZE];
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, ARCHIVE_MAGIC, 4);
+    put_le16(hdr + 4, ARCHIVE_VERSION);
+    put_le16(hdr + 6, flags);
+    put_le32(hdr + 8, count);
+    put_le32(hdr + 16, index_offset);
+    return fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr);
+}
+
+static bool archive_ctx_init(archive_ctx_t *ctx, FILE *f, bool compress, uint32_t count)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->f = f;
+    ctx->compress = compress;
+    ctx->offset = ARCHIVE_HEADER_SIZE;
+    ctx->pool = malloc(ARCHIVE_PIPELINE_DEPTH * sizeof(template_buf_t));
+    ctx->index = calloc(count ? count : 1, sizeof(template_archive_entry_t));
+#ifdef BMLITE_USE_ZLIB
+    ctx->zbuf_size = compressBound(TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE);
+    ctx->zbuf = malloc(ctx->zbuf_size);
+#endif
+    if (ctx->pool == NULL || ctx->index == NULL || (compress && ctx->zbuf == NULL)) {
+        goto fail;
+    }
+    if (!work_queue_init(&ctx->full, ARCHIVE_PIPELINE_DEPTH)) {
+        goto fail;
+    }
+    if (!work_queue_init(&ctx->free, ARCHIVE_PIPELINE_DEPTH)) {
+        work_queue_destroy(&ctx->full);
+        goto fail;
+    }
+    for (int i = 0; i < ARCHIVE_PIPELINE_DEPTH; i++) {
+        work_queue_push(&ctx->free, &ctx->pool[i]);
+    }
+    return true;
+
+fail:
+    free(ctx->pool);
+    free(ctx->index);
+    free(ctx->zbuf);
+    return false;
+}
+
+static void archive_ctx_destroy(archive_ctx_t *ctx)
+{
+    work_queue_destroy(&ctx->full);
+    work_queue_destroy(&ctx->free);
+    free(ctx->pool);
+    free(ctx->index);
+    free(ctx->zbuf);
+}
+
+static bool write_record(archive_ctx_t *ctx, template_buf_t *t)
+{
+    template_archive_entry_t *e = &ctx->index[ctx->count];
+    uint8_t hdr[ARCHIVE_RECORD_HEADER_SIZE];
+    const uint8_t *data = t->data;
+
+    e->id = t->id;
+    e->flags = 0;
+    e->raw_size = t->size;
+    e->stored_size = t->size;
+    e->crc = fpc_crc(0, t->data, t->size);
+    e->offset = ctx->offset;
+
+#ifdef BMLITE_USE_ZLIB
+    if (ctx->compress) {
+        uLongf zsize = ctx->zbuf_size;
+        // Keep template uncompressed if compression does not help
+        if (compress2(ctx->zbuf, &zsize, t->data, t->size, Z_BEST_SPEED) == Z_OK &&
+                zsize < t->size) {
+            e->flags |= TEMPLATE_ARCHIVE_FLAG_COMPRESSED;
+            e->stored_size = zsize;
+            data = ctx->zbuf;
+        }
+    }
+#endif
+
+    encode_entry(hdr, e);
+    if (fwrite(hdr, 1, sizeof(hdr), ctx->f) != sizeof(hdr) ||
+            fwrite(data, 1, e->stored_size, ctx->f) != e->stored_size) {
+        return false;
+    }
+
+    ctx->offset += sizeof(hdr) + e->stored_size;
+    ctx->raw_bytes += e->raw_size;
+    ctx->stored_bytes += e->stored_size;
+    ctx->count++;
+    return true;
+}
+
+static void *backup_writer(void *arg)
+{
+    archive_ctx_t *ctx = arg;
+    template_buf_t *t;
+
+    while ((t = work_queue_pop(&ctx->full)) != NULL) {
+        if (!write_record(ctx, t)) {
+            ctx->failed = true;
+            // Stop link thread
+            work_queue_close(&ctx->free);
+        }
+        work_queue_push(&ctx->free, t);
+    }
+    return NULL;
+}
+
+static bool write_index(archive_ctx_t *ctx)
+{
+    uint8_t buf[ARCHIVE_INDEX_ENTRY_SIZE];
+    uint32_t index_offset = ctx->offset;
+
+    for (uint32_t i = 0; i < ctx->count; i++) {
+        encode_entry(buf, &ctx->index[i]);
+        put_le32(buf + 16, ctx->index[i].offset);
+        if (fwrite(buf, 1, sizeof(buf), ctx->f) != sizeof(buf)) {
+            return false;
+        }
+    }
+
+    if (fseek(ctx->f, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    return write_header(ctx->f, ctx->compress ? TEMPLATE_ARCHIVE_FLAG_COMPRESSED : 0,
+            ctx->count, index_offset);
+}
+
+fpc_bep_result_t template_archive_backup(HCP_comm_t *chain, const char *path, bool compress,
+        template_archive_stats_t *stats)
+{
+    fpc_bep_result_t res;
+    hal_tick_t start = hal_timebase_get_tick();
+    archive_ctx_t ctx;
+    pthread_t writer;
+    uint16_t *ids;
+    uint32_t count;
+    FILE *f;
+
+#ifndef BMLITE_USE_ZLIB
+    if (compress) {
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+#endif
+
+    res = check_result(chain, bep_template_get_ids(chain));
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    // ID list lives in HCP buffer, which is reused by the next command
+    count = chain->arg.size / 2;
+    ids = malloc((count ? count : 1) * sizeof(uint16_t));
+    if (ids == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    memcpy(ids, chain->arg.data, count * sizeof(uint16_t));
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        free(ids);
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    if (!write_header(f, 0, 0, 0)) {
+        fclose(f);
+        remove(path);
+        free(ids);
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (!archive_ctx_init(&ctx, f, compress, count)) {
+        fclose(f);
+        remove(path);
+        free(ids);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    if (pthread_create(&writer, NULL, backup_writer, &ctx) != 0) {
+        archive_ctx_destroy(&ctx);
+        fclose(f);
+        remove(path);
+        free(ids);
+        return FPC_BEP_RESULT_NO_RESOURCE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        template_buf_t *t = work_queue_pop(&ctx.free);
+        if (t == NULL) {
+            res = FPC_BEP_RESULT_IO_ERROR;
+            break;
+        }
+
+        res = check_result(chain, bep_template_load_storage(chain, ids[i]));
+        if (res == FPC_BEP_RESULT_OK) {
+            res = check_result(chain, bep_template_get(chain, t->data, sizeof(t->data)));
+        }
+        if (res == FPC_BEP_RESULT_OK && chain->arg.size > sizeof(t->data)) {
+            res = FPC_BEP_RESULT_NO_MEMORY;
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            work_queue_push(&ctx.free, t);
+            break;
+        }
+
+        t->id = ids[i];
+        t->size = chain->arg.size;
+        work_queue_push(&ctx.full, t);
+    }
+
+    work_queue_close(&ctx.full);
+    pthread_join(writer, NULL);
+
+    if (res == FPC_BEP_RESULT_OK && (ctx.failed || !write_index(&ctx))) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (fclose(f) != 0 && res == FPC_BEP_RESULT_OK) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        remove(path);
+    }
+
+    if (stats) {
+        stats->templates = ctx.count;
+        stats->raw_bytes = ctx.raw_bytes;
+        stats->stored_bytes = ctx.stored_bytes;
+        stats->elapsed_ms = hal_timebase_get_tick() - start;
+    }
+
+    archive_ctx_destroy(&ctx);
+    free(ids);
+    return res;
+}
+
+static fpc_bep_result_t read_record(archive_ctx_t *ctx, const template_archive_entry_t *e,
+        template_buf_t *t)
+{
+    uint8_t hdr[ARCHIVE_RECORD_HEADER_SIZE];
+    template_archive_entry_t r;
+
+    if (e->raw_size > sizeof(t->data) || e->stored_size > sizeof(t->data)) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    if (fseek(ctx->f, e->offset, SEEK_SET) != 0 ||
+            fread(hdr, 1, sizeof(hdr), ctx->f) != sizeof(hdr)) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    decode_entry(hdr, &r);
+    if (r.id != e->id || r.stored_size != e->stored_size || r.crc != e->crc) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+
+    if (e->flags & TEMPLATE_ARCHIVE_FLAG_COMPRESSED) {
+#ifdef BMLITE_USE_ZLIB
+        uLongf size = sizeof(t->data);
+        if (fread(ctx->zbuf, 1, e->stored_size, ctx->f) != e->stored_size) {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+        if (uncompress(t->data, &size, ctx->zbuf, e->stored_size) != Z_OK ||
+                size != e->raw_size) {
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+#else
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+#endif
+    } else if (fread(t->data, 1, e->raw_size, ctx->f) != e->raw_size) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    if (fpc_crc(0, t->data, e->raw_size) != e->crc) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+
+    t->id = e->id;
+    t->size = e->raw_size;
+    return FPC_BEP_RESULT_OK;
+}
+
+static void *restore_reader(void *arg)
+{
+    archive_ctx_t *ctx = arg;
+
+    for (uint32_t i = 0; i < ctx->count; i++) {
+        template_buf_t *t = work_queue_pop(&ctx->free);
+        if (t == NULL) {
+            break;
+        }
+        t->result = read_record(ctx, &ctx->index[i], t);
+        work_queue_push(&ctx->full, t);
+        if (t->result != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        ctx->raw_bytes += ctx->index[i].raw_size;
+        ctx->stored_bytes += ctx->index[i].stored_size;
+    }
+    work_queue_close(&ctx->full);
+    return NULL;
+}
+
+static fpc_bep_result_t read_index(FILE *f, template_archive_entry_t **index, uint32_t *count,
+        uint16_t *flags)
+{
+    uint8_t hdr[ARCHIVE_HEADER_SIZE];
+    uint8_t buf[ARCHIVE_INDEX_ENTRY_SIZE];
+    uint32_t index_offset;
+    long file_size;
+    size_t bytes;
+
+    if (fseek(f, 0, SEEK_END) != 0 || (file_size = ftell(f)) < ARCHIVE_HEADER_SIZE ||
+            fseek(f, 0, SEEK_SET) != 0) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, ARCHIVE_MAGIC, 4) != 0 ||
+            get_le16(hdr + 4) != ARCHIVE_VERSION) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    *flags = get_le16(hdr + 6);
+    *count = get_le32(hdr + 8);
+    index_offset = get_le32(hdr + 16);
+#ifndef BMLITE_USE_ZLIB
+    if (*flags & TEMPLATE_ARCHIVE_FLAG_COMPRESSED) {
+        return FPC_BEP_RESULT_NOT_SUPPORTED;
+    }
+#endif
+
+    // Header values are untrusted, the index must fit in the file
+    if (index_offset < ARCHIVE_HEADER_SIZE || index_offset > (unsigned long)file_size ||
+            *count > ((unsigned long)file_size - index_offset) / ARCHIVE_INDEX_ENTRY_SIZE) {
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    if (__builtin_mul_overflow((size_t)(*count ? *count : 1), sizeof(template_archive_entry_t),
+            &bytes)) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    *index = malloc(bytes);
+    if (*index == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    if (fseek(f, index_offset, SEEK_SET) != 0) {
+        free(*index);
+        return FPC_BEP_RESULT_INVALID_FORMAT;
+    }
+    for (uint32_t i = 0; i < *count; i++) {
+        if (fread(buf, 1, sizeof(buf), f) != sizeof(buf)) {
+            free(*index);
+            return FPC_BEP_RESULT_INVALID_FORMAT;
+        }
+        decode_entry(buf, &(*index)[i]);
+        (*index)[i].offset = get_le32(buf + 16);
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t restore_template(HCP_comm_t *chain, template_buf_t *t)
+{
+    fpc_bep_result_t res;
+
+    res = check_result(chain, bep_template_put(chain, t->data, t->size));
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    res = check_result(chain, bep_template_save(chain, t->id));
+    if (res == FPC_BEP_RESULT_ID_NOT_UNIQUE) {
+        // Replace existing template
+        bep_template_remove(chain, t->id);
+        res = check_result(chain, bep_template_save(chain, t->id));
+    }
+    return res;
+}
+
+fpc_bep_result_t template_archive_restore(HCP_comm_t *chain, const char *path,
+        template_archive_stats_t *stats)
+{
+    fpc_bep_result_t res;
+    hal_tick_t start = hal_timebase_get_tick();
+    template_archive_entry_t *index;
+    archive_ctx_t ctx;
+    pthread_t reader;
+    template_buf_t *t;
+    uint32_t count;
+    uint32_t restored = 0;
+    uint16_t flags;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    res = read_index(f, &index, &count, &flags);
+    if (res != FPC_BEP_RESULT_OK) {
+        fclose(f);
+        return res;
+    }
+
+    if (!archive_ctx_init(&ctx, f, (flags & TEMPLATE_ARCHIVE_FLAG_COMPRESSED) != 0, count)) {
+        free(index);
+        fclose(f);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    free(ctx.index);
+    ctx.index = index;
+    ctx.count = count;
+
+    if (pthread_create(&reader, NULL, restore_reader, &ctx) != 0) {
+        archive_ctx_destroy(&ctx);
+        fclose(f);
+        return FPC_BEP_RESULT_NO_RESOURCE;
+    }
+
+    while ((t = work_queue_pop(&ctx.full)) != NULL) {
+        res = t->result;
+        if (res == FPC_BEP_RESULT_OK) {
+            res = restore_template(chain, t);
+        }
+        if (res != FPC_BEP_RESULT_OK) {
+            // Stop reader thread
+            work_queue_close(&ctx.free);
+            break;
+        }
+        restored++;
+        work_queue_push(&ctx.free, t);
+    }
+
+    pthread_join(reader, NULL);
+    fclose(f);
+
+    if (res == FPC_BEP_RESULT_OK && restored != count) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    if (stats) {
+        stats->templates = restored;
+        stats->raw_bytes = ctx.raw_bytes;
+        stats->stored_bytes = ctx.stored_bytes;
+        stats->elapsed_ms = hal_timebase_get_tick() - start;
+    }
+
+    archive_ctx_destroy(&ctx);
+    return res;
+}
+
+fpc_bep_result_t template_archive_load(const char *path, template_archive_item_t **items,
+        uint32_t *count)
+{
+    fpc_bep_result_t res;
+    template_archive_entry_t *index;
+    archive_ctx_t ctx;
+    uint16_t flags;
+    uint32_t n;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    res = read_index(f, &index, &n, &flags);
+    if (res != FPC_BEP_RESULT_OK) {
+        fclose(f);
+        return res;
+    }
+
+    if (!archive_ctx_init(&ctx, f, (flags & TEMPLATE_ARCHIVE_FLAG_COMPRESSED) != 0, n)) {
+        free(index);
+        fclose(f);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    free(ctx.index);
+    ctx.index = index;
+
+    *items = calloc(n ? n : 1, sizeof(template_archive_item_t));
+    if (*items == NULL) {
+        res = FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < n && res == FPC_BEP_RESULT_OK; i++) {
+        template_archive_item_t *item = &(*items)[i];
+
+        res = read_record(&ctx, &index[i], &ctx.pool[0]);
+        if (res != FPC_BEP_RESULT_OK) {
+            break;
+        }
+        item->data = malloc(ctx.pool[0].size ? ctx.pool[0].size : 1);
+        if (item->data == NULL) {
+            res = FPC_BEP_RESULT_NO_MEMORY;
+            break;
+        }
+        memcpy(item->data, ctx.pool[0].data, ctx.pool[0].size);
+        item->id = ctx.pool[0].id;
+        item->size = ctx.pool[0].size;
+    }
+
+    if (res != FPC_BEP_RESULT_OK && *items != NULL) {
+        template_archive_free(*items, n);
+        *items = NULL;
+        n = 0;
+    }
+    *count = n;
+
+    archive_ctx_destroy(&ctx);
+    fclose(f);
+    return res;
+}
+
+void template_archive_free(template_archive_item_t *items, uint32_t count)
+{
+    if (items == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        free(items[i].data);
+    }
+    free(items);
+}
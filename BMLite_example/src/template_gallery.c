@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    template_gallery.c
+ * @brief   Host-managed template paging for galleries larger than BM-Lite storage
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "template_gallery.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+
+static fpc_bep_result_t check_result(HCP_comm_t *chain, fpc_bep_result_t res)
+{
+    return res != FPC_BEP_RESULT_OK ? res : chain->bep_result;
+}
+
+static uint32_t entry_score(const template_gallery_t *g, const template_gallery_entry_t *e)
+{
+    uint32_t periods = (g->clock - e->last_use) / TEMPLATE_GALLERY_HALF_LIFE;
+
+    return periods >= 32 ? 0 : e->score >> periods;
+}
+
+static void entry_hit(template_gallery_t *g, template_gallery_entry_t *e)
+{
+    e->score = entry_score(g, e) + TEMPLATE_GALLERY_HIT_SCORE;
+    e->last_use = g->clock;
+}
+
+/* Higher score first, equal scores in gallery order */
+static int compare_key(const void *a, const void *b)
+{
+    const template_gallery_key_t *ka = a;
+    const template_gallery_key_t *kb = b;
+
+    if (ka->score != kb->score) {
+        return ka->score < kb->score ? 1 : -1;
+    }
+    return (ka->index > kb->index) - (ka->index < kb->index);
+}
+
+/* Sort entries into g->order, only non-resident ones if resident is false */
+static uint32_t sort_entries(template_gallery_t *g, bool resident)
+{
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < g->count; i++) {
+        if (resident || g->entries[i].slot < 0) {
+            g->order[n].score = entry_score(g, &g->entries[i]);
+            g->order[n].index = i;
+            n++;
+        }
+    }
+    qsort(g->order, n, sizeof(*g->order), compare_key);
+    return n;
+}
+
+/* Save template of entry index to storage slot. Returns storage writes made in *writes */
+static fpc_bep_result_t load_slot(template_gallery_t *g, uint32_t slot, uint32_t index,
+        uint32_t *writes)
+{
+    HCP_comm_t *chain = g->chain;
+    template_gallery_entry_t *e = &g->entries[index];
+    int32_t held = g->slot_entry[slot];
+    fpc_bep_result_t res;
+
+    if (held >= 0) {
+        res = check_result(chain, bep_template_remove(chain, slot));
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        (*writes)++;
+        // Entry moved from paging slot to a resident one stays resident
+        if (g->entries[held].slot == (int32_t)slot) {
+            g->entries[held].slot = -1;
+        }
+        g->slot_entry[slot] = -1;
+    }
+
+    res = check_result(chain, bep_template_put(chain, (uint8_t *)e->data, e->size));
+    if (res == FPC_BEP_RESULT_OK) {
+        res = check_result(chain, bep_template_save(chain, slot));
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        (*writes)++;
+        g->slot_entry[slot] = index;
+        e->slot = slot;
+    }
+    return res;
+}
+
+static fpc_bep_result_t get_match(HCP_comm_t *chain, bool *match)
+{
+    fpc_bep_result_t res = bmlite_get_arg(chain, ARG_MATCH);
+
+    if (res == FPC_BEP_RESULT_OK) {
+        *match = *(bool *)chain->arg.data;
+    }
+    return res;
+}
+
+static fpc_bep_result_t identify(template_gallery_t *g, bool *match, uint16_t *slot)
+{
+    HCP_comm_t *chain = g->chain;
+    fpc_bep_result_t res;
+
+    *match = false;
+    res = check_result(chain, bep_identify(chain));
+    if (res == FPC_BEP_RESULT_OK) {
+        res = get_match(chain, match);
+    }
+    if (res == FPC_BEP_RESULT_OK && *match) {
+        res = bmlite_get_arg(chain, ARG_ID);
+        if (res == FPC_BEP_RESULT_OK) {
+            *slot = *(uint16_t *)chain->arg.data;
+        }
+    }
+    return res;
+}
+
+/* Resident templates are in slots 0..resident-1, the paging slot is not one of them */
+static bool is_resident(const template_gallery_t *g, const template_gallery_entry_t *e)
+{
+    return e->slot >= 0 && (uint32_t)e->slot < g->resident;
+}
+
+/*
+ * Save template to the paging slot and identify again. Template put replaces
+ * the extracted image features in BM-Lite RAM, so they are extracted again.
+ */
+static fpc_bep_result_t identify_paged(template_gallery_t *g, uint32_t index, bool *match,
+        uint16_t *slot, uint32_t *writes)
+{
+    HCP_comm_t *chain = g->chain;
+    fpc_bep_result_t res;
+
+    *match = false;
+    res = load_slot(g, g->resident, index, writes);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = check_result(chain, bep_image_extract(chain));
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        res = identify(g, match, slot);
+    }
+    return res;
+}
+
+fpc_bep_result_t template_gallery_init(template_gallery_t *gallery, HCP_comm_t *chain,
+        const template_archive_item_t *items, uint32_t count, uint32_t capacity)
+{
+    fpc_bep_result_t res;
+    uint32_t writes = 0;
+
+    if (capacity == 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    memset(gallery, 0, sizeof(*gallery));
+    gallery->chain = chain;
+    gallery->count = count;
+    gallery->capacity = capacity;
+    gallery->resident = count > capacity ? capacity - 1 : count;
+    gallery->entries = calloc(count ? count : 1, sizeof(template_gallery_entry_t));
+    gallery->order = calloc(count ? count : 1, sizeof(template_gallery_key_t));
+    gallery->slot_entry = calloc(capacity, sizeof(int32_t));
+    if (gallery->entries == NULL || gallery->order == NULL || gallery->slot_entry == NULL) {
+        template_gallery_destroy(gallery);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        gallery->entries[i].id = items[i].id;
+        gallery->entries[i].size = items[i].size;
+        gallery->entries[i].data = items[i].data;
+        gallery->entries[i].slot = -1;
+    }
+    for (uint32_t s = 0; s < capacity; s++) {
+        gallery->slot_entry[s] = -1;
+    }
+
+    res = check_result(chain, bep_template_remove_all(chain));
+    for (uint32_t i = 0; i < gallery->resident && res == FPC_BEP_RESULT_OK; i++) {
+        res = load_slot(gallery, i, i, &writes);
+    }
+    return res;
+}
+
+void template_gallery_destroy(template_gallery_t *gallery)
+{
+    free(gallery->entries);
+    free(gallery->order);
+    free(gallery->slot_entry);
+    gallery->entries = NULL;
+    gallery->order = NULL;
+    gallery->slot_entry = NULL;
+}
+
+fpc_bep_result_t template_gallery_identify(template_gallery_t *gallery, bool *match,
+        uint16_t *template_id, template_gallery_stats_t *stats)
+{
+    template_gallery_t *g = gallery;
+    hal_tick_t start = hal_timebase_get_tick();
+    template_gallery_stats_t local = { 0 };
+    template_gallery_entry_t *e = NULL;
+    fpc_bep_result_t res;
+    uint32_t candidates = 0;
+    uint16_t slot = 0;
+
+    g->clock++;
+
+    local.identifies++;
+    res = identify(g, match, &slot);
+
+    if (res == FPC_BEP_RESULT_OK && !*match) {
+        // Page templates not in storage through the paging slot in order of score
+        candidates = sort_entries(g, false);
+    }
+    for (uint32_t next = 0; res == FPC_BEP_RESULT_OK && !*match && next < candidates; next++) {
+        local.paged++;
+        local.identifies++;
+        res = identify_paged(g, g->order[next].index, match, &slot, &local.flash_writes);
+    }
+
+    if (res == FPC_BEP_RESULT_OK && *match) {
+        if (slot >= g->capacity || g->slot_entry[slot] < 0) {
+            res = FPC_BEP_RESULT_INTERNAL_ERROR;
+        } else {
+            e = &g->entries[g->slot_entry[slot]];
+        }
+    }
+
+    if (res == FPC_BEP_RESULT_OK && *match) {
+        *template_id = e->id;
+        entry_hit(g, e);
+    }
+
+    local.elapsed_ms = hal_timebase_get_tick() - start;
+    if (stats) {
+        stats->identifies += local.identifies;
+        stats->paged += local.paged;
+        stats->flash_writes += local.flash_writes;
+        stats->elapsed_ms += local.elapsed_ms;
+    }
+    return res;
+}
+
+fpc_bep_result_t template_gallery_rebalance(template_gallery_t *gallery, uint32_t max_moves,
+        template_gallery_stats_t *stats)
+{
+    template_gallery_t *g = gallery;
+    hal_tick_t start = hal_timebase_get_tick();
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    uint32_t wanted = g->count < g->resident ? g->count : g->resident;
+    uint32_t writes = 0;
+    uint32_t moved = 0;
+    bool *keep;
+
+    keep = calloc(g->count ? g->count : 1, sizeof(bool));
+    if (keep == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    sort_entries(g, true);
+    for (uint32_t i = 0; i < wanted; i++) {
+        keep[g->order[i].index] = true;
+    }
+
+    // Best scored non-resident templates replace resident ones not kept
+    for (uint32_t i = 0; i < wanted && moved < max_moves && res == FPC_BEP_RESULT_OK; i++) {
+        uint32_t index = g->order[i].index;
+        int32_t victim = -1;
+        uint32_t victim_score = UINT32_MAX;
+
+        if (is_resident(g, &g->entries[index])) {
+            continue;
+        }
+        for (uint32_t s = 0; s < g->resident; s++) {
+            int32_t held = g->slot_entry[s];
+            uint32_t score;
+
+            if (held >= 0 && keep[held]) {
+                continue;
+            }
+            score = held < 0 ? 0 : entry_score(g, &g->entries[held]);
+            if (victim < 0 || score < victim_score) {
+                victim = s;
+                victim_score = score;
+            }
+        }
+        if (victim < 0) {
+            break;
+        }
+        res = load_slot(g, victim, index, &writes);
+        moved++;
+    }
+
+    free(keep);
+    if (stats) {
+        stats->flash_writes += writes;
+        stats->elapsed_ms += hal_timebase_get_tick() - start;
+    }
+    return res;
+}
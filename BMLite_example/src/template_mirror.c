@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    template_mirror.c
+ * @brief   Host-side record of templates stored on BM-Lite
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "template_mirror.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+#include "fpc_crc.h"
+
+#define BITMAP_WORDS (TEMPLATE_MIRROR_ID_COUNT / 64)
+/** Longest wait for event queue to apply template changes (msec) */
+#define SETTLE_TIMEOUT 1000
+
+/** Mirrors registered for template change callbacks */
+static template_mirror_t *mirrors;
+static pthread_mutex_t mirrors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static fpc_bep_result_t check_result(HCP_comm_t *chain, fpc_bep_result_t res)
+{
+    return res != FPC_BEP_RESULT_OK ? res : chain->bep_result;
+}
+
+/* Wait until template changes posted to event queue are applied to the mirror */
+static void settle(template_mirror_t *m)
+{
+#ifdef BMLITE_USE_EVENT_QUEUE
+    if (m->chain->event_queue == NULL) {
+        return;
+    }
+    for (int i = 0; i < SETTLE_TIMEOUT && !bmlite_event_queue_idle(m->chain->event_queue); i++) {
+        usleep(1000);
+    }
+#else
+    (void)m;
+#endif
+}
+
+static void set_used(template_mirror_t *m, uint16_t id, bool used)
+{
+    uint32_t word = id / 64;
+    uint64_t bit = 1ULL << (id % 64);
+
+    if (used) {
+        m->used[word] |= bit;
+    } else {
+        m->used[word] &= ~bit;
+        if (word < m->free_hint) {
+            m->free_hint = word;
+        }
+    }
+}
+
+static void set_entry(template_mirror_t *m, uint16_t id, template_mirror_state_t state,
+        uint32_t hash, uint32_t size)
+{
+    template_mirror_entry_t *e = &m->entries[id];
+
+    e->state = state;
+    e->hash = hash;
+    e->size = size;
+    e->generation = ++m->generation;
+    set_used(m, id, state != TEMPLATE_MIRROR_ABSENT);
+}
+
+static void clear_entries(template_mirror_t *m)
+{
+    memset(m->entries, 0, TEMPLATE_MIRROR_ID_COUNT * sizeof(template_mirror_entry_t));
+    memset(m->used, 0, BITMAP_WORDS * sizeof(uint64_t));
+    m->free_hint = 0;
+    m->generation++;
+}
+
+bool template_mirror_init(template_mirror_t *mirror, HCP_comm_t *chain)
+{
+    memset(mirror, 0, sizeof(*mirror));
+    mirror->chain = chain;
+    mirror->entries = calloc(TEMPLATE_MIRROR_ID_COUNT, sizeof(template_mirror_entry_t));
+    mirror->used = calloc(BITMAP_WORDS, sizeof(uint64_t));
+    if (mirror->entries == NULL || mirror->used == NULL) {
+        free(mirror->entries);
+        free(mirror->used);
+        return false;
+    }
+
+    pthread_mutex_init(&mirror->lock, NULL);
+    pthread_mutex_lock(&mirrors_lock);
+    mirror->next = mirrors;
+    mirrors = mirror;
+    pthread_mutex_unlock(&mirrors_lock);
+    return true;
+}
+
+void template_mirror_destroy(template_mirror_t *mirror)
+{
+    template_mirror_t **p;
+
+    pthread_mutex_lock(&mirrors_lock);
+    for (p = &mirrors; *p != NULL; p = &(*p)->next) {
+        if (*p == mirror) {
+            *p = mirror->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mirrors_lock);
+    pthread_mutex_destroy(&mirror->lock);
+    free(mirror->entries);
+    free(mirror->used);
+    mirror->entries = NULL;
+    mirror->used = NULL;
+}
+
+#ifdef BMLITE_USE_CALLBACK
+void bmlite_on_template_change(HCP_comm_t *chain, bmlite_template_event_t event,
+        uint16_t template_id, const uint8_t *data, uint32_t size)
+{
+    template_mirror_t *m;
+
+    pthread_mutex_lock(&mirrors_lock);
+    for (m = mirrors; m != NULL; m = m->next) {
+        if (m->chain != chain) {
+            continue;
+        }
+        pthread_mutex_lock(&m->lock);
+        switch (event) {
+            case BMLITE_TEMPLATE_PUT:
+                m->ram_known = true;
+                m->ram_hash = fpc_crc(0, data, size);
+                m->ram_size = size;
+                break;
+            case BMLITE_TEMPLATE_LOADED:
+                m->ram_known = m->entries[template_id].state == TEMPLATE_MIRROR_PRESENT;
+                m->ram_hash = m->entries[template_id].hash;
+                m->ram_size = m->entries[template_id].size;
+                break;
+            case BMLITE_TEMPLATE_RAM_CHANGED:
+                m->ram_known = false;
+                break;
+            case BMLITE_TEMPLATE_SAVED:
+                set_entry(m, template_id,
+                        m->ram_known ? TEMPLATE_MIRROR_PRESENT : TEMPLATE_MIRROR_STALE,
+                        m->ram_hash, m->ram_size);
+                break;
+            case BMLITE_TEMPLATE_REMOVED:
+                set_entry(m, template_id, TEMPLATE_MIRROR_ABSENT, 0, 0);
+                break;
+            case BMLITE_TEMPLATE_REMOVED_ALL:
+                clear_entries(m);
+                m->valid = true;
+                break;
+            case BMLITE_TEMPLATE_MATCHED:
+                // Match alone does not change the stored template
+                break;
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+    pthread_mutex_unlock(&mirrors_lock);
+}
+#endif
+
+static fpc_bep_result_t build_locked(template_mirror_t *mirror)
+{
+    HCP_comm_t *chain = mirror->chain;
+    fpc_bep_result_t res;
+    uint16_t *ids;
+    uint32_t count;
+    uint8_t *buf;
+
+    res = check_result(chain, bep_template_get_ids(chain));
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    count = chain->arg.size / 2;
+    ids = malloc((count ? count : 1) * sizeof(uint16_t));
+    buf = malloc(TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE);
+    if (ids == NULL || buf == NULL) {
+        free(ids);
+        free(buf);
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    memcpy(ids, chain->arg.data, count * sizeof(uint16_t));
+
+    clear_entries(mirror);
+    for (uint32_t i = 0; i < count; i++) {
+        // Until hash is known the template is stale
+        set_entry(mirror, ids[i], TEMPLATE_MIRROR_STALE, 0, 0);
+    }
+
+    for (uint32_t i = 0; i < count && res == FPC_BEP_RESULT_OK; i++) {
+        res = check_result(chain, bep_template_load_storage(chain, ids[i]));
+        if (res == FPC_BEP_RESULT_OK) {
+            res = check_result(chain, bep_template_get(chain, buf, TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE));
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            uint32_t size = HCP_MIN(chain->arg.size, TEMPLATE_ARCHIVE_MAX_TEMPLATE_SIZE);
+            set_entry(mirror, ids[i], TEMPLATE_MIRROR_PRESENT, fpc_crc(0, buf, size), size);
+            mirror->entries[ids[i]].synced_generation = mirror->generation;
+        }
+    }
+    mirror->valid = res == FPC_BEP_RESULT_OK;
+
+    free(ids);
+    free(buf);
+    return res;
+}
+
+fpc_bep_result_t template_mirror_build(template_mirror_t *mirror)
+{
+    fpc_bep_result_t res;
+
+    settle(mirror);
+    pthread_mutex_lock(&mirror->lock);
+    res = build_locked(mirror);
+    pthread_mutex_unlock(&mirror->lock);
+    settle(mirror);
+    return res;
+}
+
+/* Sync under mirror lock. IDs uploaded are marked in synced */
+static fpc_bep_result_t sync_locked(template_mirror_t *mirror, const template_archive_item_t *items,
+        uint32_t count, bool remove_extra, template_mirror_sync_stats_t *stats,
+        uint64_t *synced)
+{
+    HCP_comm_t *chain = mirror->chain;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    template_mirror_sync_stats_t st;
+    uint64_t *wanted;
+
+    if (!mirror->valid) {
+        return FPC_BEP_RESULT_WRONG_STATE;
+    }
+
+    memset(&st, 0, sizeof(st));
+    wanted = calloc(BITMAP_WORDS, sizeof(uint64_t));
+    if (wanted == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < count && res == FPC_BEP_RESULT_OK; i++) {
+        const template_archive_item_t *item = &items[i];
+        template_mirror_entry_t *e = &mirror->entries[item->id];
+        uint32_t hash = fpc_crc(0, item->data, item->size);
+
+        wanted[item->id / 64] |= 1ULL << (item->id % 64);
+
+        if (e->state == TEMPLATE_MIRROR_PRESENT && e->hash == hash && e->size == item->size) {
+            st.unchanged++;
+            continue;
+        }
+
+        if (e->state == TEMPLATE_MIRROR_PRESENT || e->state == TEMPLATE_MIRROR_STALE) {
+            res = check_result(chain, bep_template_remove(chain, item->id));
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            res = check_result(chain, bep_template_put(chain, item->data, item->size));
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            res = check_result(chain, bep_template_save(chain, item->id));
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            set_entry(mirror, item->id, TEMPLATE_MIRROR_PRESENT, hash, item->size);
+            e->synced_generation = mirror->generation;
+            synced[item->id / 64] |= 1ULL << (item->id % 64);
+            st.uploaded++;
+        }
+    }
+
+    if (remove_extra) {
+        for (uint32_t word = 0; word < BITMAP_WORDS && res == FPC_BEP_RESULT_OK; word++) {
+            uint64_t extra = mirror->used[word] & ~wanted[word];
+            while (extra && res == FPC_BEP_RESULT_OK) {
+                uint16_t id = word * 64 + __builtin_ctzll(extra);
+                extra &= extra - 1;
+                // Reserved ID has nothing on BM-Lite yet
+                if (mirror->entries[id].state == TEMPLATE_MIRROR_PENDING) {
+                    continue;
+                }
+                res = check_result(chain, bep_template_remove(chain, id));
+                if (res == FPC_BEP_RESULT_OK) {
+                    set_entry(mirror, id, TEMPLATE_MIRROR_ABSENT, 0, 0);
+                    st.removed++;
+                }
+            }
+        }
+    }
+
+    free(wanted);
+    *stats = st;
+    return res;
+}
+
+fpc_bep_result_t template_mirror_sync(template_mirror_t *mirror,
+        const template_archive_item_t *items, uint32_t count, bool remove_extra,
+        template_mirror_sync_stats_t *stats)
+{
+    fpc_bep_result_t res;
+    hal_tick_t start = hal_timebase_get_tick();
+    template_mirror_sync_stats_t st = { 0 };
+    uint64_t *synced = calloc(BITMAP_WORDS, sizeof(uint64_t));
+
+    if (synced == NULL) {
+        return FPC_BEP_RESULT_NO_MEMORY;
+    }
+    settle(mirror);
+    pthread_mutex_lock(&mirror->lock);
+    res = sync_locked(mirror, items, count, remove_extra, &st, synced);
+    pthread_mutex_unlock(&mirror->lock);
+
+    // Queued callbacks replay changes made by sync itself, uploaded entries stay synced
+    settle(mirror);
+    pthread_mutex_lock(&mirror->lock);
+    for (uint32_t word = 0; word < BITMAP_WORDS; word++) {
+        for (uint64_t bits = synced[word]; bits; bits &= bits - 1) {
+            template_mirror_entry_t *e = &mirror->entries[word * 64 + __builtin_ctzll(bits)];
+
+            if (e->state == TEMPLATE_MIRROR_PRESENT) {
+                e->synced_generation = e->generation;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mirror->lock);
+    free(synced);
+
+    st.elapsed_ms = hal_timebase_get_tick() - start;
+    if (stats) {
+        *stats = st;
+    }
+    return res;
+}
+
+static int32_t alloc_id(template_mirror_t *mirror)
+{
+    uint32_t word;
+
+    // Words before free_hint are known to be full
+    for (word = mirror->free_hint; word < BITMAP_WORDS; word++) {
+        if (mirror->used[word] != ~0ULL) {
+            uint16_t id = word * 64 + __builtin_ctzll(~mirror->used[word]);
+
+            mirror->free_hint = word;
+            set_entry(mirror, id, TEMPLATE_MIRROR_PENDING, 0, 0);
+            return id;
+        }
+    }
+    mirror->free_hint = BITMAP_WORDS;
+    return -1;
+}
+
+int32_t template_mirror_alloc_id(template_mirror_t *mirror)
+{
+    int32_t id;
+
+    pthread_mutex_lock(&mirror->lock);
+    id = alloc_id(mirror);
+    pthread_mutex_unlock(&mirror->lock);
+    return id;
+}
+
+void template_mirror_release_id(template_mirror_t *mirror, uint16_t template_id)
+{
+    pthread_mutex_lock(&mirror->lock);
+    if (mirror->entries[template_id].state == TEMPLATE_MIRROR_PENDING) {
+        set_entry(mirror, template_id, TEMPLATE_MIRROR_ABSENT, 0, 0);
+    }
+    pthread_mutex_unlock(&mirror->lock);
+}
+
+const template_mirror_entry_t *template_mirror_get(const template_mirror_t *mirror,
+        uint16_t template_id)
+{
+    return &mirror->entries[template_id];
+}
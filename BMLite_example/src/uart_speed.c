@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    uart_speed.c
+ * @brief   UART speed negotiation with BM-Lite
+ */
+
+#include <stdio.h>
+
+#include "uart_speed.h"
+#include "bmlite_if.h"
+#include "platform_rpi.h"
+
+/** Timeout for verifying link after speed change (msec) */
+#define SPEED_SWITCH_PROBE_TIMEOUT 200
+
+static fpc_bep_result_t check_result(HCP_comm_t *chain, fpc_bep_result_t res)
+{
+    return res != FPC_BEP_RESULT_OK ? res : chain->bep_result;
+}
+
+static fpc_bep_result_t probe_speed(HCP_comm_t *chain, uint32_t baudrate)
+{
+    fpc_bep_result_t res;
+    uint32_t prev_timeout = chain->phy_rx_timeout;
+    uint32_t speed = 0;
+
+    chain->phy_rx_timeout = SPEED_SWITCH_PROBE_TIMEOUT;
+    res = check_result(chain, bep_uart_speed_get(chain, &speed));
+    chain->phy_rx_timeout = prev_timeout;
+
+    if (res == FPC_BEP_RESULT_OK && speed != baudrate) {
+        res = FPC_BEP_RESULT_IO_ERROR;
+    }
+    return res;
+}
+
+/* Change host UART speed, link drain follows it */
+static fpc_bep_result_t set_speed(HCP_comm_t *chain, uint32_t baudrate)
+{
+    fpc_bep_result_t res = rpi_com_set_speed(chain->phy_session, baudrate);
+
+    if (res == FPC_BEP_RESULT_OK) {
+        chain->link_speed = baudrate;
+    }
+    return res;
+}
+
+fpc_bep_result_t uart_speed_switch(HCP_comm_t *chain, uint32_t baudrate)
+{
+    uint32_t old_baudrate = rpi_com_get_speed(chain->phy_session);
+    fpc_bep_result_t res;
+
+    if (baudrate == old_baudrate) {
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // BM-Lite answers at the old speed and switches after that
+    res = check_result(chain, bep_uart_speed_set(chain, baudrate));
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+
+    res = set_speed(chain, baudrate);
+    if (res == FPC_BEP_RESULT_OK) {
+        res = probe_speed(chain, baudrate);
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Roll back. BM-Lite may still be at the old speed
+    fprintf(stderr, "UART speed %u verification failed, rolling back to %u\n",
+            baudrate, old_baudrate);
+    if (set_speed(chain, old_baudrate) == FPC_BEP_RESULT_OK &&
+        probe_speed(chain, old_baudrate) == FPC_BEP_RESULT_OK) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+
+    // BM-Lite did switch, but the link is not reliable. Ask it to go back
+    if (set_speed(chain, baudrate) == FPC_BEP_RESULT_OK) {
+        bep_uart_speed_set(chain, old_baudrate);
+    }
+    set_speed(chain, old_baudrate);
+    if (probe_speed(chain, old_baudrate) != FPC_BEP_RESULT_OK) {
+        fprintf(stderr, "UART link lost after speed change\n");
+    }
+
+    return FPC_BEP_RESULT_IO_ERROR;
+}
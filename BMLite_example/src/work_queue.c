@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    work_queue.c
+ * @brief   Bounded blocking queue for handing work between threads
+ */
+
+#include <stdlib.h>
+
+#include "work_queue.h"
+
+bool work_queue_init(work_queue_t *queue, uint32_t capacity)
+{
+    queue->items = malloc(capacity * sizeof(void *));
+    if (queue->items == NULL) {
+        return false;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = false;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return true;
+}
+
+void work_queue_destroy(work_queue_t *queue)
+{
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+    queue->items = NULL;
+}
+
+static void enqueue(work_queue_t *queue, void *item)
+{
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+}
+
+bool work_queue_push(work_queue_t *queue, void *item)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    if (!queue->closed) {
+        enqueue(queue, item);
+        ok = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok;
+}
+
+bool work_queue_try_push(work_queue_t *queue, void *item)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->capacity && !queue->closed) {
+        enqueue(queue, item);
+        ok = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok;
+}
+
+void *work_queue_pop(work_queue_t *queue)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+void work_queue_close(work_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,73 @@
+# Copyright (c) 2020 Fingerprint Cards AB
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#   https://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Toolchain and build profile shared by BM-Lite makefiles
+#
+# Toolchain: cross compiler for Raspberry Pi by default.
+#   Native host build: make CROSS_COMPILE= (implies HOST=1, no GPIO and SPI)
+#
+# Profile: make BUILD=<profile>
+#   debug    - -Og, debug info and SDK debug output (default)
+#   release  - -O2, LTO, unused sections removed
+#   pgo-gen  - release with profiling instrumentation
+#   pgo-use  - release optimized with profile collected by pgo-gen (GCC 10+)
+
+TOOLCHAIN_PATH ?= /work/devtools/gcc-arm-hf/bin
+CROSS_COMPILE ?= arm-linux-gnueabihf-
+
+PATH := $(TOOLCHAIN_PATH):$(PATH)
+
+ifeq ($(CROSS_COMPILE),)
+HOST ?= 1
+endif
+
+CC := $(CROSS_COMPILE)gcc
+CXX := $(CROSS_COMPILE)g++
+# LTO aware archiver
+AR := $(CROSS_COMPILE)gcc-ar
+SIZE := $(CROSS_COMPILE)size
+
+BUILD ?= debug
+LTO ?= -flto=auto
+WERROR := -Werror
+
+RELEASE_CFLAGS := -O2 $(LTO)
+RELEASE_LDFLAGS := $(LTO) -Wl,--gc-sections
+
+ifeq ($(BUILD),debug)
+BUILD_CFLAGS := -g3 -Og -DDEBUG
+else ifeq ($(BUILD),release)
+BUILD_CFLAGS := $(RELEASE_CFLAGS)
+BUILD_LDFLAGS := $(RELEASE_LDFLAGS)
+else ifeq ($(BUILD),pgo-gen)
+BUILD_CFLAGS := $(RELEASE_CFLAGS) -fprofile-generate -fprofile-update=atomic
+BUILD_LDFLAGS := $(RELEASE_LDFLAGS) -fprofile-generate
+else ifeq ($(BUILD),pgo-use)
+BUILD_CFLAGS := $(RELEASE_CFLAGS) -fprofile-use -fprofile-partial-training -Wno-missing-profile
+BUILD_LDFLAGS := $(RELEASE_LDFLAGS)
+# Stale or partial profile is reported with warnings which are not code issues
+WERROR :=
+else
+$(error Unknown BUILD=$(BUILD), use debug, release, pgo-gen or pgo-use)
+endif
+
+# Output subdirectory. Profile data is found by object file name, so
+# pgo-gen and pgo-use share objects
+ifeq ($(BUILD),debug)
+BUILD_DIR :=
+else ifneq ($(filter pgo-%,$(BUILD)),)
+BUILD_DIR := /pgo
+else
+BUILD_DIR := /$(BUILD)
+endif
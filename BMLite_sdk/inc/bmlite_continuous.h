@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#ifndef BMLITE_CONTINUOUS_H
+#define BMLITE_CONTINUOUS_H
+
+/**
+ * @file    bmlite_continuous.h
+ * @brief   Continuous identification of touches
+ *
+ * BM-Lite waits for finger down on its side, so host sleeps until touch
+ * instead of polling with repeated captures. Each touch is captured and
+ * identified right away and the decision is passed to handler. After a
+ * match BM-Lite may update the template, so it is probed until ready before
+ * the handler is called. Then finger up is awaited, so finger resting on the sensor is reported once,
+ * and finger down wait is re-armed.
+ *
+ * Only HCP chain buffers are used, nothing is allocated per touch.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+
+/** Extra time for BM-Lite to answer after its own wait timeout (msec) */
+#define BMLITE_CONTINUOUS_RX_MARGIN 200
+
+/** Re-arm every 5 s, capture for 1 s, two capture attempts, 50 ms for template update */
+#define BMLITE_CONTINUOUS_PARAMS_DEFAULT \
+    { .wait_timeout = 5000, .capture_timeout = 1000, .capture_attempts = 2, \
+      .ready_timeout = 50 }
+
+typedef enum {
+    BMLITE_TOUCH_MATCH = 0,
+    BMLITE_TOUCH_NO_MATCH,
+    /** Capture, extract or identify failed. See bmlite_touch_event_t::error */
+    BMLITE_TOUCH_ERROR,
+} bmlite_touch_result_t;
+
+typedef struct {
+    bmlite_touch_result_t result;
+    /** Matched template, valid for ::BMLITE_TOUCH_MATCH */
+    uint16_t template_id;
+    /** Failed step result, valid for ::BMLITE_TOUCH_ERROR */
+    fpc_bep_result_t error;
+    /** When finger down was reported (usec, hal_timebase_get_us()) */
+    uint64_t touch_us;
+    /** Finger down report to decision (usec) */
+    uint32_t latency_us;
+    /** Touch number, starting from 1 */
+    uint32_t seq;
+} bmlite_touch_event_t;
+
+typedef struct {
+    /** Finger wait time on BM-Lite before re-arming (msec), 0 - forever */
+    uint16_t wait_timeout;
+    /** Capture timeout after finger down (msec) */
+    uint16_t capture_timeout;
+    /** Capture attempts per touch */
+    uint8_t capture_attempts;
+    /** Longest wait for BM-Lite updating template after match (msec),
+        see bep_wait_ready(). 0 - no wait */
+    uint16_t ready_timeout;
+} bmlite_continuous_params_t;
+
+typedef struct {
+    uint32_t touches;
+    uint32_t matches;
+    uint32_t no_matches;
+    uint32_t errors;
+    /** Finger waits expired without touch or lift */
+    uint32_t idle_rearms;
+    uint32_t latency_us_max;
+    uint64_t latency_us_total;
+} bmlite_continuous_stats_t;
+
+/**
+ * @brief Touch decision handler
+ *
+ * @param[in] event - decision of touch
+ * @param[in] ctx   - user context
+ *
+ * @return false to stop bmlite_continuous_run()
+ */
+typedef bool (*bmlite_touch_handler_t)(const bmlite_touch_event_t *event, void *ctx);
+
+/**
+ * @brief Idle handler, called each time a finger wait expires
+ *
+ * @param[in] ctx - user context
+ *
+ * @return false to stop bmlite_continuous_run()
+ */
+typedef bool (*bmlite_idle_handler_t)(void *ctx);
+
+typedef struct {
+    HCP_comm_t *chain;
+    bmlite_continuous_params_t params;
+    bmlite_touch_handler_t on_touch;
+    bmlite_idle_handler_t on_idle;
+    void *ctx;
+    bmlite_touch_event_t event;
+    bmlite_continuous_stats_t stats;
+} bmlite_continuous_t;
+
+/**
+ * @brief Initialize continuous identification
+ *
+ * @param[out] c        - continuous identification state
+ * @param[in]  chain    - HCP com chain
+ * @param[in]  params   - timeouts
+ * @param[in]  on_touch - touch decision handler
+ * @param[in]  on_idle  - idle handler, NULL - wait until touch
+ * @param[in]  ctx      - user context passed to handlers
+ */
+void bmlite_continuous_init(bmlite_continuous_t *c, HCP_comm_t *chain,
+        const bmlite_continuous_params_t *params, bmlite_touch_handler_t on_touch,
+        bmlite_idle_handler_t on_idle, void *ctx);
+
+/**
+ * @brief Identify touches until a handler returns false
+ *
+ * @param[in] c - continuous identification state
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_OK if stopped by handler,
+ *         otherwise communication error
+ */
+fpc_bep_result_t bmlite_continuous_run(bmlite_continuous_t *c);
+
+#endif /* BMLITE_CONTINUOUS_H */
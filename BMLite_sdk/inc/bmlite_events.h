@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_EVENTS_H
+#define BMLITE_EVENTS_H
+
+/**
+ * @file    bmlite_events.h
+ * @brief   Lock-free queue of bmlite_on_* events
+ *
+ * With BMLITE_USE_EVENT_QUEUE the SDK does not call bmlite_on_* callbacks
+ * of a chain which has event_queue set. Events are stored with time stamp
+ * in a single producer, single consumer ring instead and the application
+ * calls them from its own thread with bmlite_event_queue_drain(). Posting
+ * never blocks: if the ring is full the event is dropped and counted.
+ *
+ * The producer is the thread calling bep_* functions of the chain, there
+ * must be only one consumer per queue.
+ *
+ * Template data of bmlite_on_template_change() and image data of
+ * bmlite_on_image() are valid only during the SDK call, so they are copied
+ * to a payload ring given by bmlite_event_queue_set_payload(). Without the
+ * ring, or if it is full, events carrying data are dropped and counted.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hcp_tiny.h"
+
+#ifndef BMLITE_USE_CALLBACK
+  #error "BMLITE_USE_EVENT_QUEUE requires BMLITE_USE_CALLBACK"
+#endif
+
+typedef enum {
+    BMLITE_EVENT_ERROR = 0,
+    BMLITE_EVENT_START_CAPTURE,
+    BMLITE_EVENT_FINISH_CAPTURE,
+    BMLITE_EVENT_START_ENROLL,
+    BMLITE_EVENT_FINISH_ENROLL,
+    BMLITE_EVENT_START_ENROLLCAPTURE,
+    BMLITE_EVENT_FINISH_ENROLLCAPTURE,
+    BMLITE_EVENT_IDENTIFY_START,
+    BMLITE_EVENT_IDENTIFY_FINISH,
+    BMLITE_EVENT_TEMPLATE_CHANGE,
+    BMLITE_EVENT_IMAGE,
+} bmlite_event_type_t;
+
+typedef struct {
+    /** Time of event, hal_timebase_get_us() */
+    uint64_t time_us;
+    /** Chain which produced the event */
+    HCP_comm_t *chain;
+    bmlite_event_type_t type;
+    /** ::bmlite_error_t for BMLITE_EVENT_ERROR,
+        ::bmlite_template_event_t for BMLITE_EVENT_TEMPLATE_CHANGE */
+    int32_t error;
+    /** Result code for BMLITE_EVENT_ERROR, template ID for BMLITE_EVENT_TEMPLATE_CHANGE */
+    int32_t value;
+    /** Template or image data in payload ring, valid until next poll. NULL - none */
+    const uint8_t *data;
+    uint32_t size;
+    /** End of the data in payload ring. Written by SDK */
+    uint32_t data_end;
+} bmlite_event_t;
+
+typedef struct bmlite_event_queue {
+    bmlite_event_t *events;
+    uint32_t mask;
+    /** Written by producer only */
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t posted;
+    uint32_t dropped;
+    /** Payload ring, see bmlite_event_queue_set_payload() */
+    uint8_t *payload;
+    uint32_t payload_mask;
+    /** Written by producer only */
+    uint32_t payload_head;
+    /** Written by consumer only */
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t payload_tail;
+    /** Payload of last polled event, released by next poll */
+    uint32_t payload_polled;
+    /** Events whose callbacks returned, see bmlite_event_queue_idle() */
+    uint32_t dispatched;
+} bmlite_event_queue_t;
+
+typedef struct {
+    /** Events stored in the queue */
+    uint32_t posted;
+    /** Events lost because the queue was full */
+    uint32_t dropped;
+    /** Events waiting for consumer */
+    uint32_t pending;
+} bmlite_event_queue_stats_t;
+
+/**
+ * @brief Initialize event queue
+ *
+ * @param[out] queue  - queue
+ * @param[in]  events - storage for events
+ * @param[in]  count  - number of events in storage. Must be power of 2
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_event_queue_init(bmlite_event_queue_t *queue, bmlite_event_t *events,
+        uint32_t count);
+
+/**
+ * @brief Give queue a ring for template and image data of events
+ *
+ * Must be called before the queue is attached to a chain.
+ *
+ * @param[in] queue  - queue
+ * @param[in] buffer - ring storage
+ * @param[in] size   - size of storage. Must be power of 2
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_event_queue_set_payload(bmlite_event_queue_t *queue, uint8_t *buffer,
+        uint32_t size);
+
+/**
+ * @brief Post event of a chain. Used by SDK
+ *
+ * Calls the callback directly if chain has no event queue.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] type  - event type
+ * @param[in] error - ::bmlite_error_t for BMLITE_EVENT_ERROR
+ * @param[in] value - result code for BMLITE_EVENT_ERROR
+ */
+void bmlite_event_post(HCP_comm_t *chain, bmlite_event_type_t type, int32_t error,
+        int32_t value);
+
+/**
+ * @brief Post event of a chain with data, which is copied. Used by SDK
+ *
+ * Calls the callback directly if chain has no event queue.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] type  - event type
+ * @param[in] error - see bmlite_event_t::error
+ * @param[in] value - see bmlite_event_t::value
+ * @param[in] data  - template or image data. NULL - none
+ * @param[in] size  - size of data
+ */
+void bmlite_event_post_data(HCP_comm_t *chain, bmlite_event_type_t type, int32_t error,
+        int32_t value, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Take oldest event from queue
+ *
+ * Data of the event stays valid until the next call.
+ *
+ * @param[in]  queue - queue
+ * @param[out] event - event
+ *
+ * @return false if queue is empty
+ */
+bool bmlite_event_queue_poll(bmlite_event_queue_t *queue, bmlite_event_t *event);
+
+/**
+ * @brief Call bmlite_on_* callback of event
+ *
+ * @param[in] event - event
+ */
+void bmlite_event_dispatch(const bmlite_event_t *event);
+
+/**
+ * @brief Call callbacks of queued events
+ *
+ * @param[in] queue - queue
+ * @param[in] max   - max number of events to handle. 0 - all
+ *
+ * @return number of handled events
+ */
+uint32_t bmlite_event_queue_drain(bmlite_event_queue_t *queue, uint32_t max);
+
+/**
+ * @brief Check that callbacks of all posted events have returned
+ *
+ * Called by producer before it reads state kept by callbacks.
+ *
+ * @param[in] queue - queue
+ *
+ * @return true if no event is pending or being dispatched by bmlite_event_queue_drain()
+ */
+bool bmlite_event_queue_idle(bmlite_event_queue_t *queue);
+
+/**
+ * @brief Get queue counters
+ *
+ * @param[in]  queue - queue
+ * @param[out] stats - counters
+ */
+void bmlite_event_queue_get_stats(bmlite_event_queue_t *queue,
+        bmlite_event_queue_stats_t *stats);
+
+#endif /* BMLITE_EVENTS_H */
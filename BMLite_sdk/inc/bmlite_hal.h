@@ -82,6 +82,18 @@ fpc_bep_result_t hal_bmlite_spi_write_read(uint8_t *write, uint8_t *read, size_t
  */
 bool hal_bmlite_get_status(void);
 
+/*
+ * @brief Wait for BM-Lite IRQ pin to be set
+ *
+ * Default implementation polls hal_bmlite_get_status() every ms and sleeps
+ * with hal_timebase_busy_wait() in between. Platforms with pin interrupts
+ * should sleep until the edge instead.
+ *
+ * @param[in] timeout  Time to wait [ms]. 0 => check once
+ * @return true if IRQ pin is set
+ */
+bool hal_bmlite_wait_status(uint32_t timeout);
+
 /**
  * @brief Initializes timebase. Starts system tick counter.
  */
@@ -103,6 +115,13 @@ hal_tick_t hal_timebase_get_tick(void);
  */
 void hal_timebase_busy_wait(uint32_t ms);
 
+/**
+ * @brief Reads microsecond time counter. Used for latency measurement
+ *
+ * @return Time [us]. Platforms without fine timer return tick count * 1000
+ */
+uint64_t hal_timebase_get_us(void);
+
 /**
  *  Optional functions for Buttons & Leds control
  */
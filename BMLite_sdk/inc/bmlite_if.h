@@ -19,6 +19,18 @@
 
 #include "hcp_tiny.h"
 #include "bmlite_if_callbacks.h"
+#include "bmlite_image_quality.h"
+
+/**
+ * @brief BM-Lite power modes. Deeper modes save more power and take longer to wake
+ */
+typedef enum {
+    BMLITE_POWER_ACTIVE = 0,
+    BMLITE_POWER_IDLE,
+    BMLITE_POWER_SLEEP,
+    BMLITE_POWER_DEEP_SLEEP,
+    BMLITE_POWER_MODES,
+} bmlite_power_mode_t;
 
 /**
  * @brief Enroll finger. Created template must be saved to FLASH storage
@@ -29,6 +41,40 @@
  */
 fpc_bep_result_t bep_enroll_finger(HCP_comm_t *chain);
 
+/**
+ * @brief Start enroll from stored images
+ *
+ * @param[in] chain  - HCP com chain
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_enroll_start(HCP_comm_t *chain);
+
+/**
+ * @brief Push image and add it to enroll
+ *
+ * BM-Lite result is in chain->bep_result.
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] image  - image pixels
+ * @param[in] size   - image size
+ *
+ * @param[out] samples_remaining - number of images still needed
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_enroll_add_image(HCP_comm_t *chain, uint8_t *image, uint32_t size,
+        uint32_t *samples_remaining);
+
+/**
+ * @brief Finish enroll. Created template is in RAM and must be saved or uploaded
+ *
+ * @param[in] chain  - HCP com chain
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_enroll_finish(HCP_comm_t *chain);
+
 /**
  * @brief Capture and identify finger against existing templates in Flash storage
  *
@@ -44,6 +90,28 @@ fpc_bep_result_t bep_enroll_finger(HCP_comm_t *chain);
 fpc_bep_result_t bep_identify_finger(HCP_comm_t *chain, uint32_t timeout, 
                 uint16_t *template_id, bool *match);
 
+/**
+ * @brief Capture and identify finger with host-side image quality pre-check
+ *
+ * Captured image is uploaded and checked before extract. Poor image is
+ * rejected without extract and identify, so user can be asked to touch
+ * the sensor again.
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] timeout - timeout (msec). Maximum timeout 65535 msec
+ *                      set to 0 for waiting indefinitely
+ * @param[in] quality - quality thresholds. NULL - no pre-check
+ *
+ * @param[out] template_id - pointer for matched template ID
+ * @param[out] match       - pointer to match result
+ * @param[out] reason      - quality check result. Can be NULL
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_IMAGE_CAPTURE_ERROR if image is rejected
+ */
+fpc_bep_result_t bep_identify_finger_checked(HCP_comm_t *chain, uint32_t timeout,
+        const bmlite_quality_params_t *quality, uint16_t *template_id, bool *match,
+        bmlite_quality_reason_t *reason);
+
 /**
  * @brief Wait for finger present on sensor"
  *
@@ -88,6 +156,20 @@ fpc_bep_result_t bep_capture(HCP_comm_t *chain, uint16_t timeout);
  */
 fpc_bep_result_t bep_image_get_size(HCP_comm_t *chain, uint32_t *size);
 
+/**
+ * @brief Get sensor image geometry
+ *
+ * @param[in] chain  - HCP com chain
+ *
+ * @param[out] width  - image width in pixels
+ * @param[out] height - image height in pixels
+ * @param[out] dpi    - sensor resolution
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_image_get_geometry(HCP_comm_t *chain, uint16_t *width, uint16_t *height,
+        uint16_t *dpi);
+
 /**
  * @brief Allocates image buffer on FPC BM-LIte
  *
@@ -322,6 +404,22 @@ fpc_bep_result_t bep_uart_speed_set(HCP_comm_t *chain, uint32_t speed);
  */
 fpc_bep_result_t bep_uart_speed_get(HCP_comm_t *chain, uint32_t *speed);
 
+/**
+ * @brief Wait until FPC BM-Lite is ready to accept next command
+ *
+ * Sends a cheap request and returns as soon as BM-Lite answers it.
+ * Timeout bounds the whole exchange: ACK wait, answer and link retries.
+ * If there is no answer, waits until timeout expires and discards late
+ * data on the link.
+ *
+ * @param[in] chain   - HCP com chain
+ * @param[in] timeout - maximum wait time (msec)
+ *
+ * @return ::fpc_bep_result_t
+ *         FPC_BEP_RESULT_TIMEOUT if BM-Lite did not answer in time
+ */
+fpc_bep_result_t bep_wait_ready(HCP_comm_t *chain, uint32_t timeout);
+
 /**
  * @brief Reset FPC BM-Lite fingerprint sensor
  *
@@ -331,6 +429,28 @@ fpc_bep_result_t bep_uart_speed_get(HCP_comm_t *chain, uint32_t *speed);
  */
 fpc_bep_result_t bep_sensor_reset(HCP_comm_t *chain);
 
+/**
+ * @brief Put FPC BM-Lite to low power mode
+ *
+ * BM-Lite leaves low power mode on next command from host.
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] mode  - BMLITE_POWER_IDLE, BMLITE_POWER_SLEEP or BMLITE_POWER_DEEP_SLEEP
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_power_mode_set(HCP_comm_t *chain, bmlite_power_mode_t mode);
+
+/**
+ * @brief Get power mode of FPC BM-Lite
+ *
+ * @param[in]  chain - HCP com chain
+ * @param[out] mode  - power mode
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bep_power_mode_get(HCP_comm_t *chain, bmlite_power_mode_t *mode);
+
 /**
  * @brief Build and send command to FPC BM-Lite and receive answer
  *
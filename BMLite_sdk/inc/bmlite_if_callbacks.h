@@ -18,6 +18,28 @@
 #define BMLITE_IF_CALLBACKS_H
 #include <stdint.h>
 
+#include "hcp_tiny.h"
+
+/**
+ * @brief Changes of templates on BM-Lite reported by bmlite_on_template_change()
+ */
+typedef enum {
+    /** Template pushed to RAM. Template data is passed to callback */
+    BMLITE_TEMPLATE_PUT = 0,
+    /** Template copied from storage to RAM */
+    BMLITE_TEMPLATE_LOADED,
+    /** Template in RAM created or deleted by BM-Lite (enroll, delete) */
+    BMLITE_TEMPLATE_RAM_CHANGED,
+    /** Template in RAM saved to storage */
+    BMLITE_TEMPLATE_SAVED,
+    /** Template removed from storage */
+    BMLITE_TEMPLATE_REMOVED,
+    /** All templates removed from storage */
+    BMLITE_TEMPLATE_REMOVED_ALL,
+    /** Template in storage matched. BM-Lite may update it */
+    BMLITE_TEMPLATE_MATCHED,
+} bmlite_template_event_t;
+
 #ifndef BMLITE_USE_CALLBACK
   #define bmlite_on_error(error, value) 
   #define bmlite_on_start_capture() 
@@ -28,6 +50,8 @@
   #define bmlite_on_finish_enrollcapture() 
   #define bmlite_on_identify_start() 
   #define bmlite_on_identify_finish() 
+  #define bmlite_on_template_change(chain, event, template_id, data, size) 
+  #define bmlite_on_image(chain, data, size) 
 
 #else
 
@@ -54,6 +78,8 @@ typedef enum {
     BMLITE_ERROR_CALIBRATE_DELETE,
     BMLITE_ERROR_SEND_CMD,
     BMLITE_ERROR_GET_ARG,
+    /** Image rejected by quality pre-check. Value is ::bmlite_quality_reason_t */
+    BMLITE_ERROR_IMAGE_QUALITY,
 } bmlite_error_t;
 
 /**
@@ -103,6 +129,75 @@ void bmlite_on_identify_start();
  * @brief Finishing Identify Callback function
  */
 void bmlite_on_identify_finish();
+
+/**
+ * @brief Template Change Callback function
+ *
+ * Called after BM-Lite successfully executed a command changing templates
+ *
+ * @param[in] chain       - HCP com chain
+ * @param[in] event       - kind of change
+ * @param[in] template_id - template ID. Not used for RAM only changes
+ * @param[in] data        - template data for BMLITE_TEMPLATE_PUT, NULL otherwise
+ * @param[in] size        - size of template data
+ */
+void bmlite_on_template_change(HCP_comm_t *chain, bmlite_template_event_t event,
+        uint16_t template_id, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Image Upload Callback function
+ *
+ * Called after bep_image_get() successfully received an image
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] data  - image data in caller buffer
+ * @param[in] size  - size of image data
+ */
+void bmlite_on_image(HCP_comm_t *chain, const uint8_t *data, uint32_t size);
 #endif    // BMLITE_USE_CALLBACK
 
+/*
+ * Events raised by SDK for a chain. Routed to the chain event queue with
+ * BMLITE_USE_EVENT_QUEUE, otherwise passed to the callbacks directly.
+ */
+#ifdef BMLITE_USE_EVENT_QUEUE
+  #include "bmlite_events.h"
+
+  #define bmlite_emit_error(chain, error, value) \
+      bmlite_event_post(chain, BMLITE_EVENT_ERROR, error, value)
+  #define bmlite_emit_start_capture(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_START_CAPTURE, 0, 0)
+  #define bmlite_emit_finish_capture(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_FINISH_CAPTURE, 0, 0)
+  #define bmlite_emit_start_enroll(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_START_ENROLL, 0, 0)
+  #define bmlite_emit_finish_enroll(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_FINISH_ENROLL, 0, 0)
+  #define bmlite_emit_start_enrollcapture(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_START_ENROLLCAPTURE, 0, 0)
+  #define bmlite_emit_finish_enrollcapture(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_FINISH_ENROLLCAPTURE, 0, 0)
+  #define bmlite_emit_identify_start(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_IDENTIFY_START, 0, 0)
+  #define bmlite_emit_identify_finish(chain) \
+      bmlite_event_post(chain, BMLITE_EVENT_IDENTIFY_FINISH, 0, 0)
+  #define bmlite_emit_template_change(chain, event, template_id, data, size) \
+      bmlite_event_post_data(chain, BMLITE_EVENT_TEMPLATE_CHANGE, event, template_id, data, size)
+  #define bmlite_emit_image(chain, data, size) \
+      bmlite_event_post_data(chain, BMLITE_EVENT_IMAGE, 0, 0, data, size)
+#else
+  #define bmlite_emit_error(chain, error, value) bmlite_on_error(error, value)
+  #define bmlite_emit_start_capture(chain) bmlite_on_start_capture()
+  #define bmlite_emit_finish_capture(chain) bmlite_on_finish_capture()
+  #define bmlite_emit_start_enroll(chain) bmlite_on_start_enroll()
+  #define bmlite_emit_finish_enroll(chain) bmlite_on_finish_enroll()
+  #define bmlite_emit_start_enrollcapture(chain) bmlite_on_start_enrollcapture()
+  #define bmlite_emit_finish_enrollcapture(chain) bmlite_on_finish_enrollcapture()
+  #define bmlite_emit_identify_start(chain) bmlite_on_identify_start()
+  #define bmlite_emit_identify_finish(chain) bmlite_on_identify_finish()
+  #define bmlite_emit_template_change(chain, event, template_id, data, size) \
+      bmlite_on_template_change(chain, event, template_id, data, size)
+  #define bmlite_emit_image(chain, data, size) bmlite_on_image(chain, data, size)
+#endif    // BMLITE_USE_EVENT_QUEUE
+
 #endif
\ No newline at end of file
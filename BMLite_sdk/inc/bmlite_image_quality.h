@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMLITE_IMAGE_QUALITY_H
+#define BMLITE_IMAGE_QUALITY_H
+
+/**
+ * @file    bmlite_image_quality.h
+ * @brief   Host-side quality check of captured images
+ *
+ * All metrics are computed in one pass over the image. SSE2 or NEON kernel
+ * is used when the compiler targets it, scalar kernel otherwise.
+ * Both kernels give identical results.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Image sums computed by quality kernels */
+typedef struct {
+    uint32_t pixels;
+    /** Pixels darker than background level */
+    uint32_t covered;
+    uint8_t min;
+    uint8_t max;
+    uint64_t sum;
+    uint64_t sum_sq;
+    /** Sum of absolute differences of horizontal and vertical neighbours */
+    uint64_t gradient;
+    /** Number of neighbour pairs in gradient */
+    uint32_t pairs;
+} bmlite_image_sums_t;
+
+typedef struct {
+    /** Covered area, % */
+    uint32_t coverage;
+    /** Difference of brightest and darkest pixel */
+    uint32_t contrast;
+    /** Pixel variance */
+    uint32_t variance;
+    /** Mean absolute neighbour difference, 1/100 of gray level */
+    uint32_t sharpness;
+} bmlite_image_quality_t;
+
+typedef struct {
+    /** Image width. 0 - square image is assumed */
+    uint32_t width;
+    /** Pixels darker than this level are finger */
+    uint8_t background;
+    uint32_t min_coverage;
+    uint32_t min_contrast;
+    uint32_t min_variance;
+    uint32_t min_sharpness;
+} bmlite_quality_params_t;
+
+typedef enum {
+    BMLITE_QUALITY_OK = 0,
+    /** Finger covers too small part of sensor */
+    BMLITE_QUALITY_LOW_COVERAGE,
+    BMLITE_QUALITY_LOW_CONTRAST,
+    BMLITE_QUALITY_LOW_VARIANCE,
+    /** Smeared or moving finger */
+    BMLITE_QUALITY_LOW_SHARPNESS,
+    /** Empty image or image size does not fit geometry */
+    BMLITE_QUALITY_BAD_GEOMETRY,
+} bmlite_quality_reason_t;
+
+/** Default quality thresholds */
+#define BMLITE_QUALITY_PARAMS_DEFAULT { \
+    .width = 0,                         \
+    .background = 200,                  \
+    .min_coverage = 30,                 \
+    .min_contrast = 64,                 \
+    .min_variance = 400,                \
+    .min_sharpness = 500,               \
+}
+
+/**
+ * @brief Compute image sums with scalar code
+ *
+ * Reference implementation of the kernels.
+ *
+ * @param[in] image      - 8-bit image
+ * @param[in] width      - image width
+ * @param[in] height     - image height
+ * @param[in] background - background level
+ * @param[out] sums      - image sums
+ */
+void bmlite_image_sums_scalar(const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background, bmlite_image_sums_t *sums);
+
+/**
+ * @brief Compute image sums with the fastest available kernel
+ *
+ * @param[in] image      - 8-bit image
+ * @param[in] width      - image width
+ * @param[in] height     - image height
+ * @param[in] background - background level
+ * @param[out] sums      - image sums
+ */
+void bmlite_image_sums(const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background, bmlite_image_sums_t *sums);
+
+/**
+ * @brief Compute histogram of pixel values
+ *
+ * @param[in] image - 8-bit image
+ * @param[in] size  - number of pixels
+ * @param[out] hist - number of pixels of each value
+ */
+void bmlite_image_histogram(const uint8_t *image, uint32_t size, uint32_t hist[256]);
+
+/**
+ * @brief Get name of kernel used by bmlite_image_sums()
+ */
+const char *bmlite_image_kernel_name(void);
+
+/**
+ * @brief Check image quality
+ *
+ * @param[in] image    - 8-bit image
+ * @param[in] size     - image size
+ * @param[in] params   - image geometry and thresholds
+ * @param[out] quality - image quality. Can be NULL
+ *
+ * @return first failed check or BMLITE_QUALITY_OK
+ */
+bmlite_quality_reason_t bmlite_image_check(const uint8_t *image, uint32_t size,
+        const bmlite_quality_params_t *params, bmlite_image_quality_t *quality);
+
+#endif /* BMLITE_IMAGE_QUALITY_H */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITE_METRICS_H
+#define BMLITE_METRICS_H
+
+/**
+ * @file    bmlite_metrics.h
+ * @brief   Link and command counters maintained by the SDK
+ *
+ * Counters are updated with relaxed atomic operations, so any thread can
+ * take a snapshot while commands run. Build with BMLITE_USE_METRICS to
+ * enable; without it counting compiles to nothing and snapshots are zero.
+ */
+
+#include <stdint.h>
+
+#include "fpc_bep_types.h"
+
+/** Result code buckets: OK, FPC_BEP_RESULT_xxx codes and other */
+#define BMLITE_METRICS_RESULTS 28
+
+/** Command buckets */
+typedef enum {
+    BMLITE_METRICS_CMD_CAPTURE = 0,
+    BMLITE_METRICS_CMD_ENROLL,
+    BMLITE_METRICS_CMD_IDENTIFY,
+    BMLITE_METRICS_CMD_IMAGE,
+    BMLITE_METRICS_CMD_TEMPLATE,
+    BMLITE_METRICS_CMD_WAIT,
+    BMLITE_METRICS_CMD_STORAGE_TEMPLATE,
+    BMLITE_METRICS_CMD_INFO,
+    BMLITE_METRICS_CMD_COMMUNICATION,
+    BMLITE_METRICS_CMD_MCU,
+    BMLITE_METRICS_CMD_SENSOR,
+    BMLITE_METRICS_CMD_RESET,
+    BMLITE_METRICS_CMD_CANCEL,
+    BMLITE_METRICS_CMD_OTHER,
+    BMLITE_METRICS_CMDS,
+} bmlite_metrics_cmd_t;
+
+typedef struct {
+    /** Link frames and bytes, including CRC. ACKs are not counted */
+    uint64_t frames_tx;
+    uint64_t frames_rx;
+    uint64_t bytes_tx;
+    uint64_t bytes_rx;
+    /** Received frames with wrong CRC */
+    uint64_t crc_errors;
+    /** Sent frames not acknowledged in time */
+    uint64_t ack_timeouts;
+    /** Sent frames answered with something else than ACK */
+    uint64_t ack_errors;
+    /** No response frame within receive timeout */
+    uint64_t rx_timeouts;
+    /** Frames sent again after loss */
+    uint64_t retries;
+    /** Time spent waiting for BM-Lite in bmlite_tranceive() (usec) */
+    uint64_t blocked_us;
+    /** Gauge: commands in progress */
+    uint32_t in_flight;
+    /** Gauge: duration of last command (usec) */
+    uint32_t last_command_us;
+    /** Commands by ::bmlite_metrics_cmd_t and result bucket. Link errors
+        are counted with link result, otherwise with BM-Lite result */
+    uint64_t commands[BMLITE_METRICS_CMDS][BMLITE_METRICS_RESULTS];
+} bmlite_metrics_t;
+
+#ifdef BMLITE_USE_METRICS
+
+extern bmlite_metrics_t bmlite_metrics;
+
+#define bmlite_metric_add(name, value) \
+    __atomic_fetch_add(&bmlite_metrics.name, (value), __ATOMIC_RELAXED)
+#define bmlite_metric_set(name, value) \
+    __atomic_store_n(&bmlite_metrics.name, (value), __ATOMIC_RELAXED)
+
+/**
+ * @brief Count finished command
+ *
+ * @param[in] cmd     - BM-Lite command
+ * @param[in] result  - link result or BM-Lite result
+ * @param[in] elapsed - command duration (usec)
+ */
+void bmlite_metrics_command(uint16_t cmd, fpc_bep_result_t result, uint32_t elapsed);
+
+#else
+
+#define bmlite_metric_add(name, value)
+#define bmlite_metric_set(name, value)
+#define bmlite_metrics_command(cmd, result, elapsed)
+
+#endif  // BMLITE_USE_METRICS
+
+/**
+ * @brief Copy all counters
+ *
+ * @param[out] snapshot - counters. Each counter is read atomically
+ */
+void bmlite_metrics_snapshot(bmlite_metrics_t *snapshot);
+
+/**
+ * @brief Name of command bucket
+ *
+ * @param[in] cmd - ::bmlite_metrics_cmd_t
+ *
+ * @return lower case name
+ */
+const char *bmlite_metrics_cmd_name(int cmd);
+
+/**
+ * @brief Name of result bucket
+ *
+ * @param[in] index - result bucket
+ *
+ * @return lower case name of result code
+ */
+const char *bmlite_metrics_result_name(int index);
+
+#endif /* BMLITE_METRICS_H */
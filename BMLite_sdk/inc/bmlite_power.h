@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITE_POWER_H
+#define BMLITE_POWER_H
+
+/**
+ * @file    bmlite_power.h
+ * @brief   Idle power policy of BM-Lite
+ *
+ * Host calls bmlite_power_idle() periodically while BM-Lite is not used.
+ * BM-Lite is stepped down to deeper power modes as idle time grows.
+ * Before next use host calls bmlite_power_wake(), which wakes BM-Lite
+ * and records time from wake-up to the answer of the first command
+ * for the mode BM-Lite was in.
+ *
+ * Power commands and wake-up by the next frame are tested on the emulator
+ * only, not yet on BM-Lite hardware.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+
+/** Longest wait for BM-Lite to answer after wake-up (msec) */
+#define BMLITE_POWER_WAKE_TIMEOUT 1000
+
+/** Idle 1 s, sleep after 10 s, deep sleep after 1 min */
+#define BMLITE_POWER_POLICY_DEFAULT { .enter_ms = { 0, 1000, 10000, 60000 } }
+
+typedef struct {
+    /** Idle time (msec) before entering mode. Index is ::bmlite_power_mode_t.
+        0 - mode is not used */
+    uint32_t enter_ms[BMLITE_POWER_MODES];
+} bmlite_power_policy_t;
+
+typedef struct {
+    uint32_t entries;
+    uint32_t wakeups;
+    /** Wake-up to first answer latency (usec) */
+    uint32_t wake_us_last;
+    uint32_t wake_us_max;
+    uint64_t wake_us_total;
+    /** Time spent in mode (msec) */
+    uint64_t residency_ms;
+} bmlite_power_stats_t;
+
+typedef struct {
+    HCP_comm_t *chain;
+    bmlite_power_policy_t policy;
+    bmlite_power_mode_t mode;
+    /** When BM-Lite was used last time */
+    hal_tick_t idle_since;
+    /** When current mode was entered */
+    hal_tick_t mode_since;
+    bmlite_power_stats_t stats[BMLITE_POWER_MODES];
+} bmlite_power_t;
+
+/**
+ * @brief Initialize power policy. BM-Lite is assumed to be active
+ *
+ * @param[out] power  - power policy state
+ * @param[in]  chain  - HCP com chain
+ * @param[in]  policy - idle times of power modes
+ */
+void bmlite_power_init(bmlite_power_t *power, HCP_comm_t *chain,
+        const bmlite_power_policy_t *policy);
+
+/**
+ * @brief Step BM-Lite down to deepest mode allowed by idle time
+ *
+ * @param[in] power - power policy state
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_power_idle(bmlite_power_t *power);
+
+/**
+ * @brief Time until next step down
+ *
+ * @param[in] power - power policy state
+ *
+ * @return time (msec), 0 if BM-Lite is in its deepest mode
+ */
+uint32_t bmlite_power_next_ms(const bmlite_power_t *power);
+
+/**
+ * @brief Wake BM-Lite before use
+ *
+ * Does nothing if BM-Lite is active.
+ *
+ * @param[in] power - power policy state
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_power_wake(bmlite_power_t *power);
+
+/**
+ * @brief Mark end of BM-Lite use. Restarts idle time
+ *
+ * @param[in] power - power policy state
+ */
+void bmlite_power_done(bmlite_power_t *power);
+
+#endif /* BMLITE_POWER_H */
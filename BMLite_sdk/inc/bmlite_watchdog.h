@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BMLITE_WATCHDOG_H
+#define BMLITE_WATCHDOG_H
+
+/**
+ * @file    bmlite_watchdog.h
+ * @brief   Detection of wedged BM-Lite and automatic recovery
+ *
+ * Attached watchdog is told by HCP transport about every link fault of its
+ * chain and about result of every command. It trips after a burst of faults
+ * (timeouts, CRC errors, words other than ACK) or after several commands in
+ * a row failed on the link. Host calls bmlite_watchdog_check() between
+ * commands. A tripped watchdog escalates through CMD_CANCEL, SW reset,
+ * sensor reset and HW reset until BM-Lite answers again, and records time
+ * from first fault to the answer.
+ *
+ * Resets bring BM-Lite back at its default UART speed and without template
+ * in RAM, recovered application must set them up again.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hcp_tiny.h"
+
+/** Up to 8 link faults within 2 s, 3 failed commands in a row, no command
+    waits more than 30 s for an answer */
+#define BMLITE_WATCHDOG_CONFIG_DEFAULT { \
+    .fault_limit = 8, \
+    .window_ms = 2000, \
+    .fail_limit = 3, \
+    .verify_ms = 500, \
+    .stall_ms = 30000, \
+}
+
+/** Link faults reported by HCP transport */
+typedef enum {
+    /** No answer or no rest of frame in time */
+    BMLITE_WATCHDOG_RX_TIMEOUT = 0,
+    /** Sent frame not acknowledged in time */
+    BMLITE_WATCHDOG_ACK_TIMEOUT,
+    /** Sent frame answered with something else than ACK */
+    BMLITE_WATCHDOG_ACK_ERROR,
+    /** Received frame with wrong CRC */
+    BMLITE_WATCHDOG_CRC_ERROR,
+    /** Received frame with wrong size or physical layer error */
+    BMLITE_WATCHDOG_FRAME_ERROR,
+    BMLITE_WATCHDOG_FAULTS,
+} bmlite_watchdog_fault_t;
+
+/** Recovery steps in order of escalation */
+typedef enum {
+    BMLITE_WATCHDOG_CANCEL = 0,
+    BMLITE_WATCHDOG_SW_RESET,
+    BMLITE_WATCHDOG_SENSOR_RESET,
+    BMLITE_WATCHDOG_HW_RESET,
+    BMLITE_WATCHDOG_STEPS,
+} bmlite_watchdog_step_t;
+
+typedef struct {
+    /** Link faults within window_ms that trip the watchdog. 0 - not used */
+    uint32_t fault_limit;
+    uint32_t window_ms;
+    /** Commands failed on the link in a row that trip the watchdog. 0 - not used */
+    uint32_t fail_limit;
+    /** Time for BM-Lite to answer after each recovery step (msec) */
+    uint32_t verify_ms;
+    /** Longest wait for answer to a command sent without receive timeout
+        (msec). 0 - wait forever */
+    uint32_t stall_ms;
+    /** Hardware reset of BM-Lite. NULL - platform_bmlite_reset() */
+    void (*hw_reset)(HCP_comm_t *chain);
+} bmlite_watchdog_config_t;
+
+typedef struct {
+    /** Link faults by ::bmlite_watchdog_fault_t */
+    uint32_t faults[BMLITE_WATCHDOG_FAULTS];
+    uint32_t trips;
+    /** Recoveries by ::bmlite_watchdog_step_t which brought BM-Lite back */
+    uint32_t recovered[BMLITE_WATCHDOG_STEPS];
+    /** Recoveries where BM-Lite did not answer after HW reset */
+    uint32_t failed;
+    /** First fault to first answer after recovery (usec) */
+    uint32_t down_us_last;
+    uint32_t down_us_max;
+    uint64_t down_us_total;
+} bmlite_watchdog_stats_t;
+
+typedef struct bmlite_watchdog {
+    HCP_comm_t *chain;
+    bmlite_watchdog_config_t config;
+    bool tripped;
+    /** Recovery in progress, its own commands are not watched */
+    bool recovering;
+    /** Failed commands in a row */
+    uint32_t fails;
+    /** Faults in current window */
+    uint32_t window_faults;
+    uint64_t window_start_us;
+    /** First fault since BM-Lite answered last time. 0 - link is healthy */
+    uint64_t down_since_us;
+    /** Link timeouts after last answered command, without backoff of faults */
+    HCP_rto_t ack_rto;
+    HCP_rto_t body_rto;
+    bmlite_watchdog_stats_t stats;
+} bmlite_watchdog_t;
+
+/**
+ * @brief Initialize watchdog and attach it to the chain
+ *
+ * @param[out] wd     - watchdog state
+ * @param[in]  chain  - HCP com chain
+ * @param[in]  config - detection limits
+ */
+void bmlite_watchdog_init(bmlite_watchdog_t *wd, HCP_comm_t *chain,
+        const bmlite_watchdog_config_t *config);
+
+/**
+ * @brief Detach watchdog from its chain
+ *
+ * @param[in] wd - watchdog state
+ */
+void bmlite_watchdog_detach(bmlite_watchdog_t *wd);
+
+/**
+ * @brief Recover BM-Lite if the watchdog has tripped
+ *
+ * @param[in] wd - watchdog state
+ *
+ * @return ::fpc_bep_result_t, FPC_BEP_RESULT_OK if the link is healthy or
+ *         was recovered
+ */
+fpc_bep_result_t bmlite_watchdog_check(bmlite_watchdog_t *wd);
+
+/**
+ * @brief Escalate recovery steps until BM-Lite answers
+ *
+ * Called by bmlite_watchdog_check(). Can be called directly to recover
+ * BM-Lite the host knows to be wedged.
+ *
+ * @param[in]  wd   - watchdog state
+ * @param[out] step - step which brought BM-Lite back. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t bmlite_watchdog_recover(bmlite_watchdog_t *wd, bmlite_watchdog_step_t *step);
+
+/**
+ * @brief Mean time to recovery
+ *
+ * @param[in] wd - watchdog state
+ *
+ * @return time from first fault to answer (usec), 0 if nothing was recovered
+ */
+uint32_t bmlite_watchdog_mttr_us(const bmlite_watchdog_t *wd);
+
+/**
+ * @brief Name of recovery step
+ *
+ * @param[in] step - ::bmlite_watchdog_step_t
+ *
+ * @return lower case name
+ */
+const char *bmlite_watchdog_step_name(int step);
+
+/**
+ * @brief Name of link fault
+ *
+ * @param[in] fault - ::bmlite_watchdog_fault_t
+ *
+ * @return lower case name
+ */
+const char *bmlite_watchdog_fault_name(int fault);
+
+/**
+ * @brief Report link fault of the chain. Called by HCP transport
+ *
+ * @param[in] chain - HCP com chain
+ * @param[in] fault - fault
+ */
+void bmlite_watchdog_fault(HCP_comm_t *chain, bmlite_watchdog_fault_t fault);
+
+/**
+ * @brief Report finished command of the chain. Called by HCP transport
+ *
+ * @param[in] chain  - HCP com chain
+ * @param[in] result - link result of the command
+ */
+void bmlite_watchdog_command(HCP_comm_t *chain, fpc_bep_result_t result);
+
+/**
+ * @brief Receive timeout of the chain limited by stall_ms. Called by HCP transport
+ *
+ * @param[in] chain - HCP com chain
+ *
+ * @return timeout (msec), 0 - wait forever
+ */
+uint32_t bmlite_watchdog_rx_timeout(const HCP_comm_t *chain);
+
+#endif /* BMLITE_WATCHDOG_H */
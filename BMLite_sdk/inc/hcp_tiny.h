@@ -26,16 +26,54 @@
 /** Communication acknowledge definition */
 #define FPC_BEP_ACK 0x7f01ff7f
 
+/** Link timeouts before first round trip is measured (msec) */
+#define HCP_ACK_TIMEOUT_INIT    500
+#define HCP_BODY_TIMEOUT_INIT   100
+/** Default floors and ceilings of adaptive link timeouts (msec). ACK floor
+    is HCP_ACK_TIMEOUT_MIN with link retries and HCP_ACK_TIMEOUT_INIT without */
+#define HCP_ACK_TIMEOUT_MIN     50
+#define HCP_ACK_TIMEOUT_MAX     2000
+#define HCP_BODY_TIMEOUT_MIN    50
+#define HCP_BODY_TIMEOUT_MAX    1000
+
+/** Link speed assumed when chain does not know its own (bit/s) */
+#define HCP_LINK_SPEED_DEFAULT  115200
+
 typedef struct {
     uint32_t size;
     uint8_t *data;
 } HCP_arg_t;
 
+/**
+ * @brief Adaptive timeout of one link phase
+ *
+ * Computed as TCP retransmission timeout (RFC 6298): SRTT + 4 * RTTVAR,
+ * limited to [min, max] and doubled after each expiry. Set min = max for
+ * a fixed timeout.
+ *
+ * Frame body timeout follows frame size: srtt, rttvar and timeout are of a
+ * full MTU frame, the wait for a body is timeout scaled to its size plus min.
+ */
+typedef struct {
+    /** Lowest timeout (msec). 0 - default of the phase */
+    uint32_t min;
+    /** Highest timeout (msec). 0 - default of the phase */
+    uint32_t max;
+    /** Smoothed round trip time (usec). 0 - not measured yet */
+    uint32_t srtt;
+    /** Round trip time variation (usec) */
+    uint32_t rttvar;
+    /** Current timeout (msec). 0 - initial timeout of the phase */
+    uint32_t timeout;
+} HCP_rto_t;
+
 typedef struct {
     /** Send data to BM-Lite */
     fpc_bep_result_t (*write) (uint16_t, const uint8_t *, uint32_t, void *);  
     /** Receive data from BM-Lite */
     fpc_bep_result_t (*read)(uint16_t, uint8_t *, uint32_t, void *);
+    /** Physical layer session passed to write and read. NULL - default session */
+    void *phy_session;
     /** Receive timeout (msec). Applys ONLY to receiving packet from BM-Lite on physical layer */
     uint32_t phy_rx_timeout;
     /** Data buffer for application layer */
@@ -51,6 +89,29 @@ typedef struct {
     HCP_arg_t arg;
     /** Result of execution command on BM-Lite */
     fpc_bep_result_t bep_result;
+    /** Queue receiving bmlite_on_* events of this chain, see bmlite_events.h.
+        NULL - callbacks are called directly */
+    struct bmlite_event_queue *event_queue;
+    /** Wait for ACK of sent frame */
+    HCP_rto_t ack_rto;
+    /** Wait for rest of received frame after its header */
+    HCP_rto_t body_rto;
+    /** Times a frame is sent again when ACK is not received in time. Only
+        frames of commands changing nothing are sent again, as the ACK and not
+        the frame may be lost. Also lowers ACK floor to HCP_ACK_TIMEOUT_MIN.
+        0 - lost frame fails the command after 500 ms (default) */
+    uint8_t link_retries;
+    /** Watchdog recovering wedged BM-Lite of this chain, see bmlite_watchdog.h.
+        NULL - link faults are only reported to the caller */
+    struct bmlite_watchdog *watchdog;
+    /** Longest time of whole bmlite_tranceive() including ACK waits and link
+        retries (msec). 0 - each phase is limited by its own timeout only */
+    uint32_t exchange_timeout;
+    /** End of current exchange (usec). Set by bmlite_tranceive() */
+    uint64_t exchange_deadline;
+    /** Speed of physical link (bit/s), sizes silence ending link drain.
+        0 - HCP_LINK_SPEED_DEFAULT */
+    uint32_t link_speed;
 } HCP_comm_t;
 
 /**
@@ -143,4 +204,33 @@ fpc_bep_result_t bmlite_get_arg(HCP_comm_t *hcp_comm, uint16_t arg_type);
  */
 fpc_bep_result_t bmlite_copy_arg(HCP_comm_t *hcp_comm, uint16_t arg_key, void *arg_data, uint16_t arg_data_size);
 
+ /**
+ * @brief  Forget measured link round trips, e.g. after link speed change.
+ *         Timeouts start again from HCP_ACK_TIMEOUT_INIT and HCP_BODY_TIMEOUT_INIT
+ *
+ * @param[in] hcp_comm     - pointer to HCP_comm struct
+ */
+void bmlite_reset_rto(HCP_comm_t *hcp_comm);
+
+/**
+ * @brief  Read and discard what is left of broken or late frames, so the
+ *         next answer starts at frame boundary
+ *
+ * @param[in] hcp_comm     - pointer to HCP_comm struct
+ * @param[in] timeout      - silence on the link that ends draining (msec),
+ *                           at least bmlite_frame_time()
+ *
+ * @return number of discarded bytes
+ */
+uint32_t bmlite_drain_link(HCP_comm_t *hcp_comm, uint32_t timeout);
+
+/**
+ * @brief  Time of one MTU frame at link speed of the chain, rounded up
+ *
+ * @param[in] hcp_comm     - pointer to HCP_comm struct
+ *
+ * @return frame time (msec)
+ */
+uint32_t bmlite_frame_time(const HCP_comm_t *hcp_comm);
+
 #endif 
\ No newline at end of file
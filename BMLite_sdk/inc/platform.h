@@ -31,6 +31,7 @@
 #include <stddef.h>
 
 #include "fpc_bep_types.h"
+#include "hcp_tiny.h"
 
 /**
  * @brief Initializes board
@@ -39,6 +40,34 @@
  */
 fpc_bep_result_t platform_init(void *params);
 
+/** Startup steps of platform_attach() */
+typedef struct {
+    /** Board and timebase init (msec) */
+    uint32_t init_ms;
+    /** Probe of running BM-Lite (msec) */
+    uint32_t probe_ms;
+    /** HW reset and wait for BM-Lite to answer after it (msec). 0 - no reset */
+    uint32_t reset_ms;
+    /** BM-Lite did not answer the probe and was reset */
+    bool reset;
+} platform_attach_timing_t;
+
+/**
+ * @brief Initializes board and attaches to already running BM-Lite
+ *
+ * BM-Lite is probed with a cheap command first. HW Reset is done
+ * only if BM-Lite does not answer, then BM-Lite must answer after it.
+ *
+ * @param[in]  params  - pointer to additional parameters.
+ * @param[in]  chain   - HCP com chain
+ * @param[out] timing  - time of startup steps. Can be NULL
+ *
+ * @return ::fpc_bep_result_t
+ *         FPC_BEP_RESULT_TIMEOUT if BM-Lite did not answer after HW reset
+ */
+fpc_bep_result_t platform_attach(void *params, HCP_comm_t *chain,
+        platform_attach_timing_t *timing);
+
 /**
  * @brief Does BM-Lite HW Reset
  *
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/**
+ * @file    bmlite_continuous.c
+ * @brief   Continuous identification of touches
+ */
+
+#include <string.h>
+
+#include "bmlite_continuous.h"
+
+void bmlite_continuous_init(bmlite_continuous_t *c, HCP_comm_t *chain,
+        const bmlite_continuous_params_t *params, bmlite_touch_handler_t on_touch,
+        bmlite_idle_handler_t on_idle, void *ctx)
+{
+    memset(c, 0, sizeof(*c));
+    c->chain = chain;
+    c->params = *params;
+    if (c->params.capture_attempts == 0) {
+        c->params.capture_attempts = 1;
+    }
+    c->on_touch = on_touch;
+    c->on_idle = on_idle;
+    c->ctx = ctx;
+}
+
+/* Send command with BM-Lite side timeout. Host waits a bit longer for the answer */
+static fpc_bep_result_t send_timed(HCP_comm_t *chain, uint16_t cmd, uint16_t arg,
+        uint16_t timeout)
+{
+    fpc_bep_result_t res;
+    uint32_t prev_timeout = chain->phy_rx_timeout;
+
+    chain->phy_rx_timeout = timeout ? timeout + BMLITE_CONTINUOUS_RX_MARGIN : 0;
+    res = bmlite_send_cmd_arg(chain, cmd, arg, ARG_TIMEOUT, &timeout, sizeof(timeout));
+    chain->phy_rx_timeout = prev_timeout;
+    return res;
+}
+
+/* Wait for finger down or up. *reached is false if the wait expired */
+static fpc_bep_result_t finger_wait(bmlite_continuous_t *c, uint16_t arg, bool *reached)
+{
+    HCP_comm_t *chain = c->chain;
+    fpc_bep_result_t res = send_timed(chain, CMD_WAIT, arg, c->params.wait_timeout);
+
+    *reached = false;
+    if (res == FPC_BEP_RESULT_TIMEOUT) {
+        // No answer in time is handled as expired wait
+        return FPC_BEP_RESULT_OK;
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    if (chain->bep_result == FPC_BEP_RESULT_OK) {
+        *reached = true;
+    } else if (chain->bep_result != FPC_BEP_RESULT_TIMEOUT) {
+        return chain->bep_result;
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+static bool idle(bmlite_continuous_t *c)
+{
+    c->stats.idle_rearms++;
+    return c->on_idle == NULL || c->on_idle(c->ctx);
+}
+
+/*
+ * Capture, extract and identify. BM-Lite errors end up in the event,
+ * only communication errors are returned.
+ */
+static fpc_bep_result_t decide(bmlite_continuous_t *c, bmlite_touch_event_t *event)
+{
+    HCP_comm_t *chain = c->chain;
+    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
+    bool match = false;
+
+    for (int i = 0; i < c->params.capture_attempts; i++) {
+        res = send_timed(chain, CMD_CAPTURE, ARG_NONE, c->params.capture_timeout);
+        if (res != FPC_BEP_RESULT_OK || chain->bep_result == FPC_BEP_RESULT_OK) {
+            break;
+        }
+    }
+    if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+        res = bep_image_extract(chain);
+    }
+    if (res == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK) {
+        res = bep_identify(chain);
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        event->result = BMLITE_TOUCH_ERROR;
+        event->error = chain->bep_result;
+        return FPC_BEP_RESULT_OK;
+    }
+
+    res = bmlite_copy_arg(chain, ARG_MATCH, &match, sizeof(match));
+    if (res == FPC_BEP_RESULT_OK && match) {
+        res = bmlite_copy_arg(chain, ARG_ID, &event->template_id,
+                sizeof(event->template_id));
+    }
+    if (res != FPC_BEP_RESULT_OK) {
+        event->result = BMLITE_TOUCH_ERROR;
+        event->error = res;
+    } else {
+        event->result = match ? BMLITE_TOUCH_MATCH : BMLITE_TOUCH_NO_MATCH;
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+static void account(bmlite_continuous_t *c, const bmlite_touch_event_t *event)
+{
+    bmlite_continuous_stats_t *stats = &c->stats;
+
+    switch (event->result) {
+        case BMLITE_TOUCH_MATCH:
+            stats->matches++;
+            break;
+        case BMLITE_TOUCH_NO_MATCH:
+            stats->no_matches++;
+            break;
+        default:
+            stats->errors++;
+            break;
+    }
+    stats->latency_us_total += event->latency_us;
+    if (event->latency_us > stats->latency_us_max) {
+        stats->latency_us_max = event->latency_us;
+    }
+}
+
+fpc_bep_result_t bmlite_continuous_run(bmlite_continuous_t *c)
+{
+    bmlite_touch_event_t *event = &c->event;
+    fpc_bep_result_t res;
+    bool reached;
+
+    for (;;) {
+        res = finger_wait(c, ARG_FINGER_DOWN, &reached);
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        if (!reached) {
+            if (!idle(c)) {
+                return FPC_BEP_RESULT_OK;
+            }
+            continue;
+        }
+
+        memset(event, 0, sizeof(*event));
+        event->touch_us = hal_timebase_get_us();
+        event->seq = ++c->stats.touches;
+        res = decide(c, event);
+        if (res != FPC_BEP_RESULT_OK) {
+            return res;
+        }
+        event->latency_us = (uint32_t)(hal_timebase_get_us() - event->touch_us);
+        account(c, event);
+        // Template may be updating after match, as in bep_identify_finger()
+        if (event->result == BMLITE_TOUCH_MATCH && c->params.ready_timeout) {
+            bep_wait_ready(c->chain, c->params.ready_timeout);
+        }
+        if (c->on_touch && !c->on_touch(event, c->ctx)) {
+            return FPC_BEP_RESULT_OK;
+        }
+
+        // Finger resting on the sensor is reported once
+        do {
+            res = finger_wait(c, ARG_FINGER_UP, &reached);
+            if (res != FPC_BEP_RESULT_OK) {
+                return res;
+            }
+            if (!reached && !idle(c)) {
+                return FPC_BEP_RESULT_OK;
+            }
+        } while (!reached);
+    }
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_events.c
+ * @brief   Lock-free queue of bmlite_on_* events
+ */
+
+#ifdef BMLITE_USE_EVENT_QUEUE
+
+#include <stddef.h>
+#include <string.h>
+
+#include "bmlite_hal.h"
+#include "bmlite_events.h"
+#include "bmlite_if_callbacks.h"
+
+fpc_bep_result_t bmlite_event_queue_init(bmlite_event_queue_t *queue, bmlite_event_t *events,
+        uint32_t count)
+{
+    if (queue == NULL || events == NULL || count == 0 || (count & (count - 1))) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    queue->events = events;
+    queue->mask = count - 1;
+    queue->head = 0;
+    queue->posted = 0;
+    queue->dropped = 0;
+    queue->payload = NULL;
+    queue->payload_mask = 0;
+    queue->payload_head = 0;
+    queue->tail = 0;
+    queue->payload_tail = 0;
+    queue->payload_polled = 0;
+    queue->dispatched = 0;
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_event_queue_set_payload(bmlite_event_queue_t *queue, uint8_t *buffer,
+        uint32_t size)
+{
+    if (queue == NULL || buffer == NULL || size == 0 || (size & (size - 1))) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    queue->payload = buffer;
+    queue->payload_mask = size - 1;
+    return FPC_BEP_RESULT_OK;
+}
+
+static void drop(bmlite_event_queue_t *queue)
+{
+    __atomic_store_n(&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+}
+
+void bmlite_event_post_data(HCP_comm_t *chain, bmlite_event_type_t type, int32_t error,
+        int32_t value, const uint8_t *data, uint32_t size)
+{
+    bmlite_event_queue_t *queue = chain->event_queue;
+    bmlite_event_t *event;
+    uint32_t head;
+    uint32_t start;
+
+    if (queue == NULL) {
+        bmlite_event_t direct = {
+            .chain = chain,
+            .type = type,
+            .error = error,
+            .value = value,
+            .data = data,
+            .size = size,
+        };
+        bmlite_event_dispatch(&direct);
+        return;
+    }
+
+    head = queue->head;
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) > queue->mask) {
+        drop(queue);
+        return;
+    }
+    event = &queue->events[head & queue->mask];
+    start = queue->payload_head;
+    event->data = NULL;
+    if (data != NULL) {
+        uint32_t ring = queue->payload_mask + 1;
+
+        if (queue->payload == NULL || size > ring) {
+            drop(queue);
+            return;
+        }
+        // Data is kept contiguous, the ring end it doesn't fit in is skipped
+        if ((start & queue->payload_mask) + size > ring) {
+            start += ring - (start & queue->payload_mask);
+        }
+        if (start + size - __atomic_load_n(&queue->payload_tail, __ATOMIC_ACQUIRE) > ring) {
+            drop(queue);
+            return;
+        }
+        event->data = queue->payload + (start & queue->payload_mask);
+        memcpy(queue->payload + (start & queue->payload_mask), data, size);
+        start += size;
+        queue->payload_head = start;
+    }
+    event->time_us = hal_timebase_get_us();
+    event->chain = chain;
+    event->type = type;
+    event->error = error;
+    event->value = value;
+    event->size = size;
+    event->data_end = start;
+    __atomic_store_n(&queue->posted, queue->posted + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void bmlite_event_post(HCP_comm_t *chain, bmlite_event_type_t type, int32_t error,
+        int32_t value)
+{
+    bmlite_event_post_data(chain, type, error, value, NULL, 0);
+}
+
+bool bmlite_event_queue_poll(bmlite_event_queue_t *queue, bmlite_event_t *event)
+{
+    uint32_t tail = queue->tail;
+
+    // Consumer is done with data of the previous event
+    __atomic_store_n(&queue->payload_tail, queue->payload_polled, __ATOMIC_RELEASE);
+    if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *event = queue->events[tail & queue->mask];
+    queue->payload_polled = event->data_end;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void bmlite_event_dispatch(const bmlite_event_t *event)
+{
+    switch (event->type) {
+        case BMLITE_EVENT_ERROR:
+            bmlite_on_error(event->error, event->value);
+            break;
+        case BMLITE_EVENT_START_CAPTURE:
+            bmlite_on_start_capture();
+            break;
+        case BMLITE_EVENT_FINISH_CAPTURE:
+            bmlite_on_finish_capture();
+            break;
+        case BMLITE_EVENT_START_ENROLL:
+            bmlite_on_start_enroll();
+            break;
+        case BMLITE_EVENT_FINISH_ENROLL:
+            bmlite_on_finish_enroll();
+            break;
+        case BMLITE_EVENT_START_ENROLLCAPTURE:
+            bmlite_on_start_enrollcapture();
+            break;
+        case BMLITE_EVENT_FINISH_ENROLLCAPTURE:
+            bmlite_on_finish_enrollcapture();
+            break;
+        case BMLITE_EVENT_IDENTIFY_START:
+            bmlite_on_identify_start();
+            break;
+        case BMLITE_EVENT_IDENTIFY_FINISH:
+            bmlite_on_identify_finish();
+            break;
+        case BMLITE_EVENT_TEMPLATE_CHANGE:
+            bmlite_on_template_change(event->chain, event->error, event->value,
+                    event->data, event->size);
+            break;
+        case BMLITE_EVENT_IMAGE:
+            bmlite_on_image(event->chain, event->data, event->size);
+            break;
+    }
+}
+
+uint32_t bmlite_event_queue_drain(bmlite_event_queue_t *queue, uint32_t max)
+{
+    bmlite_event_t event;
+    uint32_t count = 0;
+
+    while ((max == 0 || count < max) && bmlite_event_queue_poll(queue, &event)) {
+        bmlite_event_dispatch(&event);
+        __atomic_store_n(&queue->dispatched, queue->dispatched + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+    return count;
+}
+
+bool bmlite_event_queue_idle(bmlite_event_queue_t *queue)
+{
+    return __atomic_load_n(&queue->dispatched, __ATOMIC_ACQUIRE) == queue->head;
+}
+
+void bmlite_event_queue_get_stats(bmlite_event_queue_t *queue,
+        bmlite_event_queue_stats_t *stats)
+{
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    stats->posted = __atomic_load_n(&queue->posted, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+    stats->pending = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+#endif  // BMLITE_USE_EVENT_QUEUE
@@ -25,6 +25,7 @@
 #define MAX_CAPTURE_ATTEMPTS 15
 #define MAX_SINGLE_CAPTURE_ATTEMPTS 3
 #define CAPTURE_TIMEOUT 3000
+#define READY_TIMEOUT 50
 
 #define exit_if_err(c) { bep_result = c; if(bep_result || chain->bep_result) goto exit; }
 
@@ -47,23 +48,33 @@ __attribute__((weak)) void bmlite_on_finish_enrollcapture() {}
 
 __attribute__((weak)) void bmlite_on_identify_start() {}
 __attribute__((weak)) void bmlite_on_identify_finish() {}
+
+__attribute__((weak)) void bmlite_on_template_change(HCP_comm_t *chain,
+        bmlite_template_event_t event, uint16_t template_id, const uint8_t *data, uint32_t size)
+{ (void)chain; (void)event; (void)template_id; (void)data; (void)size; }
+
+__attribute__((weak)) void bmlite_on_image(HCP_comm_t *chain, const uint8_t *data,
+        uint32_t size)
+{ (void)chain; (void)data; (void)size; }
 #endif
 
+#define succeeded(res) ((res) == FPC_BEP_RESULT_OK && chain->bep_result == FPC_BEP_RESULT_OK)
+
 fpc_bep_result_t bep_enroll_finger(HCP_comm_t *chain)
 {
     uint32_t samples_remaining = 0;
     fpc_bep_result_t bep_result = FPC_BEP_RESULT_OK;
     bool enroll_done = false;
 
-    bmlite_on_start_enroll();
+    bmlite_emit_start_enroll(chain);
     /* Enroll start */
     exit_if_err(bmlite_send_cmd(chain, CMD_ENROLL, ARG_START));
     
     for (uint8_t i = 0; i < MAX_CAPTURE_ATTEMPTS; ++i) {
 
-        bmlite_on_start_enrollcapture();
+        bmlite_emit_start_enrollcapture(chain);
         bep_result = bep_capture(chain, CAPTURE_TIMEOUT);
-        bmlite_on_finish_enrollcapture();
+        bmlite_emit_finish_enrollcapture(chain);
 
         if (bep_result != FPC_BEP_RESULT_OK) {
             continue;
@@ -89,20 +100,72 @@ fpc_bep_result_t bep_enroll_finger(HCP_comm_t *chain)
     }
 
     bep_result = bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+    bmlite_emit_template_change(chain, BMLITE_TEMPLATE_RAM_CHANGED, 0, NULL, 0);
 
 exit:
-    bmlite_on_finish_enroll();
+    bmlite_emit_finish_enroll(chain);
     return (!enroll_done) ? FPC_BEP_RESULT_GENERAL_ERROR : bep_result;
 }
 
+fpc_bep_result_t bep_enroll_start(HCP_comm_t *chain)
+{
+    return bmlite_send_cmd(chain, CMD_ENROLL, ARG_START);
+}
+
+fpc_bep_result_t bep_enroll_add_image(HCP_comm_t *chain, uint8_t *image, uint32_t size,
+        uint32_t *samples_remaining)
+{
+    assert(bep_image_put(chain, image, size));
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        return FPC_BEP_RESULT_OK;
+    }
+    assert(bmlite_send_cmd(chain, CMD_ENROLL, ARG_ADD));
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        return FPC_BEP_RESULT_OK;
+    }
+    return bmlite_copy_arg(chain, ARG_COUNT, samples_remaining, sizeof(*samples_remaining));
+}
+
+fpc_bep_result_t bep_enroll_finish(HCP_comm_t *chain)
+{
+    fpc_bep_result_t bep_result = bmlite_send_cmd(chain, CMD_ENROLL, ARG_FINISH);
+    bmlite_emit_template_change(chain, BMLITE_TEMPLATE_RAM_CHANGED, 0, NULL, 0);
+    return bep_result;
+}
+
 fpc_bep_result_t bep_identify_finger(HCP_comm_t *chain, uint32_t timeout, uint16_t *template_id, bool *match)
+{
+    return bep_identify_finger_checked(chain, timeout, NULL, template_id, match, NULL);
+}
+
+fpc_bep_result_t bep_identify_finger_checked(HCP_comm_t *chain, uint32_t timeout,
+        const bmlite_quality_params_t *quality, uint16_t *template_id, bool *match,
+        bmlite_quality_reason_t *reason)
 {
     fpc_bep_result_t bep_result;
     *match = false;
+    if (reason) {
+        *reason = BMLITE_QUALITY_OK;
+    }
 
-    bmlite_on_identify_start();
+    bmlite_emit_identify_start(chain);
 
     exit_if_err(bep_capture(chain, timeout));
+    if (quality) {
+        bmlite_quality_reason_t r;
+        // Image is checked in place in packet buffer
+        exit_if_err(bmlite_send_cmd(chain, CMD_IMAGE, ARG_UPLOAD));
+        exit_if_err(bmlite_get_arg(chain, ARG_DATA));
+        r = bmlite_image_check(chain->arg.data, chain->arg.size, quality, NULL);
+        if (reason) {
+            *reason = r;
+        }
+        if (r != BMLITE_QUALITY_OK) {
+            bmlite_emit_error(chain, BMLITE_ERROR_IMAGE_QUALITY, r);
+            bep_result = FPC_BEP_RESULT_IMAGE_CAPTURE_ERROR;
+            goto exit;
+        }
+    }
     exit_if_err(bep_image_extract(chain));
     exit_if_err(bep_identify(chain));
     exit_if_err(bmlite_get_arg(chain, ARG_MATCH));
@@ -110,11 +173,11 @@ fpc_bep_result_t bep_identify_finger(HCP_comm_t *chain, uint32_t timeout, uint16
     if(*match) {
         bmlite_get_arg(chain, ARG_ID);
         *template_id = *(uint16_t *)chain->arg.data;
-        // Delay for possible updating template on BM-Lite
-        hal_timebase_busy_wait(50);
+        // Wait for possible updating template on BM-Lite
+        bep_wait_ready(chain, READY_TIMEOUT);
     }
 exit:
-    bmlite_on_identify_finish();
+    bmlite_emit_identify_finish(chain);
     return bep_result;    
 }
 
@@ -123,11 +186,11 @@ fpc_bep_result_t sensor_wait_finger_present(HCP_comm_t *chain, uint16_t timeout)
     fpc_bep_result_t bep_result;
     uint32_t prev_timeout = chain->phy_rx_timeout;
 
-    bmlite_on_start_capture();
+    bmlite_emit_start_capture(chain);
     chain->phy_rx_timeout = timeout;
     bep_result = bmlite_send_cmd_arg(chain, CMD_WAIT, ARG_FINGER_DOWN, ARG_TIMEOUT, &timeout, sizeof(timeout));
     chain->phy_rx_timeout = prev_timeout;
-    bmlite_on_finish_capture();
+    bmlite_emit_finish_capture(chain);
 
     return bep_result;
 }
@@ -149,7 +212,7 @@ fpc_bep_result_t bep_capture(HCP_comm_t *chain, uint16_t timeout)
     fpc_bep_result_t bep_result;
     uint32_t prev_timeout = chain->phy_rx_timeout;
 
-    bmlite_on_start_capture();
+    bmlite_emit_start_capture(chain);
     chain->phy_rx_timeout = timeout;
     for(int i=0; i< MAX_SINGLE_CAPTURE_ATTEMPTS; i++) {
         bep_result = bmlite_send_cmd_arg(chain, CMD_CAPTURE, ARG_NONE, ARG_TIMEOUT, &timeout, sizeof(timeout));
@@ -157,7 +220,7 @@ fpc_bep_result_t bep_capture(HCP_comm_t *chain, uint16_t timeout)
             break;
     }
     chain->phy_rx_timeout = prev_timeout;
-    bmlite_on_finish_capture();
+    bmlite_emit_finish_capture(chain);
 
     return bep_result;
 }
@@ -172,6 +235,28 @@ fpc_bep_result_t bep_image_get_size(HCP_comm_t *chain, uint32_t *size)
     return FPC_BEP_RESULT_OK;
 }
 
+fpc_bep_result_t bep_image_get_geometry(HCP_comm_t *chain, uint16_t *width, uint16_t *height,
+        uint16_t *dpi)
+{
+    assert(bmlite_init_cmd(chain, CMD_INFO, ARG_GET));
+    assert(bmlite_add_arg(chain, ARG_WIDTH, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_HEIGHT, 0, 0));
+    assert(bmlite_add_arg(chain, ARG_DPI, 0, 0));
+    assert(bmlite_tranceive(chain));
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        return chain->bep_result;
+    }
+
+    assert(bmlite_get_arg(chain, ARG_WIDTH));
+    *width = *(uint16_t *)chain->arg.data;
+    assert(bmlite_get_arg(chain, ARG_HEIGHT));
+    *height = *(uint16_t *)chain->arg.data;
+    assert(bmlite_get_arg(chain, ARG_DPI));
+    *dpi = *(uint16_t *)chain->arg.data;
+
+    return FPC_BEP_RESULT_OK;
+}
+
 fpc_bep_result_t image_create(HCP_comm_t *chain)
 {
     return bmlite_send_cmd(chain, CMD_IMAGE, ARG_CREATE);
@@ -185,7 +270,9 @@ fpc_bep_result_t image_delete(HCP_comm_t *chain)
 fpc_bep_result_t bep_image_get(HCP_comm_t *chain, uint8_t *data, uint32_t size)
 {
     assert(bmlite_send_cmd(chain, CMD_IMAGE, ARG_UPLOAD));
-    return bmlite_copy_arg(chain, ARG_DATA, data, size);
+    assert(bmlite_copy_arg(chain, ARG_DATA, data, size));
+    bmlite_emit_image(chain, data, HCP_MIN(size, chain->arg.size));
+    return FPC_BEP_RESULT_OK;
 }
 
 fpc_bep_result_t bep_image_put(HCP_comm_t *chain, uint8_t *data, uint32_t size)
@@ -200,17 +287,31 @@ fpc_bep_result_t bep_image_extract(HCP_comm_t *chain)
 
 fpc_bep_result_t bep_identify(HCP_comm_t *chain)
 {
-   return bmlite_send_cmd(chain, CMD_IDENTIFY, ARG_NONE);
+    fpc_bep_result_t bep_result = bmlite_send_cmd(chain, CMD_IDENTIFY, ARG_NONE);
+    if (succeeded(bep_result) && bmlite_get_arg(chain, ARG_MATCH) == FPC_BEP_RESULT_OK &&
+            *(bool *)chain->arg.data && bmlite_get_arg(chain, ARG_ID) == FPC_BEP_RESULT_OK) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_MATCHED, *(uint16_t *)chain->arg.data,
+                NULL, 0);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_save(HCP_comm_t *chain, uint16_t template_id)
 {
-    return bmlite_send_cmd_arg(chain, CMD_TEMPLATE, ARG_SAVE, ARG_ID, &template_id, sizeof(template_id));
+    fpc_bep_result_t bep_result = bmlite_send_cmd_arg(chain, CMD_TEMPLATE, ARG_SAVE, ARG_ID, &template_id, sizeof(template_id));
+    if (succeeded(bep_result)) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_SAVED, template_id, NULL, 0);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_remove_ram(HCP_comm_t *chain)
 {
-    return bmlite_send_cmd(chain, CMD_TEMPLATE, ARG_DELETE);
+    fpc_bep_result_t bep_result = bmlite_send_cmd(chain, CMD_TEMPLATE, ARG_DELETE);
+    if (succeeded(bep_result)) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_RAM_CHANGED, 0, NULL, 0);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_get(HCP_comm_t *chain, uint8_t *data, uint32_t size)
@@ -221,26 +322,42 @@ fpc_bep_result_t bep_template_get(HCP_comm_t *chain, uint8_t *data, uint32_t siz
 
 fpc_bep_result_t bep_template_put(HCP_comm_t *chain, uint8_t *data, uint16_t length)
 {
-    return bmlite_send_cmd_arg(chain, CMD_TEMPLATE, ARG_DOWNLOAD,
+    fpc_bep_result_t bep_result = bmlite_send_cmd_arg(chain, CMD_TEMPLATE, ARG_DOWNLOAD,
            ARG_DATA, data, length);
+    if (succeeded(bep_result)) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_PUT, 0, data, length);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_remove(HCP_comm_t *chain, uint16_t template_id)
 {
-    return bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE, 
+    fpc_bep_result_t bep_result = bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE, 
             ARG_ID, &template_id, sizeof(template_id));
+    if (succeeded(bep_result)) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_REMOVED, template_id, NULL, 0);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_remove_all(HCP_comm_t *chain)
 {
-    return bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE,
+    fpc_bep_result_t bep_result = bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_DELETE,
              ARG_ALL, 0, 0);
+    if (succeeded(bep_result)) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_REMOVED_ALL, 0, NULL, 0);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_load_storage(HCP_comm_t *chain, uint16_t template_id)
 {
-   return bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_UPLOAD,   
+    fpc_bep_result_t bep_result = bmlite_send_cmd_arg(chain, CMD_STORAGE_TEMPLATE, ARG_UPLOAD,   
             ARG_ID, &template_id, sizeof(template_id));
+    if (succeeded(bep_result)) {
+        bmlite_emit_template_change(chain, BMLITE_TEMPLATE_LOADED, template_id, NULL, 0);
+    }
+    return bep_result;
 }
 
 fpc_bep_result_t bep_template_get_count(HCP_comm_t *chain, uint16_t *count)
@@ -289,7 +406,10 @@ fpc_bep_result_t bep_uart_speed_set(HCP_comm_t *chain, uint32_t speed)
     assert(bmlite_init_cmd(chain, CMD_COMMUNICATION, ARG_SPEED));
     assert(bmlite_add_arg(chain, ARG_SET, 0, 0));
     assert(bmlite_add_arg(chain, ARG_DATA, (uint8_t*)&speed, sizeof(speed)));
-    return bmlite_tranceive(chain);
+    assert(bmlite_tranceive(chain));
+    // Round trips measured at old speed are not valid any more
+    bmlite_reset_rto(chain);
+    return FPC_BEP_RESULT_OK;
 
 }
 
@@ -298,18 +418,78 @@ fpc_bep_result_t bep_uart_speed_get(HCP_comm_t *chain, uint32_t *speed)
     assert(bmlite_init_cmd(chain, CMD_COMMUNICATION, ARG_SPEED));
     assert(bmlite_add_arg(chain, ARG_GET, 0, 0));
     assert(bmlite_tranceive(chain));
-    return bmlite_copy_arg(chain, ARG_DATA, speed, sizeof(speed));
+    return bmlite_copy_arg(chain, ARG_DATA, speed, sizeof(*speed));
 
 }
 
+fpc_bep_result_t bep_wait_ready(HCP_comm_t *chain, uint32_t timeout)
+{
+    fpc_bep_result_t bep_result;
+    uint32_t prev_timeout = chain->phy_rx_timeout;
+    uint32_t prev_exchange = chain->exchange_timeout;
+    uint8_t prev_retries = chain->link_retries;
+    hal_tick_t start = hal_timebase_get_tick();
+    hal_tick_t elapsed;
+
+    // BM-Lite answers a cheap request as soon as it can process commands again.
+    // ACK wait, answer and retries all fit in the timeout
+    chain->phy_rx_timeout = timeout;
+    chain->exchange_timeout = timeout;
+    chain->link_retries = 0;
+    bep_result = bmlite_send_cmd_arg(chain, CMD_INFO, ARG_GET, ARG_VERSION, 0, 0);
+    chain->phy_rx_timeout = prev_timeout;
+    chain->exchange_timeout = prev_exchange;
+    chain->link_retries = prev_retries;
+
+    if (bep_result == FPC_BEP_RESULT_OK) {
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Fall back to the fixed delay if BM-Lite did not answer
+    elapsed = hal_timebase_get_tick() - start;
+    if (elapsed < timeout) {
+        hal_timebase_busy_wait(timeout - elapsed);
+    }
+    // Late answer to the probe would be taken for answer to the next command
+    bmlite_drain_link(chain, bmlite_frame_time(chain));
+    return FPC_BEP_RESULT_TIMEOUT;
+}
+
 fpc_bep_result_t bep_sensor_reset(HCP_comm_t *chain)
 {
-    // Delay for possible updating template on BM-Lite
-    hal_timebase_busy_wait(50);
+    // Wait for possible updating template on BM-Lite
+    bep_wait_ready(chain, READY_TIMEOUT);
 
     return bmlite_send_cmd(chain, CMD_SENSOR, ARG_RESET);    
 }
 
+fpc_bep_result_t bep_power_mode_set(HCP_comm_t *chain, bmlite_power_mode_t mode)
+{
+    static const uint16_t mode_arg[BMLITE_POWER_MODES] = {
+        [BMLITE_POWER_IDLE] = ARG_IDLE,
+        [BMLITE_POWER_SLEEP] = ARG_SLEEP,
+        [BMLITE_POWER_DEEP_SLEEP] = ARG_DEEP_SLEEP,
+    };
+
+    if (mode <= BMLITE_POWER_ACTIVE || mode >= BMLITE_POWER_MODES) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    return bmlite_send_cmd(chain, CMD_MCU, mode_arg[mode]);
+}
+
+fpc_bep_result_t bep_power_mode_get(HCP_comm_t *chain, bmlite_power_mode_t *mode)
+{
+    uint32_t value = 0;
+
+    assert(bmlite_send_cmd_arg(chain, CMD_MCU, ARG_GET, ARG_POWER_MODE, 0, 0));
+    if (chain->bep_result != FPC_BEP_RESULT_OK) {
+        return chain->bep_result;
+    }
+    assert(bmlite_copy_arg(chain, ARG_POWER_MODE, &value, sizeof(value)));
+    *mode = value < BMLITE_POWER_MODES ? (bmlite_power_mode_t)value : BMLITE_POWER_ACTIVE;
+    return FPC_BEP_RESULT_OK;
+}
+
 fpc_bep_result_t bmlite_send_cmd(HCP_comm_t *chain, uint16_t cmd, uint16_t arg_type)
 {
     assert(bmlite_init_cmd(chain, cmd, arg_type));
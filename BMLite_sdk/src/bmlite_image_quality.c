@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    bmlite_image_quality.c
+ * @brief   Host-side quality check of captured images
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "bmlite_image_quality.h"
+
+/* Scalar sums of pixels [from, width) of a row. next is the row below or NULL */
+static void row_tail(const uint8_t *row, const uint8_t *next, uint32_t from, uint32_t width,
+        uint8_t background, bmlite_image_sums_t *s)
+{
+    for (uint32_t x = from; x < width; x++) {
+        uint8_t p = row[x];
+        s->sum += p;
+        s->sum_sq += (uint32_t)p * p;
+        s->covered += p < background;
+        if (p < s->min) {
+            s->min = p;
+        }
+        if (p > s->max) {
+            s->max = p;
+        }
+        if (x + 1 < width) {
+            s->gradient += p > row[x + 1] ? p - row[x + 1] : row[x + 1] - p;
+        }
+        if (next) {
+            s->gradient += p > next[x] ? p - next[x] : next[x] - p;
+        }
+    }
+}
+
+static void sums_init(bmlite_image_sums_t *s, uint32_t width, uint32_t height)
+{
+    memset(s, 0, sizeof(*s));
+    s->pixels = width * height;
+    s->min = 255;
+    if (width && height) {
+        s->pairs = (width - 1) * height + width * (height - 1);
+    }
+}
+
+void bmlite_image_sums_scalar(const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background, bmlite_image_sums_t *sums)
+{
+    sums_init(sums, width, height);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = image + y * width;
+        row_tail(row, y + 1 < height ? row + width : NULL, 0, width, background, sums);
+    }
+}
+
+#if defined(__SSE2__)
+
+static uint64_t sad_total(__m128i v)
+{
+    return (uint64_t)(uint32_t)_mm_cvtsi128_si32(v) +
+            (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+
+void bmlite_image_sums(const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background, bmlite_image_sums_t *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    /* p < background  <=>  min(p, background - 1) == p */
+    const __m128i bg = _mm_set1_epi8((char)(background ? background - 1 : 0));
+    __m128i vmin = _mm_set1_epi8((char)0xff);
+    __m128i vmax = zero;
+    uint8_t lanes[16];
+
+    sums_init(sums, width, height);
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = image + y * width;
+        const uint8_t *next = y + 1 < height ? row + width : NULL;
+        __m128i sum = zero, sq = zero, covered = zero, grad = zero;
+        uint32_t x = 0;
+
+        for (; x + 16 <= width; x += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+            sq = _mm_add_epi32(sq, _mm_madd_epi16(lo, lo));
+            sq = _mm_add_epi32(sq, _mm_madd_epi16(hi, hi));
+            if (background) {
+                __m128i mask = _mm_cmpeq_epi8(_mm_min_epu8(v, bg), v);
+                covered = _mm_add_epi64(covered, _mm_sad_epu8(_mm_and_si128(mask, one), zero));
+            }
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+            if (x + 17 <= width) {
+                __m128i right = _mm_loadu_si128((const __m128i *)(row + x + 1));
+                grad = _mm_add_epi64(grad, _mm_sad_epu8(v, right));
+            } else {
+                for (uint32_t i = x; i + 1 < width; i++) {
+                    sums->gradient += row[i] > row[i + 1] ? row[i] - row[i + 1] : row[i + 1] - row[i];
+                }
+            }
+            if (next) {
+                __m128i below = _mm_loadu_si128((const __m128i *)(next + x));
+                grad = _mm_add_epi64(grad, _mm_sad_epu8(v, below));
+            }
+        }
+
+        /* Per-row flush keeps 32-bit square sums from overflow */
+        _mm_storeu_si128((__m128i *)lanes, sq);
+        for (int i = 0; i < 4; i++) {
+            uint32_t lane;
+            memcpy(&lane, lanes + 4 * i, 4);
+            sums->sum_sq += lane;
+        }
+        sums->sum += sad_total(sum);
+        sums->covered += sad_total(covered);
+        sums->gradient += sad_total(grad);
+
+        row_tail(row, next, x, width, background, sums);
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, vmin);
+    for (int i = 0; i < 16; i++) {
+        sums->min = lanes[i] < sums->min ? lanes[i] : sums->min;
+    }
+    _mm_storeu_si128((__m128i *)lanes, vmax);
+    for (int i = 0; i < 16; i++) {
+        sums->max = lanes[i] > sums->max ? lanes[i] : sums->max;
+    }
+}
+
+const char *bmlite_image_kernel_name(void)
+{
+    return "SSE2";
+}
+
+#elif defined(__ARM_NEON)
+
+static uint64_t lanes_total(uint32x4_t v)
+{
+    return (uint64_t)vgetq_lane_u32(v, 0) + vgetq_lane_u32(v, 1) +
+            vgetq_lane_u32(v, 2) + vgetq_lane_u32(v, 3);
+}
+
+void bmlite_image_sums(const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background, bmlite_image_sums_t *sums)
+{
+    const uint8x16_t bg = vdupq_n_u8(background);
+    const uint8x16_t one = vdupq_n_u8(1);
+    uint8x16_t vmin = vdupq_n_u8(0xff);
+    uint8x16_t vmax = vdupq_n_u8(0);
+    uint8_t lanes[16];
+
+    sums_init(sums, width, height);
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = image + y * width;
+        const uint8_t *next = y + 1 < height ? row + width : NULL;
+        uint32x4_t sum = vdupq_n_u32(0), sq = vdupq_n_u32(0);
+        uint32x4_t covered = vdupq_n_u32(0), grad = vdupq_n_u32(0);
+        uint32_t x = 0;
+
+        for (; x + 16 <= width; x += 16) {
+            uint8x16_t v = vld1q_u8(row + x);
+            uint16x8_t sq_lo = vmull_u8(vget_low_u8(v), vget_low_u8(v));
+            uint16x8_t sq_hi = vmull_u8(vget_high_u8(v), vget_high_u8(v));
+
+            sum = vpadalq_u16(sum, vpaddlq_u8(v));
+            /* Squares are up to 65025, widen before adding */
+            sq = vpadalq_u16(sq, sq_lo);
+            sq = vpadalq_u16(sq, sq_hi);
+            covered = vpadalq_u16(covered, vpaddlq_u8(vandq_u8(vcltq_u8(v, bg), one)));
+            vmin = vminq_u8(vmin, v);
+            vmax = vmaxq_u8(vmax, v);
+            if (x + 17 <= width) {
+                grad = vpadalq_u16(grad, vpaddlq_u8(vabdq_u8(v, vld1q_u8(row + x + 1))));
+            } else {
+                for (uint32_t i = x; i + 1 < width; i++) {
+                    sums->gradient += row[i] > row[i + 1] ? row[i] - row[i + 1] : row[i + 1] - row[i];
+                }
+            }
+            if (next) {
+                grad = vpadalq_u16(grad, vpaddlq_u8(vabdq_u8(v, vld1q_u8(next + x))));
+            }
+        }
+
+        /* Per-row flush keeps 32-bit lanes from overflow */
+        sums->sum += lanes_total(sum);
+        sums->sum_sq += lanes_total(sq);
+        sums->covered += lanes_total(covered);
+        sums->gradient += lanes_total(grad);
+
+        row_tail(row, next, x, width, background, sums);
+    }
+
+    vst1q_u8(lanes, vmin);
+    for (int i = 0; i < 16; i++) {
+        sums->min = lanes[i] < sums->min ? lanes[i] : sums->min;
+    }
+    vst1q_u8(lanes, vmax);
+    for (int i = 0; i < 16; i++) {
+        sums->max = lanes[i] > sums->max ? lanes[i] : sums->max;
+    }
+}
+
+const char *bmlite_image_kernel_name(void)
+{
+    return "NEON";
+}
+
+#else
+
+void bmlite_image_sums(const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background, bmlite_image_sums_t *sums)
+{
+    bmlite_image_sums_scalar(image, width, height, background, sums);
+}
+
+const char *bmlite_image_kernel_name(void)
+{
+    return "scalar";
+}
+
+#endif
+
+/* Neighbour pixels of a fingerprint are often equal. Four interleaved
+ * histograms keep their increments from waiting for each other */
+void bmlite_image_histogram(const uint8_t *image, uint32_t size, uint32_t hist[256])
+{
+    uint32_t part[4][256];
+    uint32_t i = 0;
+
+    memset(part, 0, sizeof(part));
+    for (; i + 4 <= size; i += 4) {
+        part[0][image[i]]++;
+        part[1][image[i + 1]]++;
+        part[2][image[i + 2]]++;
+        part[3][image[i + 3]]++;
+    }
+    for (; i < size; i++) {
+        part[0][image[i]]++;
+    }
+    for (i = 0; i < 256; i++) {
+        hist[i] = part[0][i] + part[1][i] + part[2][i] + part[3][i];
+    }
+}
+
+bmlite_quality_reason_t bmlite_image_check(const uint8_t *image, uint32_t size,
+        const bmlite_quality_params_t *params, bmlite_image_quality_t *quality)
+{
+    bmlite_image_quality_t q;
+    bmlite_image_sums_t s;
+    uint32_t width = params->width;
+    uint32_t height;
+
+    // Empty image has no pixels to divide sums by
+    if (size == 0) {
+        return BMLITE_QUALITY_BAD_GEOMETRY;
+    }
+    if (width == 0) {
+        while ((width + 1) * (width + 1) <= size) {
+            width++;
+        }
+    }
+    if (width == 0 || size % width != 0) {
+        return BMLITE_QUALITY_BAD_GEOMETRY;
+    }
+    height = size / width;
+
+    bmlite_image_sums(image, width, height, params->background, &s);
+
+    q.coverage = (uint64_t)s.covered * 100 / s.pixels;
+    q.contrast = s.max - s.min;
+    q.variance = (s.sum_sq * s.pixels - s.sum * s.sum) / ((uint64_t)s.pixels * s.pixels);
+    q.sharpness = s.pairs ? s.gradient * 100 / s.pairs : 0;
+    if (quality) {
+        *quality = q;
+    }
+
+    if (q.coverage < params->min_coverage) {
+        return BMLITE_QUALITY_LOW_COVERAGE;
+    }
+    if (q.contrast < params->min_contrast) {
+        return BMLITE_QUALITY_LOW_CONTRAST;
+    }
+    if (q.variance < params->min_variance) {
+        return BMLITE_QUALITY_LOW_VARIANCE;
+    }
+    if (q.sharpness < params->min_sharpness) {
+        return BMLITE_QUALITY_LOW_SHARPNESS;
+    }
+    return BMLITE_QUALITY_OK;
+}
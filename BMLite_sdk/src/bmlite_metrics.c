@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_metrics.c
+ * @brief   Link and command counters maintained by the SDK
+ */
+
+#include <string.h>
+
+#include "bmlite_metrics.h"
+#include "fpc_hcp_common.h"
+
+static const char *const cmd_names[BMLITE_METRICS_CMDS] = {
+    "capture", "enroll", "identify", "image", "template", "wait", "storage_template",
+    "info", "communication", "mcu", "sensor", "reset", "cancel", "other",
+};
+
+static const char *const result_names[BMLITE_METRICS_RESULTS] = {
+    "ok", "general_error", "internal_error", "invalid_argument", "not_implemented",
+    "cancelled", "no_memory", "no_resource", "io_error", "broken_sensor", "wrong_state",
+    "timeout", "id_not_unique", "id_not_found", "invalid_format", "image_capture_error",
+    "sensor_mismatch", "invalid_parameter", "missing_template", "invalid_calibration",
+    "storage_not_formatted", "sensor_not_initialized", "too_many_bad_images",
+    "crypto_error", "not_supported", "finger_not_stable", "not_initialized", "other",
+};
+
+const char *bmlite_metrics_cmd_name(int cmd)
+{
+    return cmd >= 0 && cmd < BMLITE_METRICS_CMDS ? cmd_names[cmd] : "other";
+}
+
+const char *bmlite_metrics_result_name(int index)
+{
+    return index >= 0 && index < BMLITE_METRICS_RESULTS ? result_names[index] : "other";
+}
+
+#ifdef BMLITE_USE_METRICS
+
+bmlite_metrics_t bmlite_metrics;
+
+static bmlite_metrics_cmd_t cmd_bucket(uint16_t cmd)
+{
+    switch (cmd) {
+        case CMD_CAPTURE:          return BMLITE_METRICS_CMD_CAPTURE;
+        case CMD_ENROLL:           return BMLITE_METRICS_CMD_ENROLL;
+        case CMD_IDENTIFY:         return BMLITE_METRICS_CMD_IDENTIFY;
+        case CMD_IMAGE:            return BMLITE_METRICS_CMD_IMAGE;
+        case CMD_TEMPLATE:         return BMLITE_METRICS_CMD_TEMPLATE;
+        case CMD_WAIT:             return BMLITE_METRICS_CMD_WAIT;
+        case CMD_STORAGE_TEMPLATE: return BMLITE_METRICS_CMD_STORAGE_TEMPLATE;
+        case CMD_INFO:             return BMLITE_METRICS_CMD_INFO;
+        case CMD_COMMUNICATION:    return BMLITE_METRICS_CMD_COMMUNICATION;
+        case CMD_MCU:              return BMLITE_METRICS_CMD_MCU;
+        case CMD_SENSOR:           return BMLITE_METRICS_CMD_SENSOR;
+        case CMD_RESET:            return BMLITE_METRICS_CMD_RESET;
+        case CMD_CANCEL:           return BMLITE_METRICS_CMD_CANCEL;
+        default:                   return BMLITE_METRICS_CMD_OTHER;
+    }
+}
+
+void bmlite_metrics_command(uint16_t cmd, fpc_bep_result_t result, uint32_t elapsed)
+{
+    int index = -(int)result;
+
+    if (index < 0 || index >= BMLITE_METRICS_RESULTS) {
+        index = BMLITE_METRICS_RESULTS - 1;
+    }
+    bmlite_metric_add(commands[cmd_bucket(cmd)][index], 1);
+    bmlite_metric_add(blocked_us, elapsed);
+    bmlite_metric_set(last_command_us, elapsed);
+}
+
+void bmlite_metrics_snapshot(bmlite_metrics_t *snapshot)
+{
+    const uint64_t *src = (const uint64_t *)bmlite_metrics.commands;
+    uint64_t *dst = (uint64_t *)snapshot->commands;
+
+    snapshot->frames_tx = __atomic_load_n(&bmlite_metrics.frames_tx, __ATOMIC_RELAXED);
+    snapshot->frames_rx = __atomic_load_n(&bmlite_metrics.frames_rx, __ATOMIC_RELAXED);
+    snapshot->bytes_tx = __atomic_load_n(&bmlite_metrics.bytes_tx, __ATOMIC_RELAXED);
+    snapshot->bytes_rx = __atomic_load_n(&bmlite_metrics.bytes_rx, __ATOMIC_RELAXED);
+    snapshot->crc_errors = __atomic_load_n(&bmlite_metrics.crc_errors, __ATOMIC_RELAXED);
+    snapshot->ack_timeouts = __atomic_load_n(&bmlite_metrics.ack_timeouts, __ATOMIC_RELAXED);
+    snapshot->ack_errors = __atomic_load_n(&bmlite_metrics.ack_errors, __ATOMIC_RELAXED);
+    snapshot->rx_timeouts = __atomic_load_n(&bmlite_metrics.rx_timeouts, __ATOMIC_RELAXED);
+    snapshot->retries = __atomic_load_n(&bmlite_metrics.retries, __ATOMIC_RELAXED);
+    snapshot->blocked_us = __atomic_load_n(&bmlite_metrics.blocked_us, __ATOMIC_RELAXED);
+    snapshot->in_flight = __atomic_load_n(&bmlite_metrics.in_flight, __ATOMIC_RELAXED);
+    snapshot->last_command_us = __atomic_load_n(&bmlite_metrics.last_command_us,
+            __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < BMLITE_METRICS_CMDS * BMLITE_METRICS_RESULTS; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+void bmlite_metrics_snapshot(bmlite_metrics_t *snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+#endif  // BMLITE_USE_METRICS
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_power.c
+ * @brief   Idle power policy of BM-Lite
+ */
+
+#include <string.h>
+
+#include "bmlite_power.h"
+
+static void enter_mode(bmlite_power_t *power, bmlite_power_mode_t mode, hal_tick_t now)
+{
+    power->stats[power->mode].residency_ms += now - power->mode_since;
+    power->mode = mode;
+    power->mode_since = now;
+    power->stats[mode].entries++;
+}
+
+void bmlite_power_init(bmlite_power_t *power, HCP_comm_t *chain,
+        const bmlite_power_policy_t *policy)
+{
+    memset(power, 0, sizeof(*power));
+    power->chain = chain;
+    power->policy = *policy;
+    power->mode = BMLITE_POWER_ACTIVE;
+    power->idle_since = hal_timebase_get_tick();
+    power->mode_since = power->idle_since;
+}
+
+/* Deepest mode allowed after idle time */
+static bmlite_power_mode_t target_mode(const bmlite_power_t *power, uint32_t idle_ms)
+{
+    bmlite_power_mode_t target = BMLITE_POWER_ACTIVE;
+
+    for (int mode = BMLITE_POWER_IDLE; mode < BMLITE_POWER_MODES; mode++) {
+        uint32_t enter_ms = power->policy.enter_ms[mode];
+        if (enter_ms && idle_ms >= enter_ms) {
+            target = mode;
+        }
+    }
+    return target;
+}
+
+fpc_bep_result_t bmlite_power_idle(bmlite_power_t *power)
+{
+    hal_tick_t now = hal_timebase_get_tick();
+    bmlite_power_mode_t target = target_mode(power, now - power->idle_since);
+    fpc_bep_result_t res;
+
+    if (target <= power->mode) {
+        return FPC_BEP_RESULT_OK;
+    }
+
+    res = bep_power_mode_set(power->chain, target);
+    if (res == FPC_BEP_RESULT_OK && power->chain->bep_result != FPC_BEP_RESULT_OK) {
+        res = power->chain->bep_result;
+    }
+    if (res == FPC_BEP_RESULT_OK) {
+        enter_mode(power, target, now);
+    }
+    return res;
+}
+
+uint32_t bmlite_power_next_ms(const bmlite_power_t *power)
+{
+    uint32_t idle_ms = hal_timebase_get_tick() - power->idle_since;
+
+    for (int mode = power->mode + 1; mode < BMLITE_POWER_MODES; mode++) {
+        uint32_t enter_ms = power->policy.enter_ms[mode];
+        if (enter_ms) {
+            return enter_ms > idle_ms ? enter_ms - idle_ms : 1;
+        }
+    }
+    return 0;
+}
+
+fpc_bep_result_t bmlite_power_wake(bmlite_power_t *power)
+{
+    bmlite_power_stats_t *stats = &power->stats[power->mode];
+    uint64_t start;
+    uint32_t wake_us;
+    fpc_bep_result_t res;
+
+    if (power->mode == BMLITE_POWER_ACTIVE) {
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Any command wakes BM-Lite. Latency is measured up to its answer
+    start = hal_timebase_get_us();
+    res = bep_wait_ready(power->chain, BMLITE_POWER_WAKE_TIMEOUT);
+    if (res != FPC_BEP_RESULT_OK) {
+        return res;
+    }
+    wake_us = (uint32_t)(hal_timebase_get_us() - start);
+
+    stats->wakeups++;
+    stats->wake_us_last = wake_us;
+    stats->wake_us_total += wake_us;
+    if (wake_us > stats->wake_us_max) {
+        stats->wake_us_max = wake_us;
+    }
+    enter_mode(power, BMLITE_POWER_ACTIVE, hal_timebase_get_tick());
+    return FPC_BEP_RESULT_OK;
+}
+
+void bmlite_power_done(bmlite_power_t *power)
+{
+    power->idle_since = hal_timebase_get_tick();
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    bmlite_watchdog.c
+ * @brief   Detection of wedged BM-Lite and automatic recovery
+ */
+
+#include <string.h>
+
+#include "bmlite_watchdog.h"
+#include "bmlite_if.h"
+#include "bmlite_hal.h"
+#include "platform.h"
+
+/** Wait for each probe while BM-Lite comes back (msec) */
+#define VERIFY_PROBE_TIMEOUT 100
+
+static const char *const step_names[BMLITE_WATCHDOG_STEPS] = {
+    "cancel", "sw_reset", "sensor_reset", "hw_reset",
+};
+
+static const char *const fault_names[BMLITE_WATCHDOG_FAULTS] = {
+    "rx_timeout", "ack_timeout", "ack_error", "crc_error", "frame_error",
+};
+
+const char *bmlite_watchdog_step_name(int step)
+{
+    return step >= 0 && step < BMLITE_WATCHDOG_STEPS ? step_names[step] : "other";
+}
+
+const char *bmlite_watchdog_fault_name(int fault)
+{
+    return fault >= 0 && fault < BMLITE_WATCHDOG_FAULTS ? fault_names[fault] : "other";
+}
+
+void bmlite_watchdog_init(bmlite_watchdog_t *wd, HCP_comm_t *chain,
+        const bmlite_watchdog_config_t *config)
+{
+    memset(wd, 0, sizeof(*wd));
+    wd->chain = chain;
+    wd->config = *config;
+    wd->ack_rto = chain->ack_rto;
+    wd->body_rto = chain->body_rto;
+    chain->watchdog = wd;
+}
+
+void bmlite_watchdog_detach(bmlite_watchdog_t *wd)
+{
+    if (wd->chain->watchdog == wd) {
+        wd->chain->watchdog = NULL;
+    }
+}
+
+static void mark_down(bmlite_watchdog_t *wd, uint64_t now)
+{
+    if (wd->down_since_us == 0) {
+        wd->down_since_us = now;
+    }
+}
+
+void bmlite_watchdog_fault(HCP_comm_t *chain, bmlite_watchdog_fault_t fault)
+{
+    bmlite_watchdog_t *wd = chain->watchdog;
+    uint64_t now;
+
+    if (wd == NULL) {
+        return;
+    }
+    wd->stats.faults[fault]++;
+    if (wd->recovering) {
+        return;
+    }
+
+    now = hal_timebase_get_us();
+    mark_down(wd, now);
+    if (now - wd->window_start_us >= (uint64_t)wd->config.window_ms * 1000) {
+        wd->window_start_us = now;
+        wd->window_faults = 0;
+    }
+    wd->window_faults++;
+    if (wd->config.fault_limit && wd->window_faults >= wd->config.fault_limit) {
+        wd->tripped = true;
+    }
+}
+
+void bmlite_watchdog_command(HCP_comm_t *chain, fpc_bep_result_t result)
+{
+    bmlite_watchdog_t *wd = chain->watchdog;
+
+    if (wd == NULL || wd->recovering) {
+        return;
+    }
+    if (result == FPC_BEP_RESULT_OK) {
+        // Faults recovered by link retries do not make BM-Lite down
+        wd->fails = 0;
+        wd->down_since_us = 0;
+        wd->ack_rto = chain->ack_rto;
+        wd->body_rto = chain->body_rto;
+        return;
+    }
+    mark_down(wd, hal_timebase_get_us());
+    wd->fails++;
+    if (wd->config.fail_limit && wd->fails >= wd->config.fail_limit) {
+        wd->tripped = true;
+    }
+}
+
+uint32_t bmlite_watchdog_rx_timeout(const HCP_comm_t *chain)
+{
+    if (chain->phy_rx_timeout == 0 && chain->watchdog) {
+        return chain->watchdog->config.stall_ms;
+    }
+    return chain->phy_rx_timeout;
+}
+
+static void run_step(bmlite_watchdog_t *wd, bmlite_watchdog_step_t step)
+{
+    HCP_comm_t *chain = wd->chain;
+
+    switch (step) {
+        case BMLITE_WATCHDOG_CANCEL:
+            bmlite_send_cmd(chain, CMD_CANCEL, ARG_NONE);
+            break;
+        case BMLITE_WATCHDOG_SW_RESET:
+            bep_sw_reset(chain);
+            break;
+        case BMLITE_WATCHDOG_SENSOR_RESET:
+            bep_sensor_reset(chain);
+            break;
+        case BMLITE_WATCHDOG_HW_RESET:
+            if (wd->config.hw_reset) {
+                wd->config.hw_reset(chain);
+            } else {
+                platform_bmlite_reset();
+            }
+            // Restarted BM-Lite may answer at other pace than before
+            bmlite_reset_rto(chain);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Probe BM-Lite until it answers or verify_ms passes */
+static fpc_bep_result_t verify(bmlite_watchdog_t *wd)
+{
+    // Monotonic clock, wall clock steps must not cut or stretch the wait
+    uint64_t start = hal_timebase_get_us();
+
+    do {
+        if (bep_wait_ready(wd->chain, VERIFY_PROBE_TIMEOUT) == FPC_BEP_RESULT_OK) {
+            return FPC_BEP_RESULT_OK;
+        }
+    } while (hal_timebase_get_us() - start < (uint64_t)wd->config.verify_ms * 1000);
+    return FPC_BEP_RESULT_TIMEOUT;
+}
+
+fpc_bep_result_t bmlite_watchdog_recover(bmlite_watchdog_t *wd, bmlite_watchdog_step_t *step)
+{
+    bmlite_watchdog_stats_t *stats = &wd->stats;
+    fpc_bep_result_t bep_result = FPC_BEP_RESULT_TIMEOUT;
+    int s;
+
+    mark_down(wd, hal_timebase_get_us());
+    stats->trips++;
+    wd->recovering = true;
+    for (s = 0; s < BMLITE_WATCHDOG_STEPS && bep_result != FPC_BEP_RESULT_OK; s++) {
+        // Probes of silent BM-Lite must not wait for timeouts backed off by faults
+        wd->chain->ack_rto = wd->ack_rto;
+        wd->chain->body_rto = wd->body_rto;
+        bmlite_drain_link(wd->chain, bmlite_frame_time(wd->chain));
+        run_step(wd, s);
+        bep_result = verify(wd);
+    }
+    wd->recovering = false;
+    wd->chain->bep_result = FPC_BEP_RESULT_OK;
+
+    if (bep_result != FPC_BEP_RESULT_OK) {
+        // Stay tripped, next check starts over
+        stats->failed++;
+        wd->tripped = true;
+        return bep_result;
+    }
+
+    uint32_t down_us = (uint32_t)(hal_timebase_get_us() - wd->down_since_us);
+    stats->recovered[s - 1]++;
+    stats->down_us_last = down_us;
+    stats->down_us_total += down_us;
+    if (down_us > stats->down_us_max) {
+        stats->down_us_max = down_us;
+    }
+    if (step) {
+        *step = s - 1;
+    }
+
+    wd->tripped = false;
+    wd->fails = 0;
+    wd->window_faults = 0;
+    wd->down_since_us = 0;
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t bmlite_watchdog_check(bmlite_watchdog_t *wd)
+{
+    if (!wd->tripped) {
+        return FPC_BEP_RESULT_OK;
+    }
+    return bmlite_watchdog_recover(wd, NULL);
+}
+
+uint32_t bmlite_watchdog_mttr_us(const bmlite_watchdog_t *wd)
+{
+    uint32_t recovered = 0;
+
+    for (int s = 0; s < BMLITE_WATCHDOG_STEPS; s++) {
+        recovered += wd->stats.recovered[s];
+    }
+    return recovered ? (uint32_t)(wd->stats.down_us_total / recovered) : 0;
+}
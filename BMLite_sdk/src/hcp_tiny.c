@@ -16,17 +16,20 @@
 
 #include <string.h>
 
+#include "bmlite_hal.h"
 #include "platform.h"
 #include "fpc_crc.h"
 #include "fpc_hcp_common.h"
 #include "hcp_tiny.h"
 
 #include "bmlite_if_callbacks.h"
+#include "bmlite_metrics.h"
+#include "bmlite_watchdog.h"
 
 #ifdef DEBUG
 #include <stdio.h>
 #include <stdlib.h>
-#define LOG_DEBUG(...) printf(__VA_ARGS__)
+#define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
 #else
 #define LOG_DEBUG(...)
 #endif
@@ -36,6 +39,114 @@ static uint32_t fpc_com_ack = FPC_BEP_ACK;
 static fpc_bep_result_t _rx_link(HCP_comm_t *hcp_comm);
 static fpc_bep_result_t _tx_link(HCP_comm_t *hcp_comm);
 
+static uint32_t rto_timeout(const HCP_rto_t *rto, uint32_t init)
+{
+    return rto->timeout ? rto->timeout : init;
+}
+
+static uint32_t rto_clamp(const HCP_rto_t *rto, uint32_t timeout, uint32_t min, uint32_t max)
+{
+    min = rto->min ? rto->min : min;
+    max = rto->max ? rto->max : max;
+    if (timeout < min) {
+        timeout = min;
+    }
+    return timeout > max ? (max < min ? min : max) : timeout;
+}
+
+/* Update estimate with new round trip sample, RFC 6298. Returns SRTT + 4 * RTTVAR (msec) */
+static uint32_t rto_estimate(HCP_rto_t *rto, uint32_t rtt_us)
+{
+    if (rtt_us == 0) {
+        rtt_us = 1;
+    }
+    if (rto->srtt == 0) {
+        rto->srtt = rtt_us;
+        rto->rttvar = rtt_us / 2;
+    } else {
+        uint32_t delta = rto->srtt > rtt_us ? rto->srtt - rtt_us : rtt_us - rto->srtt;
+        rto->rttvar = (3 * rto->rttvar + delta) / 4;
+        rto->srtt = (7 * rto->srtt + rtt_us) / 8;
+    }
+    return (rto->srtt + 4 * rto->rttvar + 999) / 1000;
+}
+
+static void rto_sample(HCP_rto_t *rto, uint32_t rtt_us, uint32_t min, uint32_t max)
+{
+    rto->timeout = rto_clamp(rto, rto_estimate(rto, rtt_us), min, max);
+}
+
+/* Timeout expired: wait twice as long next time */
+static void rto_backoff(HCP_rto_t *rto, uint32_t init, uint32_t min, uint32_t max)
+{
+    rto->timeout = rto_clamp(rto, 2 * rto_timeout(rto, init), min, max);
+}
+
+/* Without retries a lost ACK fails the command, so the floor stays at the
+   old fixed timeout unless set explicitly */
+static uint32_t ack_timeout_min(const HCP_comm_t *hcp_comm)
+{
+    return hcp_comm->link_retries ? HCP_ACK_TIMEOUT_MIN : HCP_ACK_TIMEOUT_INIT;
+}
+
+/* Body of bytes: transfer time scaled from a full MTU frame plus the floor */
+static uint32_t body_timeout(const HCP_rto_t *rto, uint32_t bytes)
+{
+    if (rto->timeout == 0) {
+        return HCP_BODY_TIMEOUT_INIT;
+    }
+    return rto_clamp(rto, (rto->min ? rto->min : HCP_BODY_TIMEOUT_MIN) +
+            (rto->timeout * bytes + MTU - 1) / MTU, HCP_BODY_TIMEOUT_MIN, HCP_BODY_TIMEOUT_MAX);
+}
+
+/* Timeout of one link phase cut to what is left of the exchange */
+static uint32_t link_timeout(const HCP_comm_t *hcp_comm, uint32_t timeout)
+{
+    uint64_t now;
+    uint32_t left;
+
+    if (hcp_comm->exchange_deadline == 0) {
+        return timeout;
+    }
+    now = hal_timebase_get_us();
+    // Read timeout 0 means forever, spent exchange still gets 1 ms
+    left = now < hcp_comm->exchange_deadline ?
+            (uint32_t)((hcp_comm->exchange_deadline - now + 999) / 1000) : 1;
+    return timeout == 0 || timeout > left ? left : timeout;
+}
+
+uint32_t bmlite_drain_link(HCP_comm_t *hcp_comm, uint32_t timeout)
+{
+    uint32_t n;
+    uint8_t byte;
+
+    // Stale data is at most a few frames, endless stream is not drained
+    for (n = 0; n < 4 * MTU; n++) {
+        if (hcp_comm->read(1, &byte, timeout, hcp_comm->phy_session) != FPC_BEP_RESULT_OK) {
+            break;
+        }
+    }
+    return n;
+}
+
+uint32_t bmlite_frame_time(const HCP_comm_t *hcp_comm)
+{
+    uint32_t speed = hcp_comm->link_speed ? hcp_comm->link_speed : HCP_LINK_SPEED_DEFAULT;
+
+    // 10 bit times per byte with start and stop bits
+    return (MTU * 10 * 1000 + speed - 1) / speed + 1;
+}
+
+void bmlite_reset_rto(HCP_comm_t *hcp_comm)
+{
+    hcp_comm->ack_rto.srtt = 0;
+    hcp_comm->ack_rto.rttvar = 0;
+    hcp_comm->ack_rto.timeout = 0;
+    hcp_comm->body_rto.srtt = 0;
+    hcp_comm->body_rto.rttvar = 0;
+    hcp_comm->body_rto.timeout = 0;
+}
+
 typedef struct {
     uint16_t cmd;
     uint16_t args_nr;
@@ -69,7 +180,7 @@ fpc_bep_result_t bmlite_init_cmd(HCP_comm_t *hcp_comm, uint16_t cmd, uint16_t ar
     if(arg_key != ARG_NONE) {
         bep_result = bmlite_add_arg(hcp_comm, arg_key, NULL, 0);
         if(bep_result) {
-            bmlite_on_error(BMLITE_ERROR_SEND_CMD, bep_result);
+            bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, bep_result);
             return bep_result;
         }
     }    
@@ -80,7 +191,7 @@ fpc_bep_result_t bmlite_init_cmd(HCP_comm_t *hcp_comm, uint16_t cmd, uint16_t ar
 fpc_bep_result_t bmlite_add_arg(HCP_comm_t *hcp_comm, uint16_t arg_type, void *arg_data, uint16_t arg_size)
 {
     if(hcp_comm->pkt_size + 4 + arg_size > hcp_comm->pkt_size_max) {
-        bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_NO_MEMORY);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_NO_MEMORY);
         return FPC_BEP_RESULT_NO_MEMORY;
     }
 
@@ -115,7 +226,7 @@ fpc_bep_result_t bmlite_get_arg(HCP_comm_t *hcp_comm, uint16_t arg_type)
 
     // Ignore missing ARG_RESULT because some command return result other way
     // if (arg_type != ARG_RESULT) {
-        bmlite_on_error(BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_INVALID_ARGUMENT);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_INVALID_ARGUMENT);
     // }
     return FPC_BEP_RESULT_INVALID_ARGUMENT;
 }
@@ -126,12 +237,12 @@ fpc_bep_result_t bmlite_copy_arg(HCP_comm_t *hcp_comm, uint16_t arg_key, void *a
     bep_result = bmlite_get_arg(hcp_comm, arg_key);
     if(bep_result == FPC_BEP_RESULT_OK) {
         if(arg_data == NULL) {
-            bmlite_on_error(BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_NO_MEMORY);
+            bmlite_emit_error(hcp_comm, BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_NO_MEMORY);
             return FPC_BEP_RESULT_NO_MEMORY;
         }
         memcpy(arg_data, hcp_comm->arg.data, HCP_MIN(arg_data_size, hcp_comm->arg.size));
     } else {
-        bmlite_on_error(BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_INVALID_ARGUMENT);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_GET_ARG, FPC_BEP_RESULT_INVALID_ARGUMENT);
         return FPC_BEP_RESULT_INVALID_ARGUMENT;
     }
 
@@ -141,7 +252,17 @@ fpc_bep_result_t bmlite_copy_arg(HCP_comm_t *hcp_comm, uint16_t arg_key, void *a
 fpc_bep_result_t bmlite_tranceive(HCP_comm_t *hcp_comm)
 {
     fpc_bep_result_t bep_result;
+#ifdef BMLITE_USE_METRICS
+    uint16_t cmd = ((_HCP_cmd_t *)hcp_comm->pkt_buffer)->cmd;
+    uint64_t start = hal_timebase_get_us();
+
+    bmlite_metric_add(in_flight, 1);
+#endif
 
+    if (hcp_comm->exchange_timeout) {
+        hcp_comm->exchange_deadline = hal_timebase_get_us() +
+                (uint64_t)hcp_comm->exchange_timeout * 1000;
+    }
     bep_result = bmlite_send(hcp_comm);
     if (bep_result == FPC_BEP_RESULT_OK) {
         bep_result = bmlite_receive(hcp_comm);
@@ -152,7 +273,14 @@ fpc_bep_result_t bmlite_tranceive(HCP_comm_t *hcp_comm)
             hcp_comm->bep_result = FPC_BEP_RESULT_OK;
         }
     }
+    hcp_comm->exchange_deadline = 0;
 
+#ifdef BMLITE_USE_METRICS
+    bmlite_metrics_command(cmd, bep_result ? bep_result : hcp_comm->bep_result,
+            (uint32_t)(hal_timebase_get_us() - start));
+    bmlite_metric_add(in_flight, -1);
+#endif
+    bmlite_watchdog_command(hcp_comm, bep_result);
     return bep_result;
 }
 
@@ -173,6 +301,7 @@ fpc_bep_result_t bmlite_receive(HCP_comm_t *hcp_comm)
             seq_nr = pkt->t_seq_nr;
             seq_len = pkt->t_seq_len;
             if(pkt->t_size != pkt->lnk_size - 6) {
+                bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_FRAME_ERROR);
                 com_result = FPC_BEP_RESULT_IO_ERROR;
                 continue;
             }
@@ -188,14 +317,14 @@ fpc_bep_result_t bmlite_receive(HCP_comm_t *hcp_comm)
                 LOG_DEBUG("Received data chunk %d of %d\n", seq_nr, seq_len);
 #endif
         } else {
-            bmlite_on_error(BMLITE_ERROR_SEND_CMD, bep_result);
+            bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, bep_result);
             return bep_result;
         }
     }
 
     hcp_comm->pkt_size = buf_len;
     if(com_result != FPC_BEP_RESULT_OK) {
-        bmlite_on_error(BMLITE_ERROR_SEND_CMD, com_result);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, com_result);
     }
     return com_result;
 }
@@ -203,12 +332,17 @@ fpc_bep_result_t bmlite_receive(HCP_comm_t *hcp_comm)
 static fpc_bep_result_t _rx_link(HCP_comm_t *hcp_comm)
 {
     // Get size, msg and CRC
-    uint16_t result = hcp_comm->read(4, hcp_comm->txrx_buffer, hcp_comm->phy_rx_timeout, NULL);
+    uint16_t result = hcp_comm->read(4, hcp_comm->txrx_buffer,
+            link_timeout(hcp_comm, bmlite_watchdog_rx_timeout(hcp_comm)), hcp_comm->phy_session);
     _HPC_pkt_t *pkt = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
     uint16_t size;
+    uint64_t start;
 
     if (result) {
         LOG_DEBUG("Timed out waiting for response.\n");
+        bmlite_metric_add(rx_timeouts, 1);
+        bmlite_watchdog_fault(hcp_comm, result == FPC_BEP_RESULT_TIMEOUT ?
+                BMLITE_WATCHDOG_RX_TIMEOUT : BMLITE_WATCHDOG_FRAME_ERROR);
         return result;
     }
 
@@ -217,23 +351,43 @@ static fpc_bep_result_t _rx_link(HCP_comm_t *hcp_comm)
     // Check if size plus header and crc is larger than max package size.
     if (MTU < size + 8) {
         // LOG_DEBUG("S: Invalid size %d, larger than MTU %d.\n", size, MTU);
-        bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_IO_ERROR);
+        bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_FRAME_ERROR);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_IO_ERROR);
         return FPC_BEP_RESULT_IO_ERROR;
     }
         
-    hcp_comm->read(size + 4, hcp_comm->txrx_buffer + 4, 100, NULL);
+    start = hal_timebase_get_us();
+    result = hcp_comm->read(size + 4, hcp_comm->txrx_buffer + 4,
+            link_timeout(hcp_comm, body_timeout(&hcp_comm->body_rto, size + 4)),
+            hcp_comm->phy_session);
+    if (result) {
+        LOG_DEBUG("Timed out waiting for frame body.\n");
+        bmlite_metric_add(rx_timeouts, 1);
+        bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_RX_TIMEOUT);
+        rto_backoff(&hcp_comm->body_rto, HCP_BODY_TIMEOUT_INIT, HCP_BODY_TIMEOUT_MIN,
+                HCP_BODY_TIMEOUT_MAX);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_IO_ERROR);
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    // Short frames must not shrink the wait for full ones, sample time of MTU bytes
+    hcp_comm->body_rto.timeout = rto_estimate(&hcp_comm->body_rto,
+            (uint32_t)((hal_timebase_get_us() - start) * MTU / (size + 4)));
 
     uint32_t crc = *(uint32_t *)(hcp_comm->txrx_buffer + 4 + size);
     uint32_t crc_calc = fpc_crc(0, hcp_comm->txrx_buffer+4, size);
 
     if (crc_calc != crc) {
         LOG_DEBUG("CRC mismatch. Calculated %08X, received %08X\n", crc_calc, crc);
-        bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_IO_ERROR);
+        bmlite_metric_add(crc_errors, 1);
+        bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_CRC_ERROR);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_IO_ERROR);
         return FPC_BEP_RESULT_IO_ERROR;
     }
 
     // Send Ack
-    hcp_comm->write(4, (uint8_t *)&fpc_com_ack, 0, NULL);
+    hcp_comm->write(4, (uint8_t *)&fpc_com_ack, 0, hcp_comm->phy_session);
+    bmlite_metric_add(frames_rx, 1);
+    bmlite_metric_add(bytes_rx, size + 8);
 
     return FPC_BEP_RESULT_OK;
 }
@@ -272,14 +426,41 @@ fpc_bep_result_t bmlite_send(HCP_comm_t *hcp_comm)
     }
 
     if(bep_result) {
-        bmlite_on_error(BMLITE_ERROR_SEND_CMD, bep_result);
+        bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, bep_result);
     }
     return bep_result;
 }
 
+/*
+ * Frame without ACK may have reached BM-Lite and only the ACK was lost.
+ * Sent again, it would append its payload twice or run the command twice,
+ * so frames are sent again only for commands which change nothing.
+ */
+static bool resend_safe(const HCP_comm_t *hcp_comm)
+{
+    const _HCP_cmd_t *cmd = (const _HCP_cmd_t *)hcp_comm->pkt_buffer;
+    uint16_t arg = cmd->args_nr ? ((const _CMD_arg_t *)cmd->args)->arg : ARG_NONE;
+
+    switch (cmd->cmd) {
+        case CMD_INFO:
+            return true;
+        case CMD_IMAGE:
+            return arg == ARG_SIZE || arg == ARG_UPLOAD;
+        case CMD_TEMPLATE:
+            return arg == ARG_UPLOAD;
+        case CMD_STORAGE_TEMPLATE:
+            return arg == ARG_UPLOAD || arg == ARG_COUNT || arg == ARG_ID;
+        default:
+            return false;
+    }
+}
+
 static fpc_bep_result_t _tx_link(HCP_comm_t *hcp_comm)
 {
     fpc_bep_result_t bep_result;
+    uint64_t start;
+    uint32_t ack;
+    uint8_t attempt;
 
     _HPC_pkt_t *pkt = (_HPC_pkt_t *)hcp_comm->txrx_buffer;
 
@@ -287,21 +468,47 @@ static fpc_bep_result_t _tx_link(HCP_comm_t *hcp_comm)
     *(uint32_t *)(hcp_comm->txrx_buffer + pkt->lnk_size + 4) = crc_calc;
     uint16_t size = pkt->lnk_size + 8;
 
-    bep_result = hcp_comm->write(size, hcp_comm->txrx_buffer, 0, NULL);
-
-    // Wait for ACK
-    uint32_t ack;
-    bep_result = hcp_comm->read(4, (uint8_t *)&ack, 500, NULL);
-    if (bep_result == FPC_BEP_RESULT_TIMEOUT) {
+    for (attempt = 0; ; attempt++) {
+        start = hal_timebase_get_us();
+        bep_result = hcp_comm->write(size, hcp_comm->txrx_buffer, 0, hcp_comm->phy_session);
+        bmlite_metric_add(frames_tx, 1);
+        bmlite_metric_add(bytes_tx, size);
+
+        // Wait for ACK
+        bep_result = hcp_comm->read(4, (uint8_t *)&ack,
+                link_timeout(hcp_comm, rto_timeout(&hcp_comm->ack_rto, HCP_ACK_TIMEOUT_INIT)),
+                hcp_comm->phy_session);
+        if (bep_result != FPC_BEP_RESULT_TIMEOUT) {
+            break;
+        }
         LOG_DEBUG("ASK read timeout\n");
-        bmlite_on_error(BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_TIMEOUT);
-        return FPC_BEP_RESULT_IO_ERROR;
+        bmlite_metric_add(ack_timeouts, 1);
+        bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_ACK_TIMEOUT);
+        rto_backoff(&hcp_comm->ack_rto, HCP_ACK_TIMEOUT_INIT, ack_timeout_min(hcp_comm),
+                HCP_ACK_TIMEOUT_MAX);
+        if (attempt >= hcp_comm->link_retries || !resend_safe(hcp_comm)) {
+            bmlite_emit_error(hcp_comm, BMLITE_ERROR_SEND_CMD, FPC_BEP_RESULT_TIMEOUT);
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+        bmlite_metric_add(retries, 1);
     }
 
+    if (bep_result != FPC_BEP_RESULT_OK) {
+        LOG_DEBUG("ACK read error %d\n", bep_result);
+        bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_FRAME_ERROR);
+        return bep_result;
+    }
     if(ack != fpc_com_ack) {
+        bmlite_metric_add(ack_errors, 1);
+        bmlite_watchdog_fault(hcp_comm, BMLITE_WATCHDOG_ACK_ERROR);
         return FPC_BEP_RESULT_IO_ERROR;
     }
 
+    // Round trip of sent again frame is ambiguous (Karn's algorithm)
+    if (attempt == 0) {
+        rto_sample(&hcp_comm->ack_rto, (uint32_t)(hal_timebase_get_us() - start),
+                ack_timeout_min(hcp_comm), HCP_ACK_TIMEOUT_MAX);
+    }
+
     return FPC_BEP_RESULT_OK;
 }
-
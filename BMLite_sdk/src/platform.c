@@ -24,14 +24,21 @@
  */
 #ifdef DEBUG_COMM
 #include <stdio.h>
-#define LOG_DEBUG(...) printf(__VA_ARGS__)
+#define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
 #else
 #define LOG_DEBUG(...)
 #endif
 
+#define ATTACH_PROBE_TIMEOUT 100
+/** Longest time for BM-Lite to answer after HW reset on attach (msec) */
+#define ATTACH_BOOT_TIMEOUT 1000
+/** Longest IRQ wait between button checks (msec) */
+#define STATUS_WAIT_SLICE 10
+
 #include "fpc_bep_types.h"
 #include "platform.h"
 #include "bmlite_hal.h"
+#include "bmlite_if.h"
 
 fpc_bep_result_t platform_init(void *params)
 {
@@ -44,6 +51,42 @@ fpc_bep_result_t platform_init(void *params)
     return result;
 }
 
+fpc_bep_result_t platform_attach(void *params, HCP_comm_t *chain,
+        platform_attach_timing_t *timing)
+{
+    platform_attach_timing_t t = { 0 };
+    fpc_bep_result_t result;
+    hal_tick_t start = hal_timebase_get_tick();
+
+    result = hal_board_init(params);
+    if(result != FPC_BEP_RESULT_OK) {
+        return result;
+    }
+    hal_timebase_init();
+    t.init_ms = hal_timebase_get_tick() - start;
+
+    start = hal_timebase_get_tick();
+    result = bep_wait_ready(chain, ATTACH_PROBE_TIMEOUT);
+    t.probe_ms = hal_timebase_get_tick() - start;
+
+    if(result != FPC_BEP_RESULT_OK) {
+        t.reset = true;
+        start = hal_timebase_get_tick();
+        platform_bmlite_reset();
+        // BM-Lite must come back after reset, otherwise attach has failed
+        do {
+            result = bep_wait_ready(chain, ATTACH_PROBE_TIMEOUT);
+        } while(result != FPC_BEP_RESULT_OK &&
+                hal_timebase_get_tick() - start < ATTACH_BOOT_TIMEOUT);
+        t.reset_ms = hal_timebase_get_tick() - start;
+    }
+
+    if (timing) {
+        *timing = t;
+    }
+    return result;
+}
+
 void platform_bmlite_reset(void)
 {
     hal_bmlite_reset(true);
@@ -69,17 +112,20 @@ fpc_bep_result_t platform_bmlite_send(uint16_t size, const uint8_t *data, uint32
 fpc_bep_result_t platform_bmlite_receive(uint16_t size, uint8_t *data, uint32_t timeout,
         void *session)
 {
-	volatile uint32_t start_time = hal_timebase_get_tick();
-	volatile uint32_t curr_time = start_time;
-    // Wait for BM_Lite Ready for timeout or indefinitely if timeout is 0
-    while (!hal_bmlite_get_status() &&
-    		(!timeout || (curr_time = hal_timebase_get_tick()) - start_time < timeout)) {
-                if(hal_check_button_pressed()) {
-                    return FPC_BEP_RESULT_TIMEOUT;
-                }
-    }
-    if(timeout && curr_time - start_time >= timeout) {
-        return FPC_BEP_RESULT_TIMEOUT;
+    hal_tick_t start_time = hal_timebase_get_tick();
+    hal_tick_t elapsed = 0;
+
+    // Wait for BM_Lite Ready for timeout or indefinitely if timeout is 0.
+    // The button is checked between wait slices
+    while (!hal_bmlite_wait_status(timeout && timeout - elapsed < STATUS_WAIT_SLICE ?
+                timeout - elapsed : STATUS_WAIT_SLICE)) {
+        if(hal_check_button_pressed()) {
+            return FPC_BEP_RESULT_TIMEOUT;
+        }
+        elapsed = hal_timebase_get_tick() - start_time;
+        if(timeout && elapsed >= timeout) {
+            return FPC_BEP_RESULT_TIMEOUT;
+        }
     }
 
     uint8_t buff[size];
@@ -100,3 +146,21 @@ __attribute__((weak)) uint32_t hal_check_button_pressed()
     return 0;
 }
 
+__attribute__((weak)) bool hal_bmlite_wait_status(uint32_t timeout)
+{
+    hal_tick_t start = hal_timebase_get_tick();
+
+    while (!hal_bmlite_get_status()) {
+        if (hal_timebase_get_tick() - start >= timeout) {
+            return false;
+        }
+        hal_timebase_busy_wait(1);
+    }
+    return true;
+}
+
+__attribute__((weak)) uint64_t hal_timebase_get_us(void)
+{
+    return (uint64_t)hal_timebase_get_tick() * 1000;
+}
+
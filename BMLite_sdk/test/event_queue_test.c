@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    event_queue_test.c
+ * @brief   Event queue carrying template and image data through payload ring
+ *
+ * Usage: event_queue_test [iterations] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bmlite_if_callbacks.h"
+
+#define EVENTS 16
+#define PAYLOAD_SIZE 4096
+#define MAX_DATA 1500
+
+static uint32_t failures;
+static HCP_comm_t chain;
+static bmlite_event_t storage[EVENTS];
+static uint8_t payload[PAYLOAD_SIZE];
+static bmlite_event_queue_t queue;
+
+/* Data of n-th posted event, written and checked by the test */
+static void fill(uint8_t *data, uint32_t size, uint32_t n)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(n * 31 + i);
+    }
+}
+
+static bool check(const uint8_t *data, uint32_t size, uint32_t n)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        if (data[i] != (uint8_t)(n * 31 + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Posted sequence numbers and sizes, in order */
+static uint32_t sizes[EVENTS * 2];
+static uint32_t seqs[EVENTS * 2];
+static uint32_t posted_head;
+static uint32_t posted_tail;
+static uint32_t received;
+
+void bmlite_on_image(HCP_comm_t *c, const uint8_t *data, uint32_t size)
+{
+    uint32_t slot = posted_tail++ % (EVENTS * 2);
+
+    received++;
+    if (c != &chain || size != sizes[slot] || !check(data, size, seqs[slot])) {
+        printf("FAIL: image %u of %u bytes arrived changed\n", seqs[slot], sizes[slot]);
+        failures++;
+    }
+}
+
+void bmlite_on_template_change(HCP_comm_t *c, bmlite_template_event_t event,
+        uint16_t template_id, const uint8_t *data, uint32_t size)
+{
+    uint32_t slot = posted_tail++ % (EVENTS * 2);
+
+    received++;
+    if (c != &chain || event != BMLITE_TEMPLATE_PUT || template_id != seqs[slot] % 100 ||
+            size != sizes[slot] || !check(data, size, seqs[slot])) {
+        printf("FAIL: template %u of %u bytes arrived changed\n", seqs[slot], sizes[slot]);
+        failures++;
+    }
+}
+
+void bmlite_on_error(bmlite_error_t error, int32_t value) { (void)error; (void)value; }
+void bmlite_on_start_capture() {}
+void bmlite_on_finish_capture() {}
+void bmlite_on_start_enroll() {}
+void bmlite_on_finish_enroll() {}
+void bmlite_on_start_enrollcapture() {}
+void bmlite_on_finish_enrollcapture() {}
+void bmlite_on_identify_start() {}
+void bmlite_on_identify_finish() {}
+
+uint64_t hal_timebase_get_us(void)
+{
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : (uint32_t)time(NULL);
+    uint8_t data[MAX_DATA];
+    bmlite_event_queue_stats_t stats;
+    uint32_t expected_drops = 0;
+
+    printf("Event queue, %u events, seed %u\n", iterations, seed);
+    srand(seed);
+    bmlite_event_queue_init(&queue, storage, EVENTS);
+    bmlite_event_queue_set_payload(&queue, payload, PAYLOAD_SIZE);
+    chain.event_queue = &queue;
+
+    for (uint32_t n = 0; n < iterations; n++) {
+        uint32_t size = rand() % MAX_DATA + 1;
+        uint32_t before;
+
+        bmlite_event_queue_get_stats(&queue, &stats);
+        before = stats.dropped;
+        fill(data, size, n);
+        if (rand() % 2) {
+            bmlite_emit_image(&chain, data, size);
+        } else {
+            bmlite_emit_template_change(&chain, BMLITE_TEMPLATE_PUT, n % 100, data, size);
+        }
+        // Source data is reused by SDK right after the call
+        memset(data, 0, size);
+        bmlite_event_queue_get_stats(&queue, &stats);
+        if (stats.dropped == before) {
+            sizes[posted_head % (EVENTS * 2)] = size;
+            seqs[posted_head % (EVENTS * 2)] = n;
+            posted_head++;
+        } else {
+            expected_drops++;
+        }
+        // Consumer falls behind now and then, so the rings fill and wrap
+        if (rand() % 3 == 0) {
+            bmlite_event_queue_drain(&queue, rand() % 4);
+        }
+    }
+    bmlite_event_queue_drain(&queue, 0);
+
+    if (received != posted_head || !bmlite_event_queue_idle(&queue)) {
+        printf("FAIL: %u events posted, %u received\n", posted_head, received);
+        failures++;
+    }
+    bmlite_event_queue_get_stats(&queue, &stats);
+    if (stats.posted != posted_head || stats.dropped != expected_drops || stats.pending) {
+        printf("FAIL: stats posted %u dropped %u pending %u\n", stats.posted, stats.dropped,
+                stats.pending);
+        failures++;
+    }
+    if (expected_drops == 0 && iterations > 100) {
+        printf("FAIL: payload ring never filled\n");
+        failures++;
+    }
+
+    printf("%s: %u failures\n", failures ? "FAIL" : "OK", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    image_quality_test.c
+ * @brief   Randomized equivalence of scalar and SIMD image quality kernels
+ *
+ * Usage: image_quality_test [iterations] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bmlite_image_quality.h"
+
+#define MAX_WIDTH 300
+#define MAX_HEIGHT 200
+/* Images are placed at odd offsets to test unaligned loads */
+#define MAX_OFFSET 15
+
+static uint32_t failures;
+
+/* Pixels of different shape: noise, narrow band, extremes, smooth ramps */
+static void fill_image(uint8_t *image, uint32_t width, uint32_t height)
+{
+    uint32_t size = width * height;
+    uint8_t base = rand();
+    uint8_t band = rand() % 16 + 1;
+
+    switch (rand() % 4) {
+        case 0:
+            for (uint32_t i = 0; i < size; i++) {
+                image[i] = rand();
+            }
+            break;
+        case 1:
+            for (uint32_t i = 0; i < size; i++) {
+                image[i] = base + rand() % band;
+            }
+            break;
+        case 2:
+            for (uint32_t i = 0; i < size; i++) {
+                image[i] = rand() % 2 ? 255 : 0;
+            }
+            break;
+        default:
+            for (uint32_t i = 0; i < size; i++) {
+                image[i] = base + i % width + i / width;
+            }
+            break;
+    }
+}
+
+static void check_sums(uint32_t run, const uint8_t *image, uint32_t width, uint32_t height,
+        uint8_t background)
+{
+    bmlite_image_sums_t scalar, simd;
+
+    bmlite_image_sums_scalar(image, width, height, background, &scalar);
+    bmlite_image_sums(image, width, height, background, &simd);
+
+    if (scalar.pixels != simd.pixels || scalar.covered != simd.covered ||
+            scalar.min != simd.min || scalar.max != simd.max ||
+            scalar.sum != simd.sum || scalar.sum_sq != simd.sum_sq ||
+            scalar.gradient != simd.gradient || scalar.pairs != simd.pairs) {
+        printf("FAIL run %u: %ux%u background %u\n", run, width, height, background);
+        printf("  scalar: covered %u min %u max %u sum %llu sum_sq %llu gradient %llu\n",
+                scalar.covered, scalar.min, scalar.max, (unsigned long long)scalar.sum,
+                (unsigned long long)scalar.sum_sq, (unsigned long long)scalar.gradient);
+        printf("  %s: covered %u min %u max %u sum %llu sum_sq %llu gradient %llu\n",
+                bmlite_image_kernel_name(), simd.covered, simd.min, simd.max,
+                (unsigned long long)simd.sum, (unsigned long long)simd.sum_sq,
+                (unsigned long long)simd.gradient);
+        failures++;
+    }
+}
+
+static void check_histogram(uint32_t run, const uint8_t *image, uint32_t size)
+{
+    uint32_t hist[256], expected[256];
+
+    memset(expected, 0, sizeof(expected));
+    for (uint32_t i = 0; i < size; i++) {
+        expected[image[i]]++;
+    }
+    bmlite_image_histogram(image, size, hist);
+    if (memcmp(hist, expected, sizeof(hist)) != 0) {
+        printf("FAIL run %u: histogram of %u pixels\n", run, size);
+        failures++;
+    }
+}
+
+static void check_empty(void)
+{
+    bmlite_quality_params_t params = BMLITE_QUALITY_PARAMS_DEFAULT;
+    uint8_t pixel = 0;
+
+    for (params.width = 0; params.width < 3; params.width++) {
+        if (bmlite_image_check(&pixel, 0, &params, NULL) != BMLITE_QUALITY_BAD_GEOMETRY) {
+            printf("FAIL: empty image with width %u accepted\n", params.width);
+            failures++;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : (uint32_t)time(NULL);
+    uint8_t *buffer = malloc(MAX_WIDTH * MAX_HEIGHT + MAX_OFFSET);
+
+    if (buffer == NULL) {
+        return 2;
+    }
+    printf("Kernel %s, %u images, seed %u\n", bmlite_image_kernel_name(), iterations, seed);
+    srand(seed);
+
+    check_empty();
+    for (uint32_t run = 0; run < iterations; run++) {
+        // Widths around vector length are the interesting ones
+        uint32_t width = rand() % 2 ? rand() % 40 + 1 : rand() % MAX_WIDTH + 1;
+        uint32_t height = rand() % MAX_HEIGHT + 1;
+        uint8_t *image = buffer + rand() % (MAX_OFFSET + 1);
+        uint8_t background;
+
+        switch (rand() % 4) {
+            case 0:  background = 0; break;
+            case 1:  background = 255; break;
+            default: background = rand(); break;
+        }
+
+        fill_image(image, width, height);
+        check_sums(run, image, width, height, background);
+        check_histogram(run, image, width * height);
+    }
+
+    free(buffer);
+    printf("%s: %u failures\n", failures ? "FAIL" : "OK", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    link_test.c
+ * @brief   HCP link layer against a fake PHY losing frames, ACKs and reads
+ *
+ * Usage: link_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hcp_tiny.h"
+#include "bmlite_if_callbacks.h"
+#include "bmlite_watchdog.h"
+
+/* Offset of command ID in link frame: channel, size, transport size, seq nr, seq len */
+#define FRAME_CMD_OFFSET 10
+
+static uint32_t failures;
+
+/* Fake BM-Lite: counts commands run and loses what it is told to */
+static struct {
+    uint32_t drop_frames;
+    uint32_t drop_acks;
+    fpc_bep_result_t read_error;
+    fpc_bep_result_t ack_result;
+    uint32_t executed[0x10000];
+    uint32_t faults[BMLITE_WATCHDOG_FAULTS];
+    uint64_t now_us;
+} phy;
+
+static fpc_bep_result_t phy_write(uint16_t size, const uint8_t *data, uint32_t timeout,
+        void *session)
+{
+    uint16_t cmd;
+
+    (void)timeout;
+    (void)session;
+    if (size < FRAME_CMD_OFFSET + 2) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    if (phy.drop_frames) {
+        phy.drop_frames--;
+        phy.ack_result = FPC_BEP_RESULT_TIMEOUT;
+        return FPC_BEP_RESULT_OK;
+    }
+    cmd = data[FRAME_CMD_OFFSET] | data[FRAME_CMD_OFFSET + 1] << 8;
+    phy.executed[cmd]++;
+    if (phy.drop_acks) {
+        phy.drop_acks--;
+        phy.ack_result = FPC_BEP_RESULT_TIMEOUT;
+    } else {
+        phy.ack_result = FPC_BEP_RESULT_OK;
+    }
+    return FPC_BEP_RESULT_OK;
+}
+
+static fpc_bep_result_t phy_read(uint16_t size, uint8_t *data, uint32_t timeout,
+        void *session)
+{
+    uint32_t ack = FPC_BEP_ACK;
+
+    (void)session;
+    if (phy.read_error != FPC_BEP_RESULT_OK) {
+        return phy.read_error;
+    }
+    if (phy.ack_result != FPC_BEP_RESULT_OK || size != 4) {
+        phy.now_us += timeout * 1000ULL;
+        return FPC_BEP_RESULT_TIMEOUT;
+    }
+    memcpy(data, &ack, 4);
+    phy.now_us += 100;
+    return FPC_BEP_RESULT_OK;
+}
+
+/* Link dependencies outside hcp_tiny.c */
+
+uint64_t hal_timebase_get_us(void)
+{
+    return phy.now_us;
+}
+
+void bmlite_watchdog_fault(HCP_comm_t *chain, bmlite_watchdog_fault_t fault)
+{
+    (void)chain;
+    phy.faults[fault]++;
+}
+
+void bmlite_watchdog_command(HCP_comm_t *chain, fpc_bep_result_t result)
+{
+    (void)chain;
+    (void)result;
+}
+
+uint32_t bmlite_watchdog_rx_timeout(const HCP_comm_t *chain)
+{
+    return chain->phy_rx_timeout;
+}
+
+void bmlite_on_error(bmlite_error_t error, int32_t value)
+{
+    (void)error;
+    (void)value;
+}
+
+static uint8_t pkt_buffer[1024];
+static uint8_t txrx_buffer[MTU];
+
+static HCP_comm_t chain = {
+    .write = phy_write,
+    .read = phy_read,
+    .phy_rx_timeout = 2000,
+    .pkt_buffer = pkt_buffer,
+    .pkt_size_max = sizeof(pkt_buffer),
+    .txrx_buffer = txrx_buffer,
+    .link_retries = 2,
+};
+
+static fpc_bep_result_t send(uint16_t cmd, uint16_t arg)
+{
+    memset(phy.executed, 0, sizeof(phy.executed));
+    memset(phy.faults, 0, sizeof(phy.faults));
+    bmlite_init_cmd(&chain, cmd, arg);
+    return bmlite_send(&chain);
+}
+
+/* Lost ACK of a command changing state must not run it twice */
+static void check_lost_ack(void)
+{
+    static const uint16_t writes[][2] = {
+        { CMD_ENROLL, ARG_START },
+        { CMD_ENROLL, ARG_ADD },
+        { CMD_TEMPLATE, ARG_SAVE },
+        { CMD_STORAGE_TEMPLATE, ARG_DELETE },
+    };
+    fpc_bep_result_t res;
+
+    for (uint32_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+        phy.drop_acks = 1;
+        res = send(writes[i][0], writes[i][1]);
+        if (phy.executed[writes[i][0]] != 1) {
+            printf("FAIL: command 0x%04x arg 0x%04x ran %u times after lost ACK\n",
+                    writes[i][0], writes[i][1], phy.executed[writes[i][0]]);
+            failures++;
+        }
+        if (res == FPC_BEP_RESULT_OK) {
+            printf("FAIL: command 0x%04x arg 0x%04x succeeded without ACK\n",
+                    writes[i][0], writes[i][1]);
+            failures++;
+        }
+    }
+
+    // Read-only command is recovered by link retry
+    phy.drop_acks = 1;
+    res = send(CMD_INFO, ARG_GET);
+    if (res != FPC_BEP_RESULT_OK || phy.executed[CMD_INFO] != 2) {
+        printf("FAIL: info after lost ACK: result %d, ran %u times\n", res,
+                phy.executed[CMD_INFO]);
+        failures++;
+    }
+}
+
+/* Lost frame of read-only command is sent again */
+static void check_lost_frame(void)
+{
+    fpc_bep_result_t res;
+
+    phy.drop_frames = 1;
+    res = send(CMD_INFO, ARG_GET);
+    if (res != FPC_BEP_RESULT_OK || phy.executed[CMD_INFO] != 1) {
+        printf("FAIL: info after lost frame: result %d, ran %u times\n", res,
+                phy.executed[CMD_INFO]);
+        failures++;
+    }
+}
+
+/* Read error other than timeout is returned as is, not as ACK error */
+static void check_read_error(void)
+{
+    fpc_bep_result_t res;
+
+    phy.read_error = FPC_BEP_RESULT_BROKEN_SENSOR;
+    res = send(CMD_INFO, ARG_GET);
+    phy.read_error = FPC_BEP_RESULT_OK;
+    if (res != FPC_BEP_RESULT_BROKEN_SENSOR) {
+        printf("FAIL: read error returned as %d\n", res);
+        failures++;
+    }
+    if (phy.faults[BMLITE_WATCHDOG_ACK_ERROR] != 0) {
+        printf("FAIL: read error reported as ACK error\n");
+        failures++;
+    }
+}
+
+int main(void)
+{
+    check_lost_ack();
+    check_lost_frame();
+    check_read_error();
+
+    printf("%s: %u failures\n", failures ? "FAIL" : "OK", failures);
+    return failures ? 1 : 0;
+}
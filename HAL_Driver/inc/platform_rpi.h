@@ -25,6 +25,7 @@
  * @brief   Platform specific function interface
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -33,7 +34,9 @@
 
 typedef enum {
    COM_INTERFACE = 0,
-   SPI_INTERFACE
+   SPI_INTERFACE,
+   EMU_INTERFACE,
+   TCP_INTERFACE
 } interface_t;
 
 typedef struct {
@@ -41,9 +44,98 @@ typedef struct {
    char *port;
    uint32_t baudrate;
    uint32_t timeout;
+   bool warm_attach;
+   bool flow_control;
    HCP_comm_t *hcp_comm;
 } rpi_initparams_t;
 
+typedef struct {
+   /** SCHED_FIFO priority. 0 - keep default scheduling */
+   int priority;
+   /** CPU to run on. -1 - no affinity */
+   int cpu;
+   /** Lock process memory and prefault HCP buffers */
+   bool lock_memory;
+} rpi_rt_params_t;
+
+/** Size of UART receive ring. Must be power of 2 */
+#define COM_RX_RING_SIZE 4096
+
+typedef struct {
+   /** Number of read() calls */
+   uint32_t read_calls;
+   /** Number of write() calls */
+   uint32_t write_calls;
+   /** Number of poll() calls */
+   uint32_t poll_calls;
+   /** Number of received bytes */
+   uint64_t rx_bytes;
+   /** Number of sent bytes */
+   uint64_t tx_bytes;
+} rpi_com_stats_t;
+
+typedef struct {
+   int fd;
+   uint32_t baudrate;
+   bool flow_control;
+   /** Receive ring. Free-running indexes, wrapped on access */
+   uint8_t rx_ring[COM_RX_RING_SIZE];
+   uint32_t rx_head;
+   uint32_t rx_tail;
+   rpi_com_stats_t stats;
+} rpi_com_session_t;
+
+/** Default TCP port of BM-Lite bridge */
+#define TCP_DEFAULT_PORT "7401"
+
+typedef struct {
+   /** Socket, receive ring and counters. First member, so rpi_com_get_fd()
+       and rpi_com_receive() work on TCP session too */
+   rpi_com_session_t link;
+   /** Frame was sent. Its ACK is given by the bridge, answered locally */
+   bool ack_pending;
+} rpi_tcp_session_t;
+
+/** Emulated sensor image geometry */
+#define EMU_IMAGE_WIDTH     160
+#define EMU_IMAGE_HEIGHT    160
+#define EMU_IMAGE_DPI       508
+/** Size of emulated template */
+#define EMU_TEMPLATE_SIZE   2048
+/** Default number of emulated storage slots */
+#define EMU_DEFAULT_CAPACITY 100
+
+typedef struct {
+   /** Number of processed commands */
+   uint32_t commands;
+   /** Number of frames received from host */
+   uint32_t frames_in;
+   /** Number of frames sent to host */
+   uint32_t frames_out;
+   /** Number of frames dropped due to CRC or size mismatch */
+   uint32_t crc_errors;
+   /** Number of host frames lost by rpi_emu_drop_frames() */
+   uint32_t frames_lost;
+   /** Number of ACKs lost by rpi_emu_drop_acks() */
+   uint32_t acks_lost;
+   /** Number of storage Flash writes (template save and delete) */
+   uint32_t flash_writes;
+} rpi_emu_stats_t;
+
+/** Emulated BM-Lite instance, see rpi_emu_open() */
+typedef struct rpi_emu rpi_emu_t;
+
+/** Wedged states of emulated BM-Lite, see rpi_emu_wedge() */
+typedef enum {
+   RPI_EMU_WEDGE_NONE = 0,
+   /** Frames from host are neither acknowledged nor answered */
+   RPI_EMU_WEDGE_SILENT,
+   /** Answer frames are sent with wrong CRC */
+   RPI_EMU_WEDGE_CRC,
+   /** Frames from host are answered with garbage instead of ACK */
+   RPI_EMU_WEDGE_NAK,
+} rpi_emu_wedge_t;
+
 /*
 * Pin definitions for RPI 3
 */
@@ -54,11 +146,81 @@ typedef struct {
 /**
  * @brief Initializes COM Physical layer.
  *
- * @param[in]       port        tty port to use.
- * @param[in]       baudrate    Baudrate.
- * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       port          tty port to use.
+ * @param[in]       baudrate      Baudrate. Any rate supported by UART driver.
+ * @param[in]       timeout       Timeout in ms. Use 0 for infinity.
+ * @param[in]       flow_control  Use RTS/CTS hardware flow control.
+ */
+bool rpi_com_init(char *port, int baudrate, int timeout, bool flow_control);
+
+/**
+ * @brief Opens additional COM session, e.g. for second BM-Lite.
+ *
+ * Pass the session as HCP_comm_t::phy_session together with
+ * rpi_com_send() / rpi_com_receive().
+ *
+ * @param[in]       port          tty port to use.
+ * @param[in]       baudrate      Baudrate.
+ * @param[in]       flow_control  Use RTS/CTS hardware flow control.
+ *
+ * @return Session or NULL on error.
+ */
+rpi_com_session_t *rpi_com_open(char *port, int baudrate, bool flow_control);
+
+/**
+ * @brief Closes COM session opened by rpi_com_open().
+ */
+void rpi_com_close(rpi_com_session_t *session);
+
+/**
+ * @brief Get tty file descriptor of COM session for poll() / epoll.
+ *
+ * Bytes may already be buffered in the session, check rpi_com_rx_pending()
+ * before waiting on the descriptor.
+ *
+ * @param[in]       session     ::rpi_com_session_t or NULL for default session.
  */
-bool rpi_com_init(char *port, int baudrate, int timeout);
+int rpi_com_get_fd(void *session);
+
+/**
+ * @brief Check if received bytes are buffered in COM session.
+ *
+ * @param[in]       session     ::rpi_com_session_t or NULL for default session.
+ */
+bool rpi_com_rx_pending(void *session);
+
+/**
+ * @brief Sets tty speed using termios2.
+ *
+ * @param[in]       fd            tty file descriptor.
+ * @param[in]       baudrate      Baudrate.
+ * @param[in]       flow_control  Use RTS/CTS hardware flow control.
+ *
+ * @return 0 on success, -1 on error
+ */
+int rpi_com_tty_set_speed(int fd, uint32_t baudrate, bool flow_control);
+
+/**
+ * @brief Sets host UART speed of COM session.
+ *
+ * Waits for the other side to reconfigure and discards received bytes.
+ * BM-Lite speed is changed with bep_uart_speed_set().
+ *
+ * @param[in]       session     ::rpi_com_session_t or NULL for default session.
+ * @param[in]       baudrate    New baudrate.
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t rpi_com_set_speed(void *session, uint32_t baudrate);
+
+/**
+ * @brief Gets host UART speed of COM session.
+ *
+ * @param[in]       session     ::rpi_com_session_t or NULL for default session.
+ *
+ * @return baudrate
+ */
+uint32_t rpi_com_get_speed(void *session);
 
 /**
  * @brief Sends data over communication port in blocking mode.
@@ -66,6 +228,7 @@ bool rpi_com_init(char *port, int baudrate, int timeout);
  * @param[in]       size        Number of bytes to send.
  * @param[in]       data        Data buffer to send.
  * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       session     ::rpi_com_session_t or NULL for default session.
  *
  * @return ::fpc_bep_result_t
  */
@@ -78,18 +241,112 @@ fpc_bep_result_t rpi_com_send(uint16_t size, const uint8_t *data, uint32_t timeo
  * @param[in]       size        Number of bytes to receive.
  * @param[in, out]  data        Data buffer to fill.
  * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       session     ::rpi_com_session_t or NULL for default session.
  *
  * @return ::fpc_bep_result_t
  */
 fpc_bep_result_t rpi_com_receive(uint16_t size, uint8_t *data, uint32_t timeout,
         void *session);
 
+/**
+ * @brief Get syscall and byte counters of COM Physical layer.
+ *
+ * @param[out]      stats       Counters of default session.
+ */
+void rpi_com_get_stats(rpi_com_stats_t *stats);
+
+/**
+ * @brief Connects TCP Physical layer to BM-Lite bridge.
+ *
+ * HCP frames are carried over TCP unchanged. The bridge ACKs frames to
+ * BM-Lite and checks ACKs from it, so ACKs don't cross the network.
+ *
+ * @param[in]       address     host[:port], default port ::TCP_DEFAULT_PORT.
+ */
+bool rpi_tcp_init(const char *address);
+
+/**
+ * @brief Opens additional TCP session, e.g. for second remote BM-Lite.
+ *
+ * @param[in]       address     host[:port].
+ *
+ * @return New session or NULL on failure.
+ */
+rpi_tcp_session_t *rpi_tcp_open(const char *address);
+
+/**
+ * @brief Closes TCP session opened by rpi_tcp_open().
+ */
+void rpi_tcp_close(rpi_tcp_session_t *session);
+
+/**
+ * @brief Opens listening TCP socket with TCP_NODELAY for BM-Lite bridge.
+ *
+ * Bridge has no authentication: anyone reaching the port drives BM-Lite.
+ * Empty host listens on loopback only, 0.0.0.0 or [::] on all interfaces.
+ *
+ * @param[in]       address     [host]:port, empty host - loopback.
+ *
+ * @return Socket or -1 on failure.
+ */
+int rpi_tcp_listen(const char *address);
+
+/**
+ * @brief Sends HCP frame to BM-Lite bridge.
+ *
+ * Frame goes out in single send() with TCP_NODELAY. ACK sent by HCP is
+ * dropped, the bridge has already sent its own to BM-Lite.
+ *
+ * @param[in]       size        Number of bytes to send.
+ * @param[in]       data        Data buffer to send.
+ * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       session     ::rpi_tcp_session_t or NULL for default session.
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t rpi_tcp_send(uint16_t size, const uint8_t *data, uint32_t timeout,
+        void *session);
+
+/**
+ * @brief Receives data from BM-Lite bridge.
+ *
+ * ACK of just sent frame is answered locally.
+ *
+ * @param[in]       size        Number of bytes to receive.
+ * @param[in, out]  data        Data buffer to fill.
+ * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       session     ::rpi_tcp_session_t or NULL for default session.
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t rpi_tcp_receive(uint16_t size, uint8_t *data, uint32_t timeout,
+        void *session);
+
 /**
  * @brief Initializes SPI Physical layer.
  *
- * @param[in]       speed_hz    Baudrate.
+ * @param[in]       speed_hz      Baudrate.
+ * @param[in]       check_bufsiz  Verify spidev buffer size in sysfs.
+ */
+bool rpi_spi_init(uint32_t speed_hz, bool check_bufsiz);
+
+/**
+ * @brief Get descriptor signalling rising edges of BM-Lite IRQ pin for poll() / epoll.
+ *
+ * Descriptor is an eventfd, it is readable (EPOLLIN) after an edge. Edges
+ * counted before a command was sent must be consumed by rpi_spi_irq_pending()
+ * before waiting on the descriptor.
+ *
+ * @return descriptor, -1 if IRQ pin is polled or SPI is not initialized
  */
-bool rpi_spi_init(uint32_t speed_hz);
+int rpi_spi_get_irq_fd(void);
+
+/**
+ * @brief Consume counted IRQ edges and check if BM-Lite has data to send.
+ *
+ * @param[in]       session     Not used, for compatibility with rpi_com_rx_pending().
+ */
+bool rpi_spi_irq_pending(void *session);
 
 /**
  * @brief Sends data over communication port in blocking mode.
@@ -115,6 +372,312 @@ fpc_bep_result_t platform_spi_send(uint16_t size, const uint8_t *data, uint32_t
 fpc_bep_result_t platform_spi_receive(uint16_t size, uint8_t *data, uint32_t timeout,
         void *session);
 
+/**
+ * @brief Initializes BM-Lite emulator.
+ *
+ * @param[in]       baudrate      Emulated link speed, bits/s. 0 - no link delay.
+ * @param[in]       capacity      Number of template storage slots.
+ */
+bool rpi_emu_init(uint32_t baudrate, uint32_t capacity);
+
+/**
+ * @brief Opens additional emulated BM-Lite.
+ *
+ * The instance has its own link state and storage. Pass it as
+ * HCP_comm_t::phy_session together with rpi_emu_send() / rpi_emu_receive().
+ *
+ * @param[in]       baudrate      Emulated link speed, bits/s. 0 - no link delay.
+ * @param[in]       capacity      Number of template storage slots.
+ *
+ * @return Emulator instance or NULL if out of memory.
+ */
+rpi_emu_t *rpi_emu_open(uint32_t baudrate, uint32_t capacity);
+
+/**
+ * @brief Closes emulated BM-Lite opened by rpi_emu_open().
+ */
+void rpi_emu_close(rpi_emu_t *session);
+
+/**
+ * @brief Get file descriptor signalling ready response of emulated BM-Lite.
+ *
+ * The descriptor becomes readable when the next response frame can be
+ * received without waiting, like a tty with data from real BM-Lite.
+ * It is owned by the emulator and must not be read or closed.
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ *
+ * @return File descriptor or -1 on error.
+ */
+int rpi_emu_get_fd(void *session);
+
+/**
+ * @brief Check if BM-Lite emulator is in use.
+ */
+bool rpi_emu_is_active(void);
+
+/**
+ * @brief Reset emulated BM-Lite. Storage is kept.
+ */
+void rpi_emu_reset(void);
+
+/**
+ * @brief Put finger on emulated sensor.
+ *
+ * @param[in]       key         Finger key. 0 - no finger.
+ */
+void rpi_emu_set_finger(uint32_t key);
+
+/**
+ * @brief Put finger on emulated sensor opened by rpi_emu_open().
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ * @param[in]       key         Finger key. 0 - no finger.
+ */
+void rpi_emu_session_set_finger(rpi_emu_t *session, uint32_t key);
+
+/**
+ * @brief Touch emulated sensor periodically.
+ *
+ * Finger is put on the sensor every period_ms starting now and held for
+ * hold_ms. CMD_WAIT and CMD_CAPTURE wait for the touches within their
+ * timeout like real sensor does.
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ * @param[in]       key         Finger key. 0 - keep current finger.
+ * @param[in]       period_ms   Touch period. 0 - finger stays as set by
+ *                              rpi_emu_session_set_finger().
+ * @param[in]       hold_ms     Time finger stays on the sensor.
+ */
+void rpi_emu_set_touch_pattern(rpi_emu_t *session, uint32_t key, uint32_t period_ms,
+        uint32_t hold_ms);
+
+/**
+ * @brief Get start of touch in progress at given time.
+ *
+ * Used to measure touch-to-decision latency against true touch time.
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ * @param[in]       t_us        Time, usec of CLOCK_MONOTONIC.
+ *
+ * @return Start of touch (usec), 0 if no touch pattern is set.
+ */
+uint64_t rpi_emu_get_touch_start(void *session, uint64_t t_us);
+
+/**
+ * @brief Make emulated template of a finger.
+ *
+ * @param[in]       key         Finger key.
+ * @param[out]      data        Template buffer.
+ * @param[in]       size        Template size. At least 8 bytes.
+ */
+void rpi_emu_make_template(uint32_t key, uint8_t *data, uint32_t size);
+
+/**
+ * @brief Make emulated image of a finger.
+ *
+ * @param[in]       key         Finger key.
+ * @param[out]      image       Buffer of EMU_IMAGE_WIDTH * EMU_IMAGE_HEIGHT bytes.
+ */
+void rpi_emu_make_image(uint32_t key, uint8_t *image);
+
+/**
+ * @brief Lose next frames sent by host, as a noisy link would.
+ *
+ * Lost frames are not acknowledged, so host sees ACK timeout.
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ * @param[in]       count       Number of frames to lose.
+ */
+void rpi_emu_drop_frames(rpi_emu_t *session, uint32_t count);
+
+/**
+ * @brief Lose ACKs of next frames sent by host.
+ *
+ * Frames are received and processed, so host sees ACK timeout for a frame
+ * BM-Lite already has. Sending it again runs its command once more.
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ * @param[in]       count       Number of ACKs to lose.
+ */
+void rpi_emu_drop_acks(rpi_emu_t *session, uint32_t count);
+
+/**
+ * @brief Wedge emulated BM-Lite, as firmware or link lock-up would.
+ *
+ * BM-Lite stays wedged until it receives the cure command or is reset by
+ * rpi_emu_reset().
+ *
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ * @param[in]       wedge       Wedged state.
+ * @param[in]       cure        Command bringing BM-Lite back (CMD_CANCEL,
+ *                              CMD_RESET, CMD_SENSOR). 0 - only HW reset.
+ */
+void rpi_emu_wedge(rpi_emu_t *session, rpi_emu_wedge_t wedge, uint16_t cure);
+
+/**
+ * @brief Get emulator counters.
+ */
+void rpi_emu_get_stats(rpi_emu_stats_t *stats);
+
+/**
+ * @brief Sends data to emulated BM-Lite.
+ *
+ * @param[in]       size        Number of bytes to send.
+ * @param[in]       data        Data buffer to send.
+ * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t rpi_emu_send(uint16_t size, const uint8_t *data, uint32_t timeout,
+        void *session);
+
+/**
+ * @brief Receives data from emulated BM-Lite.
+ *
+ * @param[in]       size        Number of bytes to receive.
+ * @param[in, out]  data        Data buffer to fill.
+ * @param[in]       timeout     Timeout in ms. Use 0 for infinity.
+ * @param[in]       session     ::rpi_emu_t or NULL for default instance.
+ *
+ * @return ::fpc_bep_result_t
+ */
+fpc_bep_result_t rpi_emu_receive(uint16_t size, uint8_t *data, uint32_t timeout,
+        void *session);
+
+/**
+ * @brief Applies real-time profile to the calling thread.
+ *
+ * Must be called from the thread which drives HCP communication.
+ *
+ * @param[in]       params      Real-time parameters.
+ * @param[in]       chain       HCP com chain which buffers are prefaulted.
+ *                              Can be NULL.
+ */
+bool rpi_rt_profile_apply(const rpi_rt_params_t *params, HCP_comm_t *chain);
+
+/**
+ * @brief Starts thread writing SDK metrics in Prometheus text format.
+ *
+ * The file is written to a temporary name and renamed over the target, so
+ * readers always see a complete snapshot.
+ *
+ * @param[in]       path        Output file.
+ * @param[in]       interval_ms Refresh interval in ms.
+ */
+bool rpi_metrics_exporter_start(const char *path, uint32_t interval_ms);
+
+/**
+ * @brief Writes final snapshot and stops metrics thread.
+ */
+void rpi_metrics_exporter_stop(void);
+
+/**
+ * @brief Writes metrics snapshot once.
+ *
+ * @param[in]       path        Output file.
+ */
+bool rpi_metrics_write(const char *path);
+
+/** Default shared memory name of image ring */
+#define RPI_IMAGE_RING_NAME     "/bmlite_images"
+/** Default number of images kept in ring */
+#define RPI_IMAGE_RING_SLOTS    8
+
+typedef struct rpi_image_ring rpi_image_ring_t;
+
+/**
+ * @brief Image taken from ring in place.
+ */
+typedef struct {
+    /** Sequence number, incremented by each published image */
+    uint32_t seq;
+    uint32_t size;
+    uint16_t width;
+    uint16_t height;
+    uint16_t dpi;
+    /** CLOCK_MONOTONIC time of publishing in us */
+    uint64_t timestamp_us;
+    /** Image in shared memory. Valid until rpi_image_reader_release() */
+    const uint8_t *data;
+} rpi_image_view_t;
+
+typedef struct {
+    rpi_image_ring_t *ring;
+    size_t map_size;
+    /** Sequence number of next image to read */
+    uint32_t next;
+    /** Images read completely */
+    uint64_t received;
+    /** Images overwritten before or while they were read */
+    uint64_t dropped;
+} rpi_image_reader_t;
+
+/**
+ * @brief Creates shared memory image ring.
+ *
+ * A previous ring of the same name is unlinked.
+ *
+ * @param[in]       name        POSIX shared memory name, e.g. RPI_IMAGE_RING_NAME.
+ * @param[in]       slots       Number of images kept.
+ * @param[in]       slot_size   Largest image size.
+ * @return Ring or NULL.
+ */
+rpi_image_ring_t *rpi_image_ring_create(const char *name, uint32_t slots, uint32_t slot_size);
+
+/**
+ * @brief Closes ring for readers, unmaps and unlinks it.
+ */
+void rpi_image_ring_destroy(rpi_image_ring_t *ring, const char *name);
+
+/**
+ * @brief Copies image to the oldest slot and wakes up readers.
+ *
+ * Never waits for readers: a reader which is behind by the ring size loses
+ * images.
+ *
+ * @return false if ring is NULL or image does not fit to a slot.
+ */
+bool rpi_image_ring_publish(rpi_image_ring_t *ring, const uint8_t *data, uint32_t size,
+        uint16_t width, uint16_t height, uint16_t dpi);
+
+/**
+ * @brief Maps ring created by other process. Reading starts from the next
+ *        published image.
+ */
+bool rpi_image_reader_open(rpi_image_reader_t *reader, const char *name);
+
+/**
+ * @brief Unmaps ring.
+ */
+void rpi_image_reader_close(rpi_image_reader_t *reader);
+
+/**
+ * @brief Waits for next image and returns it without copying.
+ *
+ * @param[in]       reader      Reader.
+ * @param[out]      view        Image in shared memory.
+ * @param[in]       timeout_ms  Wait timeout.
+ * @return FPC_BEP_RESULT_OK, FPC_BEP_RESULT_TIMEOUT or FPC_BEP_RESULT_IO_ERROR
+ *         if the writer destroyed the ring.
+ */
+fpc_bep_result_t rpi_image_reader_acquire(rpi_image_reader_t *reader, rpi_image_view_t *view,
+        uint32_t timeout_ms);
+
+/**
+ * @brief Finishes use of image returned by rpi_image_reader_acquire().
+ *
+ * @return false if the writer reused the slot meanwhile, so the data read
+ *         may be torn and must be discarded.
+ */
+bool rpi_image_reader_release(rpi_image_reader_t *reader, const rpi_image_view_t *view);
+
+/**
+ * @brief Number of published images not read yet.
+ */
+uint32_t rpi_image_reader_backlog(const rpi_image_reader_t *reader);
+
 /**
  * @brief Get time in micro seconds
  *
@@ -6,10 +6,21 @@ VPATH += $(NHAL)
 
 C_INC += -I$(NHAL)/inc
 
-LDFLAGS += -lwiringPi -L$(NHAL)/lib/ 
+# Build host without Raspberry Pi GPIO and SPI (COM port and emulator): make HOST=1
+ifeq ($(HOST),1)
+CFLAGS += -DRPI_NO_GPIO
+LDFLAGS += -lpthread -lm -lrt
+else
+LDFLAGS += -lwiringPi -lpthread -lm -lrt -L$(NHAL)/lib/ 
+endif
 
 # Source Folders
 VPATH += $(NHAL)/src/
 
-# C Sources
-C_SRCS += $(notdir $(wildcard $(NHAL)/src/*.c))
\ No newline at end of file
+# C Sources. BM-Lite emulator is test code, built only with: make USE_EMULATOR=1
+C_SRCS += $(notdir $(filter-out %/rpi_emu.c,$(wildcard $(NHAL)/src/*.c)))
+ifeq ($(USE_EMULATOR),1)
+C_SRCS += rpi_emu.c
+CFLAGS += -DBMLITE_USE_EMULATOR
+CXXFLAGS += -DBMLITE_USE_EMULATOR
+endif
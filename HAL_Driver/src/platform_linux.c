@@ -31,6 +31,7 @@
 #include <string.h>
 #include <termios.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bmlite_hal.h"
@@ -49,6 +50,14 @@ hal_tick_t hal_timebase_get_tick(void)
     return time_in_ms;
 }
 
+uint64_t hal_timebase_get_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void hal_timebase_busy_wait(uint32_t ms)
 {
     usleep(ms * 1000);
@@ -56,7 +65,9 @@ void hal_timebase_busy_wait(uint32_t ms)
 
 void rpi_clear_screen(void)
 {
-    system("clear");
+    /* ANSI home and erase display. No shell is forked */
+    fputs("\033[H\033[2J", stdout);
+    fflush(stdout);
 }
 
 void hal_timebase_init()
@@ -68,17 +79,34 @@ fpc_bep_result_t hal_board_init(void *params)
     rpi_initparams_t *p = (rpi_initparams_t *)params;
         switch (p->iface) {
         case SPI_INTERFACE:
-            if(!rpi_spi_init(p->baudrate)) {
+            if(!rpi_spi_init(p->baudrate, !p->warm_attach)) {
                 printf("SPI initialization failed\n");
                 return FPC_BEP_RESULT_INTERNAL_ERROR;
             }
             break;
         case COM_INTERFACE:
-            if (!rpi_com_init(p->port, p->baudrate, p->timeout)) {
+            if (!rpi_com_init(p->port, p->baudrate, p->timeout, p->flow_control)) {
                 printf("Com initialization failed\n");
                 return FPC_BEP_RESULT_INTERNAL_ERROR;
             }
             break;
+        case EMU_INTERFACE:
+#ifdef BMLITE_USE_EMULATOR
+            if (!rpi_emu_init(p->baudrate, EMU_DEFAULT_CAPACITY)) {
+                printf("Emulator initialization failed\n");
+                return FPC_BEP_RESULT_INTERNAL_ERROR;
+            }
+            break;
+#else
+            printf("Emulator is not built, use make USE_EMULATOR=1\n");
+            return FPC_BEP_RESULT_NOT_SUPPORTED;
+#endif
+        case TCP_INTERFACE:
+            if (!rpi_tcp_init(p->port)) {
+                printf("TCP connection failed\n");
+                return FPC_BEP_RESULT_INTERNAL_ERROR;
+            }
+            break;
         default:
             printf("Interface not specified'n");
             return FPC_BEP_RESULT_INTERNAL_ERROR;
@@ -87,6 +115,14 @@ fpc_bep_result_t hal_board_init(void *params)
     if (p->iface == COM_INTERFACE) {
         p->hcp_comm->read = rpi_com_receive;
         p->hcp_comm->write = rpi_com_send;
+#ifdef BMLITE_USE_EMULATOR
+    } else if (p->iface == EMU_INTERFACE) {
+        p->hcp_comm->read = rpi_emu_receive;
+        p->hcp_comm->write = rpi_emu_send;
+#endif
+    } else if (p->iface == TCP_INTERFACE) {
+        p->hcp_comm->read = rpi_tcp_receive;
+        p->hcp_comm->write = rpi_tcp_send;
     } else {
         p->hcp_comm->read = platform_bmlite_receive;
         p->hcp_comm->write = platform_bmlite_send;
@@ -27,15 +27,26 @@
 #include <fcntl.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include "platform_rpi.h"
 
-static int fd = -1;
+/** Time for BM-Lite to reconfigure UART after speed change (msec) */
+#define SPEED_SWITCH_SETTLE_TIME 10
 
-static int set_interface_attribs(int fd, int speed, int timeout)
+static rpi_com_session_t com_session = {
+    .fd = -1,
+};
+
+static int set_interface_attribs(int fd, int timeout)
 {
     struct termios tty;
+    struct serial_struct serial;
 
     memset(&tty, 0, sizeof tty);
     if (tcgetattr (fd, &tty) != 0) {
@@ -43,9 +54,6 @@ static int set_interface_attribs(int fd, int speed, int timeout)
         return -1;
     }
 
-    cfsetospeed(&tty, speed);
-    cfsetispeed(&tty, speed);
-
     tty.c_iflag = 0; // Clear input modes
     tty.c_oflag = 0; // Clear output modes
     tty.c_cflag = 0; // Clear control modes
@@ -55,90 +63,285 @@ static int set_interface_attribs(int fd, int speed, int timeout)
     tty.c_cflag |= HUPCL; // Lower modem control lines after last process closes the device (hang up)
     tty.c_cflag |= CLOCAL; // Ignore modem control lines
 
+    // Reads are non-blocking and driven by poll(), so read() must return
+    // whatever is available immediately
     tty.c_cc[VMIN] = 0; // Minimum number of characters for non-canonical read
     tty.c_cc[VTIME] = 0; // Timeout in deciseconds for non-canonical read
 
     tcsetattr(fd, TCSANOW, &tty);
+    tcflush(fd, TCIOFLUSH);
+
+    // Ask driver to push received bytes to tty layer without delay.
+    // Not all drivers support it, so failure is ignored.
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
 
     return 0;
 }
 
-bool rpi_com_init(char *port, int baudrate, int timeout)
+static uint64_t get_time_ms(void)
 {
+    struct timespec ts;
 
-    int baud;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    fd = open(port, O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) {
+/*
+ * Wait for fd to become ready until deadline.
+ * Returns 1 if ready, 0 on timeout, -1 on error
+ */
+static int wait_fd(rpi_com_session_t *s, short events, uint64_t deadline)
+{
+    struct pollfd pfd = { .fd = s->fd, .events = events };
+    int wait_ms;
+    int retval;
+
+    do {
+        if (deadline) {
+            uint64_t now = get_time_ms();
+            wait_ms = now < deadline ? (int)(deadline - now) : 0;
+        } else {
+            wait_ms = -1;
+        }
+        s->stats.poll_calls++;
+        retval = poll(&pfd, 1, wait_ms);
+    } while (retval < 0 && errno == EINTR);
+
+    if (retval > 0 && (pfd.revents & (POLLERR | POLLNVAL))) {
+        return -1;
+    }
+    return retval;
+}
+
+/*
+ * Fill RX ring with everything available in the tty.
+ * Returns number of bytes read or -1 on error
+ */
+static int fill_rx_ring(rpi_com_session_t *s)
+{
+    struct iovec iov[2];
+    uint32_t free_space = COM_RX_RING_SIZE - (s->rx_tail - s->rx_head);
+    uint32_t tail = s->rx_tail & (COM_RX_RING_SIZE - 1);
+    uint32_t chunk = HCP_MIN(free_space, COM_RX_RING_SIZE - tail);
+    int iovcnt = 1;
+    ssize_t n;
+
+    if (free_space == 0) {
+        return 0;
+    }
+
+    // Free space may wrap around the end of the ring
+    iov[0].iov_base = &s->rx_ring[tail];
+    iov[0].iov_len = chunk;
+    if (chunk < free_space) {
+        iov[1].iov_base = &s->rx_ring[0];
+        iov[1].iov_len = free_space - chunk;
+        iovcnt = 2;
+    }
+
+    do {
+        s->stats.read_calls++;
+        n = readv(s->fd, iov, iovcnt);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    s->rx_tail += n;
+    s->stats.rx_bytes += n;
+    return n;
+}
+
+/*
+ * Copy up to size bytes from RX ring to data.
+ * Returns number of bytes copied
+ */
+static uint32_t drain_rx_ring(rpi_com_session_t *s, uint8_t *data, uint32_t size)
+{
+    uint32_t n = HCP_MIN(size, s->rx_tail - s->rx_head);
+    uint32_t head = s->rx_head & (COM_RX_RING_SIZE - 1);
+    uint32_t chunk = HCP_MIN(n, COM_RX_RING_SIZE - head);
+
+    memcpy(data, &s->rx_ring[head], chunk);
+    memcpy(data + chunk, &s->rx_ring[0], n - chunk);
+    s->rx_head += n;
+    return n;
+}
+
+static bool com_open(rpi_com_session_t *s, char *port, int baudrate, int timeout,
+        bool flow_control)
+{
+    s->fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (s->fd < 0) {
         fprintf(stderr, "error %d opening %s: %s", errno, port, strerror (errno));
         return false;
     }
 
-    if (baudrate == 921600) {
-        baud = B921600;
-    } else {
-        baud = B115200;
+    set_interface_attribs(s->fd, timeout);
+    if (rpi_com_tty_set_speed(s->fd, baudrate, flow_control) != 0) {
+        fprintf(stderr, "error setting speed %d on %s\n", baudrate, port);
+        close(s->fd);
+        s->fd = -1;
+        return false;
     }
-    set_interface_attribs(fd, baud, timeout);
+    s->baudrate = baudrate;
+    s->flow_control = flow_control;
+
+    s->rx_head = 0;
+    s->rx_tail = 0;
+    memset(&s->stats, 0, sizeof(s->stats));
 
     return true;
 }
 
+bool rpi_com_init(char *port, int baudrate, int timeout, bool flow_control)
+{
+    return com_open(&com_session, port, baudrate, timeout, flow_control);
+}
+
+rpi_com_session_t *rpi_com_open(char *port, int baudrate, bool flow_control)
+{
+    rpi_com_session_t *s = malloc(sizeof(rpi_com_session_t));
+
+    if (s && !com_open(s, port, baudrate, 0, flow_control)) {
+        free(s);
+        s = NULL;
+    }
+    return s;
+}
+
+void rpi_com_close(rpi_com_session_t *session)
+{
+    if (session) {
+        close(session->fd);
+        free(session);
+    }
+}
+
+int rpi_com_get_fd(void *session)
+{
+    rpi_com_session_t *s = session ? session : &com_session;
+
+    return s->fd;
+}
+
+bool rpi_com_rx_pending(void *session)
+{
+    rpi_com_session_t *s = session ? session : &com_session;
+
+    return s->rx_tail != s->rx_head;
+}
+
+static void flush_rx(rpi_com_session_t *s)
+{
+    tcflush(s->fd, TCIFLUSH);
+    s->rx_head = s->rx_tail;
+}
+
+fpc_bep_result_t rpi_com_set_speed(void *session, uint32_t baudrate)
+{
+    rpi_com_session_t *s = session ? session : &com_session;
+
+    if (rpi_com_tty_set_speed(s->fd, baudrate, s->flow_control) != 0) {
+        return FPC_BEP_RESULT_IO_ERROR;
+    }
+    s->baudrate = baudrate;
+    usleep(SPEED_SWITCH_SETTLE_TIME * 1000);
+    flush_rx(s);
+    return FPC_BEP_RESULT_OK;
+}
+
+uint32_t rpi_com_get_speed(void *session)
+{
+    rpi_com_session_t *s = session ? session : &com_session;
+
+    return s->baudrate;
+}
+
+void rpi_com_get_stats(rpi_com_stats_t *stats)
+{
+    *stats = com_session.stats;
+}
+
 fpc_bep_result_t rpi_com_send(uint16_t size, const uint8_t *data, uint32_t timeout,
         void *session)
 {
-    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
-    int n;
+    rpi_com_session_t *s = session ? session : &com_session;
+    uint64_t deadline = timeout ? get_time_ms() + timeout : 0;
+    uint16_t n_written = 0;
+    ssize_t n;
 
-    if (fd < 0) {
+    if (s->fd < 0) {
         fprintf(stderr, "error invalid file descriptor");
         return FPC_BEP_RESULT_INVALID_ARGUMENT;
     }
 
-    n = write(fd, data, size);
-
-    if (n != size) {
-        res = FPC_BEP_RESULT_IO_ERROR;
+    // Frame is sent by single write() unless tty output buffer is full
+    while (n_written < size) {
+        s->stats.write_calls++;
+        n = write(s->fd, data + n_written, size - n_written);
+        if (n > 0) {
+            n_written += n;
+            s->stats.tx_bytes += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            int retval = wait_fd(s, POLLOUT, deadline);
+            if (retval == 0) {
+                return FPC_BEP_RESULT_TIMEOUT;
+            } else if (retval < 0) {
+                return FPC_BEP_RESULT_IO_ERROR;
+            }
+        } else {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
     }
 
-    return res;
+    return FPC_BEP_RESULT_OK;
 }
 
 fpc_bep_result_t rpi_com_receive(uint16_t size, uint8_t *data, uint32_t timeout,
         void *session)
 {
-    fpc_bep_result_t res = FPC_BEP_RESULT_OK;
-    int n_read = 0;
-    int n = 0;
-    fd_set rfds;
+    rpi_com_session_t *s = session ? session : &com_session;
+    uint64_t deadline = timeout ? get_time_ms() + timeout : 0;
+    uint16_t n_read = 0;
+    bool ready = false;
     int retval;
-    unsigned char c;
 
-    if (fd < 0) {
+    if (s->fd < 0) {
         fprintf(stderr, "error invalid file descriptor");
         return FPC_BEP_RESULT_INVALID_ARGUMENT;
     }
 
-    FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
-
-    while (n_read < size) {
-        retval = select(fd + 1, &rfds, NULL, NULL, NULL);
-
-        if (retval == -1) {
-            perror("select()");
-            exit(EXIT_FAILURE);
-        } else if (retval != 0) {
-            n = read(fd, &c, sizeof(c));
-            if (n > 0) {
-                *data = c;
-                data++;
-                n_read++;
-            }
+    while (1) {
+        n_read += drain_rx_ring(s, data + n_read, size - n_read);
+        if (n_read == size) {
+            break;
         }
-    }
 
-    return res;
-}
+        retval = fill_rx_ring(s);
+        if (retval < 0) {
+            return FPC_BEP_RESULT_IO_ERROR;
+        } else if (retval > 0) {
+            ready = false;
+            continue;
+        } else if (ready && s->rx_tail - s->rx_head < COM_RX_RING_SIZE) {
+            // Readable but nothing read: tty hang-up or socket closed by peer
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
 
+        retval = wait_fd(s, POLLIN, deadline);
+        if (retval == 0) {
+            return FPC_BEP_RESULT_TIMEOUT;
+        } else if (retval < 0) {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+        ready = true;
+    }
 
+    return FPC_BEP_RESULT_OK;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    rpi_com_termios2.c
+ * @brief   Arbitrary UART baudrate support
+ *
+ * Kernel termios2 structure conflicts with glibc <termios.h>,
+ * so it is kept in a separate compilation unit.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+/** Allowed deviation of baudrate set by driver (percent) */
+#define BAUDRATE_TOLERANCE 2
+
+int rpi_com_tty_set_speed(int fd, uint32_t baudrate, bool flow_control)
+{
+    struct termios2 tio;
+    uint32_t actual;
+
+    if (ioctl(fd, TCGETS2, &tio) != 0) {
+        return -1;
+    }
+
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baudrate;
+    tio.c_ospeed = baudrate;
+
+    if (flow_control) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_cflag &= ~CRTSCTS;
+    }
+
+    // Let pending output leave at the old speed
+    if (ioctl(fd, TCSETSW2, &tio) != 0) {
+        return -1;
+    }
+
+    // Driver may round the rate to what UART clock can produce
+    if (ioctl(fd, TCGETS2, &tio) != 0) {
+        return -1;
+    }
+    actual = tio.c_ospeed;
+    if (actual * 100 < baudrate * (100 - BAUDRATE_TOLERANCE) ||
+        actual * 100 > baudrate * (100 + BAUDRATE_TOLERANCE)) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1107 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    rpi_emu.c
+ * @brief   BM-Lite emulator physical layer
+ *
+ * Emulates BM-Lite on HCP link level (frames, CRC, ACK) so host code can
+ * be run and measured without hardware. Link transfer time and command
+ * processing time follow a rough timing model.
+ *
+ * Matching is emulated with finger keys. Emulated templates and images
+ * carry the key of the finger they were made from. Extracted image
+ * matches a template with the same key.
+ *
+ * rpi_emu_init() sets up the default device used with NULL session.
+ * More independent devices can be opened with rpi_emu_open() and passed
+ * as physical layer session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "platform_rpi.h"
+#include "fpc_crc.h"
+#include "bmlite_if.h"
+
+/** Maximum size of command or response packet */
+#define EMU_MAX_PKT_SIZE 102400
+/** Number of samples needed for enroll */
+#define EMU_ENROLL_SAMPLES 3
+/** Finger on the sensor after init */
+#define EMU_DEFAULT_FINGER 1
+/** Magic at start of emulated template */
+#define EMU_TEMPLATE_MAGIC 0x544d4545
+
+/** Timing model (usec) */
+#define EMU_CMD_TIME_US            500
+#define EMU_CAPTURE_TIME_US        60000
+#define EMU_EXTRACT_TIME_US        90000
+#define EMU_IDENTIFY_TIME_US       15000
+#define EMU_IDENTIFY_PER_TEMPLATE_US 400
+#define EMU_ENROLL_ADD_TIME_US     40000
+#define EMU_FLASH_WRITE_TIME_US    20000
+#define EMU_TEMPLATE_PUT_TIME_US   2000
+/** Matched template is updated after the answer, next command waits for it */
+#define EMU_TEMPLATE_UPDATE_TIME_US 20000
+/** Wake-up time of power modes (usec). Index is ::bmlite_power_mode_t.
+    Assumed values, not measured on BM-Lite */
+static const uint32_t emu_wake_us[] = { 0, 300, 8000, 45000 };
+
+typedef struct {
+    bool used;
+    uint16_t id;
+    uint32_t size;
+    uint8_t data[EMU_TEMPLATE_SIZE];
+} emu_template_t;
+
+typedef struct rpi_emu {
+    bool active;
+    uint32_t link_ns_per_byte;
+    uint64_t link_debt_ns;
+
+    /* Command being received from host */
+    uint8_t in_pkt[EMU_MAX_PKT_SIZE];
+    uint32_t in_size;
+
+    /* Response being sent to host */
+    uint8_t out_pkt[EMU_MAX_PKT_SIZE];
+    uint32_t out_size;
+    uint32_t out_pos;
+    uint16_t out_seq_nr;
+    uint16_t out_seq_len;
+    uint8_t frame[MTU];
+    uint32_t frame_len;
+    uint32_t frame_pos;
+    bool ack_pending;
+    bool wait_ack;
+    /** Frames from host to lose, see rpi_emu_drop_frames() */
+    uint32_t drop_frames;
+    /** ACKs of host frames to lose, see rpi_emu_drop_acks() */
+    uint32_t drop_acks;
+    /** Wedged state and command curing it, see rpi_emu_wedge() */
+    rpi_emu_wedge_t wedge;
+    uint16_t wedge_cure;
+    bool nak_pending;
+    uint64_t ready_at_us;
+    uint32_t busy_us;
+    /** Template update after match runs until then */
+    uint64_t update_until_us;
+    bool update_pending;
+
+    /* Device state */
+    uint32_t finger_key;
+    /* Periodic touches, see rpi_emu_set_touch_pattern() */
+    uint64_t touch_origin_us;
+    uint64_t touch_period_us;
+    uint64_t touch_hold_us;
+    uint8_t image[EMU_IMAGE_WIDTH * EMU_IMAGE_HEIGHT];
+    bool image_valid;
+    /** Extracted features share RAM with the template, template put replaces them */
+    uint32_t features_key;
+    bool features_valid;
+    uint8_t ram_template[EMU_TEMPLATE_SIZE];
+    uint32_t ram_template_size;
+    int enroll_remaining;
+    uint32_t enroll_key;
+    uint32_t uart_speed;
+    uint32_t power_mode;
+    emu_template_t *storage;
+    uint32_t capacity;
+    rpi_emu_stats_t stats;
+    /** timerfd signalling ready response, -1 until requested */
+    int timer_fd;
+} emu_t;
+
+/** Default instance used by rpi_emu_init() and NULL session */
+static emu_t emu;
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+
+    nanosleep(&ts, NULL);
+}
+
+/* Account link transfer time. Short transfers are accumulated */
+static void link_delay(emu_t *e, uint32_t bytes)
+{
+    e->link_debt_ns += (uint64_t)bytes * e->link_ns_per_byte;
+    if (e->link_debt_ns >= 200000) {
+        sleep_us(e->link_debt_ns / 1000);
+        e->link_debt_ns %= 1000;
+    }
+}
+
+/* Transfer of bytes starting after wait_us would not end within timeout
+   (msec, 0 - forever). Host gives up when the timeout expires */
+static bool link_timed_out(const emu_t *e, uint32_t bytes, uint64_t wait_us, uint32_t timeout)
+{
+    uint64_t end_ns = wait_us * 1000 + e->link_debt_ns + (uint64_t)bytes * e->link_ns_per_byte;
+
+    if (timeout == 0 || end_ns <= (uint64_t)timeout * 1000000) {
+        return false;
+    }
+    sleep_us((uint64_t)timeout * 1000);
+    return true;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void rpi_emu_make_template(uint32_t key, uint8_t *data, uint32_t size)
+{
+    uint32_t state = key | 1;
+
+    for (uint32_t i = 8; i < size; i++) {
+        data[i] = xorshift32(&state);
+    }
+    put_le32(data, EMU_TEMPLATE_MAGIC);
+    put_le32(data + 4, key);
+}
+
+void rpi_emu_make_image(uint32_t key, uint8_t *image)
+{
+    uint32_t state = key | 1;
+    /* Ridge orientation and period depend on the finger */
+    float angle = (xorshift32(&state) % 180) * 3.14159f / 180;
+    float period = 7 + xorshift32(&state) % 4;
+    float cx = EMU_IMAGE_WIDTH / 2, cy = EMU_IMAGE_HEIGHT / 2;
+    float rx = EMU_IMAGE_WIDTH * 0.4f, ry = EMU_IMAGE_HEIGHT * 0.46f;
+    float ca = cosf(angle), sa = sinf(angle);
+
+    for (int y = 0; y < EMU_IMAGE_HEIGHT; y++) {
+        for (int x = 0; x < EMU_IMAGE_WIDTH; x++) {
+            float dx = (x - cx) / rx, dy = (y - cy) / ry;
+            uint8_t *p = &image[y * EMU_IMAGE_WIDTH + x];
+            if (dx * dx + dy * dy > 1) {
+                *p = 230 + xorshift32(&state) % 16;
+            } else {
+                float t = (x * ca + y * sa) * 2 * 3.14159f / period;
+                *p = 128 + 90 * sinf(t) + (int)(xorshift32(&state) % 17) - 8;
+            }
+        }
+    }
+    /* Finger key is stored in the first pixels */
+    put_le32(image, key);
+}
+
+static emu_template_t *storage_find(emu_t *e, uint16_t id)
+{
+    for (uint32_t i = 0; i < e->capacity; i++) {
+        if (e->storage[i].used && e->storage[i].id == id) {
+            return &e->storage[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t storage_count(emu_t *e)
+{
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < e->capacity; i++) {
+        n += e->storage[i].used;
+    }
+    return n;
+}
+
+/* Command packet access */
+
+static bool cmd_arg(emu_t *e, uint16_t arg, uint8_t **data, uint16_t *size)
+{
+    uint16_t args_nr = get_le16(e->in_pkt + 2);
+    uint32_t pos = 4;
+
+    for (uint16_t i = 0; i < args_nr && pos + 4 <= e->in_size; i++) {
+        uint16_t a = get_le16(e->in_pkt + pos);
+        uint16_t s = get_le16(e->in_pkt + pos + 2);
+        if (a == arg) {
+            if (data) {
+                *data = e->in_pkt + pos + 4;
+            }
+            if (size) {
+                *size = s;
+            }
+            return true;
+        }
+        pos += 4 + s;
+    }
+    return false;
+}
+
+static bool cmd_has(emu_t *e, uint16_t arg)
+{
+    return cmd_arg(e, arg, NULL, NULL);
+}
+
+static uint16_t cmd_id(emu_t *e)
+{
+    uint8_t *data;
+    uint16_t size;
+
+    return cmd_arg(e, ARG_ID, &data, &size) && size >= 2 ? get_le16(data) : 0;
+}
+
+/* Response packet building */
+
+static void resp_init(emu_t *e, uint16_t cmd)
+{
+    put_le16(e->out_pkt, cmd);
+    put_le16(e->out_pkt + 2, 0);
+    e->out_size = 4;
+}
+
+static void resp_add(emu_t *e, uint16_t arg, const void *data, uint16_t size)
+{
+    if (e->out_size + 4 + size > EMU_MAX_PKT_SIZE) {
+        return;
+    }
+    put_le16(e->out_pkt + 2, get_le16(e->out_pkt + 2) + 1);
+    put_le16(e->out_pkt + e->out_size, arg);
+    put_le16(e->out_pkt + e->out_size + 2, size);
+    if (size) {
+        memcpy(e->out_pkt + e->out_size + 4, data, size);
+    }
+    e->out_size += 4 + size;
+}
+
+static void resp_add_u16(emu_t *e, uint16_t arg, uint16_t value)
+{
+    uint8_t buf[2];
+
+    put_le16(buf, value);
+    resp_add(e, arg, buf, 2);
+}
+
+static void resp_add_u32(emu_t *e, uint16_t arg, uint32_t value)
+{
+    uint8_t buf[4];
+
+    put_le32(buf, value);
+    resp_add(e, arg, buf, 4);
+}
+
+static void resp_result(emu_t *e, fpc_bep_result_t result)
+{
+    resp_add_u32(e, ARG_RESULT, (uint32_t)result);
+}
+
+/* Finger state */
+
+#define EMU_NEVER UINT64_MAX
+
+static bool finger_down_at(emu_t *e, uint64_t t)
+{
+    if (e->touch_period_us == 0) {
+        return e->finger_key != 0;
+    }
+    return t >= e->touch_origin_us &&
+        (t - e->touch_origin_us) % e->touch_period_us < e->touch_hold_us;
+}
+
+/* Time when finger is down (or up) at or after now. EMU_NEVER if it can't happen */
+static uint64_t finger_wait_us(emu_t *e, bool down, uint64_t now)
+{
+    uint64_t phase, start;
+
+    if (e->touch_period_us == 0 || e->touch_hold_us == 0) {
+        // Static finger. Lifting is not checked, as before touch patterns
+        return !down || e->finger_key ? now : EMU_NEVER;
+    }
+    if (finger_down_at(e, now) == down) {
+        return now;
+    }
+    if (now < e->touch_origin_us) {
+        return down ? e->touch_origin_us : now;
+    }
+    phase = (now - e->touch_origin_us) % e->touch_period_us;
+    start = now - phase;
+    return down ? start + e->touch_period_us : start + e->touch_hold_us;
+}
+
+/*
+ * Wait for finger state within ARG_TIMEOUT (msec, 0 - forever) from now.
+ * Device is busy until the state is reached or timeout expires.
+ */
+static bool finger_wait(emu_t *e, bool down)
+{
+    uint8_t *data;
+    uint16_t size;
+    uint64_t timeout_us = 0;
+    uint64_t now = time_us();
+    uint64_t at = finger_wait_us(e, down, now);
+
+    if (cmd_arg(e, ARG_TIMEOUT, &data, &size) && size >= 2) {
+        timeout_us = (uint64_t)get_le16(data) * 1000;
+    }
+    if (at != EMU_NEVER && (timeout_us == 0 || at - now <= timeout_us)) {
+        e->busy_us += at - now;
+        return true;
+    }
+    // Without touch pattern missing finger is reported at once
+    if (timeout_us && e->touch_period_us) {
+        e->busy_us = timeout_us;
+    }
+    return false;
+}
+
+/* Command processing */
+
+static void cmd_wait(emu_t *e)
+{
+    bool down = !cmd_has(e, ARG_FINGER_UP);
+
+    resp_result(e, finger_wait(e, down) ? FPC_BEP_RESULT_OK : FPC_BEP_RESULT_TIMEOUT);
+}
+
+static void cmd_capture(emu_t *e)
+{
+    if (!finger_wait(e, true)) {
+        if (e->touch_period_us == 0) {
+            e->busy_us += EMU_CAPTURE_TIME_US;
+        }
+        resp_result(e, FPC_BEP_RESULT_TIMEOUT);
+        return;
+    }
+    e->busy_us += EMU_CAPTURE_TIME_US;
+    rpi_emu_make_image(e->finger_key, e->image);
+    e->image_valid = true;
+    e->features_valid = false;
+    resp_result(e, FPC_BEP_RESULT_OK);
+}
+
+static void cmd_image(emu_t *e)
+{
+    uint8_t *data;
+    uint16_t size;
+
+    if (cmd_has(e, ARG_SIZE)) {
+        resp_add_u32(e, ARG_SIZE, sizeof(e->image));
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_UPLOAD)) {
+        if (!e->image_valid) {
+            resp_result(e, FPC_BEP_RESULT_WRONG_STATE);
+            return;
+        }
+        resp_add(e, ARG_DATA, e->image, sizeof(e->image));
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_DOWNLOAD)) {
+        if (!cmd_arg(e, ARG_DATA, &data, &size) || size != sizeof(e->image)) {
+            resp_result(e, FPC_BEP_RESULT_INVALID_ARGUMENT);
+            return;
+        }
+        memcpy(e->image, data, size);
+        e->image_valid = true;
+        e->features_valid = false;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_EXTRACT)) {
+        e->busy_us += EMU_EXTRACT_TIME_US;
+        if (!e->image_valid) {
+            resp_result(e, FPC_BEP_RESULT_WRONG_STATE);
+            return;
+        }
+        e->features_key = get_le32(e->image);
+        e->features_valid = true;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_CREATE) || cmd_has(e, ARG_DELETE)) {
+        e->image_valid = false;
+        e->features_valid = false;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else {
+        resp_result(e, FPC_BEP_RESULT_NOT_SUPPORTED);
+    }
+}
+
+static void cmd_identify(emu_t *e)
+{
+    uint8_t match = 0;
+    uint16_t id = 0;
+    uint32_t n = 0;
+
+    if (!e->features_valid) {
+        resp_result(e, FPC_BEP_RESULT_WRONG_STATE);
+        return;
+    }
+
+    for (uint32_t i = 0; i < e->capacity; i++) {
+        emu_template_t *t = &e->storage[i];
+        if (!t->used) {
+            continue;
+        }
+        n++;
+        if (get_le32(t->data + 4) == e->features_key) {
+            match = 1;
+            id = t->id;
+            break;
+        }
+    }
+    e->busy_us += EMU_IDENTIFY_TIME_US + n * EMU_IDENTIFY_PER_TEMPLATE_US;
+
+    resp_add(e, ARG_MATCH, &match, 1);
+    if (match) {
+        resp_add_u16(e, ARG_ID, id);
+        e->update_pending = true;
+    }
+    resp_result(e, FPC_BEP_RESULT_OK);
+}
+
+static void cmd_enroll(emu_t *e)
+{
+    if (cmd_has(e, ARG_START)) {
+        e->enroll_remaining = EMU_ENROLL_SAMPLES;
+        e->enroll_key = 0;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_ADD)) {
+        e->busy_us += EMU_ENROLL_ADD_TIME_US;
+        if (!e->image_valid || e->enroll_remaining <= 0) {
+            resp_result(e, FPC_BEP_RESULT_WRONG_STATE);
+            return;
+        }
+        e->enroll_key = get_le32(e->image);
+        e->enroll_remaining--;
+        resp_add_u32(e, ARG_COUNT, e->enroll_remaining);
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_FINISH)) {
+        if (e->enroll_remaining != 0) {
+            resp_result(e, FPC_BEP_RESULT_WRONG_STATE);
+            return;
+        }
+        rpi_emu_make_template(e->enroll_key, e->ram_template, EMU_TEMPLATE_SIZE);
+        e->ram_template_size = EMU_TEMPLATE_SIZE;
+        e->features_valid = false;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else {
+        resp_result(e, FPC_BEP_RESULT_NOT_SUPPORTED);
+    }
+}
+
+static void cmd_template(emu_t *e)
+{
+    uint8_t *data;
+    uint16_t size;
+
+    if (cmd_has(e, ARG_SAVE)) {
+        uint16_t id = cmd_id(e);
+        emu_template_t *t = NULL;
+
+        if (e->ram_template_size == 0) {
+            resp_result(e, FPC_BEP_RESULT_MISSING_TEMPLATE);
+            return;
+        }
+        if (storage_find(e, id)) {
+            resp_result(e, FPC_BEP_RESULT_ID_NOT_UNIQUE);
+            return;
+        }
+        for (uint32_t i = 0; i < e->capacity && t == NULL; i++) {
+            if (!e->storage[i].used) {
+                t = &e->storage[i];
+            }
+        }
+        if (t == NULL) {
+            resp_result(e, FPC_BEP_RESULT_NO_RESOURCE);
+            return;
+        }
+        e->busy_us += EMU_FLASH_WRITE_TIME_US;
+        e->stats.flash_writes++;
+        t->used = true;
+        t->id = id;
+        t->size = e->ram_template_size;
+        memcpy(t->data, e->ram_template, t->size);
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_DELETE)) {
+        e->ram_template_size = 0;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_UPLOAD)) {
+        if (e->ram_template_size == 0) {
+            resp_result(e, FPC_BEP_RESULT_MISSING_TEMPLATE);
+            return;
+        }
+        resp_add(e, ARG_DATA, e->ram_template, e->ram_template_size);
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_DOWNLOAD)) {
+        e->busy_us += EMU_TEMPLATE_PUT_TIME_US;
+        if (!cmd_arg(e, ARG_DATA, &data, &size) || size < 8 || size > EMU_TEMPLATE_SIZE ||
+                get_le32(data) != EMU_TEMPLATE_MAGIC) {
+            resp_result(e, FPC_BEP_RESULT_INVALID_FORMAT);
+            return;
+        }
+        memcpy(e->ram_template, data, size);
+        e->ram_template_size = size;
+        e->features_valid = false;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else {
+        resp_result(e, FPC_BEP_RESULT_NOT_SUPPORTED);
+    }
+}
+
+static void cmd_storage_template(emu_t *e)
+{
+    if (cmd_has(e, ARG_DELETE)) {
+        e->busy_us += EMU_FLASH_WRITE_TIME_US;
+        e->stats.flash_writes++;
+        if (cmd_has(e, ARG_ALL)) {
+            for (uint32_t i = 0; i < e->capacity; i++) {
+                e->storage[i].used = false;
+            }
+        } else {
+            emu_template_t *t = storage_find(e, cmd_id(e));
+            if (t == NULL) {
+                resp_result(e, FPC_BEP_RESULT_ID_NOT_FOUND);
+                return;
+            }
+            t->used = false;
+        }
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_UPLOAD)) {
+        emu_template_t *t = storage_find(e, cmd_id(e));
+        if (t == NULL) {
+            resp_result(e, FPC_BEP_RESULT_ID_NOT_FOUND);
+            return;
+        }
+        memcpy(e->ram_template, t->data, t->size);
+        e->ram_template_size = t->size;
+        e->features_valid = false;
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_COUNT)) {
+        resp_add_u16(e, ARG_COUNT, storage_count(e));
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else if (cmd_has(e, ARG_ID)) {
+        uint8_t ids[2 * 1024];
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < e->capacity && n < sizeof(ids) / 2; i++) {
+            if (e->storage[i].used) {
+                put_le16(ids + 2 * n++, e->storage[i].id);
+            }
+        }
+        resp_add(e, ARG_DATA, ids, 2 * n);
+        resp_result(e, FPC_BEP_RESULT_OK);
+    } else {
+        resp_result(e, FPC_BEP_RESULT_NOT_SUPPORTED);
+    }
+}
+
+static void cmd_info(emu_t *e)
+{
+    static const char version[] = "BM-Lite emulator 1.0";
+    static const uint8_t unique_id[12] = { 'E', 'M', 'U', 'L', 'A', 'T', 'O', 'R' };
+    bool known = false;
+
+    if (cmd_has(e, ARG_VERSION)) {
+        resp_add(e, ARG_VERSION, version, sizeof(version));
+        known = true;
+    }
+    if (cmd_has(e, ARG_UNIQUE_ID)) {
+        resp_add(e, ARG_UNIQUE_ID, unique_id, sizeof(unique_id));
+        known = true;
+    }
+    if (cmd_has(e, ARG_WIDTH)) {
+        resp_add_u16(e, ARG_WIDTH, EMU_IMAGE_WIDTH);
+        known = true;
+    }
+    if (cmd_has(e, ARG_HEIGHT)) {
+        resp_add_u16(e, ARG_HEIGHT, EMU_IMAGE_HEIGHT);
+        known = true;
+    }
+    if (cmd_has(e, ARG_DPI)) {
+        resp_add_u16(e, ARG_DPI, EMU_IMAGE_DPI);
+        known = true;
+    }
+    resp_result(e, known ? FPC_BEP_RESULT_OK : FPC_BEP_RESULT_NOT_SUPPORTED);
+}
+
+static void cmd_communication(emu_t *e)
+{
+    uint8_t *data;
+    uint16_t size;
+
+    if (cmd_has(e, ARG_GET)) {
+        resp_add_u32(e, ARG_DATA, e->uart_speed);
+    } else if (cmd_has(e, ARG_SET) && cmd_arg(e, ARG_DATA, &data, &size) && size == 4) {
+        e->uart_speed = get_le32(data);
+    } else {
+        resp_result(e, FPC_BEP_RESULT_INVALID_ARGUMENT);
+        return;
+    }
+    resp_result(e, FPC_BEP_RESULT_OK);
+}
+
+static void cmd_mcu(emu_t *e)
+{
+    if (cmd_has(e, ARG_GET) && cmd_has(e, ARG_POWER_MODE)) {
+        resp_add_u32(e, ARG_POWER_MODE, e->power_mode);
+    } else if (cmd_has(e, ARG_IDLE)) {
+        e->power_mode = BMLITE_POWER_IDLE;
+    } else if (cmd_has(e, ARG_SLEEP)) {
+        e->power_mode = BMLITE_POWER_SLEEP;
+    } else if (cmd_has(e, ARG_DEEP_SLEEP)) {
+        e->power_mode = BMLITE_POWER_DEEP_SLEEP;
+    } else {
+        resp_result(e, FPC_BEP_RESULT_INVALID_ARGUMENT);
+        return;
+    }
+    resp_result(e, FPC_BEP_RESULT_OK);
+}
+
+static void process_command(emu_t *e)
+{
+    uint16_t cmd = get_le16(e->in_pkt);
+    uint64_t now = time_us();
+
+    e->stats.commands++;
+    e->busy_us = EMU_CMD_TIME_US;
+    if (e->update_until_us > now) {
+        e->busy_us += e->update_until_us - now;
+    }
+    resp_init(e, cmd);
+
+    switch (cmd) {
+        case CMD_CAPTURE:
+            cmd_capture(e);
+            break;
+        case CMD_WAIT:
+            cmd_wait(e);
+            break;
+        case CMD_IMAGE:
+            cmd_image(e);
+            break;
+        case CMD_IDENTIFY:
+            cmd_identify(e);
+            break;
+        case CMD_ENROLL:
+            cmd_enroll(e);
+            break;
+        case CMD_TEMPLATE:
+            cmd_template(e);
+            break;
+        case CMD_STORAGE_TEMPLATE:
+            cmd_storage_template(e);
+            break;
+        case CMD_INFO:
+            cmd_info(e);
+            break;
+        case CMD_COMMUNICATION:
+            cmd_communication(e);
+            break;
+        case CMD_MCU:
+            cmd_mcu(e);
+            break;
+        case CMD_RESET:
+        case CMD_CANCEL:
+        case CMD_SENSOR:
+            e->enroll_remaining = 0;
+            resp_result(e, FPC_BEP_RESULT_OK);
+            break;
+        default:
+            resp_result(e, FPC_BEP_RESULT_NOT_SUPPORTED);
+            break;
+    }
+
+    e->out_pos = 0;
+    e->out_seq_nr = 0;
+    e->out_seq_len = e->out_size / (MTU - 6 - 8) + 1;
+    e->ready_at_us = now + e->busy_us;
+    if (e->update_pending) {
+        e->update_pending = false;
+        e->update_until_us = e->ready_at_us + EMU_TEMPLATE_UPDATE_TIME_US;
+    }
+}
+
+/* Put next response frame to the send buffer */
+static void next_frame(emu_t *e)
+{
+    uint16_t t_size = e->out_size - e->out_pos;
+
+    if (t_size > MTU - 6 - 8) {
+        t_size = MTU - 6 - 8;
+    }
+
+    e->out_seq_nr++;
+    put_le16(e->frame, 0);
+    put_le16(e->frame + 2, t_size + 6);
+    put_le16(e->frame + 4, t_size);
+    put_le16(e->frame + 6, e->out_seq_nr);
+    put_le16(e->frame + 8, e->out_seq_len);
+    memcpy(e->frame + 10, e->out_pkt + e->out_pos, t_size);
+    put_le32(e->frame + 4 + t_size + 6, fpc_crc(0, e->frame + 4, t_size + 6) ^
+            (e->wedge == RPI_EMU_WEDGE_CRC));
+    e->out_pos += t_size;
+    e->frame_len = t_size + 6 + 8;
+    e->frame_pos = 0;
+}
+
+static void receive_frame(emu_t *e, uint16_t size, const uint8_t *data)
+{
+    uint16_t lnk_size, t_size, seq_nr, seq_len;
+
+    if (size < 14) {
+        return;
+    }
+    lnk_size = get_le16(data + 2);
+    if (size != lnk_size + 8 ||
+            fpc_crc(0, data + 4, lnk_size) != get_le32(data + 4 + lnk_size)) {
+        // No ACK for broken frame
+        e->stats.crc_errors++;
+        return;
+    }
+
+    t_size = get_le16(data + 4);
+    seq_nr = get_le16(data + 6);
+    seq_len = get_le16(data + 8);
+    if (seq_nr == 1) {
+        e->in_size = 0;
+    }
+    if (e->in_size + t_size <= EMU_MAX_PKT_SIZE) {
+        memcpy(e->in_pkt + e->in_size, data + 10, t_size);
+        e->in_size += t_size;
+    }
+    e->ack_pending = true;
+
+    if (seq_nr == seq_len) {
+        process_command(e);
+        next_frame(e);
+    }
+}
+
+/* Make timer fd readable when response frame can be read */
+static void ready_notify(emu_t *e)
+{
+    struct itimerspec its = { 0 };
+
+    if (e->timer_fd < 0) {
+        return;
+    }
+    if (e->frame_pos < e->frame_len) {
+        its.it_value.tv_sec = e->ready_at_us / 1000000;
+        its.it_value.tv_nsec = (e->ready_at_us % 1000000) * 1000;
+    }
+    // Setting the timer also clears expiration count of previous frame
+    timerfd_settime(e->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static bool emu_setup(emu_t *e, uint32_t baudrate, uint32_t capacity)
+{
+    memset(e, 0, sizeof(*e));
+    e->timer_fd = -1;
+    e->storage = calloc(capacity, sizeof(emu_template_t));
+    if (e->storage == NULL) {
+        return false;
+    }
+    e->capacity = capacity;
+    e->finger_key = EMU_DEFAULT_FINGER;
+    e->uart_speed = baudrate;
+    e->link_ns_per_byte = baudrate ? 10000000000ULL / baudrate : 0;
+    e->active = true;
+    return true;
+}
+
+static void emu_cleanup(emu_t *e)
+{
+    if (e->timer_fd >= 0) {
+        close(e->timer_fd);
+    }
+    free(e->storage);
+}
+
+bool rpi_emu_init(uint32_t baudrate, uint32_t capacity)
+{
+    if (emu.active) {
+        emu_cleanup(&emu);
+    }
+    return emu_setup(&emu, baudrate, capacity);
+}
+
+rpi_emu_t *rpi_emu_open(uint32_t baudrate, uint32_t capacity)
+{
+    emu_t *e = malloc(sizeof(emu_t));
+
+    if (e && !emu_setup(e, baudrate, capacity)) {
+        free(e);
+        e = NULL;
+    }
+    return e;
+}
+
+void rpi_emu_close(rpi_emu_t *session)
+{
+    if (session) {
+        emu_cleanup(session);
+        free(session);
+    }
+}
+
+int rpi_emu_get_fd(void *session)
+{
+    emu_t *e = session ? session : &emu;
+
+    if (e->timer_fd < 0) {
+        e->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ready_notify(e);
+    }
+    return e->timer_fd;
+}
+
+bool rpi_emu_is_active(void)
+{
+    return emu.active;
+}
+
+void rpi_emu_reset(void)
+{
+    emu_t *e = &emu;
+
+    e->frame_len = 0;
+    e->frame_pos = 0;
+    e->ack_pending = false;
+    e->wait_ack = false;
+    e->in_size = 0;
+    e->image_valid = false;
+    e->features_valid = false;
+    e->ram_template_size = 0;
+    e->enroll_remaining = 0;
+    e->update_until_us = 0;
+    e->update_pending = false;
+    e->power_mode = BMLITE_POWER_ACTIVE;
+    e->wedge = RPI_EMU_WEDGE_NONE;
+    e->nak_pending = false;
+    ready_notify(e);
+}
+
+void rpi_emu_set_finger(uint32_t key)
+{
+    rpi_emu_session_set_finger(NULL, key);
+}
+
+void rpi_emu_session_set_finger(rpi_emu_t *session, uint32_t key)
+{
+    emu_t *e = session ? session : &emu;
+
+    e->finger_key = key;
+}
+
+void rpi_emu_set_touch_pattern(rpi_emu_t *session, uint32_t key, uint32_t period_ms,
+        uint32_t hold_ms)
+{
+    emu_t *e = session ? session : &emu;
+
+    if (key) {
+        e->finger_key = key;
+    }
+    e->touch_origin_us = time_us();
+    e->touch_period_us = (uint64_t)period_ms * 1000;
+    e->touch_hold_us = (uint64_t)(hold_ms < period_ms ? hold_ms : period_ms) * 1000;
+}
+
+uint64_t rpi_emu_get_touch_start(void *session, uint64_t t_us)
+{
+    emu_t *e = session ? session : &emu;
+
+    if (e->touch_period_us == 0 || t_us < e->touch_origin_us) {
+        return 0;
+    }
+    return t_us - (t_us - e->touch_origin_us) % e->touch_period_us;
+}
+
+void rpi_emu_drop_frames(rpi_emu_t *session, uint32_t count)
+{
+    emu_t *e = session ? session : &emu;
+
+    e->drop_frames = count;
+}
+
+void rpi_emu_drop_acks(rpi_emu_t *session, uint32_t count)
+{
+    emu_t *e = session ? session : &emu;
+
+    e->drop_acks = count;
+}
+
+void rpi_emu_wedge(rpi_emu_t *session, rpi_emu_wedge_t wedge, uint16_t cure)
+{
+    emu_t *e = session ? session : &emu;
+
+    e->wedge = wedge;
+    e->wedge_cure = cure;
+}
+
+/* First frame of the command curing wedged BM-Lite */
+static bool wedge_cured(emu_t *e, uint16_t size, const uint8_t *data)
+{
+    return e->wedge_cure && size >= 14 && get_le16(data + 6) == 1 &&
+            get_le16(data + 10) == e->wedge_cure;
+}
+
+void rpi_emu_get_stats(rpi_emu_stats_t *stats)
+{
+    *stats = emu.stats;
+}
+
+fpc_bep_result_t rpi_emu_send(uint16_t size, const uint8_t *data, uint32_t timeout,
+        void *session)
+{
+    emu_t *e = session ? session : &emu;
+
+    link_delay(e, size);
+
+    if (size == 4 && get_le32(data) == FPC_BEP_ACK) {
+        if (e->wait_ack) {
+            e->wait_ack = false;
+            if (e->out_seq_nr < e->out_seq_len) {
+                next_frame(e);
+                ready_notify(e);
+            }
+        }
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Frame lost on the link: BM-Lite neither sees nor acknowledges it
+    if (e->drop_frames) {
+        e->drop_frames--;
+        e->stats.frames_lost++;
+        return FPC_BEP_RESULT_OK;
+    }
+
+    if (e->wedge != RPI_EMU_WEDGE_NONE && wedge_cured(e, size, data)) {
+        e->wedge = RPI_EMU_WEDGE_NONE;
+    } else if (e->wedge == RPI_EMU_WEDGE_SILENT) {
+        return FPC_BEP_RESULT_OK;
+    } else if (e->wedge == RPI_EMU_WEDGE_NAK) {
+        e->nak_pending = true;
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Frame from host wakes BM-Lite from low power mode
+    if (e->power_mode != BMLITE_POWER_ACTIVE) {
+        sleep_us(emu_wake_us[e->power_mode]);
+        e->power_mode = BMLITE_POWER_ACTIVE;
+    }
+
+    // Host gave up on previous response and sends new command
+    e->wait_ack = false;
+    e->frame_len = 0;
+    e->frame_pos = 0;
+
+    e->stats.frames_in++;
+    receive_frame(e, size, data);
+    // Frame is received and processed, its ACK is lost on the link
+    if (e->drop_acks && e->ack_pending) {
+        e->drop_acks--;
+        e->ack_pending = false;
+        e->stats.acks_lost++;
+    }
+    ready_notify(e);
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t rpi_emu_receive(uint16_t size, uint8_t *data, uint32_t timeout,
+        void *session)
+{
+    emu_t *e = session ? session : &emu;
+
+    if ((e->ack_pending || e->nak_pending) && size == 4 &&
+            link_timed_out(e, size, 0, timeout)) {
+        return FPC_BEP_RESULT_TIMEOUT;
+    }
+    if (e->ack_pending && size == 4) {
+        put_le32(data, FPC_BEP_ACK);
+        e->ack_pending = false;
+        link_delay(e, size);
+        return FPC_BEP_RESULT_OK;
+    }
+    if (e->nak_pending && size == 4) {
+        put_le32(data, ~FPC_BEP_ACK);
+        e->nak_pending = false;
+        link_delay(e, size);
+        return FPC_BEP_RESULT_OK;
+    }
+
+    if (e->frame_pos + size > e->frame_len) {
+        // Nothing to send. Real device would keep silent until timeout
+        if (timeout) {
+            sleep_us((uint64_t)timeout * 1000);
+        }
+        return FPC_BEP_RESULT_TIMEOUT;
+    }
+
+    // Bytes which do not arrive in time stay unread like in a UART buffer
+    uint64_t now = time_us();
+    uint64_t wait_us = e->ready_at_us > now ? e->ready_at_us - now : 0;
+    if (link_timed_out(e, size, wait_us, timeout)) {
+        return FPC_BEP_RESULT_TIMEOUT;
+    }
+    if (wait_us) {
+        sleep_us(wait_us);
+    }
+
+    memcpy(data, e->frame + e->frame_pos, size);
+    e->frame_pos += size;
+    link_delay(e, size);
+    if (e->frame_pos == e->frame_len) {
+        e->stats.frames_out++;
+        e->frame_len = 0;
+        e->frame_pos = 0;
+        e->wait_ack = true;
+        ready_notify(e);
+    }
+    return FPC_BEP_RESULT_OK;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    rpi_image_ring.c
+ * @brief   Shared memory ring of captured images
+ *
+ * One writer puts images to slots of a POSIX shared memory object in turn
+ * and never waits for readers. Every slot has a sequence number which is 0
+ * while the slot is written, so readers take images in place and check
+ * after use that the slot was not reused meanwhile. Readers sleep on a
+ * process shared futex on the header sequence number.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "platform_rpi.h"
+
+#define RING_MAGIC      0x474d4942  /* "BIMG" */
+#define RING_VERSION    1
+#define RING_ALIGN      64
+
+typedef struct {
+    /** Image sequence number, 0 while the slot is written */
+    uint32_t seq;
+    uint32_t size;
+    uint16_t width;
+    uint16_t height;
+    uint16_t dpi;
+    uint16_t reserved;
+    uint64_t timestamp_us;
+} ring_slot_t;
+
+struct rpi_image_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    /** Sequence number of the last published image. Futex word */
+    uint32_t head;
+    /** Readers sleeping on head */
+    uint32_t waiters;
+    /** Bytes of mapping, header included */
+    uint64_t map_size;
+} __attribute__((aligned(RING_ALIGN)));
+
+static size_t slot_stride(uint32_t slot_size)
+{
+    return (sizeof(ring_slot_t) + slot_size + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1);
+}
+
+static ring_slot_t *ring_slot(rpi_image_ring_t *ring, uint32_t seq)
+{
+    return (ring_slot_t *)((uint8_t *)ring + sizeof(*ring) +
+            (size_t)(seq % ring->slots) * slot_stride(ring->slot_size));
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+rpi_image_ring_t *rpi_image_ring_create(const char *name, uint32_t slots, uint32_t slot_size)
+{
+    rpi_image_ring_t *ring;
+    size_t map_size;
+    int fd;
+
+    if (slots == 0 || slot_size == 0) {
+        return NULL;
+    }
+    map_size = sizeof(*ring) + (size_t)slots * slot_stride(slot_size);
+
+    // Readers of a previous ring keep their mapping of the old object
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, map_size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ring->version = RING_VERSION;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->map_size = map_size;
+    // Readers check magic last
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+void rpi_image_ring_destroy(rpi_image_ring_t *ring, const char *name)
+{
+    if (ring == NULL) {
+        return;
+    }
+    // Wake readers so they see the ring closed
+    __atomic_store_n(&ring->magic, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring->head, 1, __ATOMIC_RELEASE);
+    futex(&ring->head, FUTEX_WAKE, INT_MAX, NULL);
+    munmap(ring, ring->map_size);
+    shm_unlink(name);
+}
+
+bool rpi_image_ring_publish(rpi_image_ring_t *ring, const uint8_t *data, uint32_t size,
+        uint16_t width, uint16_t height, uint16_t dpi)
+{
+    uint32_t seq;
+    ring_slot_t *slot;
+
+    if (ring == NULL || size > ring->slot_size) {
+        return false;
+    }
+
+    seq = ring->head + 1;
+    if (seq == 0) {
+        seq = 1;
+    }
+    slot = ring_slot(ring, seq);
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->size = size;
+    slot->width = width;
+    slot->height = height;
+    slot->dpi = dpi;
+    slot->timestamp_us = time_us();
+    memcpy(slot + 1, data, size);
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+    // Store of head must not pass load of waiters, pairs with fence in wait_head()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Wake up is a system call, skip it when nobody sleeps
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_RELAXED)) {
+        futex(&ring->head, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    return true;
+}
+
+bool rpi_image_reader_open(rpi_image_reader_t *reader, const char *name)
+{
+    rpi_image_ring_t *ring;
+    struct stat st;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+    // Readers write only the waiters count, but futex needs a shared mapping
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*ring)) {
+        close(fd);
+        return false;
+    }
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+            ring->version != RING_VERSION || ring->map_size != (uint64_t)st.st_size) {
+        munmap(ring, st.st_size);
+        return false;
+    }
+
+    reader->ring = ring;
+    reader->map_size = st.st_size;
+    // Start from the next published image
+    reader->next = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+    return true;
+}
+
+void rpi_image_reader_close(rpi_image_reader_t *reader)
+{
+    if (reader->ring) {
+        munmap(reader->ring, reader->map_size);
+        reader->ring = NULL;
+    }
+}
+
+static bool wait_head(rpi_image_reader_t *reader, uint32_t head, uint32_t timeout_ms)
+{
+    rpi_image_ring_t *ring = reader->ring;
+    struct timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    long res;
+
+    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_RELAXED);
+    // Either publisher sees the waiter or the waiter sees the new head
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) != head) {
+        __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    // Sleeps only if head is still the same
+    res = futex(&ring->head, FUTEX_WAIT, head, &ts);
+    __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_RELAXED);
+    return res == 0 || errno != ETIMEDOUT;
+}
+
+fpc_bep_result_t rpi_image_reader_acquire(rpi_image_reader_t *reader, rpi_image_view_t *view,
+        uint32_t timeout_ms)
+{
+    rpi_image_ring_t *ring = reader->ring;
+    uint64_t deadline = time_us() + (uint64_t)timeout_ms * 1000;
+
+    if (ring == NULL) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        ring_slot_t *slot;
+
+        if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC) {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+
+        if ((int32_t)(head - reader->next) < 0) {
+            uint64_t now = time_us();
+            if (now >= deadline) {
+                return FPC_BEP_RESULT_TIMEOUT;
+            }
+            wait_head(reader, head, (deadline - now + 999) / 1000);
+            continue;
+        }
+
+        // Images overwritten before the reader came to them
+        if (head - reader->next >= ring->slots) {
+            uint32_t oldest = head - ring->slots + 1;
+            reader->dropped += oldest - reader->next;
+            reader->next = oldest;
+        }
+
+        slot = ring_slot(ring, reader->next);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != reader->next) {
+            // Writer came around while we were looking
+            reader->dropped++;
+            reader->next++;
+            continue;
+        }
+        view->seq = reader->next;
+        view->size = slot->size;
+        view->width = slot->width;
+        view->height = slot->height;
+        view->dpi = slot->dpi;
+        view->timestamp_us = slot->timestamp_us;
+        view->data = (const uint8_t *)(slot + 1);
+        if (view->size > ring->slot_size) {
+            view->size = ring->slot_size;
+        }
+        return FPC_BEP_RESULT_OK;
+    }
+}
+
+bool rpi_image_reader_release(rpi_image_reader_t *reader, const rpi_image_view_t *view)
+{
+    ring_slot_t *slot = ring_slot(reader->ring, view->seq);
+    bool valid;
+
+    // Reads of the image must complete before the sequence check
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    valid = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == view->seq;
+    if (valid) {
+        reader->received++;
+    } else {
+        reader->dropped++;
+    }
+    reader->next = view->seq + 1;
+    return valid;
+}
+
+uint32_t rpi_image_reader_backlog(const rpi_image_reader_t *reader)
+{
+    uint32_t head = __atomic_load_n(&reader->ring->head, __ATOMIC_ACQUIRE);
+
+    return (int32_t)(head - reader->next) < 0 ? 0 : head - reader->next + 1;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    rpi_metrics.c
+ * @brief   Prometheus text file exporter of SDK metrics
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "platform_rpi.h"
+#include "bmlite_metrics.h"
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *path;
+    uint32_t interval_ms;
+    bool running;
+    bool stop;
+} exporter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void write_counter(FILE *f, const char *name, const char *help, uint64_t value)
+{
+    fprintf(f, "# HELP bmlite_%s %s\n", name, help);
+    fprintf(f, "# TYPE bmlite_%s counter\n", name);
+    fprintf(f, "bmlite_%s %llu\n", name, (unsigned long long)value);
+}
+
+static void write_metrics(FILE *f, const bmlite_metrics_t *m)
+{
+    fprintf(f, "# HELP bmlite_frames_total Link frames exchanged with BM-Lite.\n");
+    fprintf(f, "# TYPE bmlite_frames_total counter\n");
+    fprintf(f, "bmlite_frames_total{direction=\"tx\"} %llu\n",
+            (unsigned long long)m->frames_tx);
+    fprintf(f, "bmlite_frames_total{direction=\"rx\"} %llu\n",
+            (unsigned long long)m->frames_rx);
+    fprintf(f, "# HELP bmlite_bytes_total Link bytes exchanged with BM-Lite.\n");
+    fprintf(f, "# TYPE bmlite_bytes_total counter\n");
+    fprintf(f, "bmlite_bytes_total{direction=\"tx\"} %llu\n",
+            (unsigned long long)m->bytes_tx);
+    fprintf(f, "bmlite_bytes_total{direction=\"rx\"} %llu\n",
+            (unsigned long long)m->bytes_rx);
+
+    write_counter(f, "crc_errors_total", "Received frames with wrong CRC.", m->crc_errors);
+    write_counter(f, "ack_timeouts_total", "Sent frames not acknowledged in time.",
+            m->ack_timeouts);
+    write_counter(f, "ack_errors_total", "Sent frames answered with invalid ACK.",
+            m->ack_errors);
+    write_counter(f, "rx_timeouts_total", "Responses not received in time.",
+            m->rx_timeouts);
+    write_counter(f, "retries_total", "Frames sent again after loss.", m->retries);
+
+    fprintf(f, "# HELP bmlite_commands_total Finished commands by result.\n");
+    fprintf(f, "# TYPE bmlite_commands_total counter\n");
+    for (int cmd = 0; cmd < BMLITE_METRICS_CMDS; cmd++) {
+        for (int res = 0; res < BMLITE_METRICS_RESULTS; res++) {
+            if (m->commands[cmd][res]) {
+                fprintf(f, "bmlite_commands_total{command=\"%s\",result=\"%s\"} %llu\n",
+                        bmlite_metrics_cmd_name(cmd), bmlite_metrics_result_name(res),
+                        (unsigned long long)m->commands[cmd][res]);
+            }
+        }
+    }
+
+    fprintf(f, "# HELP bmlite_blocked_seconds_total Time spent waiting for BM-Lite.\n");
+    fprintf(f, "# TYPE bmlite_blocked_seconds_total counter\n");
+    fprintf(f, "bmlite_blocked_seconds_total %.6f\n", m->blocked_us / 1e6);
+    fprintf(f, "# HELP bmlite_in_flight Commands in progress.\n");
+    fprintf(f, "# TYPE bmlite_in_flight gauge\n");
+    fprintf(f, "bmlite_in_flight %u\n", m->in_flight);
+    fprintf(f, "# HELP bmlite_last_command_seconds Duration of last command.\n");
+    fprintf(f, "# TYPE bmlite_last_command_seconds gauge\n");
+    fprintf(f, "bmlite_last_command_seconds %.6f\n", m->last_command_us / 1e6);
+}
+
+bool rpi_metrics_write(const char *path)
+{
+    bmlite_metrics_t snapshot;
+    size_t len = strlen(path);
+    char tmp[len + 5];
+    FILE *f;
+    bool ok;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Can't create %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+
+    bmlite_metrics_snapshot(&snapshot);
+    write_metrics(f, &snapshot);
+
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(tmp, path) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    return ok;
+}
+
+static void *exporter_thread(void *arg)
+{
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&exporter.lock);
+    while (!exporter.stop) {
+        pthread_mutex_unlock(&exporter.lock);
+        rpi_metrics_write(exporter.path);
+        pthread_mutex_lock(&exporter.lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += exporter.interval_ms / 1000;
+        deadline.tv_nsec += (exporter.interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!exporter.stop &&
+               pthread_cond_timedwait(&exporter.cond, &exporter.lock, &deadline) == 0);
+    }
+    pthread_mutex_unlock(&exporter.lock);
+
+    rpi_metrics_write(exporter.path);
+    return NULL;
+}
+
+bool rpi_metrics_exporter_start(const char *path, uint32_t interval_ms)
+{
+    if (exporter.running) {
+        return false;
+    }
+    exporter.path = strdup(path);
+    if (exporter.path == NULL) {
+        return false;
+    }
+    exporter.interval_ms = interval_ms ? interval_ms : 1000;
+    exporter.stop = false;
+    if (pthread_create(&exporter.thread, NULL, exporter_thread, NULL) != 0) {
+        free(exporter.path);
+        exporter.path = NULL;
+        return false;
+    }
+    exporter.running = true;
+    return true;
+}
+
+void rpi_metrics_exporter_stop(void)
+{
+    if (!exporter.running) {
+        return;
+    }
+    pthread_mutex_lock(&exporter.lock);
+    exporter.stop = true;
+    pthread_cond_signal(&exporter.cond);
+    pthread_mutex_unlock(&exporter.lock);
+
+    pthread_join(exporter.thread, NULL);
+    free(exporter.path);
+    exporter.path = NULL;
+    exporter.running = false;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    rpi_rt.c
+ * @brief   Real-time execution profile for the thread driving HCP transport
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "platform_rpi.h"
+
+/** Stack area touched in advance. Covers VLA buffers used by the transport */
+#define RT_STACK_PREFAULT_SIZE (64 * 1024)
+
+static void prefault_buffer(uint8_t *buf, uint32_t size)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (buf == NULL || size == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < size; i += page_size) {
+        ((volatile uint8_t *)buf)[i] = buf[i];
+    }
+    ((volatile uint8_t *)buf)[size - 1] = buf[size - 1];
+}
+
+static void __attribute__((noinline)) prefault_stack(void)
+{
+    volatile uint8_t stack[RT_STACK_PREFAULT_SIZE];
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    for (uint32_t i = 0; i < sizeof(stack); i += page_size) {
+        stack[i] = 0;
+    }
+}
+
+bool rpi_rt_profile_apply(const rpi_rt_params_t *params, HCP_comm_t *chain)
+{
+    int err;
+
+    if (params->lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+            fprintf(stderr, "mlockall failed: %s\n", strerror(errno));
+            return false;
+        }
+        if (chain) {
+            prefault_buffer(chain->pkt_buffer, chain->pkt_size_max);
+            prefault_buffer(chain->txrx_buffer, MTU);
+        }
+        prefault_stack();
+    }
+
+    if (params->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(params->cpu, &cpus);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            fprintf(stderr, "Can't set CPU affinity to %d: %s\n", params->cpu, strerror(err));
+            return false;
+        }
+    }
+
+    if (params->priority > 0) {
+        struct sched_param sp;
+
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = params->priority;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (err) {
+            fprintf(stderr, "Can't set SCHED_FIFO priority %d: %s\n", params->priority,
+                    strerror(err));
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -40,9 +40,16 @@
 #include <sys/ioctl.h>
 #include <asm/ioctl.h>
 
+#include "platform_rpi.h"
+
+/* Host build (RPI_NO_GPIO): no wiringPi, SPI interface is not available */
+#ifndef RPI_NO_GPIO
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
 #include "wiringPi.h"
 #include "wiringPiSPI.h"
-#include "platform_rpi.h"
 
 #define SPI_BUF_MIN_SIZE 40000
 // This path is used to determine the SPI buffer size.
@@ -53,8 +60,50 @@ static const uint8_t     spiBPW   = 8;
 
 uint32_t speed_hz_int;
 
+/* Rising edges of IRQ pin, counted by wiringPi ISR thread. -1 - pin is polled */
+static int irq_fd = -1;
+/** IRQ pin poll period without edge interrupt (msec) */
+#define IRQ_POLL_PERIOD 1
+
 void fpc_sensor_spi_reset(bool state);
 
+static void irq_isr(void)
+{
+    uint64_t one = 1;
+
+    write(irq_fd, &one, sizeof(one));
+}
+
+static void irq_init(void)
+{
+    if (irq_fd >= 0) {
+        return;
+    }
+    irq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (irq_fd >= 0 && wiringPiISR(BMLITE_IRQ_PIN, INT_EDGE_RISING, irq_isr) < 0) {
+        printf("IRQ edge interrupt is not available, pin is polled\n");
+        close(irq_fd);
+        irq_fd = -1;
+    }
+}
+
+int rpi_spi_get_irq_fd(void)
+{
+    return irq_fd;
+}
+
+bool rpi_spi_irq_pending(void *session)
+{
+    uint64_t edges;
+
+    (void)session;
+    if (irq_fd >= 0) {
+        read(irq_fd, &edges, sizeof(edges));
+    }
+    // Level tells if an edge seen before is still waiting to be served
+    return digitalRead(BMLITE_IRQ_PIN);
+}
+
 static void raspberryPi_init()
 {
     /* Start wiringPi functions. */
@@ -68,58 +117,112 @@ static void raspberryPi_init()
     digitalWrite(BMLITE_RESET_PIN, 1);
 
 }
+#endif
 
 void hal_bmlite_reset(bool state)
 {
+#ifdef BMLITE_USE_EMULATOR
+    if (rpi_emu_is_active()) {
+        if (state) {
+            rpi_emu_reset();
+        }
+        return;
+    }
+#endif
+
+#ifndef RPI_NO_GPIO
     /* The reset pin is controlled by WiringPis digitalWrite function*/
     if (state) {
         digitalWrite(BMLITE_RESET_PIN, 0);
     } else {
         digitalWrite(BMLITE_RESET_PIN, 1);
     }
+#endif
 }
 
 bool hal_bmlite_get_status(void)
 {
+#ifndef RPI_NO_GPIO
     return digitalRead(BMLITE_IRQ_PIN);
+#else
+    return false;
+#endif
 }
 
-
-bool rpi_spi_init(uint32_t speed_hz)
+#ifndef RPI_NO_GPIO
+static uint64_t get_time_ms(void)
 {
-    raspberryPi_init();
+    struct timespec ts;
 
-    /* In standard the SPI drivers buffer is 4096 bytes, the current buffer
-     * size is read and compared to minimum required size.
-     */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool hal_bmlite_wait_status(uint32_t timeout)
+{
+    uint64_t start = get_time_ms();
+    uint64_t elapsed;
+
+    // Edge count is checked after the level, so an edge between the two is not lost
+    while (!digitalRead(BMLITE_IRQ_PIN)) {
+        elapsed = get_time_ms() - start;
+        if (elapsed >= timeout) {
+            return false;
+        }
+        if (irq_fd >= 0) {
+            struct pollfd pfd = { .fd = irq_fd, .events = POLLIN };
+            uint64_t edges;
+
+            poll(&pfd, 1, timeout - elapsed);
+            read(irq_fd, &edges, sizeof(edges));
+        } else {
+            usleep(IRQ_POLL_PERIOD * 1000);
+        }
+    }
+    return true;
+}
 
+static bool spi_check_bufsiz(void)
+{
+    int bufsiz = 0;
     FILE *fp;
+
     fp = fopen(SPIBufPath, "r");
-    /* The file is opened, and if this failed the program exits. */
     if (fp == NULL) {
         printf("Could not open %s to get buffersize\n", SPIBufPath);
-        exit(1);
+        return false;
     }
 
-    /* The size of the file is determined, then the whole file is read. */
-    fseek(fp, 0, SEEK_END);         // Seek to end of file.
-    size_t filesize = ftell(fp);    // Get current file pointer.
-    fseek(fp, 0, SEEK_SET);         // Seek back to beginning of file.
-
-    char buffersize[filesize];
-    if (fread(buffersize, 1, filesize, fp) == filesize) {
+    if (fscanf(fp, "%d", &bufsiz) != 1) {
         printf("Failed to read data from %s.\n", SPIBufPath);
-        exit(1);
+        fclose(fp);
+        return false;
     }
     fclose(fp);
+
     /* Verify that SPI buffer meets minimum size. */
-    if (atoi(buffersize) < SPI_BUF_MIN_SIZE) {
+    if (bufsiz < SPI_BUF_MIN_SIZE) {
         printf("SPI buffer size is too small, if the standard RPI driver is "
                "used, this can be changed by adding \"spidev.bufsiz=<size>\" "
                "to /boot/cmdline.txt. <size> needs to be larger than %d for this "
                "sensor.\n",
                SPI_BUF_MIN_SIZE);
-        exit(1);
+        return false;
+    }
+
+    return true;
+}
+
+bool rpi_spi_init(uint32_t speed_hz, bool check_bufsiz)
+{
+    raspberryPi_init();
+
+    /* In standard the SPI drivers buffer is 4096 bytes, the current buffer
+     * size is read and compared to minimum required size.
+     * The check is skipped when attaching to already configured system.
+     */
+    if (check_bufsiz && !spi_check_bufsiz()) {
+        return false;
     }
 
     /*
@@ -134,6 +237,7 @@ bool rpi_spi_init(uint32_t speed_hz)
         printf("WiringPi GPIO setup failed with error %d", errno);
         return false;
     }
+    irq_init();
 
     return true;
 }
@@ -174,6 +278,35 @@ fpc_bep_result_t hal_bmlite_spi_write_read(const uint8_t *write, uint8_t *read,
 
 }
 
+#else
+
+int rpi_spi_get_irq_fd(void)
+{
+    return -1;
+}
+
+bool rpi_spi_irq_pending(void *session)
+{
+    (void)session;
+    return false;
+}
+
+bool rpi_spi_init(uint32_t speed_hz, bool check_bufsiz)
+{
+    (void)speed_hz;
+    (void)check_bufsiz;
+    printf("SPI is not available in host build\n");
+    return false;
+}
+
+fpc_bep_result_t hal_bmlite_spi_write_read(const uint8_t *write, uint8_t *read, size_t size,
+    bool leave_cs_asserted)
+{
+    return FPC_BEP_RESULT_IO_ERROR;
+}
+
+#endif  // RPI_NO_GPIO
+
 // fpc_bep_result_t platform_spi_send(uint16_t size, const uint8_t *data, uint32_t timeout,
 //         void *session)
 // {
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2020 Andrey Perminov <andrey.ppp@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file    rpi_tcp.c
+ * @brief   TCP physical layer, talks to BM-Lite attached to bmlite_bridge
+ *
+ * HCP link frames go over the stream unchanged. The bridge checks ACKs of
+ * frames it passes to BM-Lite and ACKs frames it receives from BM-Lite,
+ * so the host doesn't pay a network round trip per frame: ACK of a sent
+ * frame is answered here and ACK sent by HCP is dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "platform_rpi.h"
+
+/** Longest host name or address */
+#define TCP_HOST_MAX 256
+
+static rpi_tcp_session_t tcp_session = {
+    .link.fd = -1,
+};
+
+static const uint32_t tcp_ack = FPC_BEP_ACK;
+
+/* Split host[:port] or [v6-host]:port */
+static bool split_address(const char *address, char *host, const char **port)
+{
+    const char *colon = strrchr(address, ':');
+    size_t len;
+
+    *port = TCP_DEFAULT_PORT;
+    if (address[0] == '[') {
+        const char *end = strchr(address, ']');
+        if (end == NULL) {
+            return false;
+        }
+        address++;
+        len = end - address;
+        if (end[1] == ':') {
+            *port = end + 2;
+        }
+    } else if (colon && colon == strchr(address, ':')) {
+        len = colon - address;
+        *port = colon + 1;
+    } else {
+        len = strlen(address);
+    }
+    if (len >= TCP_HOST_MAX) {
+        return false;
+    }
+    memcpy(host, address, len);
+    host[len] = 0;
+    return true;
+}
+
+/* Empty host resolves to loopback, also for listening */
+static struct addrinfo *resolve(const char *address)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    char host[TCP_HOST_MAX];
+    const char *port;
+    int err;
+
+    if (!split_address(address, host, &port)) {
+        fprintf(stderr, "Invalid address %s\n", address);
+        return NULL;
+    }
+    err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Can't resolve %s: %s\n", address, gai_strerror(err));
+        return NULL;
+    }
+    return res;
+}
+
+static int tcp_connect(const char *address)
+{
+    struct addrinfo *res = resolve(address);
+    struct addrinfo *ai;
+    int one = 1;
+    int fd = -1;
+
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (res) {
+        freeaddrinfo(res);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Can't connect to %s: %s\n", address, strerror(errno));
+        return -1;
+    }
+
+    // Frames are small and each one is waited for, don't let Nagle hold them
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int rpi_tcp_listen(const char *address)
+{
+    struct addrinfo *res = resolve(address);
+    struct addrinfo *ai;
+    int one = 1;
+    int fd = -1;
+
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        // Accepted sockets inherit TCP_NODELAY
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 1) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (res) {
+        freeaddrinfo(res);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Can't listen on %s: %s\n", address, strerror(errno));
+    }
+    return fd;
+}
+
+static bool tcp_open(rpi_tcp_session_t *s, const char *address)
+{
+    memset(s, 0, sizeof(*s));
+    s->link.fd = tcp_connect(address);
+    return s->link.fd >= 0;
+}
+
+bool rpi_tcp_init(const char *address)
+{
+    return tcp_open(&tcp_session, address);
+}
+
+rpi_tcp_session_t *rpi_tcp_open(const char *address)
+{
+    rpi_tcp_session_t *s = malloc(sizeof(rpi_tcp_session_t));
+
+    if (s && !tcp_open(s, address)) {
+        free(s);
+        s = NULL;
+    }
+    return s;
+}
+
+void rpi_tcp_close(rpi_tcp_session_t *session)
+{
+    if (session) {
+        close(session->link.fd);
+        free(session);
+    }
+}
+
+/* Drop rest of response host gave up on */
+static void discard_rx(rpi_tcp_session_t *s)
+{
+    uint8_t buf[MTU];
+
+    while (rpi_com_rx_pending(&s->link)) {
+        rpi_com_receive(1, buf, 1, &s->link);
+    }
+    while (recv(s->link.fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+fpc_bep_result_t rpi_tcp_send(uint16_t size, const uint8_t *data, uint32_t timeout,
+        void *session)
+{
+    rpi_tcp_session_t *s = session ? session : &tcp_session;
+    struct pollfd pfd = { .fd = s->link.fd, .events = POLLOUT };
+    uint16_t n_sent = 0;
+    ssize_t n;
+
+    if (s->link.fd < 0) {
+        return FPC_BEP_RESULT_INVALID_ARGUMENT;
+    }
+    if (size == sizeof(tcp_ack) && memcmp(data, &tcp_ack, sizeof(tcp_ack)) == 0) {
+        // The bridge has ACKed the frame to BM-Lite already
+        return FPC_BEP_RESULT_OK;
+    }
+
+    // Host sends only when it doesn't wait for anything else
+    discard_rx(s);
+
+    while (n_sent < size) {
+        s->link.stats.write_calls++;
+        n = send(s->link.fd, data + n_sent, size - n_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            n_sent += n;
+            s->link.stats.tx_bytes += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            s->link.stats.poll_calls++;
+            n = poll(&pfd, 1, timeout ? (int)timeout : -1);
+            if (n == 0) {
+                return FPC_BEP_RESULT_TIMEOUT;
+            } else if (n < 0 && errno != EINTR) {
+                return FPC_BEP_RESULT_IO_ERROR;
+            }
+        } else {
+            return FPC_BEP_RESULT_IO_ERROR;
+        }
+    }
+    s->ack_pending = true;
+    return FPC_BEP_RESULT_OK;
+}
+
+fpc_bep_result_t rpi_tcp_receive(uint16_t size, uint8_t *data, uint32_t timeout,
+        void *session)
+{
+    rpi_tcp_session_t *s = session ? session : &tcp_session;
+
+    if (s->ack_pending) {
+        s->ack_pending = false;
+        if (size == sizeof(tcp_ack)) {
+            memcpy(data, &tcp_ack, sizeof(tcp_ack));
+            return FPC_BEP_RESULT_OK;
+        }
+    }
+    return rpi_com_receive(size, data, timeout, &s->link);
+}